@@ -0,0 +1,170 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "queue_impls/fifo_job_queue.h"
+#include "queue_impls/mpmc_job_queue.h"
+#include "queue_impls/prio_job_queue.h"
+#include "queue_impls/seg_job_queue.h"
+
+/* Runs every benchmark and writes the results as CSV.
+ * Usage: bench [-n ops] [-t threads_max] [-q queue_length] [-c] [-o file]
+ * -c only runs the contended rows and appends them to file, without a
+ * header. It's used to add the rows of a FIBER_PACKED_LAYOUT build.
+ */
+
+static struct fiber_queue_operations fifo_ops = {
+	.push = fiber_queue_fifo_push,
+	.pop = fiber_queue_fifo_pop,
+	.init = fiber_queue_fifo_init,
+	.free = fiber_queue_fifo_free,
+	.length = fiber_queue_fifo_length,
+	.push_n = fiber_queue_fifo_push_n,
+	.pop_n = fiber_queue_fifo_pop_n,
+	.set_park_spin = fiber_queue_fifo_set_park_spin,
+};
+
+static struct fiber_queue_operations mpmc_ops = {
+	.push = fiber_queue_mpmc_push,
+	.pop = fiber_queue_mpmc_pop,
+	.init = fiber_queue_mpmc_init,
+	.free = fiber_queue_mpmc_free,
+	.length = fiber_queue_mpmc_length,
+	.set_park_spin = fiber_queue_mpmc_set_park_spin,
+};
+
+static struct fiber_queue_operations prio_ops = {
+	.push = fiber_queue_prio_push,
+	.pop = fiber_queue_prio_pop,
+	.init = fiber_queue_prio_init,
+	.free = fiber_queue_prio_free,
+	.length = fiber_queue_prio_length,
+	.push_n = fiber_queue_prio_push_n,
+	.pop_n = fiber_queue_prio_pop_n,
+	.set_park_spin = fiber_queue_prio_set_park_spin,
+};
+
+static struct fiber_queue_operations seg_ops = {
+	.push = fiber_queue_seg_push,
+	.pop = fiber_queue_seg_pop,
+	.init = fiber_queue_seg_init,
+	.free = fiber_queue_seg_free,
+	.length = fiber_queue_seg_length,
+	.push_n = fiber_queue_seg_push_n,
+	.pop_n = fiber_queue_seg_pop_n,
+	.set_park_spin = fiber_queue_seg_set_park_spin,
+};
+
+struct bench_queue bench_queues[] = {
+	{ "fifo", &fifo_ops },
+	{ "mpmc", &mpmc_ops },
+	{ "prio", &prio_ops },
+	{ "seg", &seg_ops },
+};
+int bench_queues_number = sizeof(bench_queues) / sizeof(bench_queues[0]);
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+void bench_percentiles(uint64_t *samples, long n, struct bench_result *result)
+{
+	if (n == 0) {
+		return;
+	}
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	result->p50_ns = samples[n * 50 / 100];
+	result->p99_ns = samples[n * 99 / 100];
+	result->p999_ns = samples[n * 999 / 1000];
+}
+
+void bench_csv_header(FILE *out)
+{
+	fprintf(out, "bench,queue,threads,producers,ops,ns,ops_per_sec,"
+		     "p50_ns,p99_ns,p999_ns\n");
+}
+
+void bench_csv_row(FILE *out, const struct bench_result *r)
+{
+	double per_sec = r->ns > 0 ? (double)r->ops * 1e9 / (double)r->ns : 0;
+	fprintf(out, "%s,%s,%d,%d,%ld,%llu,%.0f,%llu,%llu,%llu\n", r->bench,
+		r->queue, r->threads, r->producers, r->ops,
+		(unsigned long long)r->ns, per_sec,
+		(unsigned long long)r->p50_ns, (unsigned long long)r->p99_ns,
+		(unsigned long long)r->p999_ns);
+	fflush(out);
+}
+
+int main(int argc, char *argv[])
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct bench_params params = {
+		.ops = 200000,
+		.threads_max = cpus < 4 ? 4 : (int)cpus,
+		.queue_length = 1024,
+	};
+	FILE *out = stdout;
+	const char *path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:q:co:")) != -1) {
+		switch (opt) {
+		case 'n':
+			params.ops = atol(optarg);
+			break;
+		case 't':
+			params.threads_max = atoi(optarg);
+			break;
+		case 'q':
+			params.queue_length = atoi(optarg);
+			break;
+		case 'c':
+			params.contended_only = 1;
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-n ops] [-t threads_max] "
+				"[-q queue_length] [-c] [-o file]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (params.ops < 1 || params.threads_max < 1 ||
+	    params.queue_length < 1) {
+		fprintf(stderr, "%s: -n, -t and -q must be > 0\n", argv[0]);
+		return 1;
+	}
+	if (path != NULL) {
+		out = fopen(path, params.contended_only ? "a" : "w");
+		if (out == NULL) {
+			perror(path);
+			return 1;
+		}
+	}
+	if (!params.contended_only) {
+		bench_csv_header(out);
+		bench_queue_all(out, &params);
+	}
+	bench_pool_all(out, &params);
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
@@ -0,0 +1,59 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_BENCH_H
+#define _FIBER_BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "job_queue.h"
+
+/* Every queue in queue_impls/ the benchmarks run against */
+struct bench_queue {
+	const char *name;
+	struct fiber_queue_operations *ops;
+};
+
+extern struct bench_queue bench_queues[];
+extern int bench_queues_number;
+
+struct bench_params {
+	// Operations per run
+	long ops;
+	// Thread and producer counts go 1, 2, 4 ... up to this
+	int threads_max;
+	// Capacity of queues under test
+	qsize queue_length;
+	// Only run the contended pool rows, set by -c
+	int contended_only;
+};
+
+/* One CSV row. Fields that don't apply to a benchmark are 0. */
+struct bench_result {
+	const char *bench;
+	const char *queue;
+	int threads;
+	int producers;
+	long ops;
+	uint64_t ns;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+};
+
+uint64_t bench_now_ns(void);
+
+/* Sorts samples and fills result's percentiles from them */
+void bench_percentiles(uint64_t *samples, long n, struct bench_result *result);
+
+void bench_csv_header(FILE *out);
+
+void bench_csv_row(FILE *out, const struct bench_result *result);
+
+/* Benchmarks on the queue operations alone, no pool involved */
+void bench_queue_all(FILE *out, const struct bench_params *params);
+
+/* Benchmarks through fiber_job_push with empty jobs */
+void bench_pool_all(FILE *out, const struct bench_params *params);
+
+#endif // _FIBER_BENCH_H
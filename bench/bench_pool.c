@@ -0,0 +1,182 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "fiber.h"
+
+// Latency runs take fewer samples than throughput runs take jobs
+#define LATENCY_SAMPLES_DIV 10
+// Least producers and workers in the contended run. Every producer writes
+// the pool's next job id and every worker its working count, so this is
+// where those sharing a cache line would show.
+#define CONTENDED_THREADS 16
+// Rows from a FIBER_PACKED_LAYOUT build are told apart by name
+#ifdef FIBER_PACKED_LAYOUT
+#define CONTENDED_NAME "contended_packed"
+#else
+#define CONTENDED_NAME "contended"
+#endif
+
+static void *empty_job(void *arg)
+{
+	return NULL;
+}
+
+static int pool_start(struct fiber_pool *pool, const struct bench_params *params,
+		      struct bench_queue *bq, int threads)
+{
+	struct fiber_pool_init_options opts = {
+		.queue_ops = bq->ops,
+		.threads_number = threads,
+		.queue_length = params->queue_length,
+	};
+	int res = fiber_init(pool, &opts);
+	if (res != 0) {
+		fprintf(stderr, "%s: fiber_init failed with %d\n", bq->name,
+			res);
+	}
+	return res;
+}
+
+struct producer_arg {
+	struct fiber_pool *pool;
+	pthread_barrier_t *start;
+	long ops;
+};
+
+static void *producer(void *arg)
+{
+	struct producer_arg *a = (struct producer_arg *)arg;
+	struct fiber_job job = { .job_func = empty_job };
+	pthread_barrier_wait(a->start);
+	for (long i = 0; i < a->ops; ++i) {
+		fiber_job_push(a->pool, &job, FIBER_BLOCK);
+	}
+	return NULL;
+}
+
+// Time for producers to push ops empty jobs and for threads workers to run
+// them all, so only scheduler overhead is measured.
+static void empty_jobs(FILE *out, const struct bench_params *params,
+		       struct bench_queue *bq, const char *name, int threads,
+		       int producers)
+{
+	struct fiber_pool pool = { 0 };
+	if (pool_start(&pool, params, bq, threads) != 0) {
+		return;
+	}
+	pthread_barrier_t start;
+	pthread_barrier_init(&start, NULL, producers + 1);
+	pthread_t tids[producers];
+	struct producer_arg arg = { .pool = &pool,
+				    .start = &start,
+				    .ops = params->ops / producers };
+	for (int i = 0; i < producers; ++i) {
+		pthread_create(&tids[i], NULL, producer, &arg);
+	}
+	// Released threads may be done before we return from the barrier
+	uint64_t begin = bench_now_ns();
+	pthread_barrier_wait(&start);
+	for (int i = 0; i < producers; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+	fiber_wait(&pool);
+	struct bench_result r = { .bench = name,
+				  .queue = bq->name,
+				  .threads = threads,
+				  .producers = producers,
+				  .ops = arg.ops * producers,
+				  .ns = bench_now_ns() - begin };
+	bench_csv_row(out, &r);
+	pthread_barrier_destroy(&start);
+	fiber_free(&pool);
+}
+
+static uint64_t *pushed_ns;
+static uint64_t *latency_ns;
+static long started;
+
+static void *stamp_job(void *arg)
+{
+	long i = (long)(intptr_t)arg;
+	latency_ns[i] = bench_now_ns() - pushed_ns[i];
+	__atomic_add_fetch(&started, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Enqueue to start latency. idle waits for each job to start before the
+// next push, so it measures waking a sleeping worker. Otherwise every job is
+// pushed at once and queueing delay is included.
+static void latency(FILE *out, const struct bench_params *params,
+		    struct bench_queue *bq, int threads, int idle)
+{
+	long samples = params->ops / LATENCY_SAMPLES_DIV;
+	if (samples < 1) {
+		samples = 1;
+	}
+	pushed_ns = malloc(samples * sizeof(*pushed_ns));
+	latency_ns = malloc(samples * sizeof(*latency_ns));
+	struct fiber_pool pool = { 0 };
+	if (pushed_ns == NULL || latency_ns == NULL ||
+	    pool_start(&pool, params, bq, threads) != 0) {
+		goto out;
+	}
+	started = 0;
+	uint64_t begin = bench_now_ns();
+	for (long i = 0; i < samples; ++i) {
+		struct fiber_job job = { .job_func = stamp_job,
+					 .job_arg = (void *)(intptr_t)i };
+		pushed_ns[i] = bench_now_ns();
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+		while (idle &&
+		       __atomic_load_n(&started, __ATOMIC_ACQUIRE) <= i) {
+			sched_yield();
+		}
+	}
+	fiber_wait(&pool);
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < samples) {
+		sched_yield();
+	}
+	struct bench_result r = { .bench = idle ? "latency_idle" :
+						  "latency_burst",
+				  .queue = bq->name,
+				  .threads = threads,
+				  .producers = 1,
+				  .ops = samples,
+				  .ns = bench_now_ns() - begin };
+	bench_percentiles(latency_ns, samples, &r);
+	bench_csv_row(out, &r);
+	fiber_free(&pool);
+out:
+	free(pushed_ns);
+	free(latency_ns);
+}
+
+void bench_pool_all(FILE *out, const struct bench_params *params)
+{
+	int max = params->threads_max;
+	for (int q = 0; q < bench_queues_number; ++q) {
+		struct bench_queue *bq = &bench_queues[q];
+		int contended = max > CONTENDED_THREADS ? max :
+							  CONTENDED_THREADS;
+		empty_jobs(out, params, bq, CONTENDED_NAME, contended,
+			   contended);
+		if (params->contended_only) {
+			continue;
+		}
+		for (int threads = 1; threads <= max; threads *= 2) {
+			empty_jobs(out, params, bq, "empty_job", threads, 1);
+		}
+		for (int producers = 2; producers <= max; producers *= 2) {
+			empty_jobs(out, params, bq, "empty_job", max,
+				   producers);
+		}
+		latency(out, params, bq, max, 1);
+		latency(out, params, bq, max, 0);
+	}
+}
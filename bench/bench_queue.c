@@ -0,0 +1,118 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+static void *empty_job(void *arg)
+{
+	return NULL;
+}
+
+static void push_only_pop_only(FILE *out, const struct bench_params *params,
+			       struct bench_queue *bq)
+{
+	void *queue;
+	if (bq->ops->init(&queue, params->ops, malloc, free) != 0) {
+		fprintf(stderr, "%s: init failed\n", bq->name);
+		return;
+	}
+	struct fiber_job job = { .job_func = empty_job };
+	struct bench_result r = { .queue = bq->name, .threads = 1,
+				  .producers = 1, .ops = params->ops };
+	uint64_t start = bench_now_ns();
+	for (long i = 0; i < params->ops; ++i) {
+		bq->ops->push(queue, &job, FIBER_NO_BLOCK);
+	}
+	r.ns = bench_now_ns() - start;
+	r.bench = "push_only";
+	bench_csv_row(out, &r);
+	start = bench_now_ns();
+	for (long i = 0; i < params->ops; ++i) {
+		bq->ops->pop(queue, &job, FIBER_NO_BLOCK);
+	}
+	r.ns = bench_now_ns() - start;
+	r.bench = "pop_only";
+	bench_csv_row(out, &r);
+	bq->ops->free(queue);
+}
+
+struct pingpong_arg {
+	struct bench_queue *bq;
+	void *queue;
+	pthread_barrier_t *start;
+	long ops;
+};
+
+static void *pingpong_producer(void *arg)
+{
+	struct pingpong_arg *a = (struct pingpong_arg *)arg;
+	struct fiber_job job = { .job_func = empty_job };
+	pthread_barrier_wait(a->start);
+	for (long i = 0; i < a->ops; ++i) {
+		a->bq->ops->push(a->queue, &job, FIBER_BLOCK);
+	}
+	return NULL;
+}
+
+static void *pingpong_consumer(void *arg)
+{
+	struct pingpong_arg *a = (struct pingpong_arg *)arg;
+	struct fiber_job job;
+	pthread_barrier_wait(a->start);
+	for (long i = 0; i < a->ops; ++i) {
+		a->bq->ops->pop(a->queue, &job, FIBER_BLOCK);
+	}
+	return NULL;
+}
+
+// pairs producers and pairs consumers pass ops jobs through a queue of
+// queue_length.
+static void pingpong(FILE *out, const struct bench_params *params,
+		     struct bench_queue *bq, int pairs)
+{
+	void *queue;
+	if (bq->ops->init(&queue, params->queue_length, malloc, free) != 0) {
+		fprintf(stderr, "%s: init failed\n", bq->name);
+		return;
+	}
+	pthread_barrier_t start;
+	pthread_barrier_init(&start, NULL, pairs * 2 + 1);
+	pthread_t threads[pairs * 2];
+	struct pingpong_arg arg = { .bq = bq,
+				    .queue = queue,
+				    .start = &start,
+				    .ops = params->ops / pairs };
+	for (int i = 0; i < pairs; ++i) {
+		pthread_create(&threads[i * 2], NULL, pingpong_producer, &arg);
+		pthread_create(&threads[i * 2 + 1], NULL, pingpong_consumer,
+			       &arg);
+	}
+	// Released threads may be done before we return from the barrier
+	uint64_t begin = bench_now_ns();
+	pthread_barrier_wait(&start);
+	for (int i = 0; i < pairs * 2; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	struct bench_result r = { .bench = "pingpong",
+				  .queue = bq->name,
+				  .threads = pairs,
+				  .producers = pairs,
+				  .ops = arg.ops * pairs,
+				  .ns = bench_now_ns() - begin };
+	bench_csv_row(out, &r);
+	pthread_barrier_destroy(&start);
+	bq->ops->free(queue);
+}
+
+void bench_queue_all(FILE *out, const struct bench_params *params)
+{
+	for (int q = 0; q < bench_queues_number; ++q) {
+		push_only_pop_only(out, params, &bench_queues[q]);
+		for (int pairs = 1; pairs <= params->threads_max; pairs *= 2) {
+			pingpong(out, params, &bench_queues[q], pairs);
+		}
+	}
+}
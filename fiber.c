@@ -2,13 +2,14 @@
 
 #include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "fiber.h"
+#include "fiber_graph.h"
+#include "fiber_parallel.h"
 #include "fiber_utils.h"
 #include "job_queue.h"
 
@@ -30,6 +31,9 @@ static struct fiber_queue_operations def_queue_ops = {
 	.init = fiber_queue_fifo_init,
 	.free = fiber_queue_fifo_free,
 	.length = fiber_queue_fifo_length,
+	.push_n = fiber_queue_fifo_push_n,
+	.pop_n = fiber_queue_fifo_pop_n,
+	.set_park_spin = fiber_queue_fifo_set_park_spin,
 };
 #else
 #warning \
@@ -41,6 +45,21 @@ struct pthread_arg {
 	struct fiber_thread *self;
 };
 
+// Jobs a worker took from the queue in one pop_n but hasn't run yet.
+struct job_batch {
+	qsize len;
+	qsize pos;
+	struct fiber_job jobs[FIBER_POP_BATCH_MAX];
+};
+
+// What a node's queue is created with, passed through fiber_numa_run_on.
+struct numa_queue_init_arg {
+	struct fiber_pool *pool;
+	void **queue;
+	qsize length;
+	uint32_t park_spin;
+};
+
 static void *__do_nothing_job(void *arg)
 {
 	return NULL;
@@ -50,35 +69,162 @@ static struct fiber_job wake_job = { .job_id = JOB_ID_MIN,
 				     .job_func = __do_nothing_job,
 				     .job_arg = NULL };
 
+// Set for the lifetime of each worker thread. NULL on non-worker threads.
+static _Thread_local struct pthread_arg *worker_self = NULL;
+// The task running on this worker with FIBER_OPT_STACKFUL
+static _Thread_local struct fiber_task *task_self = NULL;
+// Job caller_run_one is running on this thread, for fiber_job_cancelled
+static _Thread_local struct fiber_pool *inline_pool = NULL;
+static _Thread_local jid inline_job_id = -1;
+
+// Ids this thread reserved from a pool and hasn't handed out yet
+struct jid_block {
+	struct fiber_pool *pool;
+	uint64_t gen;
+	jid next;
+	jid left;
+};
+static _Thread_local struct jid_block jid_block = { 0 };
+// Source of fiber_pool.jid_gen
+static uint64_t jid_gen_prev = 0;
+
+/* States in pool->cancel_slots with FIBER_OPT_CANCEL. A slot holds
+ * CANCEL_WORD(job_id, state), the id tells a reused slot from the job that
+ * had it before.
+ */
+#define CANCEL_QUEUED 0
+#define CANCEL_SKIP 1 // Cancelled before it started
+#define CANCEL_RUNNING 2
+#define CANCEL_STOP 3 // Cancelled while running
+#define CANCEL_DONE 4
+#define CANCEL_STATE_BITS 3
+#define CANCEL_WORD(id, state) \
+	(((uint64_t)(id) << CANCEL_STATE_BITS) | (state))
+#define CANCEL_ID(word) ((word) >> CANCEL_STATE_BITS)
+#define CANCEL_STATE(word) ((word) & ((1u << CANCEL_STATE_BITS) - 1))
+// Whether word belongs to job id
+#define CANCEL_OF(word, id) (CANCEL_ID(word) == CANCEL_ID(CANCEL_WORD(id, 0)))
+
+// Job whose sole purpose is waking an idle worker so it can steal.
+static void *__steal_wake_job(void *arg)
+{
+	struct fiber_pool *pool = (struct fiber_pool *)arg;
+	__atomic_sub_fetch(&pool->steal_wakes, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Job whose sole purpose is waking an idle worker on another NUMA node so it
+// can take jobs from a node with none idle.
+static void *__numa_wake_job(void *arg)
+{
+	struct fiber_numa_queue *nq = (struct fiber_numa_queue *)arg;
+	__atomic_sub_fetch(&nq->wakes, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Tests point this at a fake tree
+static const char *numa_sysfs_root = FIBER_NUMA_SYSFS;
+
 // fifo_job_queue.c uses these
 int __fiber_mutex_init_get_err(int error);
-int __fiber_sem_init_get_err(int error);
 int __fiber_pthread_create_get_err(int error);
 
 static struct fiber_queue_operations *
 init_queue_ops(struct fiber_queue_operations *ops, void *(*malloc)(size_t));
-static inline jid get_and_update_jid(jid *job_id_prev);
+static inline jid get_and_update_jid_n(jid *job_id_prev, qsize n);
+static inline jid jid_take(struct fiber_pool *pool, qsize n);
+static inline jid job_push(struct fiber_pool *pool, struct fiber_job *job,
+			   uint32_t queue_flags, struct fiber_group *group);
+static inline qsize job_push_n(struct fiber_pool *pool, struct fiber_job *jobs,
+			       qsize n, uint32_t queue_flags,
+			       struct fiber_group *group);
+static inline uint32_t job_flags(uint32_t queue_flags);
+static inline void *job_arg(struct fiber_job *job);
+static inline void job_done(struct fiber_pool *pool,
+			    const struct fiber_job *job);
+static int cancel_init(struct fiber_pool *pool, qsize queue_length);
+static inline void cancel_track(struct fiber_pool *pool,
+				const struct fiber_job *jobs, qsize n);
+static void cancel_untrack(struct fiber_pool *pool,
+			   const struct fiber_job *jobs, qsize n);
+static inline int cancel_skip(struct fiber_pool *pool,
+			      const struct fiber_job *job);
+static inline void group_sub(struct fiber_group *group, uint32_t n);
 static inline jid __fiber_job_push(struct fiber_pool *pool,
 				   struct fiber_job *job, uint32_t queue_flags);
+static inline qsize __fiber_job_push_n(struct fiber_pool *pool,
+				       struct fiber_job *jobs, qsize n,
+				       uint32_t queue_flags);
+static inline jid worker_local_push(struct fiber_pool *pool,
+				    struct fiber_job *job);
+static inline void wake_idle_thief(struct fiber_pool *pool);
+static inline void stat_push(struct fiber_pool *pool, qsize pushed, int full);
+static inline int caller_runs(struct fiber_pool *pool, uint32_t queue_flags);
+static jid push_caller_runs(struct fiber_pool *pool, struct fiber_job *job,
+			    uint32_t queue_flags, int *full);
+static qsize push_n_caller_runs(struct fiber_pool *pool,
+				struct fiber_job *jobs, qsize n,
+				uint32_t queue_flags, int *full);
+static int caller_run_one(struct fiber_pool *pool, void *queue,
+			  struct fiber_job *held);
+static void caller_push_held(struct fiber_pool *pool, void *queue,
+			     struct fiber_job *held);
+static inline void *push_queue(struct fiber_pool *pool);
+static inline int job_internal(const struct fiber_job *job);
+static inline int cancel_exempt(const struct fiber_job *job);
+static int pool_queues_init(struct fiber_pool *pool, qsize length,
+			    uint32_t park_spin);
+static void pool_queues_free(struct fiber_pool *pool);
+static int queue_init(struct fiber_pool *pool, void **queue, qsize length,
+		      uint32_t park_spin);
+static int numa_queue_init(void *arg);
+static inline int numa_push_node(struct fiber_pool *pool);
+static inline void numa_wake_remote(struct fiber_pool *pool, int node);
+static inline int numa_pick_node(struct fiber_pool *pool);
+static inline int numa_cpu_node(struct fiber_pool *pool, int cpu);
+static int thread_opts_check(const struct fiber_thread_options *opts);
+static int thread_opts_copy(struct fiber_pool *pool,
+			    const struct fiber_thread_options *opts);
+static int threads_add_with(struct fiber_pool *pool, tpsize threads_num,
+			    const struct fiber_thread_options *topts,
+			    int pool_slots);
 
 /* DECLARATIONS FOR THREAD HELPER FUNCTIONS */
 static inline int fiber_thread_pool_init(struct fiber_pool *pool,
 					 tpsize threads_number);
 static inline void fiber_thread_pool_free(struct fiber_pool *pool);
-static inline int thread_ll_alloc_n(struct fiber_thread **head,
-				    tpsize threads_number,
-				    void *(*malloc)(size_t));
-static inline void thread_ll_free(struct fiber_thread *head,
-				  void (*free)(void *));
+static inline int thread_ll_alloc_n(struct fiber_slab *slab,
+				    struct fiber_thread **head,
+				    tpsize threads_number);
+static inline void thread_ll_free(struct fiber_slab *slab,
+				  struct fiber_thread *head);
 static inline void thread_ll_add(struct fiber_thread **head,
 				 struct fiber_thread *new);
 static inline void thread_ll_remove(struct fiber_thread **head,
 				    struct fiber_thread *thread);
 static int worker_threads_start(struct fiber_pool *pool,
-				struct fiber_thread *head,
-				tpsize threads_number);
-static inline int worker_pthread_start(struct pthread_arg *arg);
+				struct fiber_thread *head, tpsize threads_number,
+				const struct fiber_thread_options *topts,
+				int pool_slots);
+static inline int worker_pthread_start(struct pthread_arg *arg,
+				       const struct fiber_thread_options *topts,
+				       int cpu, tpsize index);
+static int worker_attr_init(struct fiber_pool *pool, pthread_attr_t *attr,
+			    const struct fiber_thread_options *topts,
+			    struct fiber_thread *self, int cpu);
 static void *worker_loop(void *arg);
+static void worker_exit(void *arg);
+static inline int worker_next_job(struct fiber_pool *pool,
+				  struct fiber_thread *self,
+				  struct job_batch *batch,
+				  struct fiber_job *buffer, uint32_t flags);
+static inline int shared_pop(struct fiber_pool *pool, void *queue,
+			     struct job_batch *batch, struct fiber_job *buffer,
+			     uint32_t flags);
+static int steal_job(struct fiber_pool *pool, struct fiber_thread *self,
+		     struct fiber_job *buffer);
+static int numa_steal(struct fiber_pool *pool, struct fiber_thread *self,
+		      struct fiber_job *buffer);
 static inline int handle_pool_flags(struct fiber_pool *pool);
 static int wake_worker_thread(struct fiber_pool *pool);
 static inline void handle_flag_wait_all(struct fiber_pool *pool);
@@ -86,6 +232,34 @@ static inline void pthread_cancel_n(struct fiber_thread *head,
 				    tpsize threads_number);
 static inline void thread_clean_self(struct fiber_pool *pool,
 				     struct fiber_thread *self);
+static struct fiber_worker_hist *worker_hist_alloc(void *(*malloc)(size_t));
+static int autoscale_opts_check(const struct fiber_pool_init_options *opts);
+static int autoscale_start(struct fiber_pool *pool,
+			   const struct fiber_autoscale_options *opts);
+static void autoscale_stop(struct fiber_pool *pool);
+static void *autoscale_loop(void *arg);
+static inline void autoscale_tick(struct fiber_pool *pool, int *busy_ticks);
+static inline int task_run(struct fiber_pool *pool, struct fiber_thread *self,
+			   struct fiber_job *job);
+static void task_entry(void *arg);
+static void *task_resume_job(void *arg);
+static void task_cache_free(struct fiber_thread *self);
+static void task_sleep_add(struct fiber_pool *pool, struct fiber_task *task);
+static void task_ready(struct fiber_pool *pool, struct fiber_task *task);
+static int task_ready_pop(struct fiber_pool *pool, struct fiber_job *buffer);
+static int sleep_start(struct fiber_pool *pool);
+static void sleep_stop(struct fiber_pool *pool);
+static void *sleep_loop(void *arg);
+static jid timer_add(struct fiber_pool *pool, struct fiber_job *job,
+		     const struct timespec *delay, int periodic);
+static int timer_start(struct fiber_pool *pool);
+static void timer_stop(struct fiber_pool *pool);
+static void *timer_loop(void *arg);
+static void timer_push(struct fiber_pool *pool, struct fiber_job *jobs,
+		       qsize n);
+static inline void latency_record(struct fiber_worker_hist *hist,
+				  const struct fiber_job *job,
+				  uint64_t run_start);
 
 int fiber_init(struct fiber_pool *pool, struct fiber_pool_init_options *opts)
 {
@@ -95,6 +269,17 @@ int fiber_init(struct fiber_pool *pool, struct fiber_pool_init_options *opts)
 	if (opts->threads_number < 1 || opts->queue_length < 1) {
 		return FBR_EINVLD_SIZE;
 	}
+	if (thread_opts_check(&opts->thread_opts) != 0) {
+		return FBR_EINVLD_OPT;
+	}
+	if (opts->flags & FIBER_OPT_AUTOSCALE) {
+		if (autoscale_opts_check(opts) != 0) {
+			return FBR_EINVLD_OPT;
+		}
+		if (opts->queue_ops != NULL && opts->queue_ops->length == NULL) {
+			return FBR_EQUEOPS_NONE;
+		}
+	}
 	pool->malloc = opts->malloc == NULL ? malloc : opts->malloc;
 	pool->free = opts->free == NULL ? free : opts->free;
 	if (opts->queue_ops == NULL) {
@@ -118,40 +303,137 @@ int fiber_init(struct fiber_pool *pool, struct fiber_pool_init_options *opts)
 		return FBR_EQUEOPS_NONE;
 	}
 	int error_code = 0;
+	int futures_res = -1;
+	int queues_res = -1;
+	pool->thread_opts.cpus = NULL;
+	pool->cancel_slots = NULL;
+	fiber_slab_init(&pool->slab, pool->malloc, pool->free);
 	int mutex_res = pthread_mutex_init(&pool->lock, NULL);
 	if (mutex_res != 0) {
 		error_code = __fiber_mutex_init_get_err(mutex_res);
 		goto err;
 	}
 	pool->job_id_prev = -1;
+	pool->jid_gen = __atomic_add_fetch(&jid_gen_prev, 1, __ATOMIC_RELAXED);
 	pool->pool_flags = 0;
-	if (error_code != 0) {
+	pool->opt_flags = opts->flags;
+	pool->pop_batch = opts->pop_batch > FIBER_POP_BATCH_MAX ?
+				  FIBER_POP_BATCH_MAX :
+				  opts->pop_batch;
+	pool->deque_length = opts->deque_length > 0 ?
+				     opts->deque_length :
+				     FIBER_DEQUE_LENGTH_DEFAULT;
+	pool->threads_idle = 0;
+	pool->steal_wakes = 0;
+	pool->thieves = 0;
+	pool->threads_live = 0;
+	pool->threads_started = 0;
+#ifndef FIBER_NO_STATS
+	memset(&pool->stats_shared, 0, sizeof(pool->stats_shared));
+	memset(&pool->stats_retired, 0, sizeof(pool->stats_retired));
+#endif
+	pool->hist_retired = NULL;
+	pool->task_stack_size = opts->task_stack_size > 0 ?
+					opts->task_stack_size :
+					FIBER_TASK_STACK_DEFAULT;
+	memset(&pool->sleepers, 0, sizeof(pool->sleepers));
+	pool->tasks_suspended = 0;
+	pool->ready_lock = 0;
+	pool->ready_head = NULL;
+	pool->ready_tail = NULL;
+	uint32_t park_spin = opts->park_spin < 0  ? 0 :
+			     opts->park_spin == 0 ? FIBER_PARK_SPIN_DEFAULT :
+						    (uint32_t)opts->park_spin;
+	fiber_park_sem_init(&pool->threads_sync, 0, park_spin);
+	qsize futures_number = opts->futures_number > 0 ?
+				       opts->futures_number :
+				       FIBER_FUTURES_DEFAULT;
+	futures_res = fiber_future_table_init(&pool->futures, futures_number,
+					      park_spin, pool->malloc);
+	if (futures_res != 0) {
+		error_code = futures_res;
 		goto err;
 	}
-	int queue_res = pool->queue_ops->init(
-		&pool->job_queue, opts->queue_length, pool->malloc, pool->free);
-	if (queue_res != 0) {
-		error_code = queue_res;
+	queues_res = pool_queues_init(pool, opts->queue_length, park_spin);
+	if (queues_res != 0) {
+		error_code = queues_res;
 		goto err;
 	}
-	if (pool->job_queue == NULL) {
-		error_code = FBR_EQUE_NULL;
+	if (pool->opt_flags & FIBER_OPT_CANCEL) {
+		error_code = cancel_init(pool, opts->queue_length);
+		if (error_code != 0) {
+			goto err;
+		}
+	}
+	error_code = thread_opts_copy(pool, &opts->thread_opts);
+	if (error_code != 0) {
 		goto err;
 	}
+	if (pool->opt_flags & FIBER_OPT_LATENCY) {
+		__fiber_ticks_calibrate();
+		pool->hist_retired = worker_hist_alloc(pool->malloc);
+		if (pool->hist_retired == NULL) {
+			error_code = ENOMEM;
+			goto err;
+		}
+	}
 	int tp_init = fiber_thread_pool_init(pool, opts->threads_number);
 	if (tp_init != 0) {
 		error_code = tp_init;
 		goto err;
 	}
+	if (pool->opt_flags & FIBER_OPT_STACKFUL) {
+		error_code = sleep_start(pool);
+		if (error_code != 0) {
+			fiber_thread_pool_free(pool);
+			goto err;
+		}
+	}
+	if (pool->opt_flags & FIBER_OPT_AUTOSCALE) {
+		error_code = autoscale_start(pool, &opts->autoscale);
+		if (error_code != 0) {
+			if (pool->opt_flags & FIBER_OPT_STACKFUL) {
+				sleep_stop(pool);
+			}
+			fiber_thread_pool_free(pool);
+			goto err;
+		}
+	}
+	if (pool->opt_flags & FIBER_OPT_TIMERS) {
+		error_code = timer_start(pool);
+		if (error_code != 0) {
+			if (pool->opt_flags & FIBER_OPT_AUTOSCALE) {
+				autoscale_stop(pool);
+			}
+			if (pool->opt_flags & FIBER_OPT_STACKFUL) {
+				sleep_stop(pool);
+			}
+			fiber_thread_pool_free(pool);
+			goto err;
+		}
+	}
 	return 0;
 err:
 	if (mutex_res == 0) {
 		int des_res = pthread_mutex_destroy(&pool->lock);
 		assert(des_res == 0, "failed to destroy mutex");
 	}
-	if (queue_res == 0 && pool->job_queue != NULL) {
-		pool->queue_ops->free(pool->job_queue);
+	if (queues_res == 0) {
+		pool_queues_free(pool);
+	}
+	if (futures_res == 0) {
+		fiber_future_table_free(&pool->futures, pool->free);
+	}
+	if (pool->thread_opts.cpus != NULL) {
+		pool->free((int *)pool->thread_opts.cpus);
+	}
+	if (pool->hist_retired != NULL) {
+		pool->free(pool->hist_retired);
 	}
+	if (pool->cancel_slots != NULL) {
+		pool->free(pool->cancel_slots);
+	}
+	fiber_slab_free(&pool->slab);
 	if (pool->queue_ops != NULL) {
 #ifndef FIBER_NO_DEFAULT_QUEUE
 		if (pool->queue_ops != &def_queue_ops)
@@ -164,273 +446,1440 @@ err:
 
 jid fiber_job_push(struct fiber_pool *pool, struct fiber_job *job,
 		   uint32_t queue_flags)
+{
+	return job_push(pool, job, queue_flags, NULL);
+}
+
+qsize fiber_job_push_n(struct fiber_pool *pool, struct fiber_job *jobs,
+		       qsize n, uint32_t queue_flags)
+{
+	return job_push_n(pool, jobs, n, queue_flags, NULL);
+}
+
+static jid job_push(struct fiber_pool *pool, struct fiber_job *job,
+		    uint32_t queue_flags, struct fiber_group *group)
 {
 	if (unlikely(pool == NULL || job == NULL || job->job_func == NULL)) {
 		return FBR_ENULL_ARGS;
 	}
-	job->job_id = get_and_update_jid(&pool->job_id_prev);
+	job->group = group;
+	job->job_flags = job_flags(queue_flags);
+	queue_flags &= ~(FIBER_FREE_ARG | FIBER_INLINE_ARG);
+	job->job_id = jid_take(pool, 1);
 	assert(job->job_id > -1, "given a negative job id");
-	return __fiber_job_push(pool, job, queue_flags);
+	if (pool->opt_flags & FIBER_OPT_LATENCY) {
+		job->enqueue_ts = __fiber_ticks();
+	}
+	cancel_track(pool, job, 1);
+	if (pool->opt_flags & FIBER_OPT_WORK_STEALING) {
+		jid local_res = worker_local_push(pool, job);
+		if (local_res >= 0) {
+			stat_push(pool, 1, 0);
+			return local_res;
+		}
+	}
+	int full = 0;
+	jid res;
+	if (caller_runs(pool, queue_flags)) {
+		res = push_caller_runs(pool, job, queue_flags, &full);
+	} else {
+		res = __fiber_job_push(pool, job,
+				       queue_flags & ~FIBER_CALLER_RUNS);
+	}
+	if (res < 0) {
+		cancel_untrack(pool, job, 1);
+	}
+	stat_push(pool, res >= 0, full || res == -EAGAIN);
+	return res;
 }
 
-void fiber_free(struct fiber_pool *pool)
+static qsize job_push_n(struct fiber_pool *pool, struct fiber_job *jobs,
+			qsize n, uint32_t queue_flags, struct fiber_group *group)
 {
-	if (pool == NULL || pool->queue_ops == NULL ||
-	    pool->job_queue == NULL || pool->queue_ops->free == NULL ||
-	    pool->free == NULL) {
-		return;
+	if (unlikely(pool == NULL || jobs == NULL)) {
+		return FBR_ENULL_ARGS;
 	}
-	pool->queue_ops->free(pool->job_queue);
-	fiber_thread_pool_free(pool);
-	int des_res = pthread_mutex_destroy(&pool->lock);
-	assert(des_res == 0, "failed to destroy mutex");
-#ifndef FIBER_NO_DEFAULT_QUEUE
-	if (pool->queue_ops != &def_queue_ops)
-#endif
-		pool->free((struct fiber_queue_operations *)pool->queue_ops);
+	if (unlikely(n < 1)) {
+		return FBR_EINVLD_SIZE;
+	}
+	for (qsize i = 0; i < n; ++i) {
+		if (unlikely(jobs[i].job_func == NULL)) {
+			return FBR_ENULL_ARGS;
+		}
+	}
+	jid first = jid_take(pool, n);
+	assert(first > -1, "reserved a negative job id");
+	for (qsize i = 0; i < n; ++i) {
+		jobs[i].job_id = first + i;
+		jobs[i].group = group;
+		jobs[i].job_flags = job_flags(queue_flags);
+	}
+	queue_flags &= ~(FIBER_FREE_ARG | FIBER_INLINE_ARG);
+	if (pool->opt_flags & FIBER_OPT_LATENCY) {
+		// One read for the batch, they are all queued at the same time
+		uint64_t now = __fiber_ticks();
+		for (qsize i = 0; i < n; ++i) {
+			jobs[i].enqueue_ts = now;
+		}
+	}
+	cancel_track(pool, jobs, n);
+	qsize pushed = 0;
+	if (pool->opt_flags & FIBER_OPT_WORK_STEALING) {
+		while (pushed < n &&
+		       worker_local_push(pool, &jobs[pushed]) >= 0) {
+			++pushed;
+		}
+	}
+	int full = 0;
+	if (pushed < n) {
+		qsize push_res;
+		if (caller_runs(pool, queue_flags)) {
+			push_res = push_n_caller_runs(pool, jobs + pushed,
+						      n - pushed, queue_flags,
+						      &full);
+		} else {
+			push_res = __fiber_job_push_n(
+				pool, jobs + pushed, n - pushed,
+				queue_flags & ~FIBER_CALLER_RUNS);
+		}
+		if (push_res < 0) {
+			cancel_untrack(pool, jobs + pushed, n - pushed);
+			stat_push(pool, pushed, full || push_res == -EAGAIN);
+			return pushed > 0 ? pushed : push_res;
+		}
+		pushed += push_res;
+		cancel_untrack(pool, jobs + pushed, n - pushed);
+	}
+	stat_push(pool, pushed, full || pushed < n);
+	return pushed;
 }
 
-void fiber_wait(struct fiber_pool *pool)
+int fiber_group_init(struct fiber_group *group, struct fiber_pool *pool)
 {
-	if (pool == NULL) {
-		return;
-	}
-	__atomic_or_fetch(&pool->pool_flags, FIBER_POOL_FLAG_WAIT,
-			  __ATOMIC_SEQ_CST);
-	// This sequence does not cause a race condition. If the number of
-	// working threads is non zero AFTER we set the pool flags, we
-	// know some thread will eventaully handle it. In the case where
-	// working is 0. The queue was either just empty or is empty.
-	tpsize working =
-		__atomic_load_n(&pool->threads_working, __ATOMIC_SEQ_CST);
-	tpsize length = fiber_jobs_pending(pool);
-	if (working > 0 || length > 0) {
-		while (sem_wait(&pool->threads_sync) != 0 && errno == EINTR)
-			;
+	if (group == NULL || pool == NULL) {
+		return FBR_ENULL_ARGS;
 	}
-	uint32_t off = ~FIBER_POOL_FLAG_WAIT;
-	__atomic_and_fetch(&pool->pool_flags, off, __ATOMIC_SEQ_CST);
+	group->pool = pool;
+	group->pending = 0;
+	return 0;
 }
 
-qsize fiber_jobs_pending(struct fiber_pool *pool)
+jid fiber_group_push(struct fiber_group *group, struct fiber_job *job,
+		     uint32_t queue_flags)
 {
-	if (pool == NULL || pool->job_queue == NULL ||
-	    pool->queue_ops == NULL) {
+	if (unlikely(group == NULL)) {
 		return FBR_ENULL_ARGS;
 	}
-	if (pool->queue_ops->length == NULL) {
-		return FBR_EQUEOPS_NONE;
+	// Counted first, the job may return before push does
+	__atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+	jid res = job_push(group->pool, job, queue_flags, group);
+	if (res < 0) {
+		group_sub(group, 1);
 	}
-	return pool->queue_ops->length(pool->job_queue);
+	return res;
 }
 
-/* THREAD CONTROL/INFO FUNCTIONS */
-
-int fiber_threads_remove(struct fiber_pool *pool, tpsize threads_num)
+qsize fiber_group_push_n(struct fiber_group *group, struct fiber_job *jobs,
+			 qsize n, uint32_t queue_flags)
 {
-	if (pool == NULL) {
+	if (unlikely(group == NULL)) {
 		return FBR_ENULL_ARGS;
 	}
-	if (threads_num < 1) {
+	if (unlikely(n < 1)) {
 		return FBR_EINVLD_SIZE;
 	}
-	if (pool->queue_ops == NULL || pool->queue_ops->push == NULL) {
-		return FBR_EPOOL_UNINIT;
+	__atomic_add_fetch(&group->pending, (uint32_t)n, __ATOMIC_RELAXED);
+	qsize res = job_push_n(group->pool, jobs, n, queue_flags, group);
+	qsize pushed = res < 0 ? 0 : res;
+	if (pushed < n) {
+		group_sub(group, (uint32_t)(n - pushed));
 	}
-	// Set flag & val to notify thread it should commit seppuku
-	__atomic_add_fetch(&pool->threads_kill_number, threads_num,
-			   __ATOMIC_SEQ_CST);
-	__atomic_or_fetch(&pool->pool_flags, FIBER_POOL_FLAG_KILL_N,
-			  __ATOMIC_SEQ_CST);
-	return wake_worker_thread(pool);
+	return res;
 }
 
-int fiber_threads_add(struct fiber_pool *pool, tpsize threads_num)
+int fiber_group_wait(struct fiber_group *group)
 {
-	if (pool == NULL) {
+	if (group == NULL) {
 		return FBR_ENULL_ARGS;
 	}
-	if (threads_num < 1) {
-		return FBR_EINVLD_SIZE;
-	}
-	assert(pool->threads_number + threads_num > 0, "num threads overflow");
-	struct fiber_thread *threads;
-	int error_code = thread_ll_alloc_n(&threads, threads_num, pool->malloc);
-	if (error_code != 0) {
-		return error_code;
-	}
-	assert(threads != NULL, "failed to alloc threads in fiber_threads_add");
-	int start_res = worker_threads_start(pool, threads, threads_num);
-	int lock_res = pthread_mutex_lock(&pool->lock);
-	assert(lock_res == 0,
-	       "Could not obtain pool lock to add threads to ll.");
-	thread_ll_add(&pool->thread_head, threads);
-	pthread_mutex_unlock(&pool->lock);
-	if (start_res != 0) {
-		return start_res;
+	uint32_t pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE);
+	while ((pending & ~FIBER_GROUP_WAITERS) != 0) {
+		// The last job only makes the wake syscall if the bit is set
+		if (!(pending & FIBER_GROUP_WAITERS) &&
+		    !__atomic_compare_exchange_n(
+			    &group->pending, &pending,
+			    pending | FIBER_GROUP_WAITERS, 0, __ATOMIC_ACQUIRE,
+			    __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		fiber_park_wait(&group->pending, pending | FIBER_GROUP_WAITERS,
+				NULL);
+		pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE);
 	}
-	__atomic_add_fetch(&pool->threads_number, threads_num,
-			   __ATOMIC_RELAXED);
 	return 0;
 }
 
-tpsize fiber_threads_number(struct fiber_pool *pool)
+qsize fiber_group_pending(struct fiber_group *group)
 {
-	if (pool == NULL) {
+	if (group == NULL) {
 		return FBR_ENULL_ARGS;
 	}
-	return __atomic_load_n(&pool->threads_number, __ATOMIC_RELAXED);
+	uint32_t pending = __atomic_load_n(&group->pending, __ATOMIC_RELAXED);
+	return (qsize)(pending & ~FIBER_GROUP_WAITERS);
 }
 
-tpsize fiber_threads_working(struct fiber_pool *pool)
+static void group_sub(struct fiber_group *group, uint32_t n)
 {
-	if (pool == NULL) {
-		return FBR_ENULL_ARGS;
+	uint32_t prev = __atomic_load_n(&group->pending, __ATOMIC_RELAXED);
+	uint32_t next;
+	do {
+		// The last job clears the waiters bit too, the waits it wakes
+		// are over and a reused group starts without it
+		next = prev - n == FIBER_GROUP_WAITERS ? 0 : prev - n;
+	} while (!__atomic_compare_exchange_n(&group->pending, &prev, next, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	// Only prev is used, the waiter may free group once it sees 0. Waking
+	// a stale futex is harmless.
+	if (next == 0 && (prev & FIBER_GROUP_WAITERS)) {
+		fiber_park_wake(&group->pending, INT_MAX);
 	}
-	return __atomic_load_n(&pool->threads_working, __ATOMIC_RELAXED);
 }
 
-static jid __fiber_job_push(struct fiber_pool *pool, struct fiber_job *job,
-			    uint32_t queue_flags)
+// The part of queue_flags kept in job_flags
+static uint32_t job_flags(uint32_t queue_flags)
 {
-	assert(pool->queue_ops != NULL || pool->queue_ops->push != NULL,
-	       "queue_ops or push is null.");
-	int push_res = pool->queue_ops->push(pool->job_queue, job, queue_flags);
-	// Don't allow positive error codes to return
-	if (push_res < 0) {
-		return push_res;
-	} else if (push_res != 0) {
-		return FBR_EPUSH_JOB;
+	uint32_t flags = queue_flags & (FIBER_FREE_ARG | FIBER_INLINE_ARG);
+	// job_arg is part of job_data, there is nothing to free
+	if (flags & FIBER_INLINE_ARG) {
+		flags &= ~FIBER_FREE_ARG;
 	}
-	return job->job_id;
+	return flags;
 }
 
-/* STATIC FUNCTION DEFINITIONS */
-
-static inline jid get_and_update_jid(jid *job_id_prev)
+// What job_func is called with. job must be the copy being run.
+static void *job_arg(struct fiber_job *job)
 {
-	// 64 bits will probably never overflow but 32 or less may
-#if JOB_ID_MAX < INT64_MAX || defined(FIBER_CHECK_JID_OVERFLOW)
-	jid prev = __atomic_load_n(job_id_prev, __ATOMIC_SEQ_CST);
-	__fbr_atomic_ruw(jid, job_id_prev, prev,
-			 prev == JOB_ID_MAX ? -1 : prev);
-#endif
-	return __atomic_add_fetch(job_id_prev, 1, __ATOMIC_RELEASE);
+	if (job->job_flags & FIBER_INLINE_ARG) {
+		return job->job_data;
+	}
+	return job->job_arg;
 }
 
-static struct fiber_queue_operations *
-init_queue_ops(struct fiber_queue_operations *ops, void *(*malloc)(size_t))
+// Called once a job's function has returned or it was skipped
+static void job_done(struct fiber_pool *pool, const struct fiber_job *job)
 {
-	struct fiber_queue_operations *a_ops = malloc(sizeof(*ops));
-	if (a_ops == NULL) {
-		return NULL;
+	if (pool->cancel_slots != NULL) {
+		uint64_t *slot = &pool->cancel_slots[job->job_id &
+						     pool->cancel_mask];
+		uint64_t word = __atomic_load_n(slot, __ATOMIC_RELAXED);
+		// A skipped job's slot stays CANCEL_SKIP
+		while (CANCEL_OF(word, job->job_id) &&
+		       (CANCEL_STATE(word) == CANCEL_RUNNING ||
+			CANCEL_STATE(word) == CANCEL_STOP) &&
+		       !__atomic_compare_exchange_n(
+			       slot, &word,
+			       CANCEL_WORD(job->job_id, CANCEL_DONE), 1,
+			       __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
+	if (job->job_flags & FIBER_FREE_ARG) {
+		fiber_job_arg_free(pool, job->job_arg);
+	}
+	if (job->group != NULL) {
+		group_sub(job->group, 1);
 	}
-	a_ops->push = ops->push;
-	a_ops->pop = ops->pop;
-	a_ops->init = ops->init;
-	a_ops->free = ops->free;
-	a_ops->length = ops->length;
-	return a_ops;
 }
 
-/* THREAD HELPER FUNCTIONS IMPLEMENTATIONS */
-
-static int fiber_thread_pool_init(struct fiber_pool *pool,
-				  tpsize threads_number)
+static int cancel_init(struct fiber_pool *pool, qsize queue_length)
 {
-	int error_code = thread_ll_alloc_n(&pool->thread_head, threads_number,
-					   pool->malloc);
-	if (error_code != 0) {
-		goto err;
+	uint64_t want = (uint64_t)queue_length * 4;
+	if (pool->numa_queues != NULL) {
+		want *= (uint64_t)pool->numa.nodes_number;
 	}
-
-	int sem_res = sem_init(&pool->threads_sync, 0, 0);
-	if (sem_res != 0) {
-		error_code = __fiber_sem_init_get_err(errno);
-		goto err;
+	uint64_t slots = FIBER_CANCEL_SLOTS_MIN;
+	while (slots < want) {
+		slots <<= 1;
 	}
-	pool->threads_number = threads_number;
-	pool->threads_working = 0;
-	pool->threads_kill_number = 0;
-
-	error_code =
-		worker_threads_start(pool, pool->thread_head, threads_number);
-	if (error_code != 0) {
-		goto err;
+	pool->cancel_slots = pool->malloc(slots * sizeof(uint64_t));
+	if (pool->cancel_slots == NULL) {
+		return ENOMEM;
+	}
+	// Id 0 in any state but CANCEL_QUEUED, so job 0 isn't tracked early
+	for (uint64_t i = 0; i < slots; ++i) {
+		pool->cancel_slots[i] = CANCEL_WORD(0, CANCEL_DONE);
 	}
+	pool->cancel_mask = slots - 1;
 	return 0;
-err:
-	if (pool->thread_head) {
-		thread_ll_free(pool->thread_head, pool->free);
+}
+
+// Marks jobs as queued before they can be popped
+static void cancel_track(struct fiber_pool *pool, const struct fiber_job *jobs,
+			 qsize n)
+{
+	if (pool->cancel_slots == NULL) {
+		return;
 	}
-	if (sem_res == 0) {
-		int des_res = sem_destroy(&pool->threads_sync);
-		assert(des_res == 0, "failed to destroy semaphore");
+	for (qsize i = 0; i < n; ++i) {
+		if (cancel_exempt(&jobs[i])) {
+			continue;
+		}
+		__atomic_store_n(&pool->cancel_slots[jobs[i].job_id &
+						     pool->cancel_mask],
+				 CANCEL_WORD(jobs[i].job_id, CANCEL_QUEUED),
+				 __ATOMIC_RELEASE);
 	}
-	return error_code;
 }
 
-static void fiber_thread_pool_free(struct fiber_pool *pool)
+// Marks tracked jobs that couldn't be pushed as done, so cancelling them
+// fails like it does for any job that isn't queued
+static void cancel_untrack(struct fiber_pool *pool,
+			   const struct fiber_job *jobs, qsize n)
 {
-	pthread_cancel_n(pool->thread_head, THREAD_POOL_SIZE_MAX);
-	thread_ll_free(pool->thread_head, pool->free);
-	int des_res = sem_destroy(&pool->threads_sync);
-	assert(des_res == 0, "failed to destroy semaphore");
+	if (pool->cancel_slots == NULL) {
+		return;
+	}
+	for (qsize i = 0; i < n; ++i) {
+		uint64_t *slot = &pool->cancel_slots[jobs[i].job_id &
+						     pool->cancel_mask];
+		uint64_t word = __atomic_load_n(slot, __ATOMIC_RELAXED);
+		while (CANCEL_OF(word, jobs[i].job_id) &&
+		       !__atomic_compare_exchange_n(
+			       slot, &word,
+			       CANCEL_WORD(jobs[i].job_id, CANCEL_DONE), 1,
+			       __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
 }
 
-static int thread_ll_alloc_n(struct fiber_thread **head, tpsize threads_number,
-			     void *(*malloc)(size_t))
+/* Claims a popped job for running.
+ * @returns: 0 if the job should run, 1 if it was cancelled. A cancelled job
+ * is already done, its group counted down and its future completed.
+ */
+static int cancel_skip(struct fiber_pool *pool, const struct fiber_job *job)
 {
-	*head = malloc(sizeof(**head));
-	if (*head == NULL) {
-		return errno;
+	if (pool->cancel_slots == NULL || cancel_exempt(job)) {
+		return 0;
 	}
-	struct fiber_thread *curr = *head;
-	for (tpsize i = 1; i < threads_number; ++i) {
-		curr->next = malloc(sizeof(*curr));
-		if (curr->next == NULL) {
-			return errno;
-		}
-		curr = curr->next;
+	uint64_t *slot = &pool->cancel_slots[job->job_id & pool->cancel_mask];
+	uint64_t word = CANCEL_WORD(job->job_id, CANCEL_QUEUED);
+	if (__atomic_compare_exchange_n(
+		    slot, &word, CANCEL_WORD(job->job_id, CANCEL_RUNNING), 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return 0;
 	}
-	curr->next = NULL;
-	return 0;
+	// Anything else means a newer job took the slot, so it runs untracked
+	if (word != CANCEL_WORD(job->job_id, CANCEL_SKIP)) {
+		return 0;
+	}
+	if (job->job_func == __fiber_future_job) {
+		__fiber_future_cancel(job->job_arg);
+	}
+	job_done(pool, job);
+	return 1;
 }
 
-static void thread_ll_free(struct fiber_thread *head, void (*free)(void *))
+jid fiber_job_push_future(struct fiber_pool *pool, struct fiber_job *job,
+			  uint32_t queue_flags, struct fiber_future *future)
 {
-	struct fiber_thread *next;
-	while (head != NULL) {
-		next = head->next;
-		free(head);
-		head = next;
+	if (unlikely(pool == NULL || job == NULL || job->job_func == NULL ||
+		     future == NULL)) {
+		return FBR_ENULL_ARGS;
 	}
+	// The slot only keeps job_arg
+	if (queue_flags & FIBER_INLINE_ARG) {
+		return FBR_EINVLD_OPT;
+	}
+	if (fiber_future_slot_take(&pool->futures, job, future) != 0) {
+		return FBR_ENO_FUTURE;
+	}
+	struct fiber_job trampoline = {
+		.job_func = __fiber_future_job,
+		.job_arg = &pool->futures.slots[future->slot],
+	};
+	// The slot isn't the caller's to free
+	jid res = fiber_job_push(pool, &trampoline,
+				 queue_flags & ~FIBER_FREE_ARG);
+	if (res < 0) {
+		fiber_future_slot_put(&pool->futures, future);
+		return res;
+	}
+	job->job_id = res;
+	future->job_id = res;
+	return res;
 }
 
-static void thread_ll_add(struct fiber_thread **head, struct fiber_thread *new)
+int fiber_future_wait(struct fiber_pool *pool, struct fiber_future *future,
+		      void **result)
 {
-	assert(new != NULL, "tried to add NULL to thread ll");
-	if (*head == NULL) {
-		*head = new;
-		return;
+	if (unlikely(pool == NULL || future == NULL)) {
+		return FBR_ENULL_ARGS;
 	}
-	struct fiber_thread *next = (*head)->next;
-	(*head)->next = new;
-	while (new->next != NULL) {
-		new = new->next;
+	int res = fiber_future_table_wait(&pool->futures, future, result, 1,
+					  NULL);
+	return res == EINVAL ? FBR_EINVLD_FUTURE : res;
+}
+
+int fiber_future_try_get(struct fiber_pool *pool, struct fiber_future *future,
+			 void **result)
+{
+	if (unlikely(pool == NULL || future == NULL)) {
+		return FBR_ENULL_ARGS;
 	}
-	new->next = next;
+	int res = fiber_future_table_wait(&pool->futures, future, result, 0,
+					  NULL);
+	return res == EINVAL ? FBR_EINVLD_FUTURE : res;
 }
 
-static void thread_ll_remove(struct fiber_thread **head,
-			     struct fiber_thread *thread)
+int fiber_future_wait_timeout(struct fiber_pool *pool,
+			      struct fiber_future *future, void **result,
+			      const struct timespec *timeout)
 {
-	assert(*head != NULL, "No threads in ll.");
-	assert(thread != NULL, "Tried to remove NULL from thread ll.");
-	struct fiber_thread *curr = (*head)->next;
-	if (*head == thread) {
-		*head = curr;
-		return;
+	if (unlikely(pool == NULL || future == NULL || timeout == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	int res = fiber_future_table_wait(&pool->futures, future, result, 1,
+					  timeout);
+	return res == EINVAL ? FBR_EINVLD_FUTURE : res;
+}
+
+int fiber_future_discard(struct fiber_pool *pool, struct fiber_future *future)
+{
+	if (unlikely(pool == NULL || future == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	int res = fiber_future_table_discard(&pool->futures, future);
+	return res == EINVAL ? FBR_EINVLD_FUTURE : res;
+}
+
+void fiber_free(struct fiber_pool *pool)
+{
+	if (pool == NULL || pool->queue_ops == NULL ||
+	    pool->job_queue == NULL || pool->queue_ops->free == NULL ||
+	    pool->free == NULL) {
+		return;
+	}
+	// Timers push jobs, stop them before anything they push to
+	if (pool->opt_flags & FIBER_OPT_TIMERS) {
+		timer_stop(pool);
+	}
+	// The supervisor adds workers, stop it before cancelling them
+	if (pool->opt_flags & FIBER_OPT_AUTOSCALE) {
+		autoscale_stop(pool);
+	}
+	// Sleeping tasks are queued again by the sleep thread
+	if (pool->opt_flags & FIBER_OPT_STACKFUL) {
+		sleep_stop(pool);
+	}
+	// Workers must be gone before the queue they block on is freed
+	fiber_thread_pool_free(pool);
+	if (pool->opt_flags & FIBER_OPT_STACKFUL) {
+		fiber_sleep_heap_free(&pool->sleepers, pool->free);
+	}
+	pool_queues_free(pool);
+	fiber_future_table_free(&pool->futures, pool->free);
+	// Worker caches only hold blocks of these chunks
+	fiber_slab_free(&pool->slab);
+	if (pool->thread_opts.cpus != NULL) {
+		pool->free((int *)pool->thread_opts.cpus);
+	}
+	if (pool->hist_retired != NULL) {
+		pool->free(pool->hist_retired);
+	}
+	if (pool->cancel_slots != NULL) {
+		pool->free(pool->cancel_slots);
+	}
+	int des_res = pthread_mutex_destroy(&pool->lock);
+	assert(des_res == 0, "failed to destroy mutex");
+#ifndef FIBER_NO_DEFAULT_QUEUE
+	if (pool->queue_ops != &def_queue_ops)
+#endif
+		pool->free((struct fiber_queue_operations *)pool->queue_ops);
+}
+
+jid fiber_job_push_after(struct fiber_pool *pool, struct fiber_job *job,
+			 const struct timespec *delay)
+{
+	return timer_add(pool, job, delay, 0);
+}
+
+jid fiber_job_push_every(struct fiber_pool *pool, struct fiber_job *job,
+			 const struct timespec *period)
+{
+	return timer_add(pool, job, period, 1);
+}
+
+int fiber_job_timer_cancel(struct fiber_pool *pool, jid id)
+{
+	if (pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (!(pool->opt_flags & FIBER_OPT_TIMERS)) {
+		return FBR_EINVLD_OPT;
+	}
+	int lock_res = pthread_mutex_lock(&pool->timer_lock);
+	assert(lock_res == 0, "Could not obtain timer lock");
+	struct fiber_timer *timer = fiber_timer_wheel_remove(&pool->timers, id);
+	pthread_mutex_unlock(&pool->timer_lock);
+	if (timer == NULL) {
+		return FBR_ENO_JOB;
+	}
+	pool->free(timer);
+	return 0;
+}
+
+int fiber_job_cancel(struct fiber_pool *pool, jid id)
+{
+	if (pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (!(pool->opt_flags & (FIBER_OPT_CANCEL | FIBER_OPT_TIMERS))) {
+		return FBR_EINVLD_OPT;
+	}
+	int res = FBR_ENO_JOB;
+	if (pool->opt_flags & FIBER_OPT_TIMERS) {
+		// A periodic job may also have a run queued, so keep going
+		res = fiber_job_timer_cancel(pool, id) == 0 ? 0 : FBR_ENO_JOB;
+	}
+	if (pool->cancel_slots == NULL || id < 0) {
+		return res;
+	}
+	uint64_t *slot = &pool->cancel_slots[id & pool->cancel_mask];
+	uint64_t word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	while (CANCEL_OF(word, id)) {
+		uint64_t to;
+		switch (CANCEL_STATE(word)) {
+		case CANCEL_QUEUED:
+			to = CANCEL_WORD(id, CANCEL_SKIP);
+			break;
+		case CANCEL_RUNNING:
+			to = CANCEL_WORD(id, CANCEL_STOP);
+			break;
+		case CANCEL_SKIP:
+			return 0;
+		case CANCEL_STOP:
+			return res == 0 ? 0 : FBR_EJOB_RUNNING;
+		default:
+			return res;
+		}
+		if (__atomic_compare_exchange_n(slot, &word, to, 1,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			return CANCEL_STATE(to) == CANCEL_SKIP || res == 0 ?
+				       0 :
+				       FBR_EJOB_RUNNING;
+		}
+	}
+	return res;
+}
+
+void *fiber_job_arg_alloc(struct fiber_pool *pool, size_t size)
+{
+	if (unlikely(pool == NULL)) {
+		return NULL;
+	}
+	struct pthread_arg *kit = worker_self;
+	struct fiber_slab_cache *cache = NULL;
+	if (kit != NULL && kit->pool == pool) {
+		cache = &kit->self->slab_cache;
+	}
+	return fiber_slab_alloc(&pool->slab, cache, size);
+}
+
+void fiber_job_arg_free(struct fiber_pool *pool, void *arg)
+{
+	if (unlikely(pool == NULL || arg == NULL)) {
+		return;
+	}
+	struct pthread_arg *kit = worker_self;
+	struct fiber_slab_cache *cache = NULL;
+	if (kit != NULL && kit->pool == pool) {
+		cache = &kit->self->slab_cache;
+	}
+	fiber_slab_release(&pool->slab, cache, arg);
+}
+
+int fiber_job_cancelled(void)
+{
+	struct fiber_pool *pool = inline_pool;
+	jid id = inline_job_id;
+	if (pool == NULL) {
+		struct pthread_arg *kit = worker_self;
+		if (kit == NULL) {
+			return 0;
+		}
+		pool = kit->pool;
+		id = __atomic_load_n(&kit->self->job_id, __ATOMIC_RELAXED);
+	}
+	if (pool->cancel_slots == NULL || id < 0) {
+		return 0;
+	}
+	uint64_t word = __atomic_load_n(
+		&pool->cancel_slots[id & pool->cancel_mask], __ATOMIC_ACQUIRE);
+	return word == CANCEL_WORD(id, CANCEL_STOP);
+}
+
+void fiber_wait(struct fiber_pool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+	if (pool->opt_flags & FIBER_OPT_CALLER_RUNS) {
+		int nodes = pool->numa_queues != NULL ?
+				    pool->numa.nodes_number :
+				    1;
+		for (int i = 0; i < nodes; ++i) {
+			void *queue = pool->numa_queues != NULL ?
+					      pool->numa_queues[i].job_queue :
+					      pool->job_queue;
+			struct fiber_job held = { 0 };
+			while (caller_run_one(pool, queue, &held) == 0) {
+			}
+			caller_push_held(pool, queue, &held);
+		}
+	}
+	__atomic_or_fetch(&pool->pool_flags, FIBER_POOL_FLAG_WAIT,
+			  __ATOMIC_SEQ_CST);
+	// This sequence does not cause a race condition. If the number of
+	// working threads is non zero AFTER we set the pool flags, we
+	// know some thread will eventaully handle it. In the case where
+	// working is 0. The queue was either just empty or is empty.
+	tpsize working =
+		__atomic_load_n(&pool->threads_working, __ATOMIC_SEQ_CST);
+	tpsize length = fiber_jobs_pending(pool);
+	tpsize suspended =
+		__atomic_load_n(&pool->tasks_suspended, __ATOMIC_SEQ_CST);
+	if (working > 0 || length > 0 || suspended > 0) {
+		fiber_park_sem_take(&pool->threads_sync, 1, 1);
+	}
+	uint32_t off = ~FIBER_POOL_FLAG_WAIT;
+	__atomic_and_fetch(&pool->pool_flags, off, __ATOMIC_SEQ_CST);
+}
+
+qsize fiber_jobs_pending(struct fiber_pool *pool)
+{
+	if (pool == NULL || pool->job_queue == NULL ||
+	    pool->queue_ops == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (pool->queue_ops->length == NULL) {
+		return FBR_EQUEOPS_NONE;
+	}
+	if (pool->numa_queues == NULL) {
+		return pool->queue_ops->length(pool->job_queue);
+	}
+	qsize length = 0;
+	for (int i = 0; i < pool->numa.nodes_number; ++i) {
+		length += pool->queue_ops->length(pool->numa_queues[i].job_queue);
+	}
+	return length;
+}
+
+#ifndef FIBER_NO_STATS
+static void stats_collect(struct fiber_stats *out,
+			  const struct fiber_worker_stats *from)
+{
+	out->jobs += __atomic_load_n(&from->jobs, __ATOMIC_RELAXED);
+	out->steals += __atomic_load_n(&from->steals, __ATOMIC_RELAXED);
+	out->idle_ns += __atomic_load_n(&from->idle_ns, __ATOMIC_RELAXED);
+	out->pushes += __atomic_load_n(&from->pushes, __ATOMIC_RELAXED);
+	out->pushes_full +=
+		__atomic_load_n(&from->pushes_full, __ATOMIC_RELAXED);
+	out->jobs_inline +=
+		__atomic_load_n(&from->jobs_inline, __ATOMIC_RELAXED);
+}
+#endif
+
+int fiber_pool_stats(struct fiber_pool *pool, struct fiber_stats *out)
+{
+	if (pool == NULL || out == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	memset(out, 0, sizeof(*out));
+#ifndef FIBER_NO_STATS
+	stats_collect(out, &pool->stats_shared);
+	stats_collect(out, &pool->stats_retired);
+	// Same guard as steal_job, thread_clean_self won't free a thread
+	// while we are walking.
+	__atomic_add_fetch(&pool->thieves, 1, __ATOMIC_SEQ_CST);
+	struct fiber_thread *curr =
+		__atomic_load_n(&pool->thread_head, __ATOMIC_ACQUIRE);
+	while (curr != NULL) {
+		stats_collect(out, &curr->stats);
+		curr = __atomic_load_n(&curr->next, __ATOMIC_ACQUIRE);
+	}
+	__atomic_sub_fetch(&pool->thieves, 1, __ATOMIC_RELEASE);
+#endif
+	out->threads_number = fiber_threads_number(pool);
+	out->threads_working = fiber_threads_working(pool);
+	out->jobs_pending = fiber_jobs_pending(pool);
+	return 0;
+}
+
+static void hist_collect(struct fiber_hist *wait, struct fiber_hist *run,
+			 const struct fiber_worker_hist *from)
+{
+	if (from == NULL) {
+		return;
+	}
+	if (wait != NULL) {
+		fiber_hist_merge(wait, &from->wait);
+	}
+	if (run != NULL) {
+		fiber_hist_merge(run, &from->run);
+	}
+}
+
+int fiber_pool_latency(struct fiber_pool *pool, struct fiber_hist *wait,
+		       struct fiber_hist *run)
+{
+	if (pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (!(pool->opt_flags & FIBER_OPT_LATENCY)) {
+		return FBR_EINVLD_OPT;
+	}
+	if (wait != NULL) {
+		memset(wait, 0, sizeof(*wait));
+	}
+	if (run != NULL) {
+		memset(run, 0, sizeof(*run));
+	}
+	hist_collect(wait, run, pool->hist_retired);
+	// Same guard as fiber_pool_stats
+	__atomic_add_fetch(&pool->thieves, 1, __ATOMIC_SEQ_CST);
+	struct fiber_thread *curr =
+		__atomic_load_n(&pool->thread_head, __ATOMIC_ACQUIRE);
+	while (curr != NULL) {
+		hist_collect(wait, run, curr->hist);
+		curr = __atomic_load_n(&curr->next, __ATOMIC_ACQUIRE);
+	}
+	__atomic_sub_fetch(&pool->thieves, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* THREAD CONTROL/INFO FUNCTIONS */
+
+int fiber_threads_remove(struct fiber_pool *pool, tpsize threads_num)
+{
+	if (pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (threads_num < 1) {
+		return FBR_EINVLD_SIZE;
+	}
+	if (pool->queue_ops == NULL || pool->queue_ops->push == NULL) {
+		return FBR_EPOOL_UNINIT;
+	}
+	// Set flag & val to notify thread it should commit seppuku
+	__atomic_add_fetch(&pool->threads_kill_number, threads_num,
+			   __ATOMIC_SEQ_CST);
+	__atomic_or_fetch(&pool->pool_flags, FIBER_POOL_FLAG_KILL_N,
+			  __ATOMIC_SEQ_CST);
+	return wake_worker_thread(pool);
+}
+
+int fiber_threads_add(struct fiber_pool *pool, tpsize threads_num)
+{
+	if (pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (threads_num < 1) {
+		return FBR_EINVLD_SIZE;
+	}
+	return threads_add_with(pool, threads_num, &pool->thread_opts, 1);
+}
+
+int fiber_threads_add_opts(struct fiber_pool *pool, tpsize threads_num,
+			   const struct fiber_thread_options *opts)
+{
+	if (pool == NULL || opts == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (threads_num < 1) {
+		return FBR_EINVLD_SIZE;
+	}
+	if (thread_opts_check(opts) != 0) {
+		return FBR_EINVLD_OPT;
+	}
+	return threads_add_with(pool, threads_num, opts, 0);
+}
+
+static int threads_add_with(struct fiber_pool *pool, tpsize threads_num,
+			    const struct fiber_thread_options *topts,
+			    int pool_slots)
+{
+	assert(pool->threads_number + threads_num > 0, "num threads overflow");
+	struct fiber_thread *threads;
+	int error_code = thread_ll_alloc_n(&pool->slab, &threads,
+					   threads_num);
+	if (error_code != 0) {
+		return error_code;
+	}
+	assert(threads != NULL, "failed to alloc threads in fiber_threads_add");
+	int start_res = worker_threads_start(pool, threads, threads_num, topts,
+					     pool_slots);
+	int lock_res = pthread_mutex_lock(&pool->lock);
+	assert(lock_res == 0,
+	       "Could not obtain pool lock to add threads to ll.");
+	thread_ll_add(&pool->thread_head, threads);
+	pthread_mutex_unlock(&pool->lock);
+	if (start_res != 0) {
+		return start_res;
+	}
+	__atomic_add_fetch(&pool->threads_number, threads_num,
+			   __ATOMIC_RELAXED);
+	return 0;
+}
+
+tpsize fiber_threads_number(struct fiber_pool *pool)
+{
+	if (pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	return __atomic_load_n(&pool->threads_number, __ATOMIC_RELAXED);
+}
+
+tpsize fiber_threads_working(struct fiber_pool *pool)
+{
+	if (pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	return __atomic_load_n(&pool->threads_working, __ATOMIC_RELAXED);
+}
+
+static jid __fiber_job_push(struct fiber_pool *pool, struct fiber_job *job,
+			    uint32_t queue_flags)
+{
+	assert(pool->queue_ops != NULL || pool->queue_ops->push != NULL,
+	       "queue_ops or push is null.");
+	void *queue = pool->job_queue;
+	int node = 0;
+	if (pool->numa_queues != NULL) {
+		node = numa_push_node(pool);
+		queue = pool->numa_queues[node].job_queue;
+	}
+	int push_res = pool->queue_ops->push(queue, job, queue_flags);
+	// Don't allow positive error codes to return
+	if (push_res < 0) {
+		return push_res;
+	} else if (push_res != 0) {
+		return FBR_EPUSH_JOB;
+	}
+	if (pool->numa_queues != NULL) {
+		numa_wake_remote(pool, node);
+	}
+	return job->job_id;
+}
+
+static qsize __fiber_job_push_n(struct fiber_pool *pool, struct fiber_job *jobs,
+				qsize n, uint32_t queue_flags)
+{
+	if (pool->queue_ops->push_n != NULL) {
+		void *queue = pool->job_queue;
+		int node = 0;
+		if (pool->numa_queues != NULL) {
+			node = numa_push_node(pool);
+			queue = pool->numa_queues[node].job_queue;
+		}
+		qsize push_res =
+			pool->queue_ops->push_n(queue, jobs, n, queue_flags);
+		if (push_res == 0) {
+			return FBR_EPUSH_JOB;
+		}
+		if (push_res > 0 && pool->numa_queues != NULL) {
+			numa_wake_remote(pool, node);
+		}
+		return push_res;
+	}
+	qsize pushed = 0;
+	while (pushed < n) {
+		jid push_res = __fiber_job_push(pool, &jobs[pushed], queue_flags);
+		if (push_res < 0) {
+			return pushed > 0 ? pushed : push_res;
+		}
+		++pushed;
+	}
+	return pushed;
+}
+
+static int caller_runs(struct fiber_pool *pool, uint32_t queue_flags)
+{
+	return (queue_flags & FIBER_BLOCK) &&
+	       ((queue_flags & FIBER_CALLER_RUNS) ||
+		(pool->opt_flags & FIBER_OPT_CALLER_RUNS));
+}
+
+static jid push_caller_runs(struct fiber_pool *pool, struct fiber_job *job,
+			    uint32_t queue_flags, int *full)
+{
+	queue_flags &= ~FIBER_CALLER_RUNS;
+	struct fiber_job held = { 0 };
+	while (1) {
+		jid res = __fiber_job_push(pool, job,
+					   queue_flags & ~FIBER_BLOCK);
+		if (res != -EAGAIN && res != FBR_EPUSH_JOB) {
+			return res;
+		}
+		*full = 1;
+		void *queue = push_queue(pool);
+		if (caller_run_one(pool, queue, &held) != 0) {
+			// Nothing we can run, wait for the workers instead
+			caller_push_held(pool, queue, &held);
+			return __fiber_job_push(pool, job, queue_flags);
+		}
+	}
+}
+
+static qsize push_n_caller_runs(struct fiber_pool *pool,
+				struct fiber_job *jobs, qsize n,
+				uint32_t queue_flags, int *full)
+{
+	queue_flags &= ~FIBER_CALLER_RUNS;
+	struct fiber_job held = { 0 };
+	qsize pushed = 0;
+	while (pushed < n) {
+		qsize res = __fiber_job_push_n(pool, jobs + pushed, n - pushed,
+					       queue_flags & ~FIBER_BLOCK);
+		if (res > 0) {
+			pushed += res;
+			continue;
+		}
+		if (res != -EAGAIN && res != FBR_EPUSH_JOB) {
+			return pushed > 0 ? pushed : res;
+		}
+		*full = 1;
+		void *queue = push_queue(pool);
+		if (caller_run_one(pool, queue, &held) != 0) {
+			caller_push_held(pool, queue, &held);
+			res = __fiber_job_push_n(pool, jobs + pushed,
+						 n - pushed, queue_flags);
+			if (res < 0) {
+				return pushed > 0 ? pushed : res;
+			}
+			return pushed + res;
+		}
+	}
+	return pushed;
+}
+
+/* Pops one job from queue and runs it on the calling thread.
+ * @param held -> Gets a job meant for a worker that couldn't be pushed back
+ * without blocking. The caller must requeue it with caller_push_held once
+ * it stops helping.
+ * @returns: 0 if a job ran, EAGAIN if queue was empty or only had a job
+ * meant for a worker.
+ */
+static int caller_run_one(struct fiber_pool *pool, void *queue,
+			  struct fiber_job *held)
+{
+	struct fiber_job job;
+	if (pool->queue_ops->pop(queue, &job, FIBER_NO_BLOCK) != 0) {
+		return EAGAIN;
+	}
+	if (job_internal(&job)) {
+		// Another pusher may have taken the slot, don't wait for one
+		if (pool->queue_ops->push(queue, &job, FIBER_NO_BLOCK) != 0) {
+			*held = job;
+		}
+		return EAGAIN;
+	}
+	if (cancel_skip(pool, &job)) {
+		return 0;
+	}
+	// Counted as working so fiber_wait can't return under the job
+	__atomic_add_fetch(&pool->threads_working, 1, __ATOMIC_RELAXED);
+	struct fiber_pool *outer_pool = inline_pool;
+	jid outer_id = inline_job_id;
+	inline_pool = pool;
+	inline_job_id = job.job_id;
+	job.job_func(job_arg(&job));
+	inline_pool = outer_pool;
+	inline_job_id = outer_id;
+	job_done(pool, &job);
+	__atomic_sub_fetch(&pool->threads_working, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&pool->pool_flags, __ATOMIC_SEQ_CST) &
+	    FIBER_POOL_FLAG_WAIT) {
+		handle_flag_wait_all(pool);
+	}
+#ifndef FIBER_NO_STATS
+	struct pthread_arg *kit = worker_self;
+	if (kit != NULL && kit->pool == pool) {
+		__fbr_stat_add(&kit->self->stats, jobs_inline, 1);
+	} else {
+		__fbr_stat_add_shared(&pool->stats_shared, jobs_inline, 1);
+	}
+#endif
+	return 0;
+}
+
+// Requeues the job caller_run_one couldn't push back, if any. Only called
+// where the caller may block anyway.
+static void caller_push_held(struct fiber_pool *pool, void *queue,
+			     struct fiber_job *held)
+{
+	if (held->job_func != NULL) {
+		pool->queue_ops->push(queue, held, FIBER_BLOCK);
+		held->job_func = NULL;
+	}
+}
+
+// The queue __fiber_job_push uses from this thread
+static void *push_queue(struct fiber_pool *pool)
+{
+	if (pool->numa_queues == NULL) {
+		return pool->job_queue;
+	}
+	return pool->numa_queues[numa_push_node(pool)].job_queue;
+}
+
+// Wake and resume jobs only do their part on a worker
+static int job_internal(const struct fiber_job *job)
+{
+	return job->job_func == __do_nothing_job ||
+	       job->job_func == __steal_wake_job ||
+	       job->job_func == __numa_wake_job ||
+	       job->job_func == task_resume_job;
+}
+
+// Jobs others depend on running, they are never tracked for cancelling
+static int cancel_exempt(const struct fiber_job *job)
+{
+	return job_internal(job) || job->job_func == __fiber_graph_node_job ||
+	       job->job_func == __fiber_parallel_helper;
+}
+
+static jid worker_local_push(struct fiber_pool *pool, struct fiber_job *job)
+{
+	struct pthread_arg *kit = worker_self;
+	if (kit == NULL || kit->pool != pool) {
+		return FBR_EPUSH_JOB;
+	}
+	int push_res = fiber_deque_push(&kit->self->deque, job);
+	if (push_res != 0) {
+		return push_res;
+	}
+	wake_idle_thief(pool);
+	return job->job_id;
+}
+
+// Counts a push call on the calling worker, or the pool if it isn't one
+static void stat_push(struct fiber_pool *pool, qsize pushed, int full)
+{
+#ifndef FIBER_NO_STATS
+	struct pthread_arg *kit = worker_self;
+	if (kit != NULL && kit->pool == pool) {
+		__fbr_stat_add(&kit->self->stats, pushes, pushed);
+		__fbr_stat_add(&kit->self->stats, pushes_full, full);
+		return;
+	}
+	if (pushed > 0) {
+		__fbr_stat_add_shared(&pool->stats_shared, pushes, pushed);
+	}
+	if (full) {
+		__fbr_stat_add_shared(&pool->stats_shared, pushes_full, 1);
+	}
+#endif
+}
+
+static void wake_idle_thief(struct fiber_pool *pool)
+{
+	// Pairs with the fence in worker_next_job. Either we see the idle
+	// worker or it sees the job we just pushed when it tries to steal.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	tpsize idle = __atomic_load_n(&pool->threads_idle, __ATOMIC_RELAXED);
+	if (likely(idle == 0)) {
+		return;
+	}
+	// Don't flood the queue with wakes when enough are already in flight
+	if (__atomic_load_n(&pool->steal_wakes, __ATOMIC_RELAXED) >= idle) {
+		return;
+	}
+	__atomic_add_fetch(&pool->steal_wakes, 1, __ATOMIC_RELAXED);
+	struct fiber_job wake = { .job_id = JOB_ID_MIN,
+				  .job_func = __steal_wake_job,
+				  .job_arg = pool };
+	// A full queue means workers have plenty to wake up for anyway
+	if (__fiber_job_push(pool, &wake, FIBER_NO_BLOCK) < 0) {
+		__atomic_sub_fetch(&pool->steal_wakes, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// The node whose queue a push from this thread goes to
+static int numa_push_node(struct fiber_pool *pool)
+{
+	struct pthread_arg *kit = worker_self;
+	if (kit != NULL && kit->pool == pool) {
+		return kit->self->node;
+	}
+	int node = fiber_numa_current_node(&pool->numa);
+	if (node >= pool->numa.nodes_number) {
+		node = 0;
+	}
+	return node;
+}
+
+// Called after pushing to node. If none of its workers are idle, wake an idle
+// worker on another node so the job doesn't wait for node's workers to free
+// up while others sleep.
+static void numa_wake_remote(struct fiber_pool *pool, int node)
+{
+	// Pairs with the fence in worker_next_job. Either we see the idle
+	// worker or it sees our job when it looks at the other nodes.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->numa_queues[node].threads_idle,
+			    __ATOMIC_RELAXED) > 0) {
+		return;
+	}
+	int nodes = pool->numa.nodes_number;
+	for (int i = 1; i < nodes; ++i) {
+		struct fiber_numa_queue *nq =
+			&pool->numa_queues[(node + i) % nodes];
+		tpsize idle = __atomic_load_n(&nq->threads_idle,
+					      __ATOMIC_RELAXED);
+		if (idle == 0) {
+			continue;
+		}
+		// Enough wakes are in flight already
+		if (__atomic_load_n(&nq->wakes, __ATOMIC_RELAXED) >= idle) {
+			return;
+		}
+		__atomic_add_fetch(&nq->wakes, 1, __ATOMIC_RELAXED);
+		struct fiber_job wake = { .job_id = JOB_ID_MIN,
+					  .job_func = __numa_wake_job,
+					  .job_arg = nq };
+		if (pool->queue_ops->push(nq->job_queue, &wake,
+					  FIBER_NO_BLOCK) != 0) {
+			__atomic_sub_fetch(&nq->wakes, 1, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+}
+
+/* STATIC FUNCTION DEFINITIONS */
+
+// Reserves n contiguous ids and returns the first.
+static inline jid get_and_update_jid_n(jid *job_id_prev, qsize n)
+{
+	// 64 bits will probably never overflow but 32 or less may
+#if JOB_ID_MAX < INT64_MAX || defined(FIBER_CHECK_JID_OVERFLOW)
+	jid prev = __atomic_load_n(job_id_prev, __ATOMIC_SEQ_CST);
+	// Restart at 0 if the range would run past JOB_ID_MAX
+	__fbr_atomic_ruw(jid, job_id_prev, prev,
+			 prev > JOB_ID_MAX - n ? n - 1 : prev + n);
+	return newjid - n + 1;
+#else
+	return __atomic_add_fetch(job_id_prev, n, __ATOMIC_RELEASE) - n + 1;
+#endif
+}
+
+/* Takes n contiguous ids for pool. They come from the calling thread's
+ * block when it has n left, otherwise the block is replaced by a new one
+ * from job_id_prev. Whatever was left of the old block is never used.
+ * Batches of at least FIBER_JID_BLOCK, and every id of a FIBER_OPT_CANCEL
+ * pool, are reserved on their own.
+ */
+static jid jid_take(struct fiber_pool *pool, qsize n)
+{
+	struct jid_block *block = &jid_block;
+	if (likely(block->pool == pool && block->gen == pool->jid_gen &&
+		   block->left >= n)) {
+		jid first = block->next;
+		block->left -= n;
+		// next would pass JOB_ID_MAX at the end of the last block
+		if (block->left > 0) {
+			block->next = first + n;
+		}
+		return first;
+	}
+	// Cancel slots are indexed by id, they need live ids close together
+	if (n >= FIBER_JID_BLOCK || (pool->opt_flags & FIBER_OPT_CANCEL)) {
+		return get_and_update_jid_n(&pool->job_id_prev, n);
+	}
+	jid first = get_and_update_jid_n(&pool->job_id_prev, FIBER_JID_BLOCK);
+	block->pool = pool;
+	block->gen = pool->jid_gen;
+	block->next = first + n;
+	block->left = FIBER_JID_BLOCK - n;
+	return first;
+}
+
+static struct fiber_queue_operations *
+init_queue_ops(struct fiber_queue_operations *ops, void *(*malloc)(size_t))
+{
+	struct fiber_queue_operations *a_ops = malloc(sizeof(*ops));
+	if (a_ops == NULL) {
+		return NULL;
+	}
+	a_ops->push = ops->push;
+	a_ops->pop = ops->pop;
+	a_ops->init = ops->init;
+	a_ops->free = ops->free;
+	a_ops->length = ops->length;
+	a_ops->push_n = ops->push_n;
+	a_ops->pop_n = ops->pop_n;
+	a_ops->set_park_spin = ops->set_park_spin;
+	return a_ops;
+}
+
+// Creates the pool's queue, or one per node with FIBER_OPT_NUMA. Cleans up
+// after itself on failure.
+static int pool_queues_init(struct fiber_pool *pool, qsize length,
+			    uint32_t park_spin)
+{
+	pool->numa_queues = NULL;
+	if (!(pool->opt_flags & FIBER_OPT_NUMA)) {
+		return queue_init(pool, &pool->job_queue, length, park_spin);
+	}
+	int error_code = fiber_numa_discover(&pool->numa, numa_sysfs_root,
+					     pool->malloc, pool->free);
+	if (error_code != 0) {
+		return error_code;
+	}
+	int nodes = pool->numa.nodes_number;
+	struct fiber_numa_queue *queues =
+		pool->malloc(nodes * sizeof(*queues));
+	if (queues == NULL) {
+		fiber_numa_release(&pool->numa, pool->free);
+		return ENOMEM;
+	}
+	int i;
+	for (i = 0; i < nodes; ++i) {
+		struct numa_queue_init_arg arg = { pool, &queues[i].job_queue,
+						   length, park_spin };
+		queues[i].threads_number = 0;
+		queues[i].threads_idle = 0;
+		queues[i].wakes = 0;
+		// Run the init on the node so its memory is first touched there
+		struct fiber_numa_node *node = &pool->numa.nodes[i];
+		error_code = fiber_numa_run_on(node->cpus, node->cpus_number,
+					       numa_queue_init, &arg);
+		if (error_code != 0) {
+			break;
+		}
+	}
+	if (error_code != 0) {
+		while (i-- > 0) {
+			pool->queue_ops->free(queues[i].job_queue);
+		}
+		pool->free(queues);
+		fiber_numa_release(&pool->numa, pool->free);
+		return error_code;
+	}
+	pool->numa_queues = queues;
+	pool->job_queue = queues[0].job_queue;
+	return 0;
+}
+
+static void pool_queues_free(struct fiber_pool *pool)
+{
+	if (pool->numa_queues == NULL) {
+		pool->queue_ops->free(pool->job_queue);
+		return;
+	}
+	for (int i = 0; i < pool->numa.nodes_number; ++i) {
+		pool->queue_ops->free(pool->numa_queues[i].job_queue);
+	}
+	pool->free(pool->numa_queues);
+	pool->numa_queues = NULL;
+	fiber_numa_release(&pool->numa, pool->free);
+}
+
+static int queue_init(struct fiber_pool *pool, void **queue, qsize length,
+		      uint32_t park_spin)
+{
+	int queue_res =
+		pool->queue_ops->init(queue, length, pool->malloc, pool->free);
+	if (queue_res != 0) {
+		return queue_res;
+	}
+	if (*queue == NULL) {
+		return FBR_EQUE_NULL;
+	}
+	if (pool->queue_ops->set_park_spin != NULL) {
+		pool->queue_ops->set_park_spin(*queue, park_spin);
+	}
+	return 0;
+}
+
+// fiber_numa_run_on wrapper around queue_init
+static int numa_queue_init(void *arg)
+{
+	struct numa_queue_init_arg *a = (struct numa_queue_init_arg *)arg;
+	return queue_init(a->pool, a->queue, a->length, a->park_spin);
+}
+
+static int thread_opts_check(const struct fiber_thread_options *opts)
+{
+	switch (opts->affinity) {
+	case FIBER_AFFINITY_NONE:
+		return 0;
+	case FIBER_AFFINITY_COMPACT:
+	case FIBER_AFFINITY_SCATTER:
+		return opts->cpus != NULL && opts->cpus_number < 1;
+	case FIBER_AFFINITY_EXPLICIT:
+		return opts->cpus == NULL || opts->cpus_number < 1;
+	default:
+		return 1;
+	}
+}
+
+static int thread_opts_copy(struct fiber_pool *pool,
+			    const struct fiber_thread_options *opts)
+{
+	pool->thread_opts = *opts;
+	pool->thread_opts.cpus = NULL;
+	if (opts->affinity != FIBER_AFFINITY_NONE && opts->cpus != NULL) {
+		int *cpus = pool->malloc(opts->cpus_number * sizeof(*cpus));
+		if (cpus == NULL) {
+			return ENOMEM;
+		}
+		memcpy(cpus, opts->cpus, opts->cpus_number * sizeof(*cpus));
+		pool->thread_opts.cpus = cpus;
+	}
+	const char *name = opts->name != NULL ? opts->name :
+						FIBER_THREAD_NAME_DEFAULT;
+	strncpy(pool->thread_name, name, FIBER_THREAD_NAME_MAX - 1);
+	pool->thread_name[FIBER_THREAD_NAME_MAX - 1] = '\0';
+	pool->thread_opts.name = pool->thread_name;
+	return 0;
+}
+
+/* THREAD HELPER FUNCTIONS IMPLEMENTATIONS */
+
+static int fiber_thread_pool_init(struct fiber_pool *pool,
+				  tpsize threads_number)
+{
+	int error_code = thread_ll_alloc_n(&pool->slab, &pool->thread_head,
+					   threads_number);
+	if (error_code != 0) {
+		goto err;
+	}
+	pool->threads_number = threads_number;
+	pool->threads_working = 0;
+	pool->threads_kill_number = 0;
+
+	error_code = worker_threads_start(pool, pool->thread_head,
+					  threads_number, &pool->thread_opts, 1);
+	if (error_code != 0) {
+		goto err;
+	}
+	return 0;
+err:
+	if (pool->thread_head) {
+		thread_ll_free(&pool->slab, pool->thread_head);
+	}
+	return error_code;
+}
+
+static void fiber_thread_pool_free(struct fiber_pool *pool)
+{
+	// Parked workers aren't reached by pthread_cancel. Wake one on each
+	// queue, each that exits wakes the next.
+	__atomic_or_fetch(&pool->pool_flags, FIBER_POOL_FLAG_STOP,
+			  __ATOMIC_SEQ_CST);
+	if (pool->numa_queues == NULL) {
+		pool->queue_ops->push(pool->job_queue, &wake_job,
+				      FIBER_NO_BLOCK);
+	} else {
+		for (int i = 0; i < pool->numa.nodes_number; ++i) {
+			pool->queue_ops->push(pool->numa_queues[i].job_queue,
+					      &wake_job, FIBER_NO_BLOCK);
+		}
+	}
+	// Cancels jobs still running. Threads only leave the list under the
+	// lock, so every thread we cancel is still alive.
+	int lock_res = pthread_mutex_lock(&pool->lock);
+	assert(lock_res == 0, "Could not obtain pool lock to cancel threads.");
+	pthread_cancel_n(pool->thread_head, THREAD_POOL_SIZE_MAX);
+	pthread_mutex_unlock(&pool->lock);
+	uint32_t live;
+	while ((live = __atomic_load_n(&pool->threads_live, __ATOMIC_ACQUIRE)) !=
+	       0) {
+		fiber_park_wait(&pool->threads_live, live, NULL);
+	}
+	thread_ll_free(&pool->slab, pool->thread_head);
+}
+
+// Threads come from the pool's slab rather than one malloc each
+static int thread_ll_alloc_n(struct fiber_slab *slab,
+			     struct fiber_thread **head, tpsize threads_number)
+{
+	*head = fiber_slab_alloc(slab, NULL, sizeof(**head));
+	if (*head == NULL) {
+		return ENOMEM;
+	}
+	struct fiber_thread *curr = *head;
+	curr->deque.jobs = NULL;
+	curr->hist = NULL;
+	curr->idle_since = 0;
+	curr->tasks_free = NULL;
+	curr->tasks_free_number = 0;
+	memset(&curr->slab_cache, 0, sizeof(curr->slab_cache));
+#ifndef FIBER_NO_STATS
+	memset(&curr->stats, 0, sizeof(curr->stats));
+#endif
+	for (tpsize i = 1; i < threads_number; ++i) {
+		curr->next = fiber_slab_alloc(slab, NULL, sizeof(*curr));
+		if (curr->next == NULL) {
+			return ENOMEM;
+		}
+		curr = curr->next;
+		curr->deque.jobs = NULL;
+		curr->hist = NULL;
+		curr->idle_since = 0;
+		curr->tasks_free = NULL;
+		curr->tasks_free_number = 0;
+		memset(&curr->slab_cache, 0, sizeof(curr->slab_cache));
+#ifndef FIBER_NO_STATS
+		memset(&curr->stats, 0, sizeof(curr->stats));
+#endif
+	}
+	curr->next = NULL;
+	return 0;
+}
+
+static void thread_ll_free(struct fiber_slab *slab, struct fiber_thread *head)
+{
+	struct fiber_thread *next;
+	while (head != NULL) {
+		next = head->next;
+		fiber_deque_free(&head->deque, slab->free);
+		if (head->hist != NULL) {
+			slab->free(head->hist);
+		}
+		task_cache_free(head);
+		fiber_slab_release(slab, NULL, head);
+		head = next;
+	}
+}
+
+static void thread_ll_add(struct fiber_thread **head, struct fiber_thread *new)
+{
+	assert(new != NULL, "tried to add NULL to thread ll");
+	if (*head == NULL) {
+		__atomic_store_n(head, new, __ATOMIC_RELEASE);
+		return;
+	}
+	// Link the tail of new first so thieves walking the list never see a
+	// partially linked chain.
+	struct fiber_thread *last = new;
+	while (last->next != NULL) {
+		last = last->next;
+	}
+	last->next = (*head)->next;
+	__atomic_store_n(&(*head)->next, new, __ATOMIC_RELEASE);
+}
+
+static void thread_ll_remove(struct fiber_thread **head,
+			     struct fiber_thread *thread)
+{
+	assert(*head != NULL, "No threads in ll.");
+	assert(thread != NULL, "Tried to remove NULL from thread ll.");
+	struct fiber_thread *curr = (*head)->next;
+	if (*head == thread) {
+		__atomic_store_n(head, curr, __ATOMIC_RELEASE);
+		return;
 	}
 	struct fiber_thread *prev = *head;
 	while (curr != NULL) {
@@ -439,7 +1888,7 @@ static void thread_ll_remove(struct fiber_thread **head,
 			curr = curr->next;
 			continue;
 		}
-		prev->next = curr->next;
+		__atomic_store_n(&prev->next, curr->next, __ATOMIC_RELEASE);
 		return;
 	}
 }
@@ -451,15 +1900,29 @@ struct pthread_arg_ll {
 	struct pthread_arg_ll *prev;
 };
 static int worker_threads_start(struct fiber_pool *pool,
-				struct fiber_thread *head,
-				tpsize threads_number)
+				struct fiber_thread *head, tpsize threads_number,
+				const struct fiber_thread_options *topts,
+				int pool_slots)
 {
-	int error_code = 0;
+	int *cpus = NULL;
+	int cpus_number = 0;
+	int error_code = fiber_thread_attr_cpus(
+		topts->affinity, topts->cpus, topts->cpus_number,
+		numa_sysfs_root, pool->malloc, pool->free, &cpus, &cpus_number);
+	if (error_code != 0) {
+		return error_code;
+	}
 	tpsize i = 0;
 	struct pthread_arg_ll *prev = NULL;
 	while (i < threads_number && head != NULL) {
+		tpsize index = __atomic_fetch_add(&pool->threads_started, 1,
+						  __ATOMIC_RELAXED);
+		int cpu = -1;
+		if (cpus_number > 0) {
+			cpu = cpus[(pool_slots ? index : i) % cpus_number];
+		}
 		struct pthread_arg_ll *arg_link =
-			pool->malloc(sizeof(*arg_link));
+			fiber_slab_alloc(&pool->slab, NULL, sizeof(*arg_link));
 		if (arg_link == NULL) {
 			error_code = ENOMEM;
 			goto err;
@@ -468,37 +1931,115 @@ static int worker_threads_start(struct fiber_pool *pool,
 		arg_link->arg.pool = pool;
 		arg_link->arg.self = head;
 		arg_link->arg.self->job_id = -1;
+		arg_link->arg.self->steal_seed = (uint32_t)(uintptr_t)head | 1;
+		arg_link->arg.self->node = 0;
+		if (pool->numa_queues != NULL) {
+			head->node = numa_cpu_node(pool, cpu);
+		}
 		prev = arg_link;
-		error_code = worker_pthread_start(&arg_link->arg);
+		if ((pool->opt_flags & FIBER_OPT_LATENCY) && head->hist == NULL) {
+			head->hist = worker_hist_alloc(pool->malloc);
+			if (head->hist == NULL) {
+				error_code = ENOMEM;
+				goto err;
+			}
+		}
+		if (pool->opt_flags & FIBER_OPT_WORK_STEALING) {
+			error_code = fiber_deque_init(
+				&head->deque, pool->deque_length, pool->malloc);
+			if (error_code != 0) {
+				goto err;
+			}
+		}
+		error_code = worker_pthread_start(&arg_link->arg, topts, cpu,
+						  index);
 		if (error_code != 0) {
 			goto err;
 		}
 		++i;
 		head = head->next;
 	}
-
+	if (cpus != NULL) {
+		pool->free(cpus);
+	}
 	return 0;
 err:
+	if (cpus != NULL) {
+		pool->free(cpus);
+	}
 	if (i > 0) {
 		pthread_cancel_n(head, i - 1);
 	}
 	while (prev != NULL) {
 		struct pthread_arg_ll *saved = prev->prev;
-		pool->free(prev);
+		fiber_slab_release(&pool->slab, NULL, prev);
 		prev = saved;
 	}
 	return error_code;
 }
 
-static int worker_pthread_start(struct pthread_arg *arg)
+static int worker_pthread_start(struct pthread_arg *arg,
+				const struct fiber_thread_options *topts,
+				int cpu, tpsize index)
 {
 	assert(arg != NULL, "Tried to start pthraed with NULL arg");
+	struct fiber_pool *pool = arg->pool;
+	pthread_attr_t attr;
+	int attr_res = worker_attr_init(pool, &attr, topts, arg->self, cpu);
+	if (attr_res != 0) {
+		return __fiber_pthread_create_get_err(attr_res);
+	}
+	struct fiber_numa_queue *nq = NULL;
+	if (pool->numa_queues != NULL) {
+		nq = &pool->numa_queues[arg->self->node];
+		__atomic_add_fetch(&nq->threads_number, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&pool->threads_live, 1, __ATOMIC_RELAXED);
 	int error_code =
-		pthread_create(&arg->self->thread_id, NULL, worker_loop, arg);
+		pthread_create(&arg->self->thread_id, &attr, worker_loop, arg);
+	pthread_attr_destroy(&attr);
+	if (error_code != 0) {
+		__atomic_sub_fetch(&pool->threads_live, 1, __ATOMIC_RELAXED);
+		if (nq != NULL) {
+			__atomic_sub_fetch(&nq->threads_number, 1,
+					   __ATOMIC_RELAXED);
+		}
+		return __fiber_pthread_create_get_err(error_code);
+	}
+	// A worker without a name works just as well
+	fiber_thread_attr_name(arg->self->thread_id,
+			       topts->name != NULL ? topts->name :
+						     FIBER_THREAD_NAME_DEFAULT,
+			       (unsigned)index);
+	return pthread_detach(arg->self->thread_id);
+}
+
+// Pins to cpu if >= 0, otherwise to self's node when the pool uses NUMA.
+static int worker_attr_init(struct fiber_pool *pool, pthread_attr_t *attr,
+			    const struct fiber_thread_options *topts,
+			    struct fiber_thread *self, int cpu)
+{
+	int error_code = pthread_attr_init(attr);
+	if (error_code != 0) {
+		return error_code;
+	}
+	if (topts->stack_size > 0) {
+		error_code = pthread_attr_setstacksize(attr, topts->stack_size);
+	}
+	if (error_code == 0 && topts->guard_size > 0) {
+		error_code = pthread_attr_setguardsize(attr, topts->guard_size);
+	}
+	if (error_code == 0 && cpu >= 0) {
+		error_code = fiber_numa_attr_set_cpus(attr, &cpu, 1);
+	} else if (error_code == 0 && pool->numa_queues != NULL) {
+		struct fiber_numa_node *node = &pool->numa.nodes[self->node];
+		error_code = fiber_numa_attr_set_cpus(attr, node->cpus,
+						      node->cpus_number);
+	}
 	if (error_code != 0) {
-		return __fiber_pthread_create_get_err(error_code);
+		pthread_attr_destroy(attr);
 	}
-	return pthread_detach(arg->self->thread_id);
+	return error_code;
 }
 
 static void *worker_loop(void *arg)
@@ -508,32 +2049,73 @@ static void *worker_loop(void *arg)
 	struct fiber_thread *self = kit->self;
 	assert(pool != NULL, "worker_loop passed NULL fiber_pool");
 	assert(self != NULL, "worker_loop passed NULL fiber_thread");
-	int (*job_pop)(void *, struct fiber_job *, uint32_t) =
-		pool->queue_ops->pop;
 	struct fiber_job job_buf = { 0 };
+	struct job_batch batch = { .len = 0, .pos = 0 };
+	worker_self = kit;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_cleanup_push(worker_exit, kit);
 
 	int last_handle_flags_res = 0;
 	while (1) {
 		__atomic_store_n(&self->job_id, -1, __ATOMIC_RELAXED);
-		int pop_res = job_pop(pool->job_queue, &job_buf, FIBER_BLOCK);
+#ifndef FIBER_NO_STATS
+		uint64_t idle_start = __fiber_stats_now_ns();
+#endif
+		int autoscale = pool->opt_flags & FIBER_OPT_AUTOSCALE;
+		if (autoscale && self->idle_since == 0) {
+			__atomic_store_n(&self->idle_since,
+					 __fiber_stats_now_ns(),
+					 __ATOMIC_RELAXED);
+		}
+		int pop_res = worker_next_job(pool, self, &batch, &job_buf,
+					      FIBER_BLOCK);
+		__fbr_stat_add(&self->stats, idle_ns,
+			       __fiber_stats_now_ns() - idle_start);
 		if (pop_res != 0) {
 			sched_yield();
 			continue;
 		}
+		if (autoscale) {
+			__atomic_store_n(&self->idle_since, 0, __ATOMIC_RELAXED);
+		}
 
 		__atomic_add_fetch(&pool->threads_working, 1, __ATOMIC_RELAXED);
 		do {
+			if (cancel_skip(pool, &job_buf)) {
+				continue;
+			}
 			__atomic_store_n(&self->job_id, job_buf.job_id,
 					 __ATOMIC_RELAXED);
-			job_buf.job_func(job_buf.job_arg);
+			uint64_t run_start = 0;
+			if (self->hist != NULL) {
+				run_start = __fiber_ticks();
+			}
+			int finished = 1;
+			if (pool->opt_flags & FIBER_OPT_STACKFUL) {
+				finished = task_run(pool, self, &job_buf);
+			} else {
+				job_buf.job_func(job_arg(&job_buf));
+				job_done(pool, &job_buf);
+			}
+			__fbr_stat_add(&self->stats, jobs, finished);
+			if (self->hist != NULL) {
+				latency_record(self->hist, &job_buf, run_start);
+			}
 			// Should this be atomic load? I don't think it matters
-			if (pool->pool_flags & FIBER_POOL_FLAG_KILL_N) {
+			if (pool->pool_flags &
+			    (FIBER_POOL_FLAG_KILL_N | FIBER_POOL_FLAG_STOP)) {
 				break; // Break queue pop loop
 			}
-		} while (job_pop(pool->job_queue, &job_buf, 0) == 0);
+		} while (worker_next_job(pool, self, &batch, &job_buf, 0) == 0);
+		// Told to exit mid batch, give the rest back to the pool unless
+		// it's being freed
+		while (batch.pos < batch.len &&
+		       !(pool->pool_flags & FIBER_POOL_FLAG_STOP)) {
+			__fiber_job_push(pool, &batch.jobs[batch.pos++],
+					 FIBER_BLOCK);
+		}
 		__atomic_sub_fetch(&pool->threads_working, 1, __ATOMIC_RELAXED);
 
 		if ((last_handle_flags_res = handle_pool_flags(pool)) != 0) {
@@ -544,16 +2126,194 @@ static void *worker_loop(void *arg)
 	       "A thread reached its cleanup without being told to by handle_pool_flags");
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	thread_clean_self(pool, self);
-	if (kit) {
-		pool->free(kit);
-	}
+	pthread_cleanup_pop(1);
 	pthread_exit(0);
 }
 
+// Runs when a worker exits or is cancelled
+static void worker_exit(void *arg)
+{
+	struct pthread_arg *kit = (struct pthread_arg *)arg;
+	struct fiber_pool *pool = kit->pool;
+	worker_self = NULL;
+	// arg is the first member of its pthread_arg_ll
+	fiber_slab_release(&pool->slab, NULL, kit);
+	// fiber_free may release the pool once this hits 0. Waking a stale
+	// futex is harmless.
+	if (__atomic_sub_fetch(&pool->threads_live, 1, __ATOMIC_ACQ_REL) == 0) {
+		fiber_park_wake(&pool->threads_live, INT_MAX);
+	}
+}
+
+static int worker_next_job(struct fiber_pool *pool, struct fiber_thread *self,
+			   struct job_batch *batch, struct fiber_job *buffer,
+			   uint32_t flags)
+{
+	if (batch->pos < batch->len) {
+		*buffer = batch->jobs[batch->pos++];
+		return 0;
+	}
+	if (task_ready_pop(pool, buffer) == 0) {
+		return 0;
+	}
+	int stealing = pool->opt_flags & FIBER_OPT_WORK_STEALING;
+	struct fiber_numa_queue *nq = NULL;
+	void *queue = pool->job_queue;
+	if (pool->numa_queues != NULL) {
+		nq = &pool->numa_queues[self->node];
+		queue = nq->job_queue;
+	}
+	if (!stealing && nq == NULL) {
+		return shared_pop(pool, queue, batch, buffer, flags);
+	}
+	if ((stealing && (fiber_deque_pop(&self->deque, buffer) == 0 ||
+			  steal_job(pool, self, buffer) == 0)) ||
+	    shared_pop(pool, queue, batch, buffer, 0) == 0 ||
+	    (nq != NULL && numa_steal(pool, self, buffer) == 0)) {
+		return 0;
+	}
+	if (!(flags & FIBER_BLOCK)) {
+		return EAGAIN;
+	}
+	// Announce we are going to sleep then look one more time. Pairs with
+	// the fences in wake_idle_thief and numa_wake_remote so a push can't
+	// slip past us.
+	__atomic_add_fetch(&pool->threads_idle, 1, __ATOMIC_SEQ_CST);
+	if (nq != NULL) {
+		__atomic_add_fetch(&nq->threads_idle, 1, __ATOMIC_SEQ_CST);
+	}
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int res = EAGAIN;
+	if (stealing) {
+		res = steal_job(pool, self, buffer);
+	}
+	if (res != 0 && nq != NULL) {
+		res = numa_steal(pool, self, buffer);
+	}
+	if (res != 0) {
+		res = shared_pop(pool, queue, batch, buffer, FIBER_BLOCK);
+	}
+	if (nq != NULL) {
+		__atomic_sub_fetch(&nq->threads_idle, 1, __ATOMIC_SEQ_CST);
+	}
+	__atomic_sub_fetch(&pool->threads_idle, 1, __ATOMIC_SEQ_CST);
+	return res;
+}
+
+// Pops from queue, refilling batch when pop_n is available.
+static int shared_pop(struct fiber_pool *pool, void *queue,
+		      struct job_batch *batch, struct fiber_job *buffer,
+		      uint32_t flags)
+{
+	if (pool->pop_batch < 2 || pool->queue_ops->pop_n == NULL) {
+		return pool->queue_ops->pop(queue, buffer, flags);
+	}
+	qsize popped = pool->queue_ops->pop_n(queue, batch->jobs,
+					      pool->pop_batch, flags);
+	if (popped <= 0) {
+		return EAGAIN;
+	}
+	*buffer = batch->jobs[0];
+	batch->len = popped;
+	batch->pos = 1;
+	return 0;
+}
+
+static int steal_job(struct fiber_pool *pool, struct fiber_thread *self,
+		     struct fiber_job *buffer)
+{
+	tpsize threads = __atomic_load_n(&pool->threads_number, __ATOMIC_RELAXED);
+	if (threads < 2) {
+		return EAGAIN;
+	}
+	int res = EAGAIN;
+	// thread_clean_self won't free a thread while thieves are walking.
+	__atomic_add_fetch(&pool->thieves, 1, __ATOMIC_SEQ_CST);
+	struct fiber_thread *head =
+		__atomic_load_n(&pool->thread_head, __ATOMIC_ACQUIRE);
+	struct fiber_thread *victim = head;
+	// xorshift32 to pick where to start
+	uint32_t x = self->steal_seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	self->steal_seed = x;
+	for (tpsize skip = x % threads; skip > 0 && victim != NULL; --skip) {
+		victim = __atomic_load_n(&victim->next, __ATOMIC_ACQUIRE);
+	}
+	for (tpsize i = 0; i < threads; ++i) {
+		if (victim == NULL && (victim = head) == NULL) {
+			break;
+		}
+		if (victim != self &&
+		    __atomic_load_n(&victim->deque.jobs, __ATOMIC_ACQUIRE) !=
+			    NULL &&
+		    fiber_deque_steal(&victim->deque, buffer) == 0) {
+			__fbr_stat_add(&self->stats, steals, 1);
+			res = 0;
+			break;
+		}
+		victim = __atomic_load_n(&victim->next, __ATOMIC_ACQUIRE);
+	}
+	__atomic_sub_fetch(&pool->thieves, 1, __ATOMIC_RELEASE);
+	return res;
+}
+
+// Takes one job from another node's queue, nearest index first. Only called
+// once the worker's own node has nothing to run.
+static int numa_steal(struct fiber_pool *pool, struct fiber_thread *self,
+		      struct fiber_job *buffer)
+{
+	int nodes = pool->numa.nodes_number;
+	for (int i = 1; i < nodes; ++i) {
+		struct fiber_numa_queue *nq =
+			&pool->numa_queues[(self->node + i) % nodes];
+		if (pool->queue_ops->pop(nq->job_queue, buffer,
+					 FIBER_NO_BLOCK) == 0) {
+			__fbr_stat_add(&self->stats, steals, 1);
+			return 0;
+		}
+	}
+	return EAGAIN;
+}
+
+// The node cpu belongs to, or the one with the fewest workers if cpu has none
+static int numa_cpu_node(struct fiber_pool *pool, int cpu)
+{
+	if (cpu >= 0 && cpu < pool->numa.cpus_max &&
+	    pool->numa.cpu_node[cpu] >= 0) {
+		return pool->numa.cpu_node[cpu];
+	}
+	return numa_pick_node(pool);
+}
+
+// The node with the fewest workers gets the next one
+static int numa_pick_node(struct fiber_pool *pool)
+{
+	int best = 0;
+	tpsize fewest = THREAD_POOL_SIZE_MAX;
+	for (int i = 0; i < pool->numa.nodes_number; ++i) {
+		tpsize threads = __atomic_load_n(
+			&pool->numa_queues[i].threads_number, __ATOMIC_RELAXED);
+		if (threads < fewest) {
+			fewest = threads;
+			best = i;
+		}
+	}
+	return best;
+}
+
 static int handle_pool_flags(struct fiber_pool *pool)
 {
 	uint32_t pool_flags =
 		__atomic_load_n(&pool->pool_flags, __ATOMIC_SEQ_CST);
+	if (pool_flags & FIBER_POOL_FLAG_STOP) {
+		// Wake the next worker parked on our queue. A full queue has
+		// nobody parked on it.
+		pool->queue_ops->push(push_queue(pool), &wake_job,
+				      FIBER_NO_BLOCK);
+		return 1;
+	}
 	if (pool_flags & FIBER_POOL_FLAG_KILL_N) {
 		tpsize to_kill = __atomic_sub_fetch(&pool->threads_kill_number,
 						    1, __ATOMIC_SEQ_CST);
@@ -589,11 +2349,11 @@ static void handle_flag_wait_all(struct fiber_pool *pool)
 {
 	tpsize tworking =
 		__atomic_load_n(&pool->threads_working, __ATOMIC_RELAXED);
-	if (tworking > 0) {
+	if (tworking > 0 ||
+	    __atomic_load_n(&pool->tasks_suspended, __ATOMIC_RELAXED) > 0) {
 		return;
 	}
-	int res = sem_post(&pool->threads_sync);
-	assert(res == 0, "sem_post error. probably overflow");
+	fiber_park_sem_post(&pool->threads_sync, 1);
 }
 
 static void pthread_cancel_n(struct fiber_thread *head, tpsize threads_number)
@@ -614,9 +2374,656 @@ static inline void thread_clean_self(struct fiber_pool *pool,
 	assert(lock_res == 0,
 	       "Could not obtain pool lock to remove thread from ll.");
 	thread_ll_remove(&pool->thread_head, self);
-	pool->free(self);
 	pthread_mutex_unlock(&pool->lock);
 	__atomic_fetch_sub(&pool->threads_number, 1, __ATOMIC_RELAXED);
+	if (pool->numa_queues != NULL) {
+		__atomic_fetch_sub(&pool->numa_queues[self->node].threads_number,
+				   1, __ATOMIC_RELAXED);
+	}
+	if (self->deque.jobs != NULL &&
+	    !(__atomic_load_n(&pool->pool_flags, __ATOMIC_RELAXED) &
+	      FIBER_POOL_FLAG_STOP)) {
+		// Hand back jobs we were told to exit before running
+		struct fiber_job job;
+		while (fiber_deque_pop(&self->deque, &job) == 0) {
+			__fiber_job_push(pool, &job, FIBER_BLOCK);
+		}
+	}
+#ifndef FIBER_NO_STATS
+	__fiber_stats_merge(&pool->stats_retired, &self->stats);
+#endif
+	if (self->hist != NULL) {
+		fiber_hist_merge(&pool->hist_retired->wait, &self->hist->wait);
+		fiber_hist_merge(&pool->hist_retired->run, &self->hist->run);
+	}
+	// Thieves and fiber_pool_stats may have loaded us before we were
+	// unlinked
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pool->thieves, __ATOMIC_ACQUIRE) > 0) {
+		sched_yield();
+	}
+	fiber_deque_free(&self->deque, pool->free);
+	if (self->hist != NULL) {
+		pool->free(self->hist);
+	}
+	task_cache_free(self);
+	fiber_slab_cache_flush(&pool->slab, &self->slab_cache);
+	fiber_slab_release(&pool->slab, NULL, self);
+}
+
+static struct fiber_worker_hist *worker_hist_alloc(void *(*malloc)(size_t))
+{
+	struct fiber_worker_hist *hist = malloc(sizeof(*hist));
+	if (hist != NULL) {
+		memset(hist, 0, sizeof(*hist));
+	}
+	return hist;
+}
+
+static inline void latency_record(struct fiber_worker_hist *hist,
+				  const struct fiber_job *job,
+				  uint64_t run_start)
+{
+	// Fiber's own jobs are never stamped
+	if (job->enqueue_ts == 0) {
+		return;
+	}
+	uint64_t run_end = __fiber_ticks();
+	// Counters of different cores can be slightly apart
+	uint64_t wait = run_start > job->enqueue_ts ?
+				run_start - job->enqueue_ts :
+				0;
+	__fiber_hist_record(&hist->wait, __fiber_ticks_to_ns(wait));
+	__fiber_hist_record(&hist->run,
+			    __fiber_ticks_to_ns(run_end - run_start));
+}
+
+/* AUTOSCALE SUPERVISOR */
+
+static int autoscale_opts_check(const struct fiber_pool_init_options *opts)
+{
+	const struct fiber_autoscale_options *as = &opts->autoscale;
+	tpsize min = as->threads_min > 0 ? as->threads_min : 1;
+	return as->threads_min < 0 || as->grow_pending < 0 ||
+	       opts->threads_number < min ||
+	       opts->threads_number > as->threads_max;
+}
+
+static int autoscale_start(struct fiber_pool *pool,
+			   const struct fiber_autoscale_options *opts)
+{
+	pool->autoscale = *opts;
+	if (pool->autoscale.threads_min == 0) {
+		pool->autoscale.threads_min = 1;
+	}
+	if (pool->autoscale.grow_pending == 0) {
+		pool->autoscale.grow_pending =
+			FIBER_AUTOSCALE_GROW_PENDING_DEFAULT;
+	}
+	if (pool->autoscale.idle_timeout_ms == 0) {
+		pool->autoscale.idle_timeout_ms =
+			FIBER_AUTOSCALE_IDLE_TIMEOUT_MS_DEFAULT;
+	}
+	if (pool->autoscale.interval_us == 0) {
+		pool->autoscale.interval_us = FIBER_AUTOSCALE_INTERVAL_US_DEFAULT;
+	}
+	pool->autoscale_stop = 0;
+	int res = pthread_create(&pool->autoscale_thread, NULL, autoscale_loop,
+				 pool);
+	return res == 0 ? 0 : __fiber_pthread_create_get_err(res);
+}
+
+static void autoscale_stop(struct fiber_pool *pool)
+{
+	__atomic_store_n(&pool->autoscale_stop, 1, __ATOMIC_RELEASE);
+	fiber_park_wake(&pool->autoscale_stop, 1);
+	int join_res = pthread_join(pool->autoscale_thread, NULL);
+	assert(join_res == 0, "failed to join autoscale supervisor");
+}
+
+static void *autoscale_loop(void *arg)
+{
+	struct fiber_pool *pool = (struct fiber_pool *)arg;
+	struct timespec interval = {
+		.tv_sec = pool->autoscale.interval_us / 1000000,
+		.tv_nsec = (pool->autoscale.interval_us % 1000000) * 1000,
+	};
+	int busy_ticks = 0;
+	while (!__atomic_load_n(&pool->autoscale_stop, __ATOMIC_ACQUIRE)) {
+		fiber_park_wait(&pool->autoscale_stop, 0, &interval);
+		if (__atomic_load_n(&pool->autoscale_stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		autoscale_tick(pool, &busy_ticks);
+	}
+	return NULL;
+}
+
+// Grows when jobs stay pending and retires workers idle past the timeout.
+// Retiring reuses fiber_threads_remove, so one of the idle workers is woken
+// by a wake job and exits.
+static void autoscale_tick(struct fiber_pool *pool, int *busy_ticks)
+{
+	const struct fiber_autoscale_options *as = &pool->autoscale;
+	tpsize killing =
+		__atomic_load_n(&pool->threads_kill_number, __ATOMIC_SEQ_CST);
+	tpsize live = __atomic_load_n(&pool->threads_number, __ATOMIC_RELAXED) -
+		      killing;
+	qsize pending = fiber_jobs_pending(pool);
+	if (pending > as->grow_pending) {
+		if (++*busy_ticks < 2 || live >= as->threads_max) {
+			return;
+		}
+		*busy_ticks = 0;
+		tpsize add = pending / as->grow_pending;
+		if (add > as->threads_max - live) {
+			add = as->threads_max - live;
+		}
+		// A failed add is retried next tick
+		threads_add_with(pool, add, &pool->thread_opts, 1);
+		return;
+	}
+	*busy_ticks = 0;
+	// Wait for the last retirements to be picked up
+	if (killing > 0 || live <= as->threads_min) {
+		return;
+	}
+	uint64_t now = __fiber_stats_now_ns();
+	uint64_t timeout_ns = (uint64_t)as->idle_timeout_ms * 1000000;
+	tpsize idle = 0;
+	// Same guard as fiber_pool_stats
+	__atomic_add_fetch(&pool->thieves, 1, __ATOMIC_SEQ_CST);
+	struct fiber_thread *curr =
+		__atomic_load_n(&pool->thread_head, __ATOMIC_ACQUIRE);
+	while (curr != NULL) {
+		uint64_t since =
+			__atomic_load_n(&curr->idle_since, __ATOMIC_RELAXED);
+		if (since != 0 && now > since && now - since >= timeout_ns) {
+			++idle;
+		}
+		curr = __atomic_load_n(&curr->next, __ATOMIC_ACQUIRE);
+	}
+	__atomic_sub_fetch(&pool->thieves, 1, __ATOMIC_RELEASE);
+	if (idle > live - as->threads_min) {
+		idle = live - as->threads_min;
+	}
+	if (idle > 0) {
+		fiber_threads_remove(pool, idle);
+	}
+}
+
+/* STACKFUL TASKS */
+
+void fiber_yield(void)
+{
+	struct fiber_task *task = task_self;
+	if (task == NULL) {
+		sched_yield();
+		return;
+	}
+	task->state = FIBER_TASK_YIELD;
+	fiber_task_switch(&task->ctx, task->sched);
+}
+
+int fiber_sleep(const struct timespec *duration)
+{
+	if (duration == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	struct fiber_task *task = task_self;
+	if (task == NULL) {
+		fiber_task_sleep_thread(duration);
+		return 0;
+	}
+	task->wake_ns = __fiber_stats_now_ns() +
+			(uint64_t)duration->tv_sec * 1000000000ull +
+			(uint64_t)duration->tv_nsec;
+	task->state = FIBER_TASK_SLEEP;
+	fiber_task_switch(&task->ctx, task->sched);
+	return 0;
+}
+
+void __fiber_waiter_park(struct fiber_waiter *w, uint32_t *lock,
+			 struct fiber_waiter *wake)
+{
+	struct fiber_task *task = task_self;
+	w->task = task;
+	w->woken = 0;
+	if (task == NULL) {
+		__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+		if (wake != NULL) {
+			__fiber_waiter_wake(wake);
+		}
+		while (!__atomic_load_n(&w->woken, __ATOMIC_ACQUIRE)) {
+			fiber_park_wait(&w->woken, 0, NULL);
+		}
+		return;
+	}
+	w->pool = worker_self->pool;
+	task->park_lock = lock;
+	task->park_wake = wake;
+	task->state = FIBER_TASK_PARK;
+	fiber_task_switch(&task->ctx, task->sched);
+}
+
+void __fiber_waiter_wake(struct fiber_waiter *w)
+{
+	struct fiber_task *task = w->task;
+	if (task == NULL) {
+		__atomic_store_n(&w->woken, 1, __ATOMIC_RELEASE);
+		// Waking a stale futex is harmless
+		fiber_park_wake(&w->woken, 1);
+		return;
+	}
+	task_ready(w->pool, task);
+}
+
+// Runs job on a task until it finishes or switches out. What the task asked
+// for is handled here, on the worker's stack, so no other worker can resume
+// it while we are still on it. Returns non zero if the job finished.
+static int task_run(struct fiber_pool *pool, struct fiber_thread *self,
+		     struct fiber_job *job)
+{
+	struct fiber_task *task;
+	if (job->job_func == task_resume_job) {
+		task = (struct fiber_task *)job->job_arg;
+		if (task->state == FIBER_TASK_SLEEP ||
+		    task->state == FIBER_TASK_PARK) {
+			// Counted until now so fiber_wait can't miss it
+			__atomic_sub_fetch(&pool->tasks_suspended, 1,
+					   __ATOMIC_SEQ_CST);
+		}
+	} else {
+		task = self->tasks_free;
+		if (task != NULL) {
+			self->tasks_free = task->next;
+			--self->tasks_free_number;
+		} else if ((task = fiber_task_alloc(pool->task_stack_size)) ==
+			   NULL) {
+			// Out of memory, run it on the worker's stack
+			job->job_func(job_arg(job));
+			job_done(pool, job);
+			return 1;
+		}
+		task->job = *job;
+		fiber_task_prepare(task, task_entry, task);
+	}
+	struct fiber_ctx sched;
+	// Cancellation unwinding can't cross onto a task's stack
+	int cancel_state;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+	int state;
+	do {
+		task->sched = &sched;
+		task_self = task;
+		fiber_task_switch(&sched, &task->ctx);
+		task_self = NULL;
+		// Once the task is queued another worker may own it
+		state = task->state;
+		if (state != FIBER_TASK_YIELD) {
+			break;
+		}
+		struct fiber_job resume = { .job_id = task->job.job_id,
+					    .job_func = task_resume_job,
+					    .job_arg = task };
+		// A full queue resumes the task right away rather than block
+		// the worker
+		if (__fiber_job_push(pool, &resume, FIBER_NO_BLOCK) >= 0) {
+			break;
+		}
+	} while (1);
+	pthread_setcancelstate(cancel_state, NULL);
+	switch (state) {
+	case FIBER_TASK_DONE:
+		if (self->tasks_free_number < FIBER_TASK_CACHE) {
+			task->next = self->tasks_free;
+			self->tasks_free = task;
+			++self->tasks_free_number;
+		} else {
+			fiber_task_free(task);
+		}
+		break;
+	case FIBER_TASK_SLEEP:
+		task_sleep_add(pool, task);
+		break;
+	case FIBER_TASK_PARK: {
+		// The task may be resumed elsewhere once the lock is released
+		struct fiber_waiter *wake = task->park_wake;
+		// Counted before the waker can see it
+		__atomic_add_fetch(&pool->tasks_suspended, 1, __ATOMIC_SEQ_CST);
+		__atomic_store_n(task->park_lock, 0, __ATOMIC_RELEASE);
+		if (wake != NULL) {
+			__fiber_waiter_wake(wake);
+		}
+		break;
+	}
+	}
+	return state == FIBER_TASK_DONE;
+}
+
+static void task_entry(void *arg)
+{
+	struct fiber_task *task = (struct fiber_task *)arg;
+	task->job.job_func(job_arg(&task->job));
+	// The job may have moved workers, worker_self is the current one
+	job_done(worker_self->pool, &task->job);
+	task->state = FIBER_TASK_DONE;
+	// task->sched is read after the job, it may have moved workers
+	fiber_task_switch(&task->ctx, task->sched);
+	assert(0, "finished task was resumed");
+}
+
+// Marks a queued job as a suspended task. task_run never calls it.
+static void *task_resume_job(void *arg)
+{
+	(void)arg;
+	return NULL;
+}
+
+static void task_cache_free(struct fiber_thread *self)
+{
+	while (self->tasks_free != NULL) {
+		struct fiber_task *next = self->tasks_free->next;
+		fiber_task_free(self->tasks_free);
+		self->tasks_free = next;
+	}
+	self->tasks_free_number = 0;
+}
+
+static void task_sleep_add(struct fiber_pool *pool, struct fiber_task *task)
+{
+	__atomic_add_fetch(&pool->tasks_suspended, 1, __ATOMIC_SEQ_CST);
+	int lock_res = pthread_mutex_lock(&pool->sleep_lock);
+	assert(lock_res == 0, "Could not obtain sleep lock");
+	uint64_t next = fiber_sleep_heap_next(&pool->sleepers);
+	// The sleep thread owns the task once it's in the heap
+	uint64_t wake_ns = task->wake_ns;
+	int push_res = fiber_sleep_heap_push(&pool->sleepers, task,
+					     pool->malloc, pool->free);
+	pthread_mutex_unlock(&pool->sleep_lock);
+	if (push_res != 0) {
+		// No room to sleep, wake it up now instead
+		task->wake_ns = 0;
+		task_ready(pool, task);
+		return;
+	}
+	if (next == 0 || wake_ns < next) {
+		__atomic_add_fetch(&pool->sleep_seq, 1, __ATOMIC_RELEASE);
+		fiber_park_wake(&pool->sleep_seq, 1);
+	}
+}
+
+// Queues a suspended task to be resumed. Never blocks: when the queue is full
+// the task goes on the pool's ready list instead.
+static void task_ready(struct fiber_pool *pool, struct fiber_task *task)
+{
+	struct fiber_job resume = { .job_id = task->job.job_id,
+				    .job_func = task_resume_job,
+				    .job_arg = task };
+	if (__fiber_job_push(pool, &resume, FIBER_NO_BLOCK) >= 0) {
+		return;
+	}
+	task->next = NULL;
+	__fbr_spin_lock(&pool->ready_lock);
+	if (pool->ready_tail == NULL) {
+		__atomic_store_n(&pool->ready_head, task, __ATOMIC_RELEASE);
+	} else {
+		pool->ready_tail->next = task;
+	}
+	pool->ready_tail = task;
+	__fbr_spin_unlock(&pool->ready_lock);
+	// A worker may have emptied the queue and gone to sleep since our
+	// push. If this fails too the queue is full and its next pop sees
+	// the list.
+	__fiber_job_push(pool, &wake_job, FIBER_NO_BLOCK);
+}
+
+// Takes a task off the ready list as a resume job
+static int task_ready_pop(struct fiber_pool *pool, struct fiber_job *buffer)
+{
+	if (__atomic_load_n(&pool->ready_head, __ATOMIC_ACQUIRE) == NULL) {
+		return EAGAIN;
+	}
+	__fbr_spin_lock(&pool->ready_lock);
+	struct fiber_task *task = pool->ready_head;
+	if (task != NULL) {
+		__atomic_store_n(&pool->ready_head, task->next,
+				 __ATOMIC_RELAXED);
+		if (task->next == NULL) {
+			pool->ready_tail = NULL;
+		}
+	}
+	__fbr_spin_unlock(&pool->ready_lock);
+	if (task == NULL) {
+		return EAGAIN;
+	}
+	*buffer = (struct fiber_job){ .job_id = task->job.job_id,
+				      .job_func = task_resume_job,
+				      .job_arg = task };
+	return 0;
+}
+
+static int sleep_start(struct fiber_pool *pool)
+{
+	int mutex_res = pthread_mutex_init(&pool->sleep_lock, NULL);
+	if (mutex_res != 0) {
+		return __fiber_mutex_init_get_err(mutex_res);
+	}
+	pool->sleep_seq = 0;
+	pool->sleep_stop = 0;
+	int res = pthread_create(&pool->sleep_thread, NULL, sleep_loop, pool);
+	if (res != 0) {
+		pthread_mutex_destroy(&pool->sleep_lock);
+		return __fiber_pthread_create_get_err(res);
+	}
+	return 0;
+}
+
+static void sleep_stop(struct fiber_pool *pool)
+{
+	__atomic_store_n(&pool->sleep_stop, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&pool->sleep_seq, 1, __ATOMIC_RELEASE);
+	fiber_park_wake(&pool->sleep_seq, 1);
+	int join_res = pthread_join(pool->sleep_thread, NULL);
+	assert(join_res == 0, "failed to join sleep thread");
+	pthread_mutex_destroy(&pool->sleep_lock);
+}
+
+// Queues sleeping tasks again once they are due
+static void *sleep_loop(void *arg)
+{
+	struct fiber_pool *pool = (struct fiber_pool *)arg;
+	while (!__atomic_load_n(&pool->sleep_stop, __ATOMIC_ACQUIRE)) {
+		uint32_t seq = __atomic_load_n(&pool->sleep_seq, __ATOMIC_ACQUIRE);
+		uint64_t now = __fiber_stats_now_ns();
+		int lock_res = pthread_mutex_lock(&pool->sleep_lock);
+		assert(lock_res == 0, "Could not obtain sleep lock");
+		struct fiber_task *due = NULL;
+		struct fiber_task *task;
+		while ((task = fiber_sleep_heap_pop_due(&pool->sleepers, now)) !=
+		       NULL) {
+			task->next = due;
+			due = task;
+		}
+		uint64_t next = fiber_sleep_heap_next(&pool->sleepers);
+		pthread_mutex_unlock(&pool->sleep_lock);
+		// Pushed without the lock, workers take it to sleep tasks
+		while (due != NULL) {
+			task = due;
+			due = due->next;
+			task_ready(pool, task);
+		}
+		if (next == 0) {
+			fiber_park_wait(&pool->sleep_seq, seq, NULL);
+			continue;
+		}
+		uint64_t wait_ns = next - now;
+		struct timespec timeout = { .tv_sec = wait_ns / 1000000000ull,
+					    .tv_nsec = wait_ns % 1000000000ull };
+		fiber_park_wait(&pool->sleep_seq, seq, &timeout);
+	}
+	return NULL;
+}
+
+static jid timer_add(struct fiber_pool *pool, struct fiber_job *job,
+		     const struct timespec *delay, int periodic)
+{
+	if (pool == NULL || job == NULL || job->job_func == NULL ||
+	    delay == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (!(pool->opt_flags & FIBER_OPT_TIMERS)) {
+		return FBR_EINVLD_OPT;
+	}
+	uint64_t delay_ns = (uint64_t)delay->tv_sec * 1000000000ull +
+			    (uint64_t)delay->tv_nsec;
+	if (periodic && delay_ns < FIBER_TIMER_TICK_NS) {
+		return FBR_EINVLD_SIZE;
+	}
+	struct fiber_timer *timer = pool->malloc(sizeof(*timer));
+	if (timer == NULL) {
+		return -ENOMEM;
+	}
+	job->job_id = jid_take(pool, 1);
+	job->group = NULL;
+	job->job_flags = 0;
+	timer->job = *job;
+	uint64_t now = __fiber_stats_now_ns();
+	// Rounded up so a job never runs early
+	timer->expire = (now + delay_ns + FIBER_TIMER_TICK_NS - 1) /
+			FIBER_TIMER_TICK_NS;
+	timer->period = periodic ? delay_ns / FIBER_TIMER_TICK_NS : 0;
+	int lock_res = pthread_mutex_lock(&pool->timer_lock);
+	assert(lock_res == 0, "Could not obtain timer lock");
+	uint64_t next = fiber_timer_wheel_next(&pool->timers);
+	fiber_timer_wheel_add(&pool->timers, timer, pool->malloc, pool->free);
+	// timer belongs to the wheel now
+	uint64_t expire = timer->expire;
+	pthread_mutex_unlock(&pool->timer_lock);
+	if (next == 0 || expire < next) {
+		__atomic_add_fetch(&pool->timer_seq, 1, __ATOMIC_RELEASE);
+		fiber_park_wake(&pool->timer_seq, 1);
+	}
+	return job->job_id;
+}
+
+static int timer_start(struct fiber_pool *pool)
+{
+	int mutex_res = pthread_mutex_init(&pool->timer_lock, NULL);
+	if (mutex_res != 0) {
+		return __fiber_mutex_init_get_err(mutex_res);
+	}
+	int res = fiber_timer_wheel_init(&pool->timers,
+					 __fiber_stats_now_ns() /
+						 FIBER_TIMER_TICK_NS,
+					 pool->malloc);
+	if (res != 0) {
+		pthread_mutex_destroy(&pool->timer_lock);
+		return res;
+	}
+	pool->timer_seq = 0;
+	pool->timer_stop = 0;
+	res = pthread_create(&pool->timer_thread, NULL, timer_loop, pool);
+	if (res != 0) {
+		fiber_timer_wheel_free(&pool->timers, pool->free);
+		pthread_mutex_destroy(&pool->timer_lock);
+		return __fiber_pthread_create_get_err(res);
+	}
+	return 0;
+}
+
+static void timer_stop(struct fiber_pool *pool)
+{
+	__atomic_store_n(&pool->timer_stop, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&pool->timer_seq, 1, __ATOMIC_RELEASE);
+	fiber_park_wake(&pool->timer_seq, 1);
+	int join_res = pthread_join(pool->timer_thread, NULL);
+	assert(join_res == 0, "failed to join timer thread");
+	fiber_timer_wheel_free(&pool->timers, pool->free);
+	pthread_mutex_destroy(&pool->timer_lock);
+}
+
+// Pushes jobs whose timers are due and puts periodic timers back
+static void *timer_loop(void *arg)
+{
+	struct fiber_pool *pool = (struct fiber_pool *)arg;
+	struct fiber_job jobs[FIBER_POP_BATCH_MAX];
+	while (!__atomic_load_n(&pool->timer_stop, __ATOMIC_ACQUIRE)) {
+		uint32_t seq = __atomic_load_n(&pool->timer_seq, __ATOMIC_ACQUIRE);
+		uint64_t now_ns = __fiber_stats_now_ns();
+		uint64_t now = now_ns / FIBER_TIMER_TICK_NS;
+		int lock_res = pthread_mutex_lock(&pool->timer_lock);
+		assert(lock_res == 0, "Could not obtain timer lock");
+		// Out of the wheel and the hash, so only we can see these
+		struct fiber_timer *due =
+			fiber_timer_wheel_advance(&pool->timers, now);
+		struct fiber_timer *done = NULL;
+		qsize n = 0;
+		while (due != NULL) {
+			struct fiber_timer *timer = due;
+			due = due->next;
+			// Copied under the lock, a periodic timer can be
+			// cancelled as soon as it's back in the wheel
+			jobs[n++] = timer->job;
+			if (timer->period > 0) {
+				uint64_t behind = now - timer->expire;
+				timer->expire += (behind / timer->period + 1) *
+						 timer->period;
+				fiber_timer_wheel_add(&pool->timers, timer,
+						      pool->malloc, pool->free);
+			} else {
+				timer->next = done;
+				done = timer;
+			}
+			if (n == FIBER_POP_BATCH_MAX) {
+				// Pushed without the lock, it can block
+				pthread_mutex_unlock(&pool->timer_lock);
+				timer_push(pool, jobs, n);
+				n = 0;
+				lock_res = pthread_mutex_lock(&pool->timer_lock);
+				assert(lock_res == 0,
+				       "Could not obtain timer lock");
+			}
+		}
+		uint64_t next = fiber_timer_wheel_next(&pool->timers);
+		pthread_mutex_unlock(&pool->timer_lock);
+		if (n > 0) {
+			timer_push(pool, jobs, n);
+		}
+		while (done != NULL) {
+			struct fiber_timer *timer = done;
+			done = done->next;
+			pool->free(timer);
+		}
+		if (next == 0) {
+			fiber_park_wait(&pool->timer_seq, seq, NULL);
+			continue;
+		}
+		uint64_t next_ns = next * FIBER_TIMER_TICK_NS;
+		uint64_t wait_ns = next_ns > now_ns ? next_ns - now_ns : 0;
+		struct timespec timeout = { .tv_sec = wait_ns / 1000000000ull,
+					    .tv_nsec = wait_ns % 1000000000ull };
+		fiber_park_wait(&pool->timer_seq, seq, &timeout);
+	}
+	return NULL;
+}
+
+static void timer_push(struct fiber_pool *pool, struct fiber_job *jobs,
+		       qsize n)
+{
+	if (pool->opt_flags & FIBER_OPT_LATENCY) {
+		uint64_t ticks = __fiber_ticks();
+		for (qsize i = 0; i < n; ++i) {
+			jobs[i].enqueue_ts = ticks;
+		}
+	}
+	cancel_track(pool, jobs, n);
+	qsize pushed = __fiber_job_push_n(pool, jobs, n, FIBER_BLOCK);
+	if (pushed < 0) {
+		pushed = 0;
+	}
+	cancel_untrack(pool, jobs + pushed, n - pushed);
+	stat_push(pool, pushed, 0);
 }
 
 /* INTERNAL MISC FUNCTIONS */
@@ -639,18 +3046,6 @@ int __fiber_mutex_init_get_err(int error)
 	}
 }
 
-int __fiber_sem_init_get_err(int error)
-{
-	assert(error != 0, invalid_error_msg);
-	switch (error) {
-	case EINVAL: // Semaphore value too large
-		return FBR_ESEM_RNG;
-	case ENOSYS: // Don't use pshared, should not encounter.
-	default:
-		return error;
-	}
-}
-
 int __fiber_pthread_create_get_err(int error)
 {
 	assert(error != 0, invalid_error_msg);
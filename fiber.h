@@ -5,9 +5,19 @@
 
 #include <limits.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <stdint.h>
 
+#include "fiber_deque.h"
+#include "fiber_future.h"
+#include "fiber_numa.h"
+#include "fiber_park.h"
+#include "fiber_slab.h"
+#include "fiber_stats.h"
+#include "fiber_sync.h"
+#include "fiber_task.h"
+#include "fiber_thread_attr.h"
+#include "fiber_timer.h"
+#include "fiber_utils.h"
 #include "job_queue.h"
 
 /* List of definitions to change compilation
@@ -21,6 +31,16 @@
  *    default queue implementation. If this is defined, Fiber assumes
  *    you will provide your own queue implementation at runtime through
  *    fiber_pool_init_options.
+ * 4. FIBER_NO_STATS: If defined, the counters behind fiber_pool_stats are
+ *    not compiled and every counter it reports is 0.
+ * 5. FIBER_UCONTEXT: If defined, FIBER_OPT_STACKFUL switches tasks with
+ *    ucontext instead of the hand written x86-64 and aarch64 switch.
+ * 6. FIBER_JID_BLOCK: Job ids each pushing thread reserves from the pool
+ *    at once, 1024 by default. Ids stay unique, but ids from different
+ *    threads no longer follow push order.
+ * 7. FIBER_PACKED_LAYOUT: If defined, hot fields of struct fiber_pool and
+ *    the default queue are not padded apart. Only meant for benchmarking
+ *    the padding.
  */
 
 typedef int tpsize; // Type to represent number of threads in pool
@@ -32,23 +52,170 @@ struct fiber_thread {
 	struct fiber_thread *next;
 	pthread_t thread_id;
 	jid job_id;
+	// Only allocated when the pool uses FIBER_OPT_WORK_STEALING
+	struct fiber_deque deque;
+	uint32_t steal_seed;
+	// Index of the NUMA node the thread is pinned to, 0 without FIBER_OPT_NUMA
+	int node;
+#ifndef FIBER_NO_STATS
+	struct fiber_worker_stats stats;
+#endif
+	// Only allocated when the pool uses FIBER_OPT_LATENCY
+	struct fiber_worker_hist *hist;
+	// When the worker started waiting for a job, 0 while it runs one. Only
+	// kept when the pool uses FIBER_OPT_AUTOSCALE.
+	uint64_t idle_since;
+	// Finished tasks kept for reuse with FIBER_OPT_STACKFUL
+	struct fiber_task *tasks_free;
+	int tasks_free_number;
+	// Blocks for fiber_job_arg_alloc
+	struct fiber_slab_cache slab_cache;
 };
 
+// Latency histograms one worker records for itself
+struct fiber_worker_hist {
+	// Time from push to the job starting
+	struct fiber_hist wait;
+	// Time job_func ran for
+	struct fiber_hist run;
+};
+
+/* Attributes workers are created with. Zeroed, workers float freely with the
+ * default stack and are named "fiber-N".
+ */
+struct fiber_thread_options {
+	// One of FIBER_AFFINITY_*
+	int affinity;
+	// The CPUs for FIBER_AFFINITY_EXPLICIT. Compact and scatter only use
+	// these if set, otherwise every CPU the process may run on.
+	const int *cpus;
+	int cpus_number;
+	// 0 keeps the pthread default for each
+	size_t stack_size;
+	size_t guard_size;
+	// Workers are named "<name>-N". NULL uses FIBER_THREAD_NAME_DEFAULT.
+	const char *name;
+};
+
+/* Bounds and triggers for FIBER_OPT_AUTOSCALE. 0 picks the default of each
+ * field except threads_max.
+ */
+struct fiber_autoscale_options {
+	// The pool never shrinks below threads_min or grows past threads_max.
+	// threads_number must be between the two.
+	tpsize threads_min;
+	tpsize threads_max;
+	// Grow once more than this many jobs are pending on two ticks in a row.
+	// One worker is added per grow_pending jobs pending.
+	qsize grow_pending;
+	// Retire a worker that has waited this long for a job
+	uint32_t idle_timeout_ms;
+	// How often the supervisor looks at the pool
+	uint32_t interval_us;
+};
+
+#define FIBER_AUTOSCALE_GROW_PENDING_DEFAULT 1
+#define FIBER_AUTOSCALE_IDLE_TIMEOUT_MS_DEFAULT 1000
+#define FIBER_AUTOSCALE_INTERVAL_US_DEFAULT 1000
+
 /** Pool **/
 
+// A NUMA node's queue and the workers that pop from it
+struct fiber_numa_queue {
+	void *job_queue;
+	tpsize threads_number;
+	tpsize threads_idle;
+	// Wake jobs pushed to this node that haven't run yet
+	tpsize wakes;
+};
+
 struct fiber_pool {
-	pthread_mutex_t lock;
+	// Keeps whatever precedes the pool off job_id_prev's line
+	__fbr_pad_hot(__pad_lead, FIBER_CACHE_LINE);
+	// Written once per FIBER_JID_BLOCK ids a thread pushes
 	jid job_id_prev;
+	__fbr_pad_hot(__pad_push, sizeof(jid));
+	// Written by every worker around each job
+	tpsize threads_working;
+	__fbr_pad_hot(__pad_working, sizeof(tpsize));
+	// Read by every push and pop. pool_flags only changes in fiber_wait and
+	// when workers are removed, the rest only in fiber_init.
+	uint32_t pool_flags;
+	uint32_t opt_flags;
+	qsize pop_batch;
 	const struct fiber_queue_operations *queue_ops;
 	void *job_queue;
+	// Only set when the pool uses FIBER_OPT_NUMA. job_queue is node 0's.
+	struct fiber_numa_queue *numa_queues;
+	// Only set when the pool uses FIBER_OPT_CANCEL. State of the job with
+	// id j is in cancel_slots[j & cancel_mask], tagged with j.
+	uint64_t *cancel_slots;
+	uint64_t cancel_mask;
+	// Tells this pool's id blocks from those of a pool freed at the same
+	// address
+	uint64_t jid_gen;
+
+	pthread_mutex_t lock;
 	struct fiber_thread *thread_head;
 	tpsize threads_number;
-	tpsize threads_working;
-	sem_t threads_sync;
+	struct fiber_park_sem threads_sync;
 	tpsize threads_kill_number;
-	uint32_t pool_flags;
 	void *(*malloc)(size_t __size);
 	void (*free)(void *__ptr);
+	// Work stealing state
+	qsize deque_length;
+	tpsize threads_idle;
+	tpsize steal_wakes;
+	tpsize thieves;
+	struct fiber_future_table futures;
+	// Started workers that haven't exited. fiber_free waits for 0.
+	uint32_t threads_live;
+	// Only set when the pool uses FIBER_OPT_NUMA
+	struct fiber_numa_topology numa;
+	// Used by fiber_init and fiber_threads_add. cpus and name point to
+	// copies the pool owns.
+	struct fiber_thread_options thread_opts;
+	char thread_name[FIBER_THREAD_NAME_MAX];
+	// Workers ever started. Numbers names and compact/scatter slots.
+	tpsize threads_started;
+#ifndef FIBER_NO_STATS
+	// Pushes from threads that aren't workers of this pool
+	struct fiber_worker_stats stats_shared;
+	// Counters of workers that have exited
+	struct fiber_worker_stats stats_retired;
+#endif
+	// Histograms of workers that have exited. Only set when the pool uses
+	// FIBER_OPT_LATENCY.
+	struct fiber_worker_hist *hist_retired;
+	// Only set when the pool uses FIBER_OPT_AUTOSCALE
+	struct fiber_autoscale_options autoscale;
+	pthread_t autoscale_thread;
+	// Set by fiber_free to stop the supervisor
+	uint32_t autoscale_stop;
+	// Only used when the pool uses FIBER_OPT_STACKFUL. Tasks in fiber_sleep
+	// wait in sleepers until the sleep thread queues them again.
+	size_t task_stack_size;
+	pthread_mutex_t sleep_lock;
+	struct fiber_sleep_heap sleepers;
+	tpsize tasks_suspended;
+	// Tasks woken while the queue was full. Workers resume these before
+	// popping the queue, so waking a task never blocks.
+	uint32_t ready_lock;
+	struct fiber_task *ready_head;
+	struct fiber_task *ready_tail;
+	// Bumped to wake the sleep thread, sleep_stop is set by fiber_free
+	uint32_t sleep_seq;
+	uint32_t sleep_stop;
+	pthread_t sleep_thread;
+	// Only used when the pool uses FIBER_OPT_TIMERS. The timer thread
+	// pushes jobs from timers as the wheel reaches them.
+	pthread_mutex_t timer_lock;
+	struct fiber_timer_wheel timers;
+	uint32_t timer_seq;
+	uint32_t timer_stop;
+	pthread_t timer_thread;
+	// Backs fiber_job_arg_alloc
+	struct fiber_slab slab;
 };
 
 struct fiber_pool_init_options {
@@ -57,8 +224,90 @@ struct fiber_pool_init_options {
 	void (*free)(void *__ptr);
 	tpsize threads_number;
 	qsize queue_length;
+	uint32_t flags;
+	qsize deque_length;
+	qsize pop_batch;
+	int park_spin;
+	qsize futures_number;
+	struct fiber_thread_options thread_opts;
+	struct fiber_autoscale_options autoscale;
+	size_t task_stack_size;
+};
+
+/* A set of jobs that can be waited on without waiting for the rest of the
+ * pool. pending counts jobs pushed through the group that haven't returned,
+ * its high bit is set once someone sleeps on it. Jobs may push more jobs to
+ * their own group.
+ */
+struct fiber_group {
+	struct fiber_pool *pool;
+	uint32_t pending;
 };
 
+#define FIBER_GROUP_WAITERS (1u << 31)
+
+/* Snapshot filled by fiber_pool_stats. Counters are totals since fiber_init,
+ * see struct fiber_worker_stats for what each one counts.
+ */
+struct fiber_stats {
+	uint64_t jobs;
+	uint64_t steals;
+	uint64_t idle_ns;
+	uint64_t pushes;
+	uint64_t pushes_full;
+	uint64_t jobs_inline;
+	tpsize threads_number;
+	tpsize threads_working;
+	qsize jobs_pending;
+};
+
+/* Options for fiber_pool_init_options.flags */
+// Give each worker a deque. Jobs pushed from inside a running job go to the
+// worker's deque and idle workers steal from each other before falling back
+// to the shared queue.
+#define FIBER_OPT_WORK_STEALING (1 << 0)
+// Give each NUMA node its own queue, allocated on that node, and pin each
+// worker to the CPUs of one node. Jobs go to the queue of the pushing
+// thread's node. A worker only takes jobs from another node's queue when
+// its own is empty. The topology is read from FIBER_NUMA_SYSFS.
+#define FIBER_OPT_NUMA (1 << 1)
+// Timestamp each job at push and record how long it waited in the queue and
+// how long it ran. See fiber_pool_latency. Costs two clock reads per job on
+// the worker and one per push call.
+#define FIBER_OPT_LATENCY (1 << 2)
+// Start a supervisor thread that adds workers while jobs pile up in the queue
+// and retires workers that stay idle, within the bounds in
+// fiber_pool_init_options.autoscale. Needs queue_ops->length.
+#define FIBER_OPT_AUTOSCALE (1 << 3)
+// Run every job on its own stack (M:N) so it can call fiber_yield and
+// fiber_sleep to give its worker to other jobs. Stacks are pooled per worker
+// and have a guard page. A job may resume on another worker, so it must not
+// keep pointers to thread locals across those calls.
+#define FIBER_OPT_STACKFUL (1 << 4)
+// Every FIBER_BLOCK push behaves as if FIBER_CALLER_RUNS was given, and
+// fiber_wait runs queued jobs on the calling thread until the queue is empty
+// before it sleeps. Jobs run this way are counted in jobs_inline, not jobs.
+#define FIBER_OPT_CALLER_RUNS (1 << 5)
+// Start a timer thread for fiber_job_push_after and fiber_job_push_every.
+// Timers wait in a hierarchical timing wheel with FIBER_TIMER_TICK_NS ticks
+// until they are due.
+#define FIBER_OPT_TIMERS (1 << 6)
+// Track the state of recently pushed jobs so fiber_job_cancel can stop them
+// before they run. Costs a store per pushed job and a compare and swap when
+// a worker takes and finishes one. See FIBER_CANCEL_SLOTS_MIN.
+#define FIBER_OPT_CANCEL (1 << 7)
+
+#define FIBER_DEQUE_LENGTH_DEFAULT 256
+// Fewest job states kept for fiber_job_cancel with FIBER_OPT_CANCEL
+#define FIBER_CANCEL_SLOTS_MIN 1024
+// Upper bound for fiber_pool_init_options.pop_batch
+#define FIBER_POP_BATCH_MAX 64
+// Job ids a pushing thread reserves from the pool at once. It hands them out
+// without touching job_id_prev until they run out.
+#ifndef FIBER_JID_BLOCK
+#define FIBER_JID_BLOCK 1024
+#endif
+
 /* Responsible for initializing all resources needed for the thread pool and
  * starting each thread. After fiber_init returns successfully, threads will
  * be awaiting work. Do not initialize a pool that has already been initialized.
@@ -75,32 +324,61 @@ struct fiber_pool_init_options {
  *  threads_number: The number of threads to create and start. Must be > 0.
  *  queue_length:   The length of the queue. This parameter will be passed
  *                  to the queue init function provided in queue_ops. Must be
- *                  > 0.
+ *                  > 0. With FIBER_OPT_NUMA, each node's queue gets this
+ *                  length.
+ *  flags:          FIBER_OPT_* bits that enable optional scheduler modes.
+ *  deque_length:   The length of each worker's deque when work stealing is
+ *                  enabled. If 0, FIBER_DEQUE_LENGTH_DEFAULT is used. A job
+ *                  pushed to a full deque goes to the shared queue instead.
+ *  pop_batch:      The max number of jobs a worker takes from the queue in
+ *                  one pop. Only used if queue_ops has pop_n. 0 or 1 pops
+ *                  one job at a time. Clamped to FIBER_POP_BATCH_MAX.
+ *  park_spin:      How many times a blocked worker or producer retries before
+ *                  going to sleep. 0 uses FIBER_PARK_SPIN_DEFAULT, < 0 sleeps
+ *                  right away. Passed to queue_ops->set_park_spin if set.
+ *  futures_number: The number of futures that can be pending at once. If 0,
+ *                  FIBER_FUTURES_DEFAULT is used.
+ *  thread_opts:    Affinity, stack and name of each worker. Also used for
+ *                  workers added with fiber_threads_add. With FIBER_OPT_NUMA
+ *                  and an affinity policy, a worker joins the node of the
+ *                  CPU it is pinned to.
+ *  autoscale:      Only read with FIBER_OPT_AUTOSCALE. See
+ *                  struct fiber_autoscale_options.
+ *  task_stack_size: The stack size of each job with FIBER_OPT_STACKFUL. If
+ *                  0, FIBER_TASK_STACK_DEFAULT is used.
  * @returns: 0 on success, an error code otherwise.
  * @error FBR_ENULL_ARGS -> pool or opts are NULL.
  * @error FBR_EINVLD_SIZE -> threads_number or queue_length are not > 0
+ * @error FBR_EINVLD_OPT -> thread_opts has an unknown affinity, cpus with
+ *                          cpus_number < 1, or an explicit affinity
+ *                          without cpus. Or FIBER_OPT_AUTOSCALE with
+ *                          threads_number outside of autoscale's bounds.
  * @error FBR_EQUEOPS_NONE -> FIBER_NO_DEFAULT_QUEUE is defined and queue_ops
  *                             is NULL or the required queue_ops provided are
- *                             not all provided.
+ *                             not all provided. Or FIBER_OPT_AUTOSCALE
+ *                             without queue_ops->length.
  * @error FBR_ENO_RSC -> pthread or pthread_mutex could not be initialized due
  *                        to insufficient system resources (other than memory).
  * @error FBR_EPTHRD_PERM -> pthread or pthread_mutex could not be initialized
  *                            due to insufficient permissions.
- * @error FBR_ESEM_RNG -> A semaphore could not be initialized because the value
- *                         was too large. The provided queue size was likely too
- *                         large.
  * @error FBR_EQUE_NULL -> The queue pointer was null after calling initialize
  *                          on the queue.
  * @error ENOMEM -> malloc returned a NULL pointer.
  */
 int fiber_init(struct fiber_pool *pool, struct fiber_pool_init_options *opts);
 
-/* Pushes a job onto the job queue.
+/* Pushes a job onto the job queue. If the pool uses FIBER_OPT_WORK_STEALING
+ * and this is called from inside a job running on the same pool, the job is
+ * pushed to the worker's deque and queue_flags are ignored. If the pool uses
+ * FIBER_OPT_NUMA, the job is pushed to the queue of the caller's node.
  * @param pool -> The thread pool to queue work.
  * @param job -> The job to push. A job_id will be assigned by Fiber.
  * @param queue_flags -> Flags to pass to the queue push function. Every
  * queue implementation should implement FIBER_BLOCK and FIBER_NO_BLOCK.
- * A custom implementation may take other options.
+ * A custom implementation may take other options. FIBER_CALLER_RUNS is
+ * handled here, it relies on the queue returning -EAGAIN from a
+ * FIBER_NO_BLOCK push when it is full. FIBER_FREE_ARG and FIBER_INLINE_ARG
+ * are kept in job_flags, see job_queue.h.
  * @returns: 0 on success, an error otherwise.
  * @error FBR_ENULL_ARGS -> pool, job, or job_func were NULL.
  * @error FBR_EPUSH_JOB -> An invalid job_id. The queue push function
@@ -115,16 +393,213 @@ int fiber_init(struct fiber_pool *pool, struct fiber_pool_init_options *opts);
 jid fiber_job_push(struct fiber_pool *pool, struct fiber_job *job,
 		   uint32_t queue_flags);
 
+/* Pushes n jobs onto the job queue. The job ids are reserved as one
+ * contiguous range, so jobs[i].job_id == jobs[0].job_id + i unless the ids
+ * wrapped. If the queue has a push_n operation, the jobs are handed to it
+ * in one call.
+ * @param pool -> The thread pool to queue work.
+ * @param jobs -> Array of n jobs. A job_id will be assigned to each.
+ * @param n -> The number of jobs in jobs.
+ * @param queue_flags -> Same as fiber_job_push. With FIBER_BLOCK, all jobs
+ * are pushed. Without it, as many jobs as fit are pushed.
+ * @returns: The number of jobs pushed (always a prefix of jobs), an error
+ * otherwise.
+ * @error FBR_ENULL_ARGS -> pool, jobs or a job_func were NULL.
+ * @error FBR_EINVLD_SIZE -> n is less than 1.
+ * @error -int -> Same as fiber_job_push. Only returned if no jobs were
+ * pushed.
+ */
+qsize fiber_job_push_n(struct fiber_pool *pool, struct fiber_job *jobs,
+		       qsize n, uint32_t queue_flags);
+
+/* Binds group to pool. The group may be reused once fiber_group_wait
+ * returns.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> group or pool were NULL.
+ */
+int fiber_group_init(struct fiber_group *group, struct fiber_pool *pool);
+
+/* Same as fiber_job_push, but the job is counted in group until it returns.
+ * @error FBR_ENULL_ARGS -> group, job or job_func were NULL.
+ * @error -int -> Same as fiber_job_push. The job is not counted.
+ */
+jid fiber_group_push(struct fiber_group *group, struct fiber_job *job,
+		     uint32_t queue_flags);
+
+/* Same as fiber_job_push_n, but every job pushed is counted in group. */
+qsize fiber_group_push_n(struct fiber_group *group, struct fiber_job *jobs,
+			 qsize n, uint32_t queue_flags);
+
+/* Blocks the calling thread until every job pushed through group has
+ * returned. Jobs pushed to the pool some other way are not waited for.
+ * Inside a job on a FIBER_OPT_STACKFUL pool, prefer fiber_waitgroup so the
+ * worker isn't blocked.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> group is NULL.
+ */
+int fiber_group_wait(struct fiber_group *group);
+
+/* @returns: The number of jobs in group that haven't returned yet. */
+qsize fiber_group_pending(struct fiber_group *group);
+
+/* Pushes a job whose return value can be collected through future. The job
+ * runs like one pushed with fiber_job_push. Waiting on the future only waits
+ * for this job, not the whole pool.
+ * @param pool -> The thread pool to queue work.
+ * @param job -> The job to push. A job_id will be assigned by Fiber.
+ * @param queue_flags -> Same as fiber_job_push.
+ * @param future -> Filled with the handle on success. It must be consumed
+ * exactly once with fiber_future_wait, fiber_future_try_get,
+ * fiber_future_wait_timeout or fiber_future_discard, otherwise its slot is
+ * never recycled.
+ * @returns: The job id on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool, job, job_func or future were NULL.
+ * @error FBR_ENO_FUTURE -> Every future slot is in use. See
+ * fiber_pool_init_options.futures_number.
+ * @error FBR_EINVLD_OPT -> queue_flags has FIBER_INLINE_ARG, which futures
+ * can't carry.
+ * @error -int -> Same as fiber_job_push.
+ */
+jid fiber_job_push_future(struct fiber_pool *pool, struct fiber_job *job,
+			  uint32_t queue_flags, struct fiber_future *future);
+
+/* Blocks until the future's job returns and consumes the future.
+ * @param pool -> The pool the job was pushed to.
+ * @param future -> The handle from fiber_job_push_future.
+ * @param result -> Set to the job's return value. May be NULL.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool or future were NULL.
+ * @error FBR_EINVLD_FUTURE -> future was already consumed.
+ */
+int fiber_future_wait(struct fiber_pool *pool, struct fiber_future *future,
+		      void **result);
+
+/* Same as fiber_future_wait but never blocks. The future is only consumed
+ * if 0 is returned.
+ * @returns: 0 on success, EAGAIN if the job hasn't finished, an error
+ * otherwise.
+ */
+int fiber_future_try_get(struct fiber_pool *pool, struct fiber_future *future,
+			 void **result);
+
+/* Same as fiber_future_wait but gives up after timeout. The future is only
+ * consumed if 0 is returned.
+ * @param timeout -> Relative time to wait for.
+ * @returns: 0 on success, ETIMEDOUT if timeout expired first, an error
+ * otherwise.
+ * @error FBR_ENULL_ARGS -> pool, future or timeout were NULL.
+ */
+int fiber_future_wait_timeout(struct fiber_pool *pool,
+			      struct fiber_future *future, void **result,
+			      const struct timespec *timeout);
+
+/* Consumes the future without waiting for its result. The slot is recycled
+ * as soon as the job finishes.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool or future were NULL.
+ * @error FBR_EINVLD_FUTURE -> future was already consumed.
+ */
+int fiber_future_discard(struct fiber_pool *pool, struct fiber_future *future);
+
 /* Frees the resources allocated by the pool. Before calling this,
  * please call fiber_threads_working to ensure no threads are working.
- * The free may fail if a thread holds an internal lock. If this occurs,
- * the threads will be cancelled but there will likely be a resource leak.
+ * Idle threads are woken to exit and busy ones exit after their current job,
+ * which is also cancelled. This blocks until they have all exited, so a job
+ * that never reaches a cancellation point keeps it from returning. Jobs
+ * still queued are not run.
+ * With FIBER_OPT_STACKFUL jobs are never cancelled mid run, this waits for
+ * running jobs to finish or switch out. Jobs still suspended in the queue
+ * are not freed, call fiber_wait first.
  * @param pool -> The thread pool to free.
  */
 void fiber_free(struct fiber_pool *pool);
 
+/* Gives the worker to other queued jobs. The calling job is queued again
+ * and resumes when a worker pops it. Outside of a job on a FIBER_OPT_STACKFUL
+ * pool this is sched_yield.
+ */
+void fiber_yield(void);
+
+/* Suspends the calling job for at least duration without blocking its
+ * worker. Outside of a job on a FIBER_OPT_STACKFUL pool this is nanosleep.
+ * fiber_wait counts sleeping jobs as pending.
+ * @param duration -> Relative time to sleep for.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> duration is NULL.
+ */
+int fiber_sleep(const struct timespec *duration);
+
+/* Pushes job with FIBER_BLOCK once delay has passed. The job is copied and
+ * gets its job id now. The delay is rounded up to FIBER_TIMER_TICK_NS.
+ * @param delay -> Relative time to wait before pushing.
+ * @returns: The job id on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool, job, job_func or delay were NULL.
+ * @error FBR_EINVLD_OPT -> The pool does not use FIBER_OPT_TIMERS.
+ * @error -ENOMEM -> malloc returned a NULL pointer.
+ */
+jid fiber_job_push_after(struct fiber_pool *pool, struct fiber_job *job,
+			 const struct timespec *delay);
+
+/* Same as fiber_job_push_after, but the job is pushed again every period
+ * until it is cancelled. Every run has the same job id. Runs missed while
+ * the timer thread was held up are skipped, not made up.
+ * @error FBR_EINVLD_SIZE -> period is shorter than FIBER_TIMER_TICK_NS.
+ */
+jid fiber_job_push_every(struct fiber_pool *pool, struct fiber_job *job,
+			 const struct timespec *period);
+
+/* Removes the timer of a job from fiber_job_push_after or
+ * fiber_job_push_every. A run that was already pushed still happens.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool is NULL.
+ * @error FBR_EINVLD_OPT -> The pool does not use FIBER_OPT_TIMERS.
+ * @error FBR_ENO_JOB -> No timer has job id id. It may have fired already.
+ */
+int fiber_job_timer_cancel(struct fiber_pool *pool, jid id);
+
+/* Cancels a job that hasn't started. The job stays in its queue and is
+ * skipped when a thread pops it. Its group is still counted down and a
+ * future for it completes with a NULL result. With FIBER_OPT_TIMERS, a
+ * timer that hasn't fired is removed too. A job that already started keeps
+ * running, but fiber_job_cancelled returns 1 inside it from then on.
+ * The pool keeps the state of its last queue_length * 4 jobs (at least
+ * FIBER_CANCEL_SLOTS_MIN), older jobs can't be cancelled. Nor can the jobs
+ * of fiber_graph_submit and fiber_parallel_*.
+ * @returns: 0 if the job won't run, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool is NULL.
+ * @error FBR_EINVLD_OPT -> The pool uses neither FIBER_OPT_CANCEL nor
+ *                          FIBER_OPT_TIMERS.
+ * @error FBR_EJOB_RUNNING -> The job already started. It was asked to stop.
+ * @error FBR_ENO_JOB -> No queued job has job id id. It finished already or
+ *                       is too old to be tracked.
+ */
+int fiber_job_cancel(struct fiber_pool *pool, jid id);
+
+/* Polled by a running job to stop early once fiber_job_cancel was called on
+ * it.
+ * @returns: 1 if the job running on the calling thread was cancelled, 0
+ * otherwise or outside of a job on a FIBER_OPT_CANCEL pool.
+ */
+int fiber_job_cancelled(void);
+
+/* Allocates a job argument from the pool's slab. Sizes up to FIBER_SLAB_MAX
+ * come from per-worker caches of size classes, larger ones from malloc.
+ * Push the job with FIBER_FREE_ARG to have the argument released once
+ * job_func returns, or once the job is skipped by fiber_job_cancel.
+ * fiber_job_push_future ignores FIBER_FREE_ARG.
+ * @returns: A 16 byte aligned block of at least size bytes, NULL if pool is
+ * NULL or malloc failed.
+ */
+void *fiber_job_arg_alloc(struct fiber_pool *pool, size_t size);
+
+/* Releases an argument from fiber_job_arg_alloc. Does nothing if arg is
+ * NULL.
+ */
+void fiber_job_arg_free(struct fiber_pool *pool, void *arg);
+
 /* Blocks until the job queue is empty. Once the job queue is empty
- * (all threads asleep) this function will return.
+ * (all threads asleep) this function will return. With
+ * FIBER_OPT_CALLER_RUNS the caller empties the queue itself first.
  * @param pool -> The pool to wait on.
  */
 void fiber_wait(struct fiber_pool *pool);
@@ -172,6 +647,15 @@ int fiber_threads_remove(struct fiber_pool *pool, tpsize threads_num);
  */
 int fiber_threads_add(struct fiber_pool *pool, tpsize threads_num);
 
+/* Same as fiber_threads_add but the new threads are created with opts
+ * instead of the pool's thread_opts. An explicit CPU list is indexed from 0
+ * for the new threads.
+ * @error FBR_ENULL_ARGS -> pool or opts is NULL.
+ * @error FBR_EINVLD_OPT -> Same as fiber_init.
+ */
+int fiber_threads_add_opts(struct fiber_pool *pool, tpsize threads_num,
+			   const struct fiber_thread_options *opts);
+
 /* Get the current number of threads currently running in the pool.
  * @param pool -> The pool to check.
  * @returns -> The number of threads the pool has allocated and working or
@@ -188,8 +672,33 @@ tpsize fiber_threads_number(struct fiber_pool *pool);
  */
 tpsize fiber_threads_working(struct fiber_pool *pool);
 
+/* Sums the counters of every worker, current and exited, without taking the
+ * pool lock. Counters are read one at a time while workers keep running, so
+ * the snapshot is not atomic as a whole.
+ * @param pool -> The pool to check.
+ * @param out -> Filled with the snapshot.
+ * @returns -> 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool or out is NULL.
+ */
+int fiber_pool_stats(struct fiber_pool *pool, struct fiber_stats *out);
+
+/* Merges the latency histograms of every worker, current and exited. Values
+ * are in nanoseconds. Like fiber_pool_stats, this does not take the pool
+ * lock and the snapshot is not atomic as a whole. Internal jobs Fiber
+ * pushes to wake workers are not recorded.
+ * @param pool -> The pool to check.
+ * @param wait -> Filled with the time jobs spent queued. May be NULL.
+ * @param run -> Filled with the time jobs ran for. May be NULL.
+ * @returns -> 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool is NULL.
+ * @error FBR_EINVLD_OPT -> The pool does not use FIBER_OPT_LATENCY.
+ */
+int fiber_pool_latency(struct fiber_pool *pool, struct fiber_hist *wait,
+		       struct fiber_hist *run);
+
 #define FIBER_POOL_FLAG_WAIT (1 << 0)
 #define FIBER_POOL_FLAG_KILL_N (1 << 1)
+#define FIBER_POOL_FLAG_STOP (1 << 2)
 
 /* ERROR CODES */
 
@@ -204,5 +713,11 @@ tpsize fiber_threads_working(struct fiber_pool *pool);
 #define FBR_ESEM_RNG -8
 #define FBR_EQUEOPS_NONE -9
 #define FBR_EPOOL_UNINIT -10
+#define FBR_ENO_FUTURE -11
+#define FBR_EINVLD_FUTURE -12
+#define FBR_EGRAPH_CYCLE -13
+#define FBR_EINVLD_OPT -14
+#define FBR_ENO_JOB -15
+#define FBR_EJOB_RUNNING -16
 
 #endif // _FIBER_H
@@ -0,0 +1,99 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+
+#include "fiber_deque.h"
+#include "fiber_utils.h"
+#include "job_queue.h"
+
+int fiber_deque_init(struct fiber_deque *dq, qsize capacity,
+		     void *(*malloc)(size_t))
+{
+	assert(dq != NULL, "deque_init received a NULL deque");
+	assert(capacity > 0, "deque_init received a bad capacity");
+	int64_t cap = 1;
+	while (cap < capacity) {
+		cap <<= 1;
+	}
+	struct fiber_job *jobs = malloc(cap * sizeof(*jobs));
+	if (jobs == NULL) {
+		return ENOMEM;
+	}
+	dq->mask = cap - 1;
+	dq->top = 0;
+	dq->bottom = 0;
+	// Thieves treat a non NULL buffer as a deque that is ready to use.
+	__atomic_store_n(&dq->jobs, jobs, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void fiber_deque_free(struct fiber_deque *dq, void (*free)(void *))
+{
+	assert(dq != NULL, "deque_free received a NULL deque");
+	if (dq->jobs != NULL) {
+		free(dq->jobs);
+		dq->jobs = NULL;
+	}
+}
+
+int fiber_deque_push(struct fiber_deque *dq, struct fiber_job *job)
+{
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	if (b - t > dq->mask) {
+		return -EAGAIN;
+	}
+	dq->jobs[b & dq->mask] = *job;
+	// Job must be visible before thieves can see the new bottom.
+	__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int fiber_deque_pop(struct fiber_deque *dq, struct fiber_job *buffer)
+{
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		// Empty, restore bottom
+		__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+		return EAGAIN;
+	}
+	*buffer = dq->jobs[b & dq->mask];
+	if (t == b) {
+		// Last job, race any thieves for it.
+		int won = __atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+						      __ATOMIC_SEQ_CST,
+						      __ATOMIC_RELAXED);
+		__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+		return won ? 0 : EAGAIN;
+	}
+	return 0;
+}
+
+int fiber_deque_steal(struct fiber_deque *dq, struct fiber_job *buffer)
+{
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return EAGAIN;
+	}
+	// The owner can't overwrite this slot until top moves past t, so the
+	// copy is only used if our CAS is the one that moves it.
+	struct fiber_job job = dq->jobs[t & dq->mask];
+	if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return EAGAIN;
+	}
+	*buffer = job;
+	return 0;
+}
+
+qsize fiber_deque_length(struct fiber_deque *dq)
+{
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+	return b > t ? (qsize)(b - t) : 0;
+}
@@ -0,0 +1,53 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_DEQUE_H
+#define _FIBER_DEQUE_H
+
+#include <stdint.h>
+
+#include "fiber_utils.h"
+#include "job_queue.h"
+
+/* Fixed size Chase-Lev work stealing deque. Only the owning worker may
+ * push and pop (LIFO end). Any thread may steal from the other end (FIFO).
+ * The deque does not grow. A push to a full deque fails so the caller can
+ * fall back to the pool's shared queue.
+ */
+struct fiber_deque {
+	// Thieves race on top, only the owner writes bottom.
+	int64_t top;
+	__fbr_pad(__pad_top, sizeof(int64_t));
+	int64_t bottom;
+	__fbr_pad(__pad_bottom, sizeof(int64_t));
+	struct fiber_job *jobs;
+	int64_t mask;
+};
+
+/* Allocates the deque's buffer. capacity is rounded up to a power of two.
+ * @returns: 0 on success, ENOMEM if malloc failed.
+ */
+int fiber_deque_init(struct fiber_deque *dq, qsize capacity,
+		     void *(*malloc)(size_t));
+
+void fiber_deque_free(struct fiber_deque *dq, void (*free)(void *));
+
+/* Owner only. Pushes job onto the bottom of the deque.
+ * @returns: 0 on success, -EAGAIN if the deque is full.
+ */
+int fiber_deque_push(struct fiber_deque *dq, struct fiber_job *job);
+
+/* Owner only. Pops the most recently pushed job.
+ * @returns: 0 on success, EAGAIN if the deque is empty.
+ */
+int fiber_deque_pop(struct fiber_deque *dq, struct fiber_job *buffer);
+
+/* Any thread. Takes the oldest job in the deque.
+ * @returns: 0 on success, EAGAIN if the deque is empty or another thread
+ * won the race for the job.
+ */
+int fiber_deque_steal(struct fiber_deque *dq, struct fiber_job *buffer);
+
+/* Approximate number of jobs in the deque. */
+qsize fiber_deque_length(struct fiber_deque *dq);
+
+#endif // _FIBER_DEQUE_H
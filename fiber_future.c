@@ -0,0 +1,238 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "fiber_future.h"
+#include "fiber_utils.h"
+
+#define FUTURE_FREE 0
+#define FUTURE_PENDING 1
+#define FUTURE_DONE 2
+#define FUTURE_DISCARDED 3
+
+// Marks the end of the free list
+#define FUTURE_NONE UINT32_MAX
+
+static inline void slot_release(struct fiber_future_table *table,
+				struct fiber_future_slot *slot);
+static inline struct fiber_future_slot *
+slot_lookup(struct fiber_future_table *table, struct fiber_future *future);
+static int remaining_time(const struct timespec *deadline,
+			  struct timespec *remaining);
+
+int fiber_future_table_init(struct fiber_future_table *table, qsize capacity,
+			    uint32_t spin, void *(*malloc)(size_t))
+{
+	assert(table != NULL, "future_table_init given NULL table");
+	assert(capacity > 0, "future_table_init given bad capacity");
+	struct fiber_future_slot *slots = malloc(capacity * sizeof(*slots));
+	if (slots == NULL) {
+		return ENOMEM;
+	}
+	for (qsize i = 0; i < capacity; ++i) {
+		slots[i].table = table;
+		slots[i].state = FUTURE_FREE;
+		slots[i].gen = 0;
+		slots[i].next_free = i + 1 < capacity ? (uint32_t)i + 1 :
+							FUTURE_NONE;
+		fiber_park_event_init(&slots[i].done, spin);
+	}
+	table->slots = slots;
+	table->capacity = capacity;
+	table->free_head = 0;
+	return 0;
+}
+
+void fiber_future_table_free(struct fiber_future_table *table,
+			     void (*free)(void *))
+{
+	assert(table != NULL, "future_table_free given NULL table");
+	if (table->slots != NULL) {
+		free(table->slots);
+		table->slots = NULL;
+	}
+}
+
+int fiber_future_slot_take(struct fiber_future_table *table,
+			   struct fiber_job *job, struct fiber_future *future)
+{
+	uint64_t head = __atomic_load_n(&table->free_head, __ATOMIC_ACQUIRE);
+	uint32_t idx;
+	uint64_t next;
+	do {
+		idx = (uint32_t)head;
+		if (idx == FUTURE_NONE) {
+			return EAGAIN;
+		}
+		// May be stale if another thread took idx first. The tag makes
+		// the CAS fail in that case.
+		uint32_t next_idx = __atomic_load_n(&table->slots[idx].next_free,
+						    __ATOMIC_RELAXED);
+		next = (((head >> 32) + 1) << 32) | next_idx;
+	} while (!__atomic_compare_exchange_n(&table->free_head, &head, next, 1,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+	struct fiber_future_slot *slot = &table->slots[idx];
+	slot->job_func = job->job_func;
+	slot->job_arg = job->job_arg;
+	slot->result = NULL;
+	// Published to the worker by the queue push
+	__atomic_store_n(&slot->state, FUTURE_PENDING, __ATOMIC_RELAXED);
+	future->slot = idx;
+	future->gen = __atomic_load_n(&slot->gen, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void fiber_future_slot_put(struct fiber_future_table *table,
+			   struct fiber_future *future)
+{
+	slot_release(table, &table->slots[future->slot]);
+}
+
+// Publishes res to the waiter, or frees a slot that was discarded
+static void slot_complete(struct fiber_future_slot *slot, void *res)
+{
+	slot->result = res;
+	uint32_t expected = FUTURE_PENDING;
+	if (__atomic_compare_exchange_n(&slot->state, &expected, FUTURE_DONE,
+					0, __ATOMIC_RELEASE,
+					__ATOMIC_ACQUIRE)) {
+		// The waiter may consume and recycle the slot before this
+		// runs. A notify on a recycled slot is only a spurious wake.
+		fiber_park_event_notify(&slot->done, INT_MAX);
+	} else {
+		// Discarded while running, nobody will consume it
+		slot_release(slot->table, slot);
+	}
+}
+
+void *__fiber_future_job(void *arg)
+{
+	struct fiber_future_slot *slot = (struct fiber_future_slot *)arg;
+	void *res = slot->job_func(slot->job_arg);
+	slot_complete(slot, res);
+	return res;
+}
+
+void __fiber_future_cancel(void *arg)
+{
+	slot_complete((struct fiber_future_slot *)arg, NULL);
+}
+
+int fiber_future_table_wait(struct fiber_future_table *table,
+			    struct fiber_future *future, void **result,
+			    int block, const struct timespec *timeout)
+{
+	struct fiber_future_slot *slot = slot_lookup(table, future);
+	if (slot == NULL) {
+		return EINVAL;
+	}
+	struct timespec deadline, remaining;
+	if (timeout != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout->tv_sec;
+		deadline.tv_nsec += timeout->tv_nsec;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	uint32_t spin = block ? slot->done.spin : 0;
+	while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != FUTURE_DONE) {
+		if (!block) {
+			return EAGAIN;
+		}
+		if (spin > 0) {
+			--spin;
+			__fbr_cpu_relax();
+			continue;
+		}
+		if (timeout != NULL && !remaining_time(&deadline, &remaining)) {
+			return ETIMEDOUT;
+		}
+		uint32_t key = fiber_park_event_prepare(&slot->done);
+		if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) ==
+		    FUTURE_DONE) {
+			fiber_park_event_cancel(&slot->done);
+			break;
+		}
+		fiber_park_event_wait(&slot->done, key,
+				      timeout != NULL ? &remaining : NULL);
+	}
+	if (result != NULL) {
+		*result = slot->result;
+	}
+	slot_release(table, slot);
+	return 0;
+}
+
+int fiber_future_table_discard(struct fiber_future_table *table,
+			       struct fiber_future *future)
+{
+	struct fiber_future_slot *slot = slot_lookup(table, future);
+	if (slot == NULL) {
+		return EINVAL;
+	}
+	uint32_t expected = FUTURE_PENDING;
+	if (!__atomic_compare_exchange_n(&slot->state, &expected,
+					 FUTURE_DISCARDED, 0, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		// Already done, recycle it ourselves
+		slot_release(table, slot);
+	}
+	return 0;
+}
+
+static inline void slot_release(struct fiber_future_table *table,
+				struct fiber_future_slot *slot)
+{
+	uint32_t idx = (uint32_t)(slot - table->slots);
+	__atomic_add_fetch(&slot->gen, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->state, FUTURE_FREE, __ATOMIC_RELAXED);
+	uint64_t head = __atomic_load_n(&table->free_head, __ATOMIC_RELAXED);
+	uint64_t next;
+	do {
+		__atomic_store_n(&slot->next_free, (uint32_t)head,
+				 __ATOMIC_RELAXED);
+		next = (((head >> 32) + 1) << 32) | idx;
+	} while (!__atomic_compare_exchange_n(&table->free_head, &head, next, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+static inline struct fiber_future_slot *
+slot_lookup(struct fiber_future_table *table, struct fiber_future *future)
+{
+	if (future->slot >= (uint32_t)table->capacity) {
+		return NULL;
+	}
+	struct fiber_future_slot *slot = &table->slots[future->slot];
+	if (__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != future->gen) {
+		return NULL;
+	}
+	// Discarded slots keep their gen until the job finishes
+	uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+	if (state == FUTURE_FREE || state == FUTURE_DISCARDED) {
+		return NULL;
+	}
+	return slot;
+}
+
+// Returns 0 if deadline has passed
+static int remaining_time(const struct timespec *deadline,
+			  struct timespec *remaining)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	remaining->tv_sec = deadline->tv_sec - now.tv_sec;
+	remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if (remaining->tv_nsec < 0) {
+		remaining->tv_sec -= 1;
+		remaining->tv_nsec += 1000000000L;
+	}
+	return remaining->tv_sec > 0 ||
+	       (remaining->tv_sec == 0 && remaining->tv_nsec > 0);
+}
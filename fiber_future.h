@@ -0,0 +1,91 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_FUTURE_H
+#define _FIBER_FUTURE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "fiber_park.h"
+#include "job_queue.h"
+
+/* Completion slots for jobs pushed with fiber_job_push_future. Slots live in
+ * a fixed array allocated at init and are recycled through a lock-free free
+ * list, so pushing a future never calls malloc.
+ */
+
+// Used when fiber_pool_init_options.futures_number is 0
+#define FIBER_FUTURES_DEFAULT 256
+
+/* Handle to a pending result. Must be consumed exactly once by
+ * fiber_future_wait, fiber_future_try_get, a successful
+ * fiber_future_wait_timeout or fiber_future_discard.
+ */
+struct fiber_future {
+	jid job_id;
+	uint32_t slot;
+	uint32_t gen;
+};
+
+struct fiber_future_slot {
+	void *(*job_func)(void *arg);
+	void *job_arg;
+	void *result;
+	struct fiber_future_table *table;
+	struct fiber_park_event done;
+	uint32_t state;
+	// Bumped each time the slot is recycled. Stale handles don't match.
+	uint32_t gen;
+	uint32_t next_free;
+};
+
+struct fiber_future_table {
+	// Free list head. Index in the low 32 bits, ABA tag in the high 32.
+	uint64_t free_head;
+	struct fiber_future_slot *slots;
+	qsize capacity;
+};
+
+/* @param spin -> Times a waiter checks the slot before sleeping. */
+int fiber_future_table_init(struct fiber_future_table *table, qsize capacity,
+			    uint32_t spin, void *(*malloc)(size_t));
+
+void fiber_future_table_free(struct fiber_future_table *table,
+			     void (*free)(void *));
+
+/* Takes a free slot and fills it with job's function and argument.
+ * @returns: 0 on success, EAGAIN if every slot is in use.
+ */
+int fiber_future_slot_take(struct fiber_future_table *table,
+			   struct fiber_job *job, struct fiber_future *future);
+
+/* Returns a slot whose job was never pushed. */
+void fiber_future_slot_put(struct fiber_future_table *table,
+			   struct fiber_future *future);
+
+/* job_func of the job pushed in place of the user's. arg is the slot. */
+void *__fiber_future_job(void *arg);
+
+/* Completes the future of a __fiber_future_job that was cancelled before it
+ * ran. The result is NULL.
+ */
+void __fiber_future_cancel(void *arg);
+
+/* Waits for the future's job to finish and consumes the future.
+ * @param block -> If 0, only checks once.
+ * @param timeout -> Relative timeout or NULL to wait forever.
+ * @returns: 0 on success, EAGAIN if block was 0 and the job isn't done,
+ * ETIMEDOUT if timeout expired, EINVAL if the handle is stale.
+ */
+int fiber_future_table_wait(struct fiber_future_table *table,
+			    struct fiber_future *future, void **result,
+			    int block, const struct timespec *timeout);
+
+/* Consumes the future without waiting. The slot is recycled once the job
+ * finishes.
+ * @returns: 0 on success, EINVAL if the handle is stale.
+ */
+int fiber_future_table_discard(struct fiber_future_table *table,
+			       struct fiber_future *future);
+
+#endif // _FIBER_FUTURE_H
@@ -0,0 +1,231 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+#include <limits.h>
+
+#include "fiber.h"
+#include "fiber_graph.h"
+#include "fiber_park.h"
+#include "fiber_utils.h"
+
+// Times fiber_graph_wait re-checks before sleeping
+#define GRAPH_WAIT_SPIN 128
+
+static void graph_node_run(struct fiber_graph_node *node);
+static int graph_node_push(struct fiber_graph_node *node, uint32_t flags);
+static int graph_has_cycle(struct fiber_graph *graph);
+
+int fiber_graph_init(struct fiber_graph *graph, struct fiber_pool *pool,
+		     qsize nodes_capacity, qsize edges_capacity)
+{
+	if (graph == NULL || pool == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (nodes_capacity < 1 || edges_capacity < 0) {
+		return FBR_EINVLD_SIZE;
+	}
+	graph->pool = pool;
+	graph->nodes = pool->malloc(nodes_capacity * sizeof(*graph->nodes));
+	graph->scratch = pool->malloc(nodes_capacity * sizeof(*graph->scratch));
+	graph->edges = edges_capacity > 0 ?
+			       pool->malloc(edges_capacity *
+					    sizeof(*graph->edges)) :
+			       NULL;
+	if (graph->nodes == NULL || graph->scratch == NULL ||
+	    (edges_capacity > 0 && graph->edges == NULL)) {
+		fiber_graph_free(graph);
+		return ENOMEM;
+	}
+	graph->nodes_number = 0;
+	graph->nodes_capacity = nodes_capacity;
+	graph->edges_number = 0;
+	graph->edges_capacity = edges_capacity;
+	graph->queue_flags = 0;
+	graph->remaining = 0;
+	return 0;
+}
+
+int fiber_graph_add(struct fiber_graph *graph, struct fiber_job *job)
+{
+	if (graph == NULL || job == NULL || job->job_func == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (graph->nodes_number == graph->nodes_capacity) {
+		return FBR_EINVLD_SIZE;
+	}
+	struct fiber_graph_node *node = &graph->nodes[graph->nodes_number];
+	node->job = *job;
+	node->graph = graph;
+	node->edges = FIBER_GRAPH_NONE;
+	node->deps = 0;
+	node->pending = 0;
+	return graph->nodes_number++;
+}
+
+int fiber_graph_edge(struct fiber_graph *graph, int before, int after)
+{
+	if (graph == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (before < 0 || after < 0 || before == after ||
+	    (uint32_t)before >= graph->nodes_number ||
+	    (uint32_t)after >= graph->nodes_number ||
+	    graph->edges_number == graph->edges_capacity) {
+		return FBR_EINVLD_SIZE;
+	}
+	struct fiber_graph_edge *edge = &graph->edges[graph->edges_number];
+	edge->to = after;
+	edge->next = graph->nodes[before].edges;
+	graph->nodes[before].edges = graph->edges_number++;
+	graph->nodes[after].deps++;
+	return 0;
+}
+
+int fiber_graph_submit(struct fiber_graph *graph, uint32_t queue_flags)
+{
+	if (graph == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (graph->nodes_number == 0) {
+		return FBR_EINVLD_SIZE;
+	}
+	// The pushed jobs carry the node in job_arg, not job_data
+	if (queue_flags & FIBER_INLINE_ARG) {
+		return FBR_EINVLD_OPT;
+	}
+	assert(__atomic_load_n(&graph->remaining, __ATOMIC_ACQUIRE) == 0,
+	       "graph submitted while it is still running");
+	if (graph_has_cycle(graph)) {
+		return FBR_EGRAPH_CYCLE;
+	}
+	// job_arg of the pushed jobs is the node, which isn't the caller's
+	// to free
+	queue_flags &= ~FIBER_FREE_ARG;
+	// Successors are pushed by workers, which must never block on a full
+	// queue the other workers might be blocked on too.
+	graph->queue_flags = queue_flags & ~FIBER_BLOCK;
+	for (uint32_t i = 0; i < graph->nodes_number; ++i) {
+		graph->nodes[i].pending = graph->nodes[i].deps;
+	}
+	__atomic_store_n(&graph->remaining, graph->nodes_number,
+			 __ATOMIC_RELEASE);
+	// Roots can finish and make other nodes ready while we loop, but only
+	// nodes with deps == 0 are ever pushed here.
+	for (uint32_t i = 0; i < graph->nodes_number; ++i) {
+		struct fiber_graph_node *node = &graph->nodes[i];
+		if (node->deps == 0 &&
+		    graph_node_push(node, queue_flags | FIBER_BLOCK) != 0) {
+			// Queue is full, run it here instead of waiting
+			graph_node_run(node);
+		}
+	}
+	return 0;
+}
+
+void fiber_graph_wait(struct fiber_graph *graph)
+{
+	if (graph == NULL) {
+		return;
+	}
+	int spin = GRAPH_WAIT_SPIN;
+	uint32_t remaining;
+	while ((remaining = __atomic_load_n(&graph->remaining,
+					    __ATOMIC_ACQUIRE)) != 0) {
+		if (spin-- > 0) {
+			__fbr_cpu_relax();
+			continue;
+		}
+		fiber_park_wait(&graph->remaining, remaining, NULL);
+	}
+}
+
+void fiber_graph_free(struct fiber_graph *graph)
+{
+	if (graph == NULL || graph->pool == NULL) {
+		return;
+	}
+	if (graph->nodes != NULL)
+		graph->pool->free(graph->nodes);
+	if (graph->edges != NULL)
+		graph->pool->free(graph->edges);
+	if (graph->scratch != NULL)
+		graph->pool->free(graph->scratch);
+	graph->nodes = NULL;
+	graph->edges = NULL;
+	graph->scratch = NULL;
+}
+
+// Runs node, then the successors that couldn't be queued. Those are kept on
+// a local list instead of run recursively, so a long chain against a full
+// queue doesn't grow the stack.
+static void graph_node_run(struct fiber_graph_node *node)
+{
+	node->next = NULL;
+	while (node != NULL) {
+		struct fiber_graph *graph = node->graph;
+		node->job.job_func(node->job.job_arg);
+		struct fiber_graph_node *next = node->next;
+		for (uint32_t e = node->edges; e != FIBER_GRAPH_NONE;
+		     e = graph->edges[e].next) {
+			struct fiber_graph_node *succ =
+				&graph->nodes[graph->edges[e].to];
+			if (__atomic_sub_fetch(&succ->pending, 1,
+					       __ATOMIC_ACQ_REL) == 0 &&
+			    graph_node_push(succ, graph->queue_flags) != 0) {
+				succ->next = next;
+				next = succ;
+			}
+		}
+		// The waiter may free the graph as soon as this hits 0, so the
+		// wake must not read anything from it. It can't hit 0 while
+		// next holds unfinished nodes. Waking a stale futex is
+		// harmless.
+		uint32_t *remaining = &graph->remaining;
+		if (__atomic_sub_fetch(remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+			fiber_park_wake(remaining, INT_MAX);
+		}
+		node = next;
+	}
+}
+
+void *__fiber_graph_node_job(void *arg)
+{
+	graph_node_run((struct fiber_graph_node *)arg);
+	return NULL;
+}
+
+// Returns non zero if node couldn't be queued, the caller runs it instead
+static int graph_node_push(struct fiber_graph_node *node, uint32_t flags)
+{
+	struct fiber_job job = { .job_func = __fiber_graph_node_job,
+				 .job_arg = node };
+	jid res = fiber_job_push(node->graph->pool, &job, flags);
+	node->job.job_id = res < 0 ? job.job_id : res;
+	return res < 0;
+}
+
+// Kahn's algorithm. Returns non zero if not every node can be ordered.
+static int graph_has_cycle(struct fiber_graph *graph)
+{
+	uint32_t *ready = graph->scratch;
+	uint32_t ready_len = 0;
+	for (uint32_t i = 0; i < graph->nodes_number; ++i) {
+		graph->nodes[i].pending = graph->nodes[i].deps;
+		if (graph->nodes[i].deps == 0) {
+			ready[ready_len++] = i;
+		}
+	}
+	uint32_t visited = 0;
+	while (ready_len > 0) {
+		struct fiber_graph_node *node = &graph->nodes[ready[--ready_len]];
+		++visited;
+		for (uint32_t e = node->edges; e != FIBER_GRAPH_NONE;
+		     e = graph->edges[e].next) {
+			uint32_t to = graph->edges[e].to;
+			if (--graph->nodes[to].pending == 0) {
+				ready[ready_len++] = to;
+			}
+		}
+	}
+	return visited != graph->nodes_number;
+}
@@ -0,0 +1,114 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_GRAPH_H
+#define _FIBER_GRAPH_H
+
+#include <stdint.h>
+
+#include "fiber.h"
+#include "job_queue.h"
+
+/* Job dependency graph. Nodes are jobs, an edge a -> b means b only runs
+ * after a returned. Each node keeps a counter of unfinished predecessors.
+ * The job that brings a counter to zero pushes that successor through the
+ * pool's queue_ops, so independent branches run side by side instead of
+ * waiting on a pool wide barrier.
+ *
+ * A graph can be submitted again once fiber_graph_wait returns.
+ */
+
+struct fiber_graph_edge {
+	uint32_t to;
+	uint32_t next;
+};
+
+struct fiber_graph_node {
+	struct fiber_job job;
+	struct fiber_graph *graph;
+	// First outgoing edge or FIBER_GRAPH_NONE
+	uint32_t edges;
+	// Number of predecessors
+	uint32_t deps;
+	// Predecessors that haven't finished in the current run
+	uint32_t pending;
+	// Link in the list of nodes a worker runs itself when the queue is full
+	struct fiber_graph_node *next;
+};
+
+struct fiber_graph {
+	struct fiber_pool *pool;
+	struct fiber_graph_node *nodes;
+	struct fiber_graph_edge *edges;
+	uint32_t nodes_number;
+	uint32_t nodes_capacity;
+	uint32_t edges_number;
+	uint32_t edges_capacity;
+	uint32_t queue_flags;
+	// Nodes that haven't finished in the current run. Also the futex word
+	// fiber_graph_wait sleeps on.
+	uint32_t remaining;
+	// Used by the cycle check in submit
+	uint32_t *scratch;
+};
+
+#define FIBER_GRAPH_NONE UINT32_MAX
+
+/* Allocates room for a graph with fixed node and edge capacity using the
+ * pool's allocator.
+ * @param graph -> The graph to initialize.
+ * @param pool -> The pool the graph's jobs are pushed to.
+ * @param nodes_capacity -> Max number of nodes. Must be > 0.
+ * @param edges_capacity -> Max number of edges. May be 0.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> graph or pool are NULL.
+ * @error FBR_EINVLD_SIZE -> nodes_capacity < 1 or edges_capacity < 0.
+ * @error ENOMEM -> malloc returned a NULL pointer.
+ */
+int fiber_graph_init(struct fiber_graph *graph, struct fiber_pool *pool,
+		     qsize nodes_capacity, qsize edges_capacity);
+
+/* Adds a node. The job is copied.
+ * @returns: The node's index on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> graph, job or job_func are NULL.
+ * @error FBR_EINVLD_SIZE -> The graph is full.
+ */
+int fiber_graph_add(struct fiber_graph *graph, struct fiber_job *job);
+
+/* Makes node after wait for node before.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> graph is NULL.
+ * @error FBR_EINVLD_SIZE -> A node index is out of range, before == after,
+ * or there is no room for another edge.
+ */
+int fiber_graph_edge(struct fiber_graph *graph, int before, int after);
+
+/* Pushes every node without predecessors. Nodes whose predecessors all
+ * finished are pushed from the worker that ran the last one with
+ * FIBER_NO_BLOCK. If the queue is full, that worker runs the node itself
+ * rather than blocking.
+ * @param queue_flags -> Passed to every push. Roots are always pushed with
+ * FIBER_BLOCK. A root the queue refuses is run by the caller.
+ * FIBER_FREE_ARG is ignored.
+ * @returns: 0 on success, an error otherwise.
+ * @error FBR_ENULL_ARGS -> graph is NULL.
+ * @error FBR_EINVLD_SIZE -> The graph has no nodes.
+ * @error FBR_EGRAPH_CYCLE -> The edges form a cycle. Nothing was pushed.
+ * @error FBR_EINVLD_OPT -> queue_flags has FIBER_INLINE_ARG. Nothing was
+ * pushed.
+ */
+int fiber_graph_submit(struct fiber_graph *graph, uint32_t queue_flags);
+
+/* Blocks until every node of the submitted graph has finished. Do not call
+ * this from inside a job unless other workers can finish the graph.
+ */
+void fiber_graph_wait(struct fiber_graph *graph);
+
+/* Frees the graph's memory. The graph must not be running. */
+void fiber_graph_free(struct fiber_graph *graph);
+
+/* job_func of the jobs submit pushes. arg is the node. Never cancelled, the
+ * node's successors and fiber_graph_wait depend on it running.
+ */
+void *__fiber_graph_node_job(void *arg);
+
+#endif // _FIBER_GRAPH_H
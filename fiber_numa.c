@@ -0,0 +1,231 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber_numa.h"
+#include "fiber_utils.h"
+
+#define NUMA_NODES_MAX 1024
+#define NUMA_CPUS_MAX 8192
+#define NUMA_LIST_BUF 16384
+
+static int read_list(const char *path, char *buf, int *out, int max);
+static int single_node(struct fiber_numa_topology *topo,
+		       void *(*malloc)(size_t));
+static void cpu_set_from(cpu_set_t *set, const int *cpus, int n);
+
+int fiber_numa_discover(struct fiber_numa_topology *topo, const char *root,
+			void *(*malloc)(size_t), void (*free)(void *))
+{
+	assert(topo != NULL, "numa_discover given NULL topology");
+	assert(root != NULL, "numa_discover given NULL root");
+	topo->nodes = NULL;
+	topo->nodes_number = 0;
+	topo->cpu_node = NULL;
+	topo->cpus_max = 0;
+	char path[512];
+	int ids[NUMA_NODES_MAX];
+	char *buf = malloc(NUMA_LIST_BUF);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	snprintf(path, sizeof(path), "%s/online", root);
+	int ids_number = read_list(path, buf, ids, NUMA_NODES_MAX);
+	if (ids_number <= 0) {
+		free(buf);
+		return single_node(topo, malloc);
+	}
+	int *cpus = malloc(NUMA_CPUS_MAX * sizeof(*cpus));
+	topo->nodes = malloc(ids_number * sizeof(*topo->nodes));
+	if (cpus == NULL || topo->nodes == NULL) {
+		goto err;
+	}
+	for (int i = 0; i < ids_number; ++i) {
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", root, ids[i]);
+		int cpus_number = read_list(path, buf, cpus, NUMA_CPUS_MAX);
+		// Memory only nodes can't run workers
+		if (cpus_number <= 0) {
+			continue;
+		}
+		struct fiber_numa_node *node = &topo->nodes[topo->nodes_number];
+		node->cpus = malloc(cpus_number * sizeof(*node->cpus));
+		if (node->cpus == NULL) {
+			goto err;
+		}
+		node->id = ids[i];
+		node->cpus_number = cpus_number;
+		for (int c = 0; c < cpus_number; ++c) {
+			node->cpus[c] = cpus[c];
+			if (cpus[c] >= topo->cpus_max) {
+				topo->cpus_max = cpus[c] + 1;
+			}
+		}
+		++topo->nodes_number;
+	}
+	free(cpus);
+	cpus = NULL;
+	free(buf);
+	buf = NULL;
+	if (topo->nodes_number == 0) {
+		free(topo->nodes);
+		topo->cpus_max = 0;
+		return single_node(topo, malloc);
+	}
+	topo->cpu_node = malloc(topo->cpus_max * sizeof(*topo->cpu_node));
+	if (topo->cpu_node == NULL) {
+		goto err;
+	}
+	for (int c = 0; c < topo->cpus_max; ++c) {
+		topo->cpu_node[c] = -1;
+	}
+	for (int n = 0; n < topo->nodes_number; ++n) {
+		for (int c = 0; c < topo->nodes[n].cpus_number; ++c) {
+			topo->cpu_node[topo->nodes[n].cpus[c]] = n;
+		}
+	}
+	return 0;
+err:
+	if (cpus != NULL)
+		free(cpus);
+	if (buf != NULL)
+		free(buf);
+	fiber_numa_release(topo, free);
+	return ENOMEM;
+}
+
+void fiber_numa_release(struct fiber_numa_topology *topo,
+			void (*free)(void *))
+{
+	assert(topo != NULL, "numa_release given NULL topology");
+	if (topo->nodes != NULL) {
+		for (int i = 0; i < topo->nodes_number; ++i) {
+			if (topo->nodes[i].cpus != NULL)
+				free(topo->nodes[i].cpus);
+		}
+		free(topo->nodes);
+	}
+	if (topo->cpu_node != NULL)
+		free(topo->cpu_node);
+	topo->nodes = NULL;
+	topo->nodes_number = 0;
+	topo->cpu_node = NULL;
+	topo->cpus_max = 0;
+}
+
+int fiber_numa_parse_list(const char *list, int *out, int max)
+{
+	int count = 0;
+	const char *p = list;
+	while (*p != '\0' && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0) {
+			return -1;
+		}
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			++p;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first) {
+				return -1;
+			}
+			p = end;
+		}
+		for (long v = first; v <= last; ++v) {
+			if (count == max) {
+				return -1;
+			}
+			out[count++] = (int)v;
+		}
+		if (*p == ',') {
+			++p;
+		} else if (*p != '\0' && *p != '\n') {
+			return -1;
+		}
+	}
+	return count;
+}
+
+int fiber_numa_current_node(const struct fiber_numa_topology *topo)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= topo->cpus_max) {
+		return 0;
+	}
+	int node = topo->cpu_node[cpu];
+	return node < 0 ? 0 : node;
+}
+
+int fiber_numa_attr_set_cpus(pthread_attr_t *attr, const int *cpus, int n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	cpu_set_t set;
+	cpu_set_from(&set, cpus, n);
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+int fiber_numa_run_on(const int *cpus, int n, int (*fn)(void *arg), void *arg)
+{
+	cpu_set_t old, set;
+	pthread_t self = pthread_self();
+	int pinned = 0;
+	if (n > 0 && pthread_getaffinity_np(self, sizeof(old), &old) == 0) {
+		cpu_set_from(&set, cpus, n);
+		pinned = pthread_setaffinity_np(self, sizeof(set), &set) == 0;
+		// Get onto one of the new CPUs before fn touches anything
+		sched_yield();
+	}
+	int res = fn(arg);
+	if (pinned) {
+		pthread_setaffinity_np(self, sizeof(old), &old);
+	}
+	return res;
+}
+
+// Reads the first line of path into buf, which holds NUMA_LIST_BUF bytes.
+// Returns the number of entries read, -1 on any error
+static int read_list(const char *path, char *buf, int *out, int max)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	char *line = fgets(buf, NUMA_LIST_BUF, f);
+	fclose(f);
+	if (line == NULL) {
+		return -1;
+	}
+	return fiber_numa_parse_list(buf, out, max);
+}
+
+static int single_node(struct fiber_numa_topology *topo,
+		       void *(*malloc)(size_t))
+{
+	topo->nodes = malloc(sizeof(*topo->nodes));
+	if (topo->nodes == NULL) {
+		return ENOMEM;
+	}
+	topo->nodes[0].id = 0;
+	topo->nodes[0].cpus_number = 0;
+	topo->nodes[0].cpus = NULL;
+	topo->nodes_number = 1;
+	return 0;
+}
+
+static void cpu_set_from(cpu_set_t *set, const int *cpus, int n)
+{
+	CPU_ZERO(set);
+	for (int i = 0; i < n; ++i) {
+		if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) {
+			CPU_SET(cpus[i], set);
+		}
+	}
+}
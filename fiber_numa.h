@@ -0,0 +1,63 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_NUMA_H
+#define _FIBER_NUMA_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* NUMA topology read from sysfs so there is no libnuma dependency. Only
+ * what FIBER_OPT_NUMA needs: which CPUs belong to which node and the node
+ * of a given CPU. Linux only.
+ */
+
+#define FIBER_NUMA_SYSFS "/sys/devices/system/node"
+
+struct fiber_numa_node {
+	// Node id as named by the kernel
+	int id;
+	int cpus_number;
+	int *cpus;
+};
+
+struct fiber_numa_topology {
+	struct fiber_numa_node *nodes;
+	int nodes_number;
+	// Index into nodes for each CPU, -1 if the CPU has no node
+	int *cpu_node;
+	int cpus_max;
+};
+
+/* Reads the topology under root, normally FIBER_NUMA_SYSFS. If root can't
+ * be read, the topology is a single node without CPUs, so nothing gets
+ * pinned.
+ * @returns: 0 on success, ENOMEM if malloc failed.
+ */
+int fiber_numa_discover(struct fiber_numa_topology *topo, const char *root,
+			void *(*malloc)(size_t), void (*free)(void *));
+
+void fiber_numa_release(struct fiber_numa_topology *topo,
+			void (*free)(void *));
+
+/* Parses a kernel list like "0-3,8,10-11" into out.
+ * @returns: The number of entries, or -1 if list is malformed or has more
+ * than max entries.
+ */
+int fiber_numa_parse_list(const char *list, int *out, int max);
+
+/* @returns: The index of the node the caller is running on, 0 if unknown. */
+int fiber_numa_current_node(const struct fiber_numa_topology *topo);
+
+/* Restricts threads created with attr to cpus. Does nothing if n is 0.
+ * @returns: 0 on success, an errno otherwise.
+ */
+int fiber_numa_attr_set_cpus(pthread_attr_t *attr, const int *cpus, int n);
+
+/* Pins the caller to cpus, calls fn, then restores the caller's affinity.
+ * Memory fn touches first is then placed on the node of those CPUs.
+ * @returns: fn's return value.
+ */
+int fiber_numa_run_on(const int *cpus, int n, int (*fn)(void *arg),
+		      void *arg);
+
+#endif // _FIBER_NUMA_H
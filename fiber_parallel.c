@@ -0,0 +1,255 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <limits.h>
+#include <string.h>
+
+#include "fiber.h"
+#include "fiber_parallel.h"
+#include "fiber_park.h"
+#include "fiber_utils.h"
+
+// Times the caller re-checks before sleeping on the last chunks
+#define PARALLEL_WAIT_SPIN 128
+
+#define ALIGN_UP(n) \
+	(((n) + FIBER_CACHE_LINE - 1) & ~(size_t)(FIBER_CACHE_LINE - 1))
+
+/* Shared by the caller and its helpers. Allocated together with the helper
+ * jobs and accumulators, freed by whoever drops the last reference since
+ * helpers can still be queued after the caller returns.
+ */
+struct parallel {
+	struct fiber_pool *pool;
+	void (*for_fn)(int64_t begin, int64_t end, void *ctx);
+	void (*reduce_fn)(int64_t begin, int64_t end, void *acc, void *ctx);
+	void (*join)(void *acc, const void *other, void *ctx);
+	void *ctx;
+	const void *identity;
+	size_t size;
+	// Accumulators, slot 0 is the caller's. Each is a cache line apart.
+	char *slots;
+	size_t stride;
+	uint32_t slots_used;
+	uint32_t refs;
+	int64_t end;
+	int64_t grain;
+	int64_t participants;
+	// Set to 1 once left hits 0. The caller sleeps on it.
+	uint32_t finished;
+	__fbr_pad(__pad_finished, sizeof(uint32_t));
+	// Elements whose chunk hasn't returned
+	int64_t left;
+	__fbr_pad(__pad_left, sizeof(int64_t));
+	// Start of the unclaimed part of the range
+	int64_t next;
+};
+
+static int parallel_run(struct fiber_pool *pool, int64_t begin, int64_t end,
+			int64_t grain, struct parallel *proto, void *result);
+static int parallel_claim(struct parallel *p, int64_t *begin, int64_t *end);
+static void parallel_chunk(struct parallel *p, int64_t begin, int64_t end,
+			   void *acc);
+static void *parallel_slot_take(struct parallel *p);
+static void parallel_put(struct parallel *p);
+
+int fiber_parallel_for(struct fiber_pool *pool, int64_t begin, int64_t end,
+		       int64_t grain,
+		       void (*fn)(int64_t begin, int64_t end, void *ctx),
+		       void *ctx)
+{
+	if (pool == NULL || fn == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (end < begin || grain < 0) {
+		return FBR_EINVLD_SIZE;
+	}
+	struct parallel proto = { .for_fn = fn, .ctx = ctx };
+	return parallel_run(pool, begin, end, grain, &proto, NULL);
+}
+
+int fiber_parallel_reduce(struct fiber_pool *pool, int64_t begin, int64_t end,
+			  int64_t grain, size_t size, const void *identity,
+			  void (*fn)(int64_t begin, int64_t end, void *acc,
+				     void *ctx),
+			  void (*join)(void *acc, const void *other,
+				       void *ctx),
+			  void *ctx, void *result)
+{
+	if (pool == NULL || identity == NULL || fn == NULL || join == NULL ||
+	    result == NULL) {
+		return FBR_ENULL_ARGS;
+	}
+	if (end < begin || grain < 0 || size == 0) {
+		return FBR_EINVLD_SIZE;
+	}
+	struct parallel proto = { .reduce_fn = fn,
+				  .join = join,
+				  .ctx = ctx,
+				  .identity = identity,
+				  .size = size };
+	return parallel_run(pool, begin, end, grain, &proto, result);
+}
+
+// proto holds the functions, ctx and accumulator size to run the range with
+
+static int parallel_run(struct fiber_pool *pool, int64_t begin, int64_t end,
+			int64_t grain, struct parallel *proto, void *result)
+{
+	int64_t n = end - begin;
+	tpsize threads = __atomic_load_n(&pool->threads_number,
+					 __ATOMIC_RELAXED);
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (grain == 0) {
+		grain = n / (((int64_t)threads + 1) * FIBER_PARALLEL_CHUNKS);
+		if (grain < 1) {
+			grain = 1;
+		}
+	}
+	int64_t chunks = n / grain + (n % grain != 0);
+	int64_t helpers = chunks - 1 < threads ? chunks - 1 : threads;
+	size_t stride = ALIGN_UP(proto->size);
+	size_t jobs_off = ALIGN_UP(sizeof(struct parallel));
+	size_t slots_off =
+		ALIGN_UP(jobs_off + (size_t)helpers * sizeof(struct fiber_job));
+	struct parallel *p = NULL;
+	if (helpers > 0) {
+		size_t total = slots_off;
+		if (proto->reduce_fn != NULL) {
+			total += (size_t)(helpers + 1) * stride;
+		}
+		p = pool->malloc(total);
+	}
+	if (p == NULL) {
+		// Not worth splitting or no memory, the caller does it all
+		if (proto->reduce_fn != NULL) {
+			memmove(result, proto->identity, proto->size);
+			if (n > 0) {
+				proto->reduce_fn(begin, end, result, proto->ctx);
+			}
+		} else if (n > 0) {
+			proto->for_fn(begin, end, proto->ctx);
+		}
+		return 0;
+	}
+	*p = *proto;
+	p->pool = pool;
+	p->slots = proto->reduce_fn != NULL ? (char *)p + slots_off : NULL;
+	p->stride = stride;
+	p->slots_used = 0;
+	p->refs = (uint32_t)helpers + 1;
+	p->end = end;
+	p->grain = grain;
+	p->participants = helpers + 1;
+	p->finished = 0;
+	p->left = n;
+	p->next = begin;
+	void *acc = p->slots != NULL ? parallel_slot_take(p) : NULL;
+
+	struct fiber_job *jobs = (struct fiber_job *)((char *)p + jobs_off);
+	memset(jobs, 0, helpers * sizeof(*jobs));
+	for (int64_t i = 0; i < helpers; ++i) {
+		jobs[i].job_func = __fiber_parallel_helper;
+		jobs[i].job_arg = p;
+	}
+	qsize pushed = fiber_job_push_n(pool, jobs, (qsize)helpers,
+					FIBER_NO_BLOCK);
+	if (pushed < 0) {
+		pushed = 0;
+	}
+	if (pushed < helpers) {
+		// We still hold our own reference, this can't reach 0
+		__atomic_sub_fetch(&p->refs, (uint32_t)(helpers - pushed),
+				   __ATOMIC_RELAXED);
+	}
+
+	int64_t b, e;
+	while (parallel_claim(p, &b, &e)) {
+		parallel_chunk(p, b, e, acc);
+	}
+	int spin = PARALLEL_WAIT_SPIN;
+	while (__atomic_load_n(&p->finished, __ATOMIC_ACQUIRE) == 0) {
+		if (spin-- > 0) {
+			__fbr_cpu_relax();
+			continue;
+		}
+		fiber_park_wait(&p->finished, 0, NULL);
+	}
+	if (p->slots != NULL) {
+		memcpy(result, acc, p->size);
+		for (uint32_t i = 1; i < p->slots_used; ++i) {
+			p->join(result, p->slots + i * p->stride, p->ctx);
+		}
+	}
+	parallel_put(p);
+	return 0;
+}
+
+// Guided chunking, each claim takes its share of what is left
+static int parallel_claim(struct parallel *p, int64_t *begin, int64_t *end)
+{
+	int64_t b = __atomic_load_n(&p->next, __ATOMIC_RELAXED);
+	int64_t e;
+	do {
+		if (b >= p->end) {
+			return 0;
+		}
+		int64_t left = p->end - b;
+		int64_t n = left / p->participants;
+		if (n < p->grain) {
+			n = p->grain;
+		}
+		e = n < left ? b + n : p->end;
+	} while (!__atomic_compare_exchange_n(&p->next, &b, e, 1,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	*begin = b;
+	*end = e;
+	return 1;
+}
+
+static void parallel_chunk(struct parallel *p, int64_t begin, int64_t end,
+			   void *acc)
+{
+	if (p->reduce_fn != NULL) {
+		p->reduce_fn(begin, end, acc, p->ctx);
+	} else {
+		p->for_fn(begin, end, p->ctx);
+	}
+	if (__atomic_sub_fetch(&p->left, end - begin, __ATOMIC_ACQ_REL) == 0) {
+		__atomic_store_n(&p->finished, 1, __ATOMIC_RELEASE);
+		fiber_park_wake(&p->finished, INT_MAX);
+	}
+}
+
+// Only taken once a chunk is claimed, so the caller can't be joining yet
+static void *parallel_slot_take(struct parallel *p)
+{
+	uint32_t i = __atomic_fetch_add(&p->slots_used, 1, __ATOMIC_RELAXED);
+	void *acc = p->slots + i * p->stride;
+	memcpy(acc, p->identity, p->size);
+	return acc;
+}
+
+void *__fiber_parallel_helper(void *arg)
+{
+	struct parallel *p = (struct parallel *)arg;
+	void *acc = NULL;
+	int64_t b, e;
+	while (parallel_claim(p, &b, &e)) {
+		if (p->slots != NULL && acc == NULL) {
+			acc = parallel_slot_take(p);
+		}
+		parallel_chunk(p, b, e, acc);
+	}
+	parallel_put(p);
+	return NULL;
+}
+
+static void parallel_put(struct parallel *p)
+{
+	if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		p->pool->free(p);
+	}
+}
@@ -0,0 +1,64 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_PARALLEL_H
+#define _FIBER_PARALLEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fiber.h"
+
+/* Data parallel loops over [begin, end). The range is handed out in guided
+ * chunks: each claim takes the remaining count split between participants,
+ * but never less than grain, so early chunks are large and the tail is
+ * balanced. One helper job per worker is pushed in a single batch and the
+ * caller claims chunks too, so it only sleeps while the last chunks taken
+ * by helpers finish.
+ *
+ * Helpers that are still queued when the range runs out find nothing to do
+ * and return. They never hold up the caller, so both functions can be
+ * called from inside a job, even on a single worker pool.
+ */
+
+// Used when grain is 0. Aims for this many chunks per participant.
+#define FIBER_PARALLEL_CHUNKS 8
+
+/* Calls fn(chunk_begin, chunk_end, ctx) over disjoint chunks covering
+ * [begin, end). Chunks may run concurrently and in any order.
+ * @param grain -> The smallest chunk handed out. 0 picks one from the
+ * range and pool size.
+ * @returns: 0 once every chunk has returned, an error otherwise.
+ * @error FBR_ENULL_ARGS -> pool or fn are NULL.
+ * @error FBR_EINVLD_SIZE -> end < begin or grain < 0.
+ * If the helpers can't be allocated or the queue is full, the caller runs
+ * the range by itself.
+ */
+int fiber_parallel_for(struct fiber_pool *pool, int64_t begin, int64_t end,
+		       int64_t grain,
+		       void (*fn)(int64_t begin, int64_t end, void *ctx),
+		       void *ctx);
+
+/* Same as fiber_parallel_for, but each participant folds its chunks into a
+ * private accumulator of size bytes that starts as a copy of identity.
+ * fn(chunk_begin, chunk_end, acc, ctx) adds a chunk to acc. The
+ * accumulators are combined into result with join(acc, other, ctx), which
+ * must be associative and commutative since chunk assignment isn't fixed.
+ * @param result -> size bytes. Holds identity joined with every
+ * accumulator on success. May alias identity.
+ * @error FBR_ENULL_ARGS -> pool, identity, fn, join or result are NULL.
+ * @error FBR_EINVLD_SIZE -> end < begin, grain < 0 or size is 0.
+ */
+int fiber_parallel_reduce(struct fiber_pool *pool, int64_t begin, int64_t end,
+			  int64_t grain, size_t size, const void *identity,
+			  void (*fn)(int64_t begin, int64_t end, void *acc,
+				     void *ctx),
+			  void (*join)(void *acc, const void *other,
+				       void *ctx),
+			  void *ctx, void *result);
+
+/* job_func of the helpers pushed to the pool. Never cancelled, each helper
+ * holds a reference on the shared state it drops when it returns.
+ */
+void *__fiber_parallel_helper(void *arg);
+
+#endif // _FIBER_PARALLEL_H
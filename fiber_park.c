@@ -0,0 +1,134 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "fiber_park.h"
+#include "fiber_utils.h"
+
+static inline qsize sem_try_take(struct fiber_park_sem *sem, qsize n);
+
+void fiber_park_sem_init(struct fiber_park_sem *sem, uint32_t value,
+			 uint32_t spin)
+{
+	assert(sem != NULL, "park_sem_init given NULL sem");
+	sem->count = value;
+	sem->sleepers = 0;
+	sem->spin = spin;
+}
+
+qsize fiber_park_sem_take(struct fiber_park_sem *sem, qsize n, int block)
+{
+	assert(sem != NULL, "park_sem_take given NULL sem");
+	assert(n > 0, "park_sem_take given bad n");
+	qsize taken = sem_try_take(sem, n);
+	if (likely(taken > 0) || !block) {
+		return taken;
+	}
+	for (uint32_t i = 0; i < sem->spin; ++i) {
+		__fbr_cpu_relax();
+		if ((taken = sem_try_take(sem, n)) > 0) {
+			return taken;
+		}
+	}
+	__atomic_add_fetch(&sem->sleepers, 1, __ATOMIC_SEQ_CST);
+	// Pairs with the fence in post. Either post sees us as a sleeper or
+	// we see its count and the kernel refuses to put us to sleep.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while ((taken = sem_try_take(sem, n)) == 0) {
+		fiber_park_wait(&sem->count, 0, NULL);
+	}
+	__atomic_sub_fetch(&sem->sleepers, 1, __ATOMIC_RELAXED);
+	return taken;
+}
+
+void fiber_park_sem_post(struct fiber_park_sem *sem, qsize n)
+{
+	assert(sem != NULL, "park_sem_post given NULL sem");
+	__atomic_add_fetch(&sem->count, n, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (likely(__atomic_load_n(&sem->sleepers, __ATOMIC_RELAXED) == 0)) {
+		return;
+	}
+	fiber_park_wake(&sem->count, n);
+}
+
+uint32_t fiber_park_sem_value(struct fiber_park_sem *sem)
+{
+	return __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+}
+
+void fiber_park_event_init(struct fiber_park_event *ev, uint32_t spin)
+{
+	assert(ev != NULL, "park_event_init given NULL event");
+	ev->seq = 0;
+	ev->sleepers = 0;
+	ev->spin = spin;
+}
+
+uint32_t fiber_park_event_prepare(struct fiber_park_event *ev)
+{
+	__atomic_add_fetch(&ev->sleepers, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+}
+
+int fiber_park_event_wait(struct fiber_park_event *ev, uint32_t key,
+			  const struct timespec *timeout)
+{
+	int res = fiber_park_wait(&ev->seq, key, timeout);
+	__atomic_sub_fetch(&ev->sleepers, 1, __ATOMIC_RELAXED);
+	return res;
+}
+
+void fiber_park_event_cancel(struct fiber_park_event *ev)
+{
+	__atomic_sub_fetch(&ev->sleepers, 1, __ATOMIC_RELAXED);
+}
+
+void fiber_park_event_notify(struct fiber_park_event *ev, int n)
+{
+	// Pairs with the fence in prepare. The caller's condition change must
+	// happen before this call.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (likely(__atomic_load_n(&ev->sleepers, __ATOMIC_RELAXED) == 0)) {
+		return;
+	}
+	__atomic_add_fetch(&ev->seq, 1, __ATOMIC_RELEASE);
+	fiber_park_wake(&ev->seq, n);
+}
+
+int fiber_park_wait(uint32_t *word, uint32_t expected,
+		    const struct timespec *timeout)
+{
+	long res = syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected,
+			   timeout, NULL, 0);
+	if (res == -1 && errno == ETIMEDOUT) {
+		return ETIMEDOUT;
+	}
+	// Woken, spurious wake, EINTR or *word != expected. Caller re-checks.
+	return 0;
+}
+
+void fiber_park_wake(uint32_t *word, int n)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline qsize sem_try_take(struct fiber_park_sem *sem, qsize n)
+{
+	uint32_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while (count > 0) {
+		uint32_t take = count < (uint32_t)n ? count : (uint32_t)n;
+		if (__atomic_compare_exchange_n(&sem->count, &count,
+						count - take, 1,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			return take;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_PARK_H
+#define _FIBER_PARK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "job_queue.h"
+
+/* Parking layer used in place of sem_t. Waiters spin for a while, then
+ * register as sleepers and futex wait. Posters only make a syscall when a
+ * sleeper is registered, so the uncontended path never enters the kernel.
+ * Linux only.
+ */
+
+// Used when fiber_pool_init_options.park_spin is 0
+#define FIBER_PARK_SPIN_DEFAULT 128
+
+/* Counting semaphore */
+struct fiber_park_sem {
+	uint32_t count;
+	uint32_t sleepers;
+	uint32_t spin;
+};
+
+/* Event count for conditions that aren't a simple counter. A waiter reads a
+ * key, re-checks its condition and only sleeps if no notify happened since
+ * the key was read.
+ */
+struct fiber_park_event {
+	uint32_t seq;
+	uint32_t sleepers;
+	uint32_t spin;
+};
+
+void fiber_park_sem_init(struct fiber_park_sem *sem, uint32_t value,
+			 uint32_t spin);
+
+/* Takes up to n from the semaphore. If block is non zero, waits until at
+ * least one can be taken.
+ * @returns: The amount taken. 0 only if block is 0.
+ */
+qsize fiber_park_sem_take(struct fiber_park_sem *sem, qsize n, int block);
+
+/* Adds n to the semaphore and wakes up to n sleepers. */
+void fiber_park_sem_post(struct fiber_park_sem *sem, qsize n);
+
+uint32_t fiber_park_sem_value(struct fiber_park_sem *sem);
+
+void fiber_park_event_init(struct fiber_park_event *ev, uint32_t spin);
+
+/* Registers the caller as a sleeper and returns the key to wait on. Must be
+ * followed by fiber_park_event_wait or fiber_park_event_cancel.
+ */
+uint32_t fiber_park_event_prepare(struct fiber_park_event *ev);
+
+/* Sleeps until a notify happens after key was read. Unregisters the caller.
+ * @param timeout -> Relative timeout or NULL to wait forever.
+ * @returns: 0 if woken or the key is stale, ETIMEDOUT if timeout expired.
+ */
+int fiber_park_event_wait(struct fiber_park_event *ev, uint32_t key,
+			  const struct timespec *timeout);
+
+/* Unregisters the caller after the condition was met post prepare. */
+void fiber_park_event_cancel(struct fiber_park_event *ev);
+
+/* Wakes up to n sleepers. Free when nobody is sleeping. */
+void fiber_park_event_notify(struct fiber_park_event *ev, int n);
+
+/* Raw futex wrappers. wait sleeps while *word == expected. It isn't a
+ * cancellation point, whoever needs a sleeper gone must wake it.
+ */
+int fiber_park_wait(uint32_t *word, uint32_t expected,
+		    const struct timespec *timeout);
+void fiber_park_wake(uint32_t *word, int n);
+
+#endif // _FIBER_PARK_H
@@ -0,0 +1,225 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+
+#include "fiber_slab.h"
+#include "fiber_utils.h"
+
+// Chunks are linked through this much room at their start
+#define CHUNK_HEADER sizeof(struct fiber_slab_block)
+
+static inline uint32_t size_class(size_t size)
+{
+	if (size <= FIBER_SLAB_MIN) {
+		return 0;
+	}
+	return 64 - __builtin_clzll((unsigned long long)size - 1) -
+	       __builtin_ctz(FIBER_SLAB_MIN);
+}
+
+static inline size_t block_size(uint32_t cls)
+{
+	return sizeof(struct fiber_slab_block) +
+	       ((size_t)FIBER_SLAB_MIN << cls);
+}
+
+// Pushes the list first..last onto the shared list of cls
+static void shared_put(struct fiber_slab *slab, uint32_t cls,
+		       struct fiber_slab_block *first,
+		       struct fiber_slab_block *last)
+{
+	struct fiber_slab_class *c = &slab->classes[cls];
+	__fbr_spin_lock(&c->lock);
+	last->next = c->free;
+	c->free = first;
+	__fbr_spin_unlock(&c->lock);
+}
+
+/* Takes up to n blocks from the shared list of cls.
+ * @returns: The blocks as a NULL terminated list, NULL if there were none.
+ */
+static struct fiber_slab_block *shared_take(struct fiber_slab *slab,
+					    uint32_t cls, uint32_t n,
+					    uint32_t *taken)
+{
+	struct fiber_slab_class *c = &slab->classes[cls];
+	__fbr_spin_lock(&c->lock);
+	struct fiber_slab_block *first = c->free;
+	struct fiber_slab_block *last = NULL;
+	uint32_t i = 0;
+	for (struct fiber_slab_block *b = first; b != NULL && i < n;
+	     b = b->next) {
+		last = b;
+		++i;
+	}
+	if (last != NULL) {
+		c->free = last->next;
+		last->next = NULL;
+	}
+	__fbr_spin_unlock(&c->lock);
+	*taken = i;
+	return first;
+}
+
+/* Carves a new chunk into blocks of cls. Up to n are returned to the caller
+ * and the rest go on the shared list.
+ * @returns: The blocks as a NULL terminated list, NULL if malloc failed.
+ */
+static struct fiber_slab_block *chunk_carve(struct fiber_slab *slab,
+					    uint32_t cls, uint32_t n,
+					    uint32_t *taken)
+{
+	char *chunk = slab->malloc(FIBER_SLAB_CHUNK);
+	if (chunk == NULL) {
+		*taken = 0;
+		return NULL;
+	}
+	__fbr_spin_lock(&slab->chunks_lock);
+	*(void **)chunk = slab->chunks;
+	slab->chunks = chunk;
+	__fbr_spin_unlock(&slab->chunks_lock);
+	size_t size = block_size(cls);
+	uint32_t blocks = (FIBER_SLAB_CHUNK - CHUNK_HEADER) / size;
+	assert(blocks > 0, "FIBER_SLAB_CHUNK is smaller than a block");
+	struct fiber_slab_block *first = NULL;
+	struct fiber_slab_block *tail = NULL;
+	for (uint32_t i = blocks; i > 0; --i) {
+		struct fiber_slab_block *b =
+			(struct fiber_slab_block *)(chunk + CHUNK_HEADER +
+						    (i - 1) * size);
+		b->cls = cls;
+		b->next = first;
+		first = b;
+		if (tail == NULL) {
+			tail = b;
+		}
+	}
+	if (blocks <= n) {
+		*taken = blocks;
+		return first;
+	}
+	struct fiber_slab_block *last = first;
+	for (uint32_t i = 1; i < n; ++i) {
+		last = last->next;
+	}
+	struct fiber_slab_block *rest = last->next;
+	last->next = NULL;
+	shared_put(slab, cls, rest, tail);
+	*taken = n;
+	return first;
+}
+
+void fiber_slab_init(struct fiber_slab *slab, void *(*malloc)(size_t),
+		     void (*free)(void *))
+{
+	assert(slab != NULL, "slab_init given NULL slab");
+	for (int i = 0; i < FIBER_SLAB_CLASSES; ++i) {
+		slab->classes[i].lock = 0;
+		slab->classes[i].free = NULL;
+	}
+	slab->chunks_lock = 0;
+	slab->chunks = NULL;
+	slab->malloc = malloc;
+	slab->free = free;
+}
+
+void *fiber_slab_alloc(struct fiber_slab *slab, struct fiber_slab_cache *cache,
+		       size_t size)
+{
+	assert(slab != NULL, "slab_alloc given NULL slab");
+	struct fiber_slab_block *b;
+	if (unlikely(size > FIBER_SLAB_MAX)) {
+		b = slab->malloc(sizeof(*b) + size);
+		if (b == NULL) {
+			return NULL;
+		}
+		b->cls = FIBER_SLAB_LARGE;
+		return b + 1;
+	}
+	uint32_t cls = size_class(size);
+	uint32_t want = cache != NULL ? FIBER_SLAB_BATCH : 1;
+	if (cache != NULL && cache->free[cls] != NULL) {
+		b = cache->free[cls];
+		cache->free[cls] = b->next;
+		--cache->number[cls];
+		return b + 1;
+	}
+	uint32_t taken;
+	b = shared_take(slab, cls, want, &taken);
+	if (b == NULL) {
+		b = chunk_carve(slab, cls, want, &taken);
+		if (b == NULL) {
+			return NULL;
+		}
+	}
+	if (cache != NULL) {
+		cache->free[cls] = b->next;
+		cache->number[cls] = taken - 1;
+	}
+	return b + 1;
+}
+
+void fiber_slab_release(struct fiber_slab *slab,
+			struct fiber_slab_cache *cache, void *ptr)
+{
+	assert(slab != NULL, "slab_release given NULL slab");
+	assert(ptr != NULL, "slab_release given NULL ptr");
+	struct fiber_slab_block *b = (struct fiber_slab_block *)ptr - 1;
+	uint32_t cls = (uint32_t)b->cls;
+	if (unlikely(cls == FIBER_SLAB_LARGE)) {
+		slab->free(b);
+		return;
+	}
+	assert(cls < FIBER_SLAB_CLASSES, "slab_release given a bad block");
+	if (cache == NULL) {
+		shared_put(slab, cls, b, b);
+		return;
+	}
+	b->next = cache->free[cls];
+	cache->free[cls] = b;
+	if (++cache->number[cls] < FIBER_SLAB_BATCH * 2) {
+		return;
+	}
+	// Keep one batch, hand the other back for other threads
+	struct fiber_slab_block *last = b;
+	for (uint32_t i = 1; i < FIBER_SLAB_BATCH; ++i) {
+		last = last->next;
+	}
+	cache->free[cls] = last->next;
+	cache->number[cls] -= FIBER_SLAB_BATCH;
+	shared_put(slab, cls, b, last);
+}
+
+void fiber_slab_cache_flush(struct fiber_slab *slab,
+			    struct fiber_slab_cache *cache)
+{
+	assert(slab != NULL && cache != NULL, "slab_cache_flush given NULL");
+	for (uint32_t cls = 0; cls < FIBER_SLAB_CLASSES; ++cls) {
+		struct fiber_slab_block *first = cache->free[cls];
+		if (first == NULL) {
+			continue;
+		}
+		struct fiber_slab_block *last = first;
+		while (last->next != NULL) {
+			last = last->next;
+		}
+		shared_put(slab, cls, first, last);
+		cache->free[cls] = NULL;
+		cache->number[cls] = 0;
+	}
+}
+
+void fiber_slab_free(struct fiber_slab *slab)
+{
+	assert(slab != NULL, "slab_free given NULL slab");
+	void *chunk = slab->chunks;
+	while (chunk != NULL) {
+		void *next = *(void **)chunk;
+		slab->free(chunk);
+		chunk = next;
+	}
+	slab->chunks = NULL;
+	for (int i = 0; i < FIBER_SLAB_CLASSES; ++i) {
+		slab->classes[i].free = NULL;
+	}
+}
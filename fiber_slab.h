@@ -0,0 +1,79 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_SLAB_H
+#define _FIBER_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size class allocator behind fiber_job_arg_alloc. Class c hands out
+ * FIBER_SLAB_MIN << c byte blocks carved from FIBER_SLAB_CHUNK sized chunks
+ * of the pool's malloc. A worker keeps freed blocks in its own cache and
+ * trades them with the class's shared list FIBER_SLAB_BATCH at a time, so
+ * most calls on a worker take no lock. Other threads use the shared lists.
+ * Chunks are only given back when the slab is freed. Requests larger than
+ * FIBER_SLAB_MAX go straight to malloc.
+ */
+
+#define FIBER_SLAB_CLASSES 8
+#define FIBER_SLAB_MIN 16
+#define FIBER_SLAB_MAX (FIBER_SLAB_MIN << (FIBER_SLAB_CLASSES - 1))
+#ifndef FIBER_SLAB_CHUNK
+#define FIBER_SLAB_CHUNK (64 * 1024)
+#endif
+// Blocks moved between a worker's cache and a shared list at once
+#define FIBER_SLAB_BATCH 32
+// Class of a block that came from malloc
+#define FIBER_SLAB_LARGE FIBER_SLAB_CLASSES
+
+// Sits in front of every block and keeps the payload 16 byte aligned
+struct fiber_slab_block {
+	// Only used while the block is free
+	struct fiber_slab_block *next;
+	uint64_t cls;
+};
+
+struct fiber_slab_class {
+	uint32_t lock;
+	struct fiber_slab_block *free;
+};
+
+struct fiber_slab {
+	struct fiber_slab_class classes[FIBER_SLAB_CLASSES];
+	// Every chunk, linked through their first word
+	uint32_t chunks_lock;
+	void *chunks;
+	void *(*malloc)(size_t);
+	void (*free)(void *);
+};
+
+// Owned by one worker
+struct fiber_slab_cache {
+	struct fiber_slab_block *free[FIBER_SLAB_CLASSES];
+	uint32_t number[FIBER_SLAB_CLASSES];
+};
+
+void fiber_slab_init(struct fiber_slab *slab, void *(*malloc)(size_t),
+		     void (*free)(void *));
+
+/* @param cache -> The calling worker's cache, NULL on other threads.
+ * @returns: A 16 byte aligned block of at least size bytes, NULL if malloc
+ * failed.
+ */
+void *fiber_slab_alloc(struct fiber_slab *slab, struct fiber_slab_cache *cache,
+		       size_t size);
+
+/* Gives back a block from fiber_slab_alloc. cache is the calling worker's,
+ * which doesn't have to be the one the block came from.
+ */
+void fiber_slab_release(struct fiber_slab *slab,
+			struct fiber_slab_cache *cache, void *ptr);
+
+/* Moves every block in cache to the shared lists. */
+void fiber_slab_cache_flush(struct fiber_slab *slab,
+			    struct fiber_slab_cache *cache);
+
+/* Frees every chunk. Blocks still handed out become invalid. */
+void fiber_slab_free(struct fiber_slab *slab);
+
+#endif // _FIBER_SLAB_H
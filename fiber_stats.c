@@ -0,0 +1,114 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <time.h>
+
+#include "fiber_stats.h"
+
+uint64_t __fiber_stats_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void __fiber_stats_merge(struct fiber_worker_stats *to,
+			 const struct fiber_worker_stats *from)
+{
+	__atomic_add_fetch(&to->jobs, from->jobs, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->steals, from->steals, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->idle_ns, from->idle_ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->pushes, from->pushes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->pushes_full, from->pushes_full,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->jobs_inline, from->jobs_inline,
+			   __ATOMIC_RELAXED);
+}
+
+// ns per tick in 32.32 fixed point
+uint64_t __fiber_tick_mult = 1ull << 32;
+
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+
+static void calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	// Long enough that the clock_gettime overhead is noise
+	uint64_t ns0 = __fiber_stats_now_ns();
+	uint64_t ticks0 = __fiber_ticks();
+	uint64_t ns1;
+	do {
+		ns1 = __fiber_stats_now_ns();
+	} while (ns1 - ns0 < 2000000);
+	uint64_t ticks = __fiber_ticks() - ticks0;
+	if (ticks > 0) {
+		__fiber_tick_mult = ((ns1 - ns0) << 32) / ticks;
+	}
+#endif
+}
+
+void __fiber_ticks_calibrate(void)
+{
+	pthread_once(&calibrate_once, calibrate);
+}
+
+void fiber_hist_merge(struct fiber_hist *to, const struct fiber_hist *from)
+{
+	for (int i = 0; i < FIBER_HIST_BUCKETS; ++i) {
+		uint64_t n = __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+		if (n > 0) {
+			__atomic_add_fetch(&to->buckets[i], n, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_add_fetch(&to->count,
+			   __atomic_load_n(&from->count, __ATOMIC_RELAXED),
+			   __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	uint64_t curr = __atomic_load_n(&to->max, __ATOMIC_RELAXED);
+	while (max > curr &&
+	       !__atomic_compare_exchange_n(&to->max, &curr, max, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+// Highest value that maps to bucket i
+static uint64_t bucket_top(int i)
+{
+	if (i < FIBER_HIST_SUB) {
+		return (uint64_t)i;
+	}
+	int k = i - FIBER_HIST_SUB;
+	int exp = k / FIBER_HIST_SUB + FIBER_HIST_SUB_BITS;
+	uint64_t width = 1ull << (exp - FIBER_HIST_SUB_BITS);
+	uint64_t low = (1ull << exp) | ((uint64_t)(k % FIBER_HIST_SUB) * width);
+	return low + width - 1;
+}
+
+uint64_t fiber_hist_percentile(const struct fiber_hist *hist,
+			       double percentile)
+{
+	assert(hist != NULL, "hist_percentile given NULL hist");
+	if (hist->count == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->count);
+	if (rank == 0) {
+		rank = 1;
+	} else if (rank > hist->count) {
+		rank = hist->count;
+	}
+	uint64_t seen = 0;
+	for (int i = 0; i < FIBER_HIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			if (i == FIBER_HIST_BUCKETS - 1) {
+				// Holds everything past the range
+				return hist->max;
+			}
+			uint64_t top = bucket_top(i);
+			return top < hist->max ? top : hist->max;
+		}
+	}
+	return hist->max;
+}
@@ -0,0 +1,133 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_STATS_H
+#define _FIBER_STATS_H
+
+#include <stdint.h>
+
+#include "fiber_utils.h"
+
+#define FIBER_STATS_COUNTERS 6
+
+/* Counters one worker keeps for itself. Only the owner writes them, so
+ * updates are plain relaxed stores and readers never see a torn value. The
+ * padding keeps another worker's fields off this line.
+ */
+struct fiber_worker_stats {
+	// Jobs run to completion, wake jobs included. A task that yields or
+	// sleeps counts once, on the worker it finishes on.
+	uint64_t jobs;
+	// Jobs taken from another worker's deque or another node's queue
+	uint64_t steals;
+	// Time spent waiting for a job, spinning or asleep
+	uint64_t idle_ns;
+	// Successful fiber_job_push* calls made from jobs on this worker
+	uint64_t pushes;
+	// fiber_job_push* calls refused because the queue was full
+	uint64_t pushes_full;
+	// Jobs this worker ran while blocked in a FIBER_CALLER_RUNS push
+	uint64_t jobs_inline;
+	__fbr_pad(__pad, FIBER_STATS_COUNTERS * sizeof(uint64_t));
+};
+
+#ifndef FIBER_NO_STATS
+// Owner only
+#define __fbr_stat_add(stats, field, n)                                     \
+	__atomic_store_n(&(stats)->field, (stats)->field + (uint64_t)(n), \
+			 __ATOMIC_RELAXED)
+// Any thread
+#define __fbr_stat_add_shared(stats, field, n) \
+	__atomic_add_fetch(&(stats)->field, (uint64_t)(n), __ATOMIC_RELAXED)
+#else
+#define __fbr_stat_add(stats, field, n)
+#define __fbr_stat_add_shared(stats, field, n)
+#endif
+
+/* Monotonic time for idle_ns */
+uint64_t __fiber_stats_now_ns(void);
+
+/* Log-linear histogram in nanoseconds, like HdrHistogram. Values below
+ * FIBER_HIST_SUB are exact. Above that, every power of two is split into
+ * FIBER_HIST_SUB buckets, so a bucket is within 1/FIBER_HIST_SUB (~6%) of
+ * the values in it. Values past 2^FIBER_HIST_EXP_MAX ns (~39 hours) land in
+ * the last bucket.
+ */
+#define FIBER_HIST_SUB_BITS 4
+#define FIBER_HIST_SUB (1 << FIBER_HIST_SUB_BITS)
+#define FIBER_HIST_EXP_MAX 47
+#define FIBER_HIST_BUCKETS \
+	(FIBER_HIST_SUB * (FIBER_HIST_EXP_MAX - FIBER_HIST_SUB_BITS + 2))
+
+struct fiber_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[FIBER_HIST_BUCKETS];
+};
+
+/* Adds every value of from into to with atomic adds, so from may be
+ * recorded into and to merged into by other threads at the same time.
+ */
+void fiber_hist_merge(struct fiber_hist *to, const struct fiber_hist *from);
+
+/* @param percentile -> In [0, 100], e.g. 99.9.
+ * @returns: The highest value in the bucket the percentile falls in, capped
+ * at hist->max. 0 if hist is empty.
+ */
+uint64_t fiber_hist_percentile(const struct fiber_hist *hist,
+			       double percentile);
+
+static inline int __fiber_hist_index(uint64_t value)
+{
+	if (value < FIBER_HIST_SUB) {
+		return (int)value;
+	}
+	int exp = 63 - __builtin_clzll(value);
+	if (exp > FIBER_HIST_EXP_MAX) {
+		return FIBER_HIST_BUCKETS - 1;
+	}
+	int sub = (int)(value >> (exp - FIBER_HIST_SUB_BITS)) &
+		  (FIBER_HIST_SUB - 1);
+	return FIBER_HIST_SUB + (exp - FIBER_HIST_SUB_BITS) * FIBER_HIST_SUB +
+	       sub;
+}
+
+/* Owner only, same as the worker counters */
+static inline void __fiber_hist_record(struct fiber_hist *hist, uint64_t value)
+{
+	int i = __fiber_hist_index(value);
+	__atomic_store_n(&hist->buckets[i], hist->buckets[i] + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+	if (value > hist->max) {
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	}
+}
+
+/* Timestamps for FIBER_OPT_LATENCY. On x86 this is the TSC, elsewhere
+ * CLOCK_MONOTONIC. __fiber_ticks_calibrate must run before
+ * __fiber_ticks_to_ns is used.
+ */
+extern uint64_t __fiber_tick_mult;
+
+static inline uint64_t __fiber_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return __fiber_stats_now_ns();
+#endif
+}
+
+static inline uint64_t __fiber_ticks_to_ns(uint64_t ticks)
+{
+	return (uint64_t)(((unsigned __int128)ticks * __fiber_tick_mult) >>
+			  32);
+}
+
+void __fiber_ticks_calibrate(void);
+
+/* Adds every counter of from into to with atomic adds */
+void __fiber_stats_merge(struct fiber_worker_stats *to,
+			 const struct fiber_worker_stats *from);
+
+#endif // _FIBER_STATS_H
@@ -0,0 +1,270 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include "fiber.h"
+#include "fiber_sync.h"
+#include "fiber_utils.h"
+
+static inline void wait_list_push(struct fiber_wait_list *list,
+				  struct fiber_waiter *w)
+{
+	w->next = NULL;
+	if (list->tail == NULL) {
+		list->head = w;
+	} else {
+		list->tail->next = w;
+	}
+	list->tail = w;
+}
+
+static inline struct fiber_waiter *wait_list_pop(struct fiber_wait_list *list)
+{
+	struct fiber_waiter *w = list->head;
+	if (w != NULL) {
+		list->head = w->next;
+		if (list->head == NULL) {
+			list->tail = NULL;
+		}
+	}
+	return w;
+}
+
+// Wakes every waiter taken off a list, the lock must already be released
+static void wake_all(struct fiber_waiter *w)
+{
+	while (w != NULL) {
+		// w is gone once woken
+		struct fiber_waiter *next = w->next;
+		__fiber_waiter_wake(w);
+		w = next;
+	}
+}
+
+void fiber_mutex_init(struct fiber_mutex *mutex)
+{
+	assert(mutex != NULL, "mutex_init given NULL mutex");
+	mutex->lock = 0;
+	mutex->locked = 0;
+	mutex->waiters.head = NULL;
+	mutex->waiters.tail = NULL;
+}
+
+int fiber_mutex_lock(struct fiber_mutex *mutex)
+{
+	if (unlikely(mutex == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&mutex->lock);
+	if (!mutex->locked) {
+		mutex->locked = 1;
+		__fbr_spin_unlock(&mutex->lock);
+		return 0;
+	}
+	struct fiber_waiter w;
+	wait_list_push(&mutex->waiters, &w);
+	// Unlock hands us the mutex, it stays locked
+	__fiber_waiter_park(&w, &mutex->lock, NULL);
+	return 0;
+}
+
+int fiber_mutex_trylock(struct fiber_mutex *mutex)
+{
+	if (unlikely(mutex == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&mutex->lock);
+	int res = mutex->locked ? EAGAIN : 0;
+	mutex->locked = 1;
+	__fbr_spin_unlock(&mutex->lock);
+	return res;
+}
+
+// Unlocks mutex or hands it to the next waiter, which is returned for the
+// caller to wake.
+static struct fiber_waiter *mutex_release(struct fiber_mutex *mutex)
+{
+	__fbr_spin_lock(&mutex->lock);
+	assert(mutex->locked, "unlocked a mutex that wasn't locked");
+	struct fiber_waiter *w = wait_list_pop(&mutex->waiters);
+	if (w == NULL) {
+		mutex->locked = 0;
+	}
+	__fbr_spin_unlock(&mutex->lock);
+	return w;
+}
+
+int fiber_mutex_unlock(struct fiber_mutex *mutex)
+{
+	if (unlikely(mutex == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	struct fiber_waiter *w = mutex_release(mutex);
+	if (w != NULL) {
+		__fiber_waiter_wake(w);
+	}
+	return 0;
+}
+
+void fiber_cond_init(struct fiber_cond *cond)
+{
+	assert(cond != NULL, "cond_init given NULL cond");
+	cond->lock = 0;
+	cond->waiters.head = NULL;
+	cond->waiters.tail = NULL;
+}
+
+int fiber_cond_wait(struct fiber_cond *cond, struct fiber_mutex *mutex)
+{
+	if (unlikely(cond == NULL || mutex == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	struct fiber_waiter w;
+	__fbr_spin_lock(&cond->lock);
+	wait_list_push(&cond->waiters, &w);
+	// A signal needs cond->lock, so it can't slip in before we park. The
+	// mutex's next owner is woken once cond->lock is released.
+	struct fiber_waiter *next = mutex_release(mutex);
+	__fiber_waiter_park(&w, &cond->lock, next);
+	return fiber_mutex_lock(mutex);
+}
+
+int fiber_cond_signal(struct fiber_cond *cond)
+{
+	if (unlikely(cond == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&cond->lock);
+	struct fiber_waiter *w = wait_list_pop(&cond->waiters);
+	__fbr_spin_unlock(&cond->lock);
+	if (w != NULL) {
+		__fiber_waiter_wake(w);
+	}
+	return 0;
+}
+
+int fiber_cond_broadcast(struct fiber_cond *cond)
+{
+	if (unlikely(cond == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&cond->lock);
+	struct fiber_waiter *w = cond->waiters.head;
+	cond->waiters.head = NULL;
+	cond->waiters.tail = NULL;
+	__fbr_spin_unlock(&cond->lock);
+	wake_all(w);
+	return 0;
+}
+
+void fiber_semaphore_init(struct fiber_semaphore *sem, uint32_t count)
+{
+	assert(sem != NULL, "semaphore_init given NULL sem");
+	sem->lock = 0;
+	sem->count = count;
+	sem->waiters.head = NULL;
+	sem->waiters.tail = NULL;
+}
+
+int fiber_semaphore_wait(struct fiber_semaphore *sem)
+{
+	if (unlikely(sem == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&sem->lock);
+	if (sem->count > 0) {
+		--sem->count;
+		__fbr_spin_unlock(&sem->lock);
+		return 0;
+	}
+	struct fiber_waiter w;
+	wait_list_push(&sem->waiters, &w);
+	// Post hands us the unit without touching count
+	__fiber_waiter_park(&w, &sem->lock, NULL);
+	return 0;
+}
+
+int fiber_semaphore_trywait(struct fiber_semaphore *sem)
+{
+	if (unlikely(sem == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&sem->lock);
+	int res = EAGAIN;
+	if (sem->count > 0) {
+		--sem->count;
+		res = 0;
+	}
+	__fbr_spin_unlock(&sem->lock);
+	return res;
+}
+
+int fiber_semaphore_post(struct fiber_semaphore *sem)
+{
+	if (unlikely(sem == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&sem->lock);
+	struct fiber_waiter *w = wait_list_pop(&sem->waiters);
+	if (w == NULL) {
+		++sem->count;
+	}
+	__fbr_spin_unlock(&sem->lock);
+	if (w != NULL) {
+		__fiber_waiter_wake(w);
+	}
+	return 0;
+}
+
+void fiber_waitgroup_init(struct fiber_waitgroup *wg)
+{
+	assert(wg != NULL, "waitgroup_init given NULL wg");
+	wg->lock = 0;
+	wg->count = 0;
+	wg->waiters.head = NULL;
+	wg->waiters.tail = NULL;
+}
+
+int fiber_waitgroup_add(struct fiber_waitgroup *wg, int64_t n)
+{
+	if (unlikely(wg == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&wg->lock);
+	if (wg->count + n < 0) {
+		__fbr_spin_unlock(&wg->lock);
+		return FBR_EINVLD_SIZE;
+	}
+	wg->count += n;
+	struct fiber_waiter *w = NULL;
+	if (wg->count == 0) {
+		w = wg->waiters.head;
+		wg->waiters.head = NULL;
+		wg->waiters.tail = NULL;
+	}
+	__fbr_spin_unlock(&wg->lock);
+	wake_all(w);
+	return 0;
+}
+
+int fiber_waitgroup_done(struct fiber_waitgroup *wg)
+{
+	return fiber_waitgroup_add(wg, -1);
+}
+
+int fiber_waitgroup_wait(struct fiber_waitgroup *wg)
+{
+	if (unlikely(wg == NULL)) {
+		return FBR_ENULL_ARGS;
+	}
+	__fbr_spin_lock(&wg->lock);
+	if (wg->count == 0) {
+		__fbr_spin_unlock(&wg->lock);
+		return 0;
+	}
+	struct fiber_waiter w;
+	wait_list_push(&wg->waiters, &w);
+	__fiber_waiter_park(&w, &wg->lock, NULL);
+	return 0;
+}
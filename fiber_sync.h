@@ -0,0 +1,101 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_SYNC_H
+#define _FIBER_SYNC_H
+
+#include <stdint.h>
+
+/* Synchronization for jobs on a FIBER_OPT_STACKFUL pool. A job that would
+ * block is suspended and its worker moves on to other queued jobs. The job
+ * is queued again when it is woken. Any other caller, including a job on a
+ * pool without FIBER_OPT_STACKFUL, blocks its thread on a futex instead.
+ *
+ * Every primitive is zero initialized, so = { 0 } or the *_init function
+ * both work. Each keeps a short spinlock over its state and a FIFO of
+ * waiters. Ownership and semaphore units are handed straight to the
+ * waiter that is woken, so a waiter can't be starved by new arrivals.
+ */
+
+struct fiber_task;
+struct fiber_pool;
+
+// One suspended caller. Lives on the caller's stack.
+struct fiber_waiter {
+	struct fiber_waiter *next;
+	// NULL when the caller is a thread
+	struct fiber_task *task;
+	struct fiber_pool *pool;
+	// Futex word for thread callers
+	uint32_t woken;
+};
+
+struct fiber_wait_list {
+	struct fiber_waiter *head;
+	struct fiber_waiter *tail;
+};
+
+struct fiber_mutex {
+	uint32_t lock;
+	uint32_t locked;
+	struct fiber_wait_list waiters;
+};
+
+struct fiber_cond {
+	uint32_t lock;
+	struct fiber_wait_list waiters;
+};
+
+struct fiber_semaphore {
+	uint32_t lock;
+	uint32_t count;
+	struct fiber_wait_list waiters;
+};
+
+struct fiber_waitgroup {
+	uint32_t lock;
+	int64_t count;
+	struct fiber_wait_list waiters;
+};
+
+/* All functions below return 0 on success, FBR_ENULL_ARGS if given NULL. */
+
+void fiber_mutex_init(struct fiber_mutex *mutex);
+int fiber_mutex_lock(struct fiber_mutex *mutex);
+/* @returns: 0 if the mutex was taken, EAGAIN if it is held. */
+int fiber_mutex_trylock(struct fiber_mutex *mutex);
+int fiber_mutex_unlock(struct fiber_mutex *mutex);
+
+void fiber_cond_init(struct fiber_cond *cond);
+/* Unlocks mutex, waits for a signal and locks mutex again before
+ * returning. Like pthread_cond_wait, re-check the condition in a loop.
+ */
+int fiber_cond_wait(struct fiber_cond *cond, struct fiber_mutex *mutex);
+int fiber_cond_signal(struct fiber_cond *cond);
+int fiber_cond_broadcast(struct fiber_cond *cond);
+
+void fiber_semaphore_init(struct fiber_semaphore *sem, uint32_t count);
+int fiber_semaphore_wait(struct fiber_semaphore *sem);
+/* @returns: 0 if a unit was taken, EAGAIN if count is 0. */
+int fiber_semaphore_trywait(struct fiber_semaphore *sem);
+int fiber_semaphore_post(struct fiber_semaphore *sem);
+
+void fiber_waitgroup_init(struct fiber_waitgroup *wg);
+/* Adds n (may be negative) to the count. Waiters are woken once it is 0.
+ * @error FBR_EINVLD_SIZE -> The count would drop below 0.
+ */
+int fiber_waitgroup_add(struct fiber_waitgroup *wg, int64_t n);
+/* Same as fiber_waitgroup_add(wg, -1) */
+int fiber_waitgroup_done(struct fiber_waitgroup *wg);
+/* Returns once the count is 0. */
+int fiber_waitgroup_wait(struct fiber_waitgroup *wg);
+
+/* Implemented in fiber.c. Suspends the caller on w. lock is held on entry
+ * and released once the caller can safely be woken. wake, if not NULL, is
+ * woken after lock is released.
+ */
+void __fiber_waiter_park(struct fiber_waiter *w, uint32_t *lock,
+			 struct fiber_waiter *wake);
+/* Makes w's caller runnable again. w may be gone once this returns. */
+void __fiber_waiter_wake(struct fiber_waiter *w);
+
+#endif // _FIBER_SYNC_H
@@ -0,0 +1,305 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fiber_task.h"
+#include "fiber_utils.h"
+
+#define TASK_ALIGN 64
+
+struct fiber_task *fiber_task_alloc(size_t stack_size)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t top = (sizeof(struct fiber_task) + TASK_ALIGN - 1) &
+		     ~(size_t)(TASK_ALIGN - 1);
+	size_t size = (stack_size + top + page - 1) & ~(page - 1);
+	size += page; // Guard
+	char *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	if (mprotect(map, page, PROT_NONE) != 0) {
+		munmap(map, size);
+		return NULL;
+	}
+	struct fiber_task *task = (struct fiber_task *)(map + size - top);
+	memset(task, 0, sizeof(*task));
+	task->map = map;
+	task->map_size = size;
+	return task;
+}
+
+void fiber_task_free(struct fiber_task *task)
+{
+	assert(task != NULL, "task_free given NULL task");
+	munmap(task->map, task->map_size);
+}
+
+#ifdef FIBER_TASK_ASM
+
+// Starts a task. The first switch returns here with entry and arg in callee
+// saved registers. Return address is undefined so unwinders stop here.
+void __fiber_task_start(void);
+
+#if defined(__x86_64__)
+
+/* Saves rbp, rbx, r12-r15, MXCSR and the x87 control word on the stack,
+ * then swaps stacks.
+ */
+__asm__(".text\n"
+	".globl fiber_task_switch\n"
+	".type fiber_task_switch,@function\n"
+	".p2align 4\n"
+	"fiber_task_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size fiber_task_switch,.-fiber_task_switch\n"
+	".globl __fiber_task_start\n"
+	".hidden __fiber_task_start\n"
+	".type __fiber_task_start,@function\n"
+	".p2align 4\n"
+	"__fiber_task_start:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined rip\n"
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+	"	.cfi_endproc\n"
+	".size __fiber_task_start,.-__fiber_task_start\n");
+
+// Default MXCSR and x87 control word
+#define CTX_FPU_INIT (0x1f80ull | (0x037full << 32))
+
+void fiber_task_prepare(struct fiber_task *task, void (*entry)(void *),
+			void *arg)
+{
+	uintptr_t top = (uintptr_t)task & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)top;
+	// __fiber_task_start runs with a 16 byte aligned rsp, so the call
+	// leaves entry with the alignment the ABI expects.
+	*--sp = 0;
+	*--sp = 0;
+	*--sp = (uint64_t)(uintptr_t)__fiber_task_start;
+	*--sp = 0; // rbp
+	*--sp = 0; // rbx
+	*--sp = (uint64_t)(uintptr_t)arg; // r12
+	*--sp = (uint64_t)(uintptr_t)entry; // r13
+	*--sp = 0; // r14
+	*--sp = 0; // r15
+	*--sp = CTX_FPU_INIT;
+	task->ctx.sp = sp;
+	task->state = FIBER_TASK_RUN;
+}
+
+#elif defined(__aarch64__)
+
+/* Saves x19-x30 and d8-d15 in a 176 byte frame, then swaps stacks. */
+__asm__(".text\n"
+	".globl fiber_task_switch\n"
+	".type fiber_task_switch,%function\n"
+	".p2align 4\n"
+	"fiber_task_switch:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	ldr x9, [x1]\n"
+	"	mov sp, x9\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size fiber_task_switch,.-fiber_task_switch\n"
+	".globl __fiber_task_start\n"
+	".hidden __fiber_task_start\n"
+	".type __fiber_task_start,%function\n"
+	".p2align 4\n"
+	"__fiber_task_start:\n"
+	"	.cfi_startproc\n"
+	"	.cfi_undefined x30\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+	"	.cfi_endproc\n"
+	".size __fiber_task_start,.-__fiber_task_start\n");
+
+void fiber_task_prepare(struct fiber_task *task, void (*entry)(void *),
+			void *arg)
+{
+	uintptr_t top = (uintptr_t)task & ~(uintptr_t)15;
+	uint64_t *frame = (uint64_t *)(top - 176);
+	memset(frame, 0, 176);
+	frame[0] = (uint64_t)(uintptr_t)arg; // x19
+	frame[1] = (uint64_t)(uintptr_t)entry; // x20
+	frame[11] = (uint64_t)(uintptr_t)__fiber_task_start; // x30
+	task->ctx.sp = frame;
+	task->state = FIBER_TASK_RUN;
+}
+
+#endif
+
+#else // ucontext
+
+// makecontext only passes ints, so the pointers are split in two
+static void task_start(unsigned entry_hi, unsigned entry_lo, unsigned arg_hi,
+		       unsigned arg_lo)
+{
+	void (*entry)(void *) =
+		(void (*)(void *))(((uintptr_t)entry_hi << 32) | entry_lo);
+	void *arg = (void *)(((uintptr_t)arg_hi << 32) | arg_lo);
+	entry(arg);
+}
+
+void fiber_task_prepare(struct fiber_task *task, void (*entry)(void *),
+			void *arg)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	getcontext(&task->ctx.uc);
+	task->ctx.uc.uc_stack.ss_sp = (char *)task->map + page;
+	task->ctx.uc.uc_stack.ss_size =
+		(size_t)((char *)task - (char *)task->map) - page;
+	task->ctx.uc.uc_link = NULL;
+	uint64_t e = (uint64_t)(uintptr_t)entry;
+	uint64_t a = (uint64_t)(uintptr_t)arg;
+	makecontext(&task->ctx.uc, (void (*)(void))task_start, 4,
+		    (unsigned)(e >> 32), (unsigned)e, (unsigned)(a >> 32),
+		    (unsigned)a);
+	task->state = FIBER_TASK_RUN;
+}
+
+void fiber_task_switch(struct fiber_ctx *from, struct fiber_ctx *to)
+{
+	swapcontext(&from->uc, &to->uc);
+}
+
+#endif // FIBER_TASK_ASM
+
+void fiber_task_sleep_thread(const struct timespec *duration)
+{
+	struct timespec left = *duration;
+	while (nanosleep(&left, &left) != 0 && errno == EINTR) {
+	}
+}
+
+int fiber_sleep_heap_push(struct fiber_sleep_heap *heap,
+			  struct fiber_task *task, void *(*malloc)(size_t),
+			  void (*free)(void *))
+{
+	assert(heap != NULL && task != NULL, "sleep_heap_push given NULL");
+	if (heap->length == heap->capacity) {
+		size_t capacity = heap->capacity > 0 ? heap->capacity * 2 : 64;
+		struct fiber_task **tasks = malloc(capacity * sizeof(*tasks));
+		if (tasks == NULL) {
+			return ENOMEM;
+		}
+		if (heap->tasks != NULL) {
+			memcpy(tasks, heap->tasks,
+			       heap->length * sizeof(*tasks));
+			free(heap->tasks);
+		}
+		heap->tasks = tasks;
+		heap->capacity = capacity;
+	}
+	size_t i = heap->length++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (heap->tasks[parent]->wake_ns <= task->wake_ns) {
+			break;
+		}
+		heap->tasks[i] = heap->tasks[parent];
+		i = parent;
+	}
+	heap->tasks[i] = task;
+	return 0;
+}
+
+struct fiber_task *fiber_sleep_heap_pop_due(struct fiber_sleep_heap *heap,
+					    uint64_t now)
+{
+	if (heap->length == 0 || heap->tasks[0]->wake_ns > now) {
+		return NULL;
+	}
+	struct fiber_task *due = heap->tasks[0];
+	struct fiber_task *last = heap->tasks[--heap->length];
+	size_t i = 0;
+	while (1) {
+		size_t child = i * 2 + 1;
+		if (child >= heap->length) {
+			break;
+		}
+		if (child + 1 < heap->length &&
+		    heap->tasks[child + 1]->wake_ns <
+			    heap->tasks[child]->wake_ns) {
+			++child;
+		}
+		if (last->wake_ns <= heap->tasks[child]->wake_ns) {
+			break;
+		}
+		heap->tasks[i] = heap->tasks[child];
+		i = child;
+	}
+	if (heap->length > 0) {
+		heap->tasks[i] = last;
+	}
+	return due;
+}
+
+uint64_t fiber_sleep_heap_next(const struct fiber_sleep_heap *heap)
+{
+	return heap->length > 0 ? heap->tasks[0]->wake_ns : 0;
+}
+
+void fiber_sleep_heap_free(struct fiber_sleep_heap *heap,
+			   void (*free)(void *))
+{
+	for (size_t i = 0; i < heap->length; ++i) {
+		fiber_task_free(heap->tasks[i]);
+	}
+	if (heap->tasks != NULL) {
+		free(heap->tasks);
+	}
+	heap->tasks = NULL;
+	heap->length = 0;
+	heap->capacity = 0;
+}
@@ -0,0 +1,108 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_TASK_H
+#define _FIBER_TASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "job_queue.h"
+
+/* Stackful tasks for FIBER_OPT_STACKFUL. A task runs one job on its own
+ * stack so the job can switch back to the worker in the middle and be
+ * resumed later, possibly by another worker. The switch is hand written for
+ * x86-64 and aarch64 and uses ucontext elsewhere or when FIBER_UCONTEXT is
+ * defined.
+ */
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(FIBER_UCONTEXT)
+#define FIBER_TASK_ASM
+// Callee saved registers live on the stack, only the stack pointer is kept
+struct fiber_ctx {
+	void *sp;
+};
+#else
+#include <ucontext.h>
+struct fiber_ctx {
+	ucontext_t uc;
+};
+#endif
+
+// Used when fiber_pool_init_options.task_stack_size is 0
+#define FIBER_TASK_STACK_DEFAULT (64 * 1024)
+// Finished tasks a worker keeps for reuse before unmapping them
+#define FIBER_TASK_CACHE 16
+
+// What a task asked for when it last switched back to its worker
+#define FIBER_TASK_RUN 0
+#define FIBER_TASK_YIELD 1
+#define FIBER_TASK_SLEEP 2
+#define FIBER_TASK_DONE 3
+#define FIBER_TASK_PARK 4
+
+struct fiber_task {
+	struct fiber_ctx ctx;
+	// The worker's context to switch back to. Set each time it's resumed.
+	struct fiber_ctx *sched;
+	struct fiber_job job;
+	int state;
+	// CLOCK_MONOTONIC deadline for FIBER_TASK_SLEEP
+	uint64_t wake_ns;
+	// Released by the worker once a FIBER_TASK_PARK task is switched out
+	uint32_t *park_lock;
+	// Woken by the worker once park_lock is released, may be NULL
+	struct fiber_waiter *park_wake;
+	// Worker cache and ready list link
+	struct fiber_task *next;
+	// The whole mapping, guard page included
+	void *map;
+	size_t map_size;
+};
+
+/* Maps a stack of stack_size (rounded up to pages) with a guard page below
+ * it. The task itself sits at the top of the same mapping.
+ * @returns: The task or NULL if mmap failed.
+ */
+struct fiber_task *fiber_task_alloc(size_t stack_size);
+
+void fiber_task_free(struct fiber_task *task);
+
+/* Resets task's context so the next switch to it calls entry(arg) at the
+ * top of its stack. entry must never return, it has to switch away.
+ */
+void fiber_task_prepare(struct fiber_task *task, void (*entry)(void *),
+			void *arg);
+
+/* Saves the current context into from and resumes to. Returns when
+ * something switches back to from.
+ */
+void fiber_task_switch(struct fiber_ctx *from, struct fiber_ctx *to);
+
+/* nanosleep for callers that aren't on a task, resumed after signals. */
+void fiber_task_sleep_thread(const struct timespec *duration);
+
+/* Min heap of sleeping tasks ordered by wake_ns. Not thread safe. */
+struct fiber_sleep_heap {
+	struct fiber_task **tasks;
+	size_t length;
+	size_t capacity;
+};
+
+/* @returns: 0 on success, ENOMEM if growing the heap failed. */
+int fiber_sleep_heap_push(struct fiber_sleep_heap *heap,
+			  struct fiber_task *task, void *(*malloc)(size_t),
+			  void (*free)(void *));
+
+/* @returns: The earliest task if its wake_ns is <= now, NULL otherwise. */
+struct fiber_task *fiber_sleep_heap_pop_due(struct fiber_sleep_heap *heap,
+					    uint64_t now);
+
+/* @returns: The earliest wake_ns, 0 if the heap is empty. */
+uint64_t fiber_sleep_heap_next(const struct fiber_sleep_heap *heap);
+
+/* Frees the heap and every task still in it. */
+void fiber_sleep_heap_free(struct fiber_sleep_heap *heap,
+			   void (*free)(void *));
+
+#endif // _FIBER_TASK_H
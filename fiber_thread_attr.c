@@ -0,0 +1,129 @@
+/* See LICENSE file for copyright and license details. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include "fiber_numa.h"
+#include "fiber_thread_attr.h"
+#include "fiber_utils.h"
+
+static int allowed_cpus(const cpu_set_t *allowed, void *(*malloc)(size_t),
+			int **out, int *out_number);
+
+int fiber_thread_attr_cpus(int affinity, const int *cpus, int cpus_number,
+			   const char *root, void *(*malloc)(size_t),
+			   void (*free)(void *), int **out, int *out_number)
+{
+	assert(out != NULL && out_number != NULL,
+	       "thread_attr_cpus given NULL out");
+	*out = NULL;
+	*out_number = 0;
+	if (affinity == FIBER_AFFINITY_NONE) {
+		return 0;
+	}
+	if (affinity == FIBER_AFFINITY_EXPLICIT) {
+		*out = malloc(cpus_number * sizeof(**out));
+		if (*out == NULL) {
+			return ENOMEM;
+		}
+		for (int i = 0; i < cpus_number; ++i) {
+			(*out)[i] = cpus[i];
+		}
+		*out_number = cpus_number;
+		return 0;
+	}
+	cpu_set_t allowed;
+	if (cpus != NULL) {
+		CPU_ZERO(&allowed);
+		for (int i = 0; i < cpus_number; ++i) {
+			if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+				CPU_SET(cpus[i], &allowed);
+		}
+	} else if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (int i = 0; i < CPU_SETSIZE; ++i) {
+			CPU_SET(i, &allowed);
+		}
+	}
+	struct fiber_numa_topology topo;
+	int error_code = fiber_numa_discover(&topo, root, malloc, free);
+	if (error_code != 0) {
+		return error_code;
+	}
+	int total = 0;
+	int widest = 0;
+	for (int n = 0; n < topo.nodes_number; ++n) {
+		total += topo.nodes[n].cpus_number;
+		if (topo.nodes[n].cpus_number > widest) {
+			widest = topo.nodes[n].cpus_number;
+		}
+	}
+	int *list = total > 0 ? malloc(total * sizeof(*list)) : NULL;
+	if (total > 0 && list == NULL) {
+		fiber_numa_release(&topo, free);
+		return ENOMEM;
+	}
+	int count = 0;
+	if (affinity == FIBER_AFFINITY_COMPACT) {
+		for (int n = 0; n < topo.nodes_number; ++n) {
+			for (int c = 0; c < topo.nodes[n].cpus_number; ++c) {
+				int cpu = topo.nodes[n].cpus[c];
+				if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+					list[count++] = cpu;
+			}
+		}
+	} else {
+		for (int c = 0; c < widest; ++c) {
+			for (int n = 0; n < topo.nodes_number; ++n) {
+				if (c >= topo.nodes[n].cpus_number)
+					continue;
+				int cpu = topo.nodes[n].cpus[c];
+				if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+					list[count++] = cpu;
+			}
+		}
+	}
+	fiber_numa_release(&topo, free);
+	if (count > 0) {
+		*out = list;
+		*out_number = count;
+		return 0;
+	}
+	if (list != NULL) {
+		free(list);
+	}
+	// No node information we can use, take the allowed CPUs in order
+	return allowed_cpus(&allowed, malloc, out, out_number);
+}
+
+int fiber_thread_attr_name(pthread_t thread, const char *prefix,
+			   unsigned index)
+{
+	char name[FIBER_THREAD_NAME_MAX];
+	snprintf(name, sizeof(name), "%s-%u", prefix, index);
+	return pthread_setname_np(thread, name);
+}
+
+static int allowed_cpus(const cpu_set_t *allowed, void *(*malloc)(size_t),
+			int **out, int *out_number)
+{
+	int count = CPU_COUNT(allowed);
+	if (count == 0) {
+		return 0;
+	}
+	*out = malloc(count * sizeof(**out));
+	if (*out == NULL) {
+		return ENOMEM;
+	}
+	int i = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE && i < count; ++cpu) {
+		if (CPU_ISSET(cpu, allowed)) {
+			(*out)[i++] = cpu;
+		}
+	}
+	*out_number = count;
+	return 0;
+}
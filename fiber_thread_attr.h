@@ -0,0 +1,47 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_THREAD_ATTR_H
+#define _FIBER_THREAD_ATTR_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Helpers for the attributes of worker threads: which CPU each one is
+ * pinned to and its name. Linux only.
+ */
+
+/* Values for fiber_thread_options.affinity */
+// Workers float freely (or over their node's CPUs with FIBER_OPT_NUMA)
+#define FIBER_AFFINITY_NONE 0
+// Worker n is pinned to the nth allowed CPU, filling one node before the
+// next so neighbouring workers share caches.
+#define FIBER_AFFINITY_COMPACT 1
+// Consecutive workers are pinned to CPUs on different nodes, then to the
+// next CPU of each node.
+#define FIBER_AFFINITY_SCATTER 2
+// Worker n is pinned to cpus[n % cpus_number]
+#define FIBER_AFFINITY_EXPLICIT 3
+
+// Linux limits thread names to 15 characters
+#define FIBER_THREAD_NAME_MAX 16
+#define FIBER_THREAD_NAME_DEFAULT "fiber"
+
+/* Builds the list of CPUs workers are pinned to, in the order workers take
+ * them. For compact and scatter, only the CPUs in cpus are used, or the ones
+ * the process may run on if cpus is NULL, and nodes are read from the sysfs
+ * tree at root. For explicit, cpus is copied as is.
+ * @param out -> Set to a list allocated with malloc, NULL if there are none.
+ * @param out_number -> Set to the length of out.
+ * @returns: 0 on success, ENOMEM if malloc failed.
+ */
+int fiber_thread_attr_cpus(int affinity, const int *cpus, int cpus_number,
+			   const char *root, void *(*malloc)(size_t),
+			   void (*free)(void *), int **out, int *out_number);
+
+/* Names thread "<prefix>-<index>", truncated to fit FIBER_THREAD_NAME_MAX.
+ * @returns: 0 on success, an errno otherwise.
+ */
+int fiber_thread_attr_name(pthread_t thread, const char *prefix,
+			   unsigned index);
+
+#endif // _FIBER_THREAD_ATTR_H
@@ -0,0 +1,266 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+#include <string.h>
+
+#include "fiber_timer.h"
+#include "fiber_utils.h"
+
+#define HASH_BUCKETS_MIN 64
+#define WHEEL_BITS (FIBER_TIMER_LEVELS * FIBER_TIMER_LEVEL_BITS)
+// Low bits of a tick that are zero when level's cursor moves
+#define LEVEL_MASK(level) \
+	((1ull << ((level) * FIBER_TIMER_LEVEL_BITS)) - 1)
+
+static inline size_t hash_index(const struct fiber_timer_wheel *wheel, jid id);
+static void hash_grow(struct fiber_timer_wheel *wheel,
+		      void *(*malloc)(size_t), void (*free)(void *));
+static void hash_remove(struct fiber_timer_wheel *wheel,
+			struct fiber_timer *timer);
+static inline void list_push(struct fiber_timer **head,
+			     struct fiber_timer *timer);
+static inline void list_unlink(struct fiber_timer_wheel *wheel,
+			       struct fiber_timer *timer);
+static void place(struct fiber_timer_wheel *wheel, struct fiber_timer *timer);
+static void cascade(struct fiber_timer_wheel *wheel, struct fiber_timer *list);
+
+int fiber_timer_wheel_init(struct fiber_timer_wheel *wheel, uint64_t now,
+			   void *(*malloc)(size_t))
+{
+	assert(wheel != NULL, "timer_wheel_init given NULL wheel");
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->hash = malloc(HASH_BUCKETS_MIN * sizeof(*wheel->hash));
+	if (wheel->hash == NULL) {
+		return ENOMEM;
+	}
+	memset(wheel->hash, 0, HASH_BUCKETS_MIN * sizeof(*wheel->hash));
+	wheel->hash_mask = HASH_BUCKETS_MIN - 1;
+	wheel->now = now;
+	return 0;
+}
+
+void fiber_timer_wheel_free(struct fiber_timer_wheel *wheel,
+			    void (*free)(void *))
+{
+	if (wheel->hash == NULL) {
+		return;
+	}
+	// Every timer is in exactly one hash chain
+	for (size_t i = 0; i <= wheel->hash_mask; ++i) {
+		struct fiber_timer *timer = wheel->hash[i];
+		while (timer != NULL) {
+			struct fiber_timer *next = timer->hash_next;
+			free(timer);
+			timer = next;
+		}
+	}
+	free(wheel->hash);
+	memset(wheel, 0, sizeof(*wheel));
+}
+
+void fiber_timer_wheel_add(struct fiber_timer_wheel *wheel,
+			   struct fiber_timer *timer, void *(*malloc)(size_t),
+			   void (*free)(void *))
+{
+	assert(wheel != NULL && timer != NULL, "timer_wheel_add given NULL");
+	if (wheel->count > wheel->hash_mask) {
+		hash_grow(wheel, malloc, free);
+	}
+	size_t i = hash_index(wheel, timer->job.job_id);
+	timer->hash_next = wheel->hash[i];
+	wheel->hash[i] = timer;
+	++wheel->count;
+	// The slot for now was already fired
+	if (timer->expire <= wheel->now) {
+		timer->expire = wheel->now + 1;
+	}
+	place(wheel, timer);
+}
+
+struct fiber_timer *fiber_timer_wheel_remove(struct fiber_timer_wheel *wheel,
+					     jid id)
+{
+	struct fiber_timer *timer = wheel->hash[hash_index(wheel, id)];
+	while (timer != NULL && timer->job.job_id != id) {
+		timer = timer->hash_next;
+	}
+	if (timer == NULL) {
+		return NULL;
+	}
+	hash_remove(wheel, timer);
+	list_unlink(wheel, timer);
+	return timer;
+}
+
+struct fiber_timer *fiber_timer_wheel_advance(struct fiber_timer_wheel *wheel,
+					      uint64_t to)
+{
+	struct fiber_timer *due = NULL;
+	while (wheel->now < to) {
+		uint64_t next = fiber_timer_wheel_next(wheel);
+		if (next == 0 || next > to) {
+			// Nothing in between, skipping empty slots is free
+			wheel->now = to;
+			break;
+		}
+		uint64_t now = next;
+		wheel->now = now;
+		if ((now & ((1ull << WHEEL_BITS) - 1)) == 0) {
+			struct fiber_timer *list = wheel->overflow;
+			wheel->overflow = NULL;
+			cascade(wheel, list);
+		}
+		// Top down, a higher level can refill a lower one's slot
+		for (int level = FIBER_TIMER_LEVELS - 1; level > 0; --level) {
+			if ((now & LEVEL_MASK(level)) != 0) {
+				continue;
+			}
+			int s = (now >> (level * FIBER_TIMER_LEVEL_BITS)) &
+				(FIBER_TIMER_SLOTS - 1);
+			struct fiber_timer *list = wheel->slots[level][s];
+			wheel->slots[level][s] = NULL;
+			wheel->occupied[level] &= ~(1ull << s);
+			cascade(wheel, list);
+		}
+		int s = now & (FIBER_TIMER_SLOTS - 1);
+		struct fiber_timer *timer = wheel->slots[0][s];
+		wheel->slots[0][s] = NULL;
+		wheel->occupied[0] &= ~(1ull << s);
+		while (timer != NULL) {
+			struct fiber_timer *next_timer = timer->next;
+			hash_remove(wheel, timer);
+			timer->pprev = NULL;
+			timer->next = due;
+			due = timer;
+			timer = next_timer;
+		}
+	}
+	return due;
+}
+
+uint64_t fiber_timer_wheel_next(const struct fiber_timer_wheel *wheel)
+{
+	uint64_t now = wheel->now;
+	// Lower levels come first in time, the first hit is the earliest
+	for (int level = 0; level < FIBER_TIMER_LEVELS; ++level) {
+		int shift = level * FIBER_TIMER_LEVEL_BITS;
+		int cur = (now >> shift) & (FIBER_TIMER_SLOTS - 1);
+		if (cur == FIBER_TIMER_SLOTS - 1) {
+			continue;
+		}
+		// A timer's slot is always past the cursor of its level
+		uint64_t ahead = wheel->occupied[level] & (~0ull << (cur + 1));
+		if (ahead == 0) {
+			continue;
+		}
+		uint64_t s = (uint64_t)__builtin_ctzll(ahead);
+		uint64_t base = now & ~LEVEL_MASK(level + 1);
+		return base | (s << shift);
+	}
+	if (wheel->overflow != NULL) {
+		return ((now >> WHEEL_BITS) + 1) << WHEEL_BITS;
+	}
+	return 0;
+}
+
+static size_t hash_index(const struct fiber_timer_wheel *wheel, jid id)
+{
+	// Fibonacci hashing, ids are mostly sequential
+	uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ull;
+	return (size_t)(h >> 32) & wheel->hash_mask;
+}
+
+static void hash_grow(struct fiber_timer_wheel *wheel,
+		      void *(*malloc)(size_t), void (*free)(void *))
+{
+	size_t buckets = (wheel->hash_mask + 1) * 2;
+	struct fiber_timer **hash = malloc(buckets * sizeof(*hash));
+	if (hash == NULL) {
+		return;
+	}
+	memset(hash, 0, buckets * sizeof(*hash));
+	struct fiber_timer **old = wheel->hash;
+	size_t old_buckets = wheel->hash_mask + 1;
+	wheel->hash = hash;
+	wheel->hash_mask = buckets - 1;
+	for (size_t i = 0; i < old_buckets; ++i) {
+		struct fiber_timer *timer = old[i];
+		while (timer != NULL) {
+			struct fiber_timer *next = timer->hash_next;
+			size_t j = hash_index(wheel, timer->job.job_id);
+			timer->hash_next = hash[j];
+			hash[j] = timer;
+			timer = next;
+		}
+	}
+	free(old);
+}
+
+static void hash_remove(struct fiber_timer_wheel *wheel,
+			struct fiber_timer *timer)
+{
+	struct fiber_timer **link = &wheel->hash[hash_index(wheel,
+							   timer->job.job_id)];
+	while (*link != timer) {
+		link = &(*link)->hash_next;
+	}
+	*link = timer->hash_next;
+	--wheel->count;
+}
+
+static void list_push(struct fiber_timer **head, struct fiber_timer *timer)
+{
+	timer->next = *head;
+	if (*head != NULL) {
+		(*head)->pprev = &timer->next;
+	}
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void list_unlink(struct fiber_timer_wheel *wheel,
+			struct fiber_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	if (timer->slot >= 0) {
+		int level = timer->slot / FIBER_TIMER_SLOTS;
+		int s = timer->slot % FIBER_TIMER_SLOTS;
+		if (wheel->slots[level][s] == NULL) {
+			wheel->occupied[level] &= ~(1ull << s);
+		}
+	}
+	timer->pprev = NULL;
+	timer->next = NULL;
+}
+
+// expire must be >= now. Equal to now only while advance is on that tick.
+static void place(struct fiber_timer_wheel *wheel, struct fiber_timer *timer)
+{
+	uint64_t expire = timer->expire;
+	uint64_t diff = expire ^ wheel->now;
+	int level = diff == 0 ? 0 :
+				(63 - __builtin_clzll(diff)) /
+					FIBER_TIMER_LEVEL_BITS;
+	if (level >= FIBER_TIMER_LEVELS) {
+		timer->slot = -1;
+		list_push(&wheel->overflow, timer);
+		return;
+	}
+	int s = (expire >> (level * FIBER_TIMER_LEVEL_BITS)) &
+		(FIBER_TIMER_SLOTS - 1);
+	timer->slot = level * FIBER_TIMER_SLOTS + s;
+	list_push(&wheel->slots[level][s], timer);
+	wheel->occupied[level] |= 1ull << s;
+}
+
+static void cascade(struct fiber_timer_wheel *wheel, struct fiber_timer *list)
+{
+	while (list != NULL) {
+		struct fiber_timer *next = list->next;
+		place(wheel, list);
+		list = next;
+	}
+}
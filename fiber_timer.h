@@ -0,0 +1,88 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_TIMER_H
+#define _FIBER_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "job_queue.h"
+
+/* Hierarchical timing wheel for FIBER_OPT_TIMERS. Time is counted in ticks
+ * of FIBER_TIMER_TICK_NS. Each level has FIBER_TIMER_SLOTS slots and covers
+ * FIBER_TIMER_SLOTS times the span of the level below. A timer sits in the
+ * lowest level where its expiry differs from the current tick and moves
+ * down a level each time the wheel reaches its slot, so adding and removing
+ * are O(1). A bitmap of occupied slots per level lets advance jump straight
+ * over empty stretches instead of stepping every tick.
+ *
+ * Timers are also kept in a hash table by job id for cancellation. Not
+ * thread safe.
+ */
+
+#define FIBER_TIMER_TICK_NS 1000000ull
+#define FIBER_TIMER_LEVEL_BITS 6
+#define FIBER_TIMER_SLOTS (1 << FIBER_TIMER_LEVEL_BITS)
+// 2^36 ticks, a little over two years at 1ms. Later timers wait in an
+// overflow list that is looked at once per wrap of the top level.
+#define FIBER_TIMER_LEVELS 6
+
+struct fiber_timer {
+	struct fiber_job job;
+	// Tick the job is due at
+	uint64_t expire;
+	// Ticks between runs, 0 for a one shot timer
+	uint64_t period;
+	// Slot list. pprev points at whatever points at this timer.
+	struct fiber_timer *next;
+	struct fiber_timer **pprev;
+	struct fiber_timer *hash_next;
+	// level * FIBER_TIMER_SLOTS + slot, -1 in the overflow list
+	int slot;
+};
+
+struct fiber_timer_wheel {
+	// Last tick processed
+	uint64_t now;
+	struct fiber_timer *slots[FIBER_TIMER_LEVELS][FIBER_TIMER_SLOTS];
+	uint64_t occupied[FIBER_TIMER_LEVELS];
+	struct fiber_timer *overflow;
+	struct fiber_timer **hash;
+	size_t hash_mask;
+	size_t count;
+};
+
+/* @returns: 0 on success, ENOMEM if the hash table couldn't be allocated. */
+int fiber_timer_wheel_init(struct fiber_timer_wheel *wheel, uint64_t now,
+			   void *(*malloc)(size_t));
+
+/* Frees the wheel and every timer still in it. */
+void fiber_timer_wheel_free(struct fiber_timer_wheel *wheel,
+			    void (*free)(void *));
+
+/* Adds timer by timer->job.job_id. A timer already due fires on the next
+ * advance. If the hash table can't grow, chains just get longer.
+ */
+void fiber_timer_wheel_add(struct fiber_timer_wheel *wheel,
+			   struct fiber_timer *timer, void *(*malloc)(size_t),
+			   void (*free)(void *));
+
+/* Takes the timer with job id id out of the wheel.
+ * @returns: The timer or NULL if there is none.
+ */
+struct fiber_timer *fiber_timer_wheel_remove(struct fiber_timer_wheel *wheel,
+					     jid id);
+
+/* Moves the wheel to tick to.
+ * @returns: Every timer with expire <= to, linked through next and removed
+ * from the wheel. NULL if none are due.
+ */
+struct fiber_timer *fiber_timer_wheel_advance(struct fiber_timer_wheel *wheel,
+					      uint64_t to);
+
+/* @returns: The tick advance next has work at, 0 if the wheel is empty.
+ * Timers are due at or after it, so it is when to wake up next.
+ */
+uint64_t fiber_timer_wheel_next(const struct fiber_timer_wheel *wheel);
+
+#endif // _FIBER_TIMER_H
@@ -3,9 +3,50 @@
 #ifndef _FIBER_UTILS_H
 #define _FIBER_UTILS_H
 
+#include <stdint.h>
+
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+// Size used to keep hot, independently written fields on separate lines.
+#define FIBER_CACHE_LINE 64
+// Padding that fills out the rest of a cache line after used bytes. Padding
+// is used over alignment attributes so custom mallocs don't need to honor
+// over-aligned types.
+#define __fbr_pad(name, used) char name[FIBER_CACHE_LINE - (used)]
+// Padding after a group of hot fields in a struct that may start anywhere on
+// a line, e.g. from malloc. Two lines keep the next group off the group's
+// last line wherever the struct starts. FIBER_PACKED_LAYOUT drops it so the
+// benchmarks can compare against fields sharing lines.
+#ifdef FIBER_PACKED_LAYOUT
+#define __fbr_pad_hot(name, used) char name[1]
+#else
+#define __fbr_pad_hot(name, used) char name[2 * FIBER_CACHE_LINE - (used)]
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define __fbr_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define __fbr_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define __fbr_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// Test and test-and-set lock for short critical sections. 0 is unlocked.
+static inline void __fbr_spin_lock(uint32_t *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+			__fbr_cpu_relax();
+		}
+	}
+}
+
+static inline void __fbr_spin_unlock(uint32_t *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
 #ifdef FIBER_ASSERTS
 #include <stdio.h>
 #include <stdlib.h>
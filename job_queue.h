@@ -13,10 +13,28 @@ typedef int qsize; // Type to represent a queue's size
 #define JOB_ID_MIN LONG_MIN
 #define QUEUE_SIZE_MAX UINT_MAX
 
+struct fiber_group;
+
+// Bytes of job_data, sized so a job fills one 64 byte cache line
+#define FIBER_JOB_DATA_SIZE 24
+
 struct fiber_job {
 	jid job_id;
 	void *(*job_func)(void *arg);
-	void *job_arg;
+	// Set by Fiber at push when the pool uses FIBER_OPT_LATENCY, 0 for
+	// Fiber's internal jobs. Queues must copy it with the job.
+	uint64_t enqueue_ts;
+	// Set by fiber_group_push*, NULL otherwise
+	struct fiber_group *group;
+	// FIBER_FREE_ARG and FIBER_INLINE_ARG if given at push, 0 otherwise.
+	// Queues must copy it with the job.
+	uint32_t job_flags;
+	union {
+		void *job_arg;
+		// Pushed with FIBER_INLINE_ARG, job_func is given a pointer to
+		// the copy of this the worker runs, instead of job_arg
+		unsigned char job_data[FIBER_JOB_DATA_SIZE];
+	};
 };
 
 struct fiber_queue_operations {
@@ -29,9 +47,35 @@ struct fiber_queue_operations {
 
 	// Optional
 	qsize (*length)(void *queue);
+	/* Push up to n jobs in one call. With FIBER_BLOCK all n jobs must be
+	 * pushed. Without it, push as many as fit. Returns the number of jobs
+	 * pushed or a negative error if none could be pushed.
+	 */
+	qsize (*push_n)(void *queue, struct fiber_job *jobs, qsize n,
+			uint32_t flags);
+	/* Pop up to n jobs into buffer. With FIBER_BLOCK, wait for at least
+	 * one job. Returns the number of jobs popped, 0 if there were none.
+	 */
+	qsize (*pop_n)(void *queue, struct fiber_job *buffer, qsize n,
+		       uint32_t flags);
+	/* Number of times a blocking push/pop should spin before sleeping.
+	 * Called once after init with fiber_pool_init_options.park_spin.
+	 */
+	void (*set_park_spin)(void *queue, uint32_t spin);
 };
 
 #define FIBER_BLOCK (1 << 31)
 #define FIBER_NO_BLOCK 0
+// Handled by Fiber and cleared before the queue sees the flags. A FIBER_BLOCK
+// push that finds the queue full pops and runs queued jobs on the calling
+// thread until there is room, instead of sleeping.
+#define FIBER_CALLER_RUNS (1 << 30)
+// Handled by Fiber and cleared before the queue sees the flags. job_arg came
+// from fiber_job_arg_alloc and is released once job_func returns.
+#define FIBER_FREE_ARG (1 << 29)
+// Handled by Fiber and cleared before the queue sees the flags. The argument
+// lives in job_data and travels with the job, so small arguments need no
+// allocation. FIBER_FREE_ARG is ignored with it.
+#define FIBER_INLINE_ARG (1 << 28)
 
 #endif // _FIBER_JOB_QUEUE_H
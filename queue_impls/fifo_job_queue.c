@@ -3,18 +3,20 @@
 #ifndef FIBER_NO_DEFAULT_QUEUE
 #include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <string.h>
 
+#include "fiber_park.h"
 #include "fiber_utils.h"
 #include "fifo_job_queue.h"
 #include "../job_queue.h"
 
-static const char *sem_post_err_msg =
-	"sem_post returned error. Likely an overflow\n";
-
 // From fiber.c
 extern int __fiber_mutex_init_get_err(int error);
-extern int __fiber_sem_init_get_err(int error);
+
+static inline void fifo_copy_in(struct fifo_jq *fq, struct fiber_job *jobs,
+				qsize n);
+static inline void fifo_copy_out(struct fifo_jq *fq, struct fiber_job *buffer,
+				 qsize n);
 
 int fiber_queue_fifo_init(void **queue, qsize capacity, void *(*malloc)(size_t),
 			  void (*free)(void *))
@@ -24,24 +26,28 @@ int fiber_queue_fifo_init(void **queue, qsize capacity, void *(*malloc)(size_t),
 	assert(malloc != NULL, "fifo_init received a NULL malloc func");
 	assert(free != NULL, "fifo_init received a NULL malloc func");
 	int error_code = 0;
+	int tail_lock_res = -1, head_lock_res = -1;
+	struct fiber_job *jobs = NULL;
 	struct fifo_jq *fq = malloc(sizeof(*fq));
 	if (fq == NULL) {
 		error_code = ENOMEM;
 		goto err;
 	}
-	struct fiber_job *jobs = malloc(capacity * sizeof(*jobs));
+	jobs = malloc(capacity * sizeof(*jobs));
 	if (jobs == NULL) {
 		error_code = ENOMEM;
 		goto err;
 	}
-	int sem_void_res = sem_init(&fq->void_num, 0, capacity);
-	if (sem_void_res != 0) {
-		error_code = __fiber_sem_init_get_err(errno);
+	fiber_park_sem_init(&fq->void_num, capacity, FIBER_PARK_SPIN_DEFAULT);
+	fiber_park_sem_init(&fq->jobs_num, 0, FIBER_PARK_SPIN_DEFAULT);
+	tail_lock_res = pthread_mutex_init(&fq->tail_lock, NULL);
+	if (tail_lock_res != 0) {
+		error_code = __fiber_mutex_init_get_err(tail_lock_res);
 		goto err;
 	}
-	int sem_jobs_res = sem_init(&fq->jobs_num, 0, 0);
-	if (sem_jobs_res != 0) {
-		error_code = __fiber_sem_init_get_err(errno);
+	head_lock_res = pthread_mutex_init(&fq->head_lock, NULL);
+	if (head_lock_res != 0) {
+		error_code = __fiber_mutex_init_get_err(head_lock_res);
 		goto err;
 	}
 
@@ -56,10 +62,8 @@ int fiber_queue_fifo_init(void **queue, qsize capacity, void *(*malloc)(size_t),
 err:
 	if (jobs != NULL)
 		free(jobs);
-	if (sem_void_res == 0)
-		sem_destroy(&fq->void_num);
-	if (sem_jobs_res == 0)
-		sem_destroy(&fq->jobs_num);
+	if (tail_lock_res == 0)
+		pthread_mutex_destroy(&fq->tail_lock);
 	if (fq != NULL)
 		free(fq);
 	return error_code;
@@ -71,21 +75,15 @@ int fiber_queue_fifo_push(void *queue, struct fiber_job *job, uint32_t flags)
 	assert(job != NULL, "fifo_push given NULL job");
 	assert(job->job_func != NULL, "fifo_push given NULL job_func");
 	struct fifo_jq *fq = (struct fifo_jq *)queue;
-	// Decrement semaphore
-	if (flags & FIBER_BLOCK) {
-		while (sem_wait(&fq->void_num) == -1 && errno == EINTR)
-			;
-	} else {
-		int try_res = sem_trywait(&fq->void_num);
-		if (try_res == -1) {
-			return -EAGAIN;
-		}
+	if (fiber_park_sem_take(&fq->void_num, 1, flags & FIBER_BLOCK) == 0) {
+		return -EAGAIN;
 	}
 
+	pthread_mutex_lock(&fq->tail_lock);
 	fq->jobs[fq->tail] = *job;
 	fq->tail = (fq->tail + 1) % fq->capacity;
-	int lock_res = sem_post(&fq->jobs_num);
-	assert(lock_res == 0, sem_post_err_msg);
+	pthread_mutex_unlock(&fq->tail_lock);
+	fiber_park_sem_post(&fq->jobs_num, 1);
 	return 0;
 }
 
@@ -94,30 +92,72 @@ int fiber_queue_fifo_pop(void *queue, struct fiber_job *buffer, uint32_t flags)
 	assert(queue != NULL, "fifo_pop given NULL queue");
 	assert(buffer != NULL, "fifo_pop given NULL job buffer");
 	struct fifo_jq *fq = (struct fifo_jq *)queue;
-	if (flags & FIBER_BLOCK) {
-		while (sem_wait(&fq->jobs_num) == -1 && errno == EINTR)
-			;
-	} else {
-		int try_res = sem_trywait(&fq->jobs_num);
-		if (try_res == -1) {
-			return EAGAIN;
-		}
+	if (fiber_park_sem_take(&fq->jobs_num, 1, flags & FIBER_BLOCK) == 0) {
+		return EAGAIN;
 	}
 
+	pthread_mutex_lock(&fq->head_lock);
 	*buffer = fq->jobs[fq->head];
 	fq->head = (fq->head + 1) % fq->capacity;
-	int lock_res = sem_post(&fq->void_num);
-	assert(lock_res == 0, sem_post_err_msg);
+	pthread_mutex_unlock(&fq->head_lock);
+	fiber_park_sem_post(&fq->void_num, 1);
 	return 0;
 }
 
+qsize fiber_queue_fifo_push_n(void *queue, struct fiber_job *jobs, qsize n,
+			      uint32_t flags)
+{
+	assert(queue != NULL, "fifo_push_n given NULL queue");
+	assert(jobs != NULL, "fifo_push_n given NULL jobs");
+	struct fifo_jq *fq = (struct fifo_jq *)queue;
+	qsize pushed = 0;
+	while (pushed < n) {
+		qsize taken = fiber_park_sem_take(&fq->void_num, n - pushed,
+						  flags & FIBER_BLOCK);
+		if (taken == 0) {
+			break;
+		}
+		pthread_mutex_lock(&fq->tail_lock);
+		fifo_copy_in(fq, jobs + pushed, taken);
+		pthread_mutex_unlock(&fq->tail_lock);
+		fiber_park_sem_post(&fq->jobs_num, taken);
+		pushed += taken;
+	}
+	return pushed > 0 ? pushed : -EAGAIN;
+}
+
+qsize fiber_queue_fifo_pop_n(void *queue, struct fiber_job *buffer, qsize n,
+			     uint32_t flags)
+{
+	assert(queue != NULL, "fifo_pop_n given NULL queue");
+	assert(buffer != NULL, "fifo_pop_n given NULL job buffer");
+	struct fifo_jq *fq = (struct fifo_jq *)queue;
+	qsize taken = fiber_park_sem_take(&fq->jobs_num, n, flags & FIBER_BLOCK);
+	if (taken == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&fq->head_lock);
+	fifo_copy_out(fq, buffer, taken);
+	pthread_mutex_unlock(&fq->head_lock);
+	fiber_park_sem_post(&fq->void_num, taken);
+	return taken;
+}
+
+void fiber_queue_fifo_set_park_spin(void *queue, uint32_t spin)
+{
+	assert(queue != NULL, "fifo_set_park_spin given NULL queue");
+	struct fifo_jq *fq = (struct fifo_jq *)queue;
+	fq->void_num.spin = spin;
+	fq->jobs_num.spin = spin;
+}
+
 void fiber_queue_fifo_free(void *queue)
 {
 	assert(queue != NULL, "fifo_free given NULL queue");
 	struct fifo_jq *fq = (struct fifo_jq *)queue;
 	fq->free(fq->jobs);
-	sem_destroy(&fq->jobs_num);
-	sem_destroy(&fq->void_num);
+	pthread_mutex_destroy(&fq->tail_lock);
+	pthread_mutex_destroy(&fq->head_lock);
 	fq->free(fq);
 }
 
@@ -125,11 +165,32 @@ qsize fiber_queue_fifo_length(void *queue)
 {
 	assert(queue != NULL, "fifo_length given NULL queue");
 	struct fifo_jq *fq = (struct fifo_jq *)queue;
-	int sem_val;
-	int error_code = sem_getvalue(&fq->jobs_num, &sem_val);
-	if (error_code != 0 || sem_val < 0) {
-		return 0;
+	return fiber_park_sem_value(&fq->jobs_num);
+}
+
+// Caller holds tail_lock and has reserved n free slots.
+static inline void fifo_copy_in(struct fifo_jq *fq, struct fiber_job *jobs,
+				qsize n)
+{
+	qsize first = fq->capacity - fq->tail;
+	if (first > n) {
+		first = n;
+	}
+	memcpy(&fq->jobs[fq->tail], jobs, first * sizeof(*jobs));
+	memcpy(fq->jobs, jobs + first, (n - first) * sizeof(*jobs));
+	fq->tail = (fq->tail + n) % fq->capacity;
+}
+
+// Caller holds head_lock and has reserved n filled slots.
+static inline void fifo_copy_out(struct fifo_jq *fq, struct fiber_job *buffer,
+				 qsize n)
+{
+	qsize first = fq->capacity - fq->head;
+	if (first > n) {
+		first = n;
 	}
-	return sem_val;
+	memcpy(buffer, &fq->jobs[fq->head], first * sizeof(*buffer));
+	memcpy(buffer + first, fq->jobs, (n - first) * sizeof(*buffer));
+	fq->head = (fq->head + n) % fq->capacity;
 }
 #endif // FIBER_NO_DEFAULT_QUEUE
@@ -5,15 +5,28 @@
 #define _FIBER_FIFO_JOB_QUEUE_H
 
 #include <pthread.h>
-#include <semaphore.h>
 
+#include "fiber_park.h"
+#include "fiber_utils.h"
 #include "job_queue.h"
 
 struct fifo_jq {
-	sem_t void_num;
-	sem_t jobs_num;
-	qsize head;
+	// Producers serialize on tail, consumers on head. Each side and each
+	// semaphore is on its own cache lines.
+	__fbr_pad_hot(__pad_lead, FIBER_CACHE_LINE);
+	pthread_mutex_t tail_lock;
 	qsize tail;
+	__fbr_pad_hot(__pad_tail, sizeof(pthread_mutex_t) + sizeof(qsize));
+	pthread_mutex_t head_lock;
+	qsize head;
+	__fbr_pad_hot(__pad_head, sizeof(pthread_mutex_t) + sizeof(qsize));
+	// Taken by producers, posted by consumers
+	struct fiber_park_sem void_num;
+	__fbr_pad_hot(__pad_void, sizeof(struct fiber_park_sem));
+	// Taken by consumers, posted by producers
+	struct fiber_park_sem jobs_num;
+	__fbr_pad_hot(__pad_jobs, sizeof(struct fiber_park_sem));
+	// Read only after init
 	struct fiber_job *jobs;
 	qsize capacity;
 	void (*free)(void *);
@@ -26,6 +39,14 @@ int fiber_queue_fifo_push(void *queue, struct fiber_job *job, uint32_t flags);
 
 int fiber_queue_fifo_pop(void *queue, struct fiber_job *buffer, uint32_t flags);
 
+qsize fiber_queue_fifo_push_n(void *queue, struct fiber_job *jobs, qsize n,
+			      uint32_t flags);
+
+qsize fiber_queue_fifo_pop_n(void *queue, struct fiber_job *buffer, qsize n,
+			     uint32_t flags);
+
+void fiber_queue_fifo_set_park_spin(void *queue, uint32_t spin);
+
 void fiber_queue_fifo_free(void *queue);
 
 qsize fiber_queue_fifo_length(void *queue);
@@ -0,0 +1,252 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "fiber_park.h"
+#include "fiber_utils.h"
+#include "mpmc_job_queue.h"
+#include "../job_queue.h"
+
+#define MPMC_CAPACITY_MAX (1 << 30)
+
+// From fiber.c
+extern int __fiber_mutex_init_get_err(int error);
+
+static inline int mpmc_try_push(struct mpmc_jq *mq, struct fiber_job *job);
+static inline int mpmc_try_pop(struct mpmc_jq *mq, struct fiber_job *buffer);
+static inline void mpmc_wake(struct mpmc_jq *mq, uint32_t *waiters,
+			     pthread_cond_t *cond);
+static void mpmc_unlock_cleanup(void *lock);
+
+int fiber_queue_mpmc_init(void **queue, qsize capacity, void *(*malloc)(size_t),
+			  void (*free)(void *))
+{
+	assert(queue != NULL, "mpmc_init received a NULL queue");
+	assert(capacity > 0, "mpmc_init received a bad capacity");
+	assert(malloc != NULL, "mpmc_init received a NULL malloc func");
+	assert(free != NULL, "mpmc_init received a NULL free func");
+	if (capacity > MPMC_CAPACITY_MAX) {
+		return EINVAL;
+	}
+	// A one slot ring can't tell "full" from "free for the next lap".
+	uint64_t cap = 2;
+	while (cap < (uint64_t)capacity) {
+		cap <<= 1;
+	}
+	int error_code = 0;
+	int mutex_res = -1, not_empty_res = -1, not_full_res = -1;
+	struct mpmc_jq_slot *slots = NULL;
+	struct mpmc_jq *mq = malloc(sizeof(*mq));
+	if (mq == NULL) {
+		error_code = ENOMEM;
+		goto err;
+	}
+	slots = malloc(cap * sizeof(*slots));
+	if (slots == NULL) {
+		error_code = ENOMEM;
+		goto err;
+	}
+	mutex_res = pthread_mutex_init(&mq->lock, NULL);
+	if (mutex_res != 0) {
+		error_code = __fiber_mutex_init_get_err(mutex_res);
+		goto err;
+	}
+	not_empty_res = pthread_cond_init(&mq->not_empty, NULL);
+	if (not_empty_res != 0) {
+		error_code = not_empty_res;
+		goto err;
+	}
+	not_full_res = pthread_cond_init(&mq->not_full, NULL);
+	if (not_full_res != 0) {
+		error_code = not_full_res;
+		goto err;
+	}
+	for (uint64_t i = 0; i < cap; ++i) {
+		slots[i].seq = i;
+	}
+	mq->slots = slots;
+	mq->mask = cap - 1;
+	mq->head = 0;
+	mq->tail = 0;
+	mq->pop_waiters = 0;
+	mq->push_waiters = 0;
+	mq->spin = FIBER_PARK_SPIN_DEFAULT;
+	mq->free = free;
+	*queue = mq;
+	return 0;
+err:
+	if (not_empty_res == 0)
+		pthread_cond_destroy(&mq->not_empty);
+	if (mutex_res == 0)
+		pthread_mutex_destroy(&mq->lock);
+	if (slots != NULL)
+		free(slots);
+	if (mq != NULL)
+		free(mq);
+	return error_code;
+}
+
+int fiber_queue_mpmc_push(void *queue, struct fiber_job *job, uint32_t flags)
+{
+	assert(queue != NULL, "mpmc_push given NULL queue");
+	assert(job != NULL, "mpmc_push given NULL job");
+	assert(job->job_func != NULL, "mpmc_push given NULL job_func");
+	struct mpmc_jq *mq = (struct mpmc_jq *)queue;
+	int spins = (flags & FIBER_BLOCK) ? (int)mq->spin : 0;
+	while (mpmc_try_push(mq, job) != 0) {
+		if (spins-- > 0) {
+			__fbr_cpu_relax();
+			continue;
+		}
+		if (!(flags & FIBER_BLOCK)) {
+			return -EAGAIN;
+		}
+		pthread_mutex_lock(&mq->lock);
+		pthread_cleanup_push(mpmc_unlock_cleanup, &mq->lock);
+		__atomic_add_fetch(&mq->push_waiters, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (mpmc_try_push(mq, job) != 0) {
+			pthread_cond_wait(&mq->not_full, &mq->lock);
+		}
+		__atomic_sub_fetch(&mq->push_waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_cleanup_pop(1);
+		break;
+	}
+	mpmc_wake(mq, &mq->pop_waiters, &mq->not_empty);
+	return 0;
+}
+
+int fiber_queue_mpmc_pop(void *queue, struct fiber_job *buffer, uint32_t flags)
+{
+	assert(queue != NULL, "mpmc_pop given NULL queue");
+	assert(buffer != NULL, "mpmc_pop given NULL job buffer");
+	struct mpmc_jq *mq = (struct mpmc_jq *)queue;
+	int spins = (flags & FIBER_BLOCK) ? (int)mq->spin : 0;
+	while (mpmc_try_pop(mq, buffer) != 0) {
+		if (spins-- > 0) {
+			__fbr_cpu_relax();
+			continue;
+		}
+		if (!(flags & FIBER_BLOCK)) {
+			return EAGAIN;
+		}
+		pthread_mutex_lock(&mq->lock);
+		pthread_cleanup_push(mpmc_unlock_cleanup, &mq->lock);
+		__atomic_add_fetch(&mq->pop_waiters, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (mpmc_try_pop(mq, buffer) != 0) {
+			pthread_cond_wait(&mq->not_empty, &mq->lock);
+		}
+		__atomic_sub_fetch(&mq->pop_waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_cleanup_pop(1);
+		break;
+	}
+	mpmc_wake(mq, &mq->push_waiters, &mq->not_full);
+	return 0;
+}
+
+void fiber_queue_mpmc_free(void *queue)
+{
+	assert(queue != NULL, "mpmc_free given NULL queue");
+	struct mpmc_jq *mq = (struct mpmc_jq *)queue;
+	pthread_cond_destroy(&mq->not_full);
+	pthread_cond_destroy(&mq->not_empty);
+	pthread_mutex_destroy(&mq->lock);
+	mq->free(mq->slots);
+	mq->free(mq);
+}
+
+void fiber_queue_mpmc_set_park_spin(void *queue, uint32_t spin)
+{
+	assert(queue != NULL, "mpmc_set_park_spin given NULL queue");
+	struct mpmc_jq *mq = (struct mpmc_jq *)queue;
+	mq->spin = spin;
+}
+
+qsize fiber_queue_mpmc_length(void *queue)
+{
+	assert(queue != NULL, "mpmc_length given NULL queue");
+	struct mpmc_jq *mq = (struct mpmc_jq *)queue;
+	// Head is read first so a racing pop can't make the length negative.
+	uint64_t head = __atomic_load_n(&mq->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = __atomic_load_n(&mq->tail, __ATOMIC_ACQUIRE);
+	if (tail <= head) {
+		return 0;
+	}
+	uint64_t len = tail - head;
+	return len > mq->mask + 1 ? (qsize)(mq->mask + 1) : (qsize)len;
+}
+
+static inline int mpmc_try_push(struct mpmc_jq *mq, struct fiber_job *job)
+{
+	uint64_t pos = __atomic_load_n(&mq->tail, __ATOMIC_RELAXED);
+	while (1) {
+		struct mpmc_jq_slot *slot = &mq->slots[pos & mq->mask];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			// Slot is free for this lap, try to claim it.
+			if (__atomic_compare_exchange_n(&mq->tail, &pos,
+							pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				slot->job = *job;
+				__atomic_store_n(&slot->seq, pos + 1,
+						 __ATOMIC_RELEASE);
+				return 0;
+			}
+		} else if (diff < 0) {
+			// Consumer hasn't emptied the slot from the last lap.
+			return -EAGAIN;
+		} else {
+			pos = __atomic_load_n(&mq->tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static inline int mpmc_try_pop(struct mpmc_jq *mq, struct fiber_job *buffer)
+{
+	uint64_t pos = __atomic_load_n(&mq->head, __ATOMIC_RELAXED);
+	while (1) {
+		struct mpmc_jq_slot *slot = &mq->slots[pos & mq->mask];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&mq->head, &pos,
+							pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				*buffer = slot->job;
+				// Hand the slot to the producer of the next lap.
+				__atomic_store_n(&slot->seq, pos + mq->mask + 1,
+						 __ATOMIC_RELEASE);
+				return 0;
+			}
+		} else if (diff < 0) {
+			// Producer hasn't filled the slot yet, queue is empty.
+			return EAGAIN;
+		} else {
+			pos = __atomic_load_n(&mq->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static inline void mpmc_wake(struct mpmc_jq *mq, uint32_t *waiters,
+			     pthread_cond_t *cond)
+{
+	// Pairs with the fence after a sleeper bumps its waiter count. Either
+	// we see the sleeper or the sleeper sees the slot we just changed.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (likely(__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0)) {
+		return;
+	}
+	pthread_mutex_lock(&mq->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&mq->lock);
+}
+
+static void mpmc_unlock_cleanup(void *lock)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
@@ -0,0 +1,56 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_MPMC_JOB_QUEUE_H
+#define _FIBER_MPMC_JOB_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fiber_utils.h"
+#include "job_queue.h"
+
+/* Bounded lock-free multi-producer multi-consumer ring. Each slot carries
+ * a sequence number that tells producers and consumers whether the slot is
+ * free for the current lap or holds a job. The capacity is rounded up to a
+ * power of two so indexing is a mask instead of a modulo.
+ */
+struct mpmc_jq_slot {
+	uint64_t seq;
+	struct fiber_job job;
+};
+
+struct mpmc_jq {
+	// Producers only touch tail, consumers only touch head.
+	uint64_t tail;
+	__fbr_pad(__pad_tail, sizeof(uint64_t));
+	uint64_t head;
+	__fbr_pad(__pad_head, sizeof(uint64_t));
+	// Only used when a caller has to block. Workers and producers check
+	// the waiter counts and skip the lock when no one is sleeping.
+	uint32_t pop_waiters;
+	uint32_t push_waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	// Read only after init
+	struct mpmc_jq_slot *slots;
+	uint64_t mask;
+	// Failed attempts before a blocking caller goes to sleep
+	uint32_t spin;
+	void (*free)(void *);
+};
+
+int fiber_queue_mpmc_init(void **queue, qsize capacity, void *(*malloc)(size_t),
+			  void (*free)(void *));
+
+int fiber_queue_mpmc_push(void *queue, struct fiber_job *job, uint32_t flags);
+
+int fiber_queue_mpmc_pop(void *queue, struct fiber_job *buffer, uint32_t flags);
+
+void fiber_queue_mpmc_free(void *queue);
+
+void fiber_queue_mpmc_set_park_spin(void *queue, uint32_t spin);
+
+qsize fiber_queue_mpmc_length(void *queue);
+
+#endif // _FIBER_MPMC_JOB_QUEUE_H
@@ -0,0 +1,237 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "fiber_park.h"
+#include "fiber_utils.h"
+#include "prio_job_queue.h"
+#include "../job_queue.h"
+
+// From fiber.c
+extern int __fiber_mutex_init_get_err(int error);
+
+static inline uint32_t prio_pick_lane(struct prio_jq *pq);
+static inline void prio_take(struct prio_jq *pq, uint32_t lane,
+			     struct fiber_job *buffer);
+static inline void prio_put(struct prio_jq *pq, uint32_t lane,
+			    struct fiber_job *job);
+
+int fiber_queue_prio_init(void **queue, qsize capacity,
+			  void *(*malloc)(size_t), void (*free)(void *))
+{
+	assert(queue != NULL, "prio_init received a NULL queue");
+	assert(capacity > 0, "prio_init received a bad capacity");
+	assert(malloc != NULL, "prio_init received a NULL malloc func");
+	assert(free != NULL, "prio_init received a NULL free func");
+	if (capacity > INT_MAX / FIBER_PRIO_LANES) {
+		return EINVAL;
+	}
+	int error_code = 0;
+	struct fiber_job *jobs = NULL;
+	struct prio_jq *pq = malloc(sizeof(*pq));
+	if (pq == NULL) {
+		error_code = ENOMEM;
+		goto err;
+	}
+	// One allocation, each lane gets a slice
+	jobs = malloc((size_t)capacity * FIBER_PRIO_LANES * sizeof(*jobs));
+	if (jobs == NULL) {
+		error_code = ENOMEM;
+		goto err;
+	}
+	int lock_res = pthread_mutex_init(&pq->lock, NULL);
+	if (lock_res != 0) {
+		error_code = __fiber_mutex_init_get_err(lock_res);
+		goto err;
+	}
+	fiber_park_sem_init(&pq->jobs_num, 0, FIBER_PARK_SPIN_DEFAULT);
+	for (int i = 0; i < FIBER_PRIO_LANES; ++i) {
+		fiber_park_sem_init(&pq->void_num[i], capacity,
+				    FIBER_PARK_SPIN_DEFAULT);
+		pq->lanes[i].jobs = jobs + (size_t)i * capacity;
+		pq->lanes[i].head = 0;
+		pq->lanes[i].tail = 0;
+		pq->lanes[i].length = 0;
+		pq->lanes[i].passed = 0;
+	}
+	pq->lanes_used = 0;
+	pq->aging = FIBER_PRIO_AGING;
+	pq->capacity = capacity;
+	pq->free = free;
+	*queue = pq;
+	return 0;
+err:
+	if (jobs != NULL)
+		free(jobs);
+	if (pq != NULL)
+		free(pq);
+	return error_code;
+}
+
+int fiber_queue_prio_push(void *queue, struct fiber_job *job, uint32_t flags)
+{
+	assert(queue != NULL, "prio_push given NULL queue");
+	assert(job != NULL, "prio_push given NULL job");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	uint32_t lane = flags & FIBER_PRIO_MASK;
+	if (fiber_park_sem_take(&pq->void_num[lane], 1, flags & FIBER_BLOCK) ==
+	    0) {
+		return -EAGAIN;
+	}
+	pthread_mutex_lock(&pq->lock);
+	prio_put(pq, lane, job);
+	pthread_mutex_unlock(&pq->lock);
+	fiber_park_sem_post(&pq->jobs_num, 1);
+	return 0;
+}
+
+int fiber_queue_prio_pop(void *queue, struct fiber_job *buffer, uint32_t flags)
+{
+	assert(queue != NULL, "prio_pop given NULL queue");
+	assert(buffer != NULL, "prio_pop given NULL job buffer");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	if (fiber_park_sem_take(&pq->jobs_num, 1, flags & FIBER_BLOCK) == 0) {
+		return EAGAIN;
+	}
+	pthread_mutex_lock(&pq->lock);
+	uint32_t lane = prio_pick_lane(pq);
+	prio_take(pq, lane, buffer);
+	pthread_mutex_unlock(&pq->lock);
+	fiber_park_sem_post(&pq->void_num[lane], 1);
+	return 0;
+}
+
+qsize fiber_queue_prio_push_n(void *queue, struct fiber_job *jobs, qsize n,
+			      uint32_t flags)
+{
+	assert(queue != NULL, "prio_push_n given NULL queue");
+	assert(jobs != NULL, "prio_push_n given NULL jobs");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	uint32_t lane = flags & FIBER_PRIO_MASK;
+	qsize pushed = 0;
+	while (pushed < n) {
+		qsize taken = fiber_park_sem_take(&pq->void_num[lane],
+						  n - pushed,
+						  flags & FIBER_BLOCK);
+		if (taken == 0) {
+			break;
+		}
+		pthread_mutex_lock(&pq->lock);
+		for (qsize i = 0; i < taken; ++i) {
+			prio_put(pq, lane, &jobs[pushed + i]);
+		}
+		pthread_mutex_unlock(&pq->lock);
+		fiber_park_sem_post(&pq->jobs_num, taken);
+		pushed += taken;
+	}
+	return pushed > 0 ? pushed : -EAGAIN;
+}
+
+qsize fiber_queue_prio_pop_n(void *queue, struct fiber_job *buffer, qsize n,
+			     uint32_t flags)
+{
+	assert(queue != NULL, "prio_pop_n given NULL queue");
+	assert(buffer != NULL, "prio_pop_n given NULL job buffer");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	qsize taken = fiber_park_sem_take(&pq->jobs_num, n, flags & FIBER_BLOCK);
+	if (taken == 0) {
+		return 0;
+	}
+	qsize freed[FIBER_PRIO_LANES] = { 0 };
+	pthread_mutex_lock(&pq->lock);
+	for (qsize i = 0; i < taken; ++i) {
+		uint32_t lane = prio_pick_lane(pq);
+		prio_take(pq, lane, &buffer[i]);
+		++freed[lane];
+	}
+	pthread_mutex_unlock(&pq->lock);
+	for (int i = 0; i < FIBER_PRIO_LANES; ++i) {
+		if (freed[i] > 0) {
+			fiber_park_sem_post(&pq->void_num[i], freed[i]);
+		}
+	}
+	return taken;
+}
+
+void fiber_queue_prio_set_park_spin(void *queue, uint32_t spin)
+{
+	assert(queue != NULL, "prio_set_park_spin given NULL queue");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	pq->jobs_num.spin = spin;
+	for (int i = 0; i < FIBER_PRIO_LANES; ++i) {
+		pq->void_num[i].spin = spin;
+	}
+}
+
+void fiber_queue_prio_set_aging(void *queue, uint32_t aging)
+{
+	assert(queue != NULL, "prio_set_aging given NULL queue");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	pthread_mutex_lock(&pq->lock);
+	pq->aging = aging;
+	pthread_mutex_unlock(&pq->lock);
+}
+
+void fiber_queue_prio_free(void *queue)
+{
+	assert(queue != NULL, "prio_free given NULL queue");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	// Lane 0 owns the allocation
+	pq->free(pq->lanes[0].jobs);
+	pthread_mutex_destroy(&pq->lock);
+	pq->free(pq);
+}
+
+qsize fiber_queue_prio_length(void *queue)
+{
+	assert(queue != NULL, "prio_length given NULL queue");
+	struct prio_jq *pq = (struct prio_jq *)queue;
+	return fiber_park_sem_value(&pq->jobs_num);
+}
+
+// Must hold the lock and lanes_used must not be 0
+static inline uint32_t prio_pick_lane(struct prio_jq *pq)
+{
+	uint32_t used = pq->lanes_used;
+	assert(used != 0, "prio_pick_lane called with no jobs");
+	uint32_t lane = 31 - __builtin_clz(used);
+	if (pq->aging == 0) {
+		return lane;
+	}
+	// Every lower lane with jobs is passed over once more. The lowest one
+	// that has waited long enough goes first.
+	uint32_t below = used & ((1u << lane) - 1);
+	while (below != 0) {
+		uint32_t l = __builtin_ctz(below);
+		below &= below - 1;
+		if (++pq->lanes[l].passed >= pq->aging) {
+			return l;
+		}
+	}
+	return lane;
+}
+
+static inline void prio_take(struct prio_jq *pq, uint32_t lane,
+			     struct fiber_job *buffer)
+{
+	struct prio_jq_lane *l = &pq->lanes[lane];
+	*buffer = l->jobs[l->head];
+	l->head = (l->head + 1) % pq->capacity;
+	l->passed = 0;
+	if (--l->length == 0) {
+		pq->lanes_used &= ~(1u << lane);
+	}
+}
+
+static inline void prio_put(struct prio_jq *pq, uint32_t lane,
+			    struct fiber_job *job)
+{
+	struct prio_jq_lane *l = &pq->lanes[lane];
+	l->jobs[l->tail] = *job;
+	l->tail = (l->tail + 1) % pq->capacity;
+	if (l->length++ == 0) {
+		pq->lanes_used |= 1u << lane;
+	}
+}
@@ -0,0 +1,83 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_PRIO_JOB_QUEUE_H
+#define _FIBER_PRIO_JOB_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fiber_park.h"
+#include "job_queue.h"
+
+/* Queue with FIBER_PRIO_LANES priority lanes, each its own ring of the
+ * capacity passed to init. The lane is picked from the low bits of the push
+ * flags, so pass FIBER_PRIO(n) | FIBER_BLOCK to fiber_job_push. Pop takes
+ * from the highest non-empty lane, found through a bitmap of non-empty
+ * lanes.
+ *
+ * To keep a flood of high priority jobs from starving the rest, a lane that
+ * has been passed over aging times is served next. See
+ * fiber_queue_prio_set_aging.
+ */
+
+#define FIBER_PRIO_LANES 8
+#define FIBER_PRIO_MASK (FIBER_PRIO_LANES - 1)
+// Push flag for lane p. Higher runs first. Flags without one use lane 0.
+#define FIBER_PRIO(p) ((uint32_t)(p) & FIBER_PRIO_MASK)
+#define FIBER_PRIO_LOWEST 0
+#define FIBER_PRIO_HIGHEST FIBER_PRIO_MASK
+
+#ifndef FIBER_PRIO_AGING
+#define FIBER_PRIO_AGING 64
+#endif
+
+struct prio_jq_lane {
+	struct fiber_job *jobs;
+	qsize head;
+	qsize tail;
+	qsize length;
+	// Pops that went to a higher lane while this one had jobs
+	uint32_t passed;
+};
+
+struct prio_jq {
+	// Jobs across all lanes
+	struct fiber_park_sem jobs_num;
+	// Free slots per lane
+	struct fiber_park_sem void_num[FIBER_PRIO_LANES];
+	pthread_mutex_t lock;
+	// Bit n is set while lane n has jobs
+	uint32_t lanes_used;
+	uint32_t aging;
+	qsize capacity;
+	struct prio_jq_lane lanes[FIBER_PRIO_LANES];
+	void (*free)(void *);
+};
+
+int fiber_queue_prio_init(void **queue, qsize capacity,
+			  void *(*malloc)(size_t), void (*free)(void *));
+
+int fiber_queue_prio_push(void *queue, struct fiber_job *job, uint32_t flags);
+
+int fiber_queue_prio_pop(void *queue, struct fiber_job *buffer, uint32_t flags);
+
+/* All n jobs go to the lane in flags. */
+qsize fiber_queue_prio_push_n(void *queue, struct fiber_job *jobs, qsize n,
+			      uint32_t flags);
+
+qsize fiber_queue_prio_pop_n(void *queue, struct fiber_job *buffer, qsize n,
+			     uint32_t flags);
+
+void fiber_queue_prio_set_park_spin(void *queue, uint32_t spin);
+
+/* Sets how many times a non-empty lane may be passed over before it is
+ * served ahead of higher lanes. 0 disables aging. Defaults to
+ * FIBER_PRIO_AGING.
+ */
+void fiber_queue_prio_set_aging(void *queue, uint32_t aging);
+
+void fiber_queue_prio_free(void *queue);
+
+qsize fiber_queue_prio_length(void *queue);
+
+#endif // _FIBER_PRIO_JOB_QUEUE_H
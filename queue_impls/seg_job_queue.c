@@ -0,0 +1,314 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "fiber_park.h"
+#include "fiber_utils.h"
+#include "seg_job_queue.h"
+#include "../job_queue.h"
+
+// From fiber.c
+extern int __fiber_mutex_init_get_err(int error);
+
+static inline int seg_wait_room(struct seg_jq *sq, uint32_t flags);
+static inline struct seg_jq_seg *seg_get(struct seg_jq *sq);
+static inline void seg_put(struct seg_jq *sq, struct seg_jq_seg *seg);
+static inline qsize seg_copy_in(struct seg_jq *sq, struct fiber_job *jobs,
+				qsize n);
+static inline void seg_copy_out(struct seg_jq *sq, struct fiber_job *buffer,
+				qsize n);
+
+int fiber_queue_seg_init(void **queue, qsize capacity, void *(*malloc)(size_t),
+			 void (*free)(void *))
+{
+	assert(queue != NULL, "seg_init received a NULL queue");
+	assert(capacity > 0, "seg_init received a bad capacity");
+	assert(malloc != NULL, "seg_init received a NULL malloc func");
+	assert(free != NULL, "seg_init received a NULL free func");
+	int error_code = 0;
+	int tail_lock_res = -1, head_lock_res = -1, spare_lock_res = -1;
+	struct seg_jq_seg *seg = NULL;
+	struct seg_jq *sq = malloc(sizeof(*sq));
+	if (sq == NULL) {
+		error_code = ENOMEM;
+		goto err;
+	}
+	seg = malloc(sizeof(*seg));
+	if (seg == NULL) {
+		error_code = ENOMEM;
+		goto err;
+	}
+	tail_lock_res = pthread_mutex_init(&sq->tail_lock, NULL);
+	if (tail_lock_res != 0) {
+		error_code = __fiber_mutex_init_get_err(tail_lock_res);
+		goto err;
+	}
+	head_lock_res = pthread_mutex_init(&sq->head_lock, NULL);
+	if (head_lock_res != 0) {
+		error_code = __fiber_mutex_init_get_err(head_lock_res);
+		goto err;
+	}
+	spare_lock_res = pthread_mutex_init(&sq->spare_lock, NULL);
+	if (spare_lock_res != 0) {
+		error_code = __fiber_mutex_init_get_err(spare_lock_res);
+		goto err;
+	}
+	fiber_park_sem_init(&sq->jobs_num, 0, FIBER_PARK_SPIN_DEFAULT);
+	fiber_park_event_init(&sq->room, FIBER_PARK_SPIN_DEFAULT);
+
+	seg->next = NULL;
+	sq->tail_seg = seg;
+	sq->tail = 0;
+	sq->head_seg = seg;
+	sq->head = 0;
+	sq->spare = NULL;
+	sq->spare_num = 0;
+	sq->spare_max = (capacity + FIBER_SEG_JOBS - 1) / FIBER_SEG_JOBS;
+	sq->high_water = 0;
+	sq->malloc = malloc;
+	sq->free = free;
+	*queue = sq;
+
+	return 0;
+err:
+	if (seg != NULL)
+		free(seg);
+	if (tail_lock_res == 0)
+		pthread_mutex_destroy(&sq->tail_lock);
+	if (head_lock_res == 0)
+		pthread_mutex_destroy(&sq->head_lock);
+	if (sq != NULL)
+		free(sq);
+	return error_code;
+}
+
+int fiber_queue_seg_push(void *queue, struct fiber_job *job, uint32_t flags)
+{
+	assert(queue != NULL, "seg_push given NULL queue");
+	assert(job != NULL, "seg_push given NULL job");
+	assert(job->job_func != NULL, "seg_push given NULL job_func");
+	struct seg_jq *sq = (struct seg_jq *)queue;
+	int room_res = seg_wait_room(sq, flags);
+	if (room_res != 0) {
+		return room_res;
+	}
+
+	pthread_mutex_lock(&sq->tail_lock);
+	qsize pushed = seg_copy_in(sq, job, 1);
+	pthread_mutex_unlock(&sq->tail_lock);
+	if (pushed == 0) {
+		return -ENOMEM;
+	}
+	fiber_park_sem_post(&sq->jobs_num, 1);
+	return 0;
+}
+
+int fiber_queue_seg_pop(void *queue, struct fiber_job *buffer, uint32_t flags)
+{
+	assert(queue != NULL, "seg_pop given NULL queue");
+	assert(buffer != NULL, "seg_pop given NULL job buffer");
+	return fiber_queue_seg_pop_n(queue, buffer, 1, flags) == 1 ? 0 : EAGAIN;
+}
+
+qsize fiber_queue_seg_push_n(void *queue, struct fiber_job *jobs, qsize n,
+			     uint32_t flags)
+{
+	assert(queue != NULL, "seg_push_n given NULL queue");
+	assert(jobs != NULL, "seg_push_n given NULL jobs");
+	struct seg_jq *sq = (struct seg_jq *)queue;
+	int room_res = seg_wait_room(sq, flags);
+	if (room_res != 0) {
+		return room_res;
+	}
+	pthread_mutex_lock(&sq->tail_lock);
+	qsize pushed = seg_copy_in(sq, jobs, n);
+	pthread_mutex_unlock(&sq->tail_lock);
+	if (pushed == 0) {
+		return -ENOMEM;
+	}
+	fiber_park_sem_post(&sq->jobs_num, pushed);
+	return pushed;
+}
+
+qsize fiber_queue_seg_pop_n(void *queue, struct fiber_job *buffer, qsize n,
+			    uint32_t flags)
+{
+	assert(queue != NULL, "seg_pop_n given NULL queue");
+	assert(buffer != NULL, "seg_pop_n given NULL job buffer");
+	struct seg_jq *sq = (struct seg_jq *)queue;
+	qsize taken = fiber_park_sem_take(&sq->jobs_num, n, flags & FIBER_BLOCK);
+	if (taken == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&sq->head_lock);
+	seg_copy_out(sq, buffer, taken);
+	pthread_mutex_unlock(&sq->head_lock);
+	if (__atomic_load_n(&sq->high_water, __ATOMIC_RELAXED) > 0) {
+		fiber_park_event_notify(&sq->room, INT_MAX);
+	}
+	return taken;
+}
+
+void fiber_queue_seg_set_park_spin(void *queue, uint32_t spin)
+{
+	assert(queue != NULL, "seg_set_park_spin given NULL queue");
+	struct seg_jq *sq = (struct seg_jq *)queue;
+	sq->jobs_num.spin = spin;
+	sq->room.spin = spin;
+}
+
+void fiber_queue_seg_set_high_water(void *queue, qsize mark)
+{
+	assert(queue != NULL, "seg_set_high_water given NULL queue");
+	assert(mark >= 0, "seg_set_high_water given a negative mark");
+	struct seg_jq *sq = (struct seg_jq *)queue;
+	__atomic_store_n(&sq->high_water, mark, __ATOMIC_RELAXED);
+	// Waiters on the old mark may have room now
+	__atomic_add_fetch(&sq->room.seq, 1, __ATOMIC_RELEASE);
+	fiber_park_wake(&sq->room.seq, INT_MAX);
+}
+
+void fiber_queue_seg_free(void *queue)
+{
+	assert(queue != NULL, "seg_free given NULL queue");
+	struct seg_jq *sq = (struct seg_jq *)queue;
+	struct seg_jq_seg *seg = sq->head_seg;
+	while (seg != NULL) {
+		struct seg_jq_seg *next = seg->next;
+		sq->free(seg);
+		seg = next;
+	}
+	seg = sq->spare;
+	while (seg != NULL) {
+		struct seg_jq_seg *next = seg->next;
+		sq->free(seg);
+		seg = next;
+	}
+	pthread_mutex_destroy(&sq->tail_lock);
+	pthread_mutex_destroy(&sq->head_lock);
+	pthread_mutex_destroy(&sq->spare_lock);
+	sq->free(sq);
+}
+
+qsize fiber_queue_seg_length(void *queue)
+{
+	assert(queue != NULL, "seg_length given NULL queue");
+	struct seg_jq *sq = (struct seg_jq *)queue;
+	return fiber_park_sem_value(&sq->jobs_num);
+}
+
+/* Waits while the queue is at its high-water mark.
+ * @returns: 0 once there is room, -EAGAIN if there is none and FIBER_BLOCK
+ * isn't in flags.
+ */
+static inline int seg_wait_room(struct seg_jq *sq, uint32_t flags)
+{
+	while (1) {
+		qsize mark = __atomic_load_n(&sq->high_water, __ATOMIC_RELAXED);
+		if (mark == 0 ||
+		    fiber_park_sem_value(&sq->jobs_num) < (uint32_t)mark) {
+			return 0;
+		}
+		if (!(flags & FIBER_BLOCK)) {
+			return -EAGAIN;
+		}
+		uint32_t key = fiber_park_event_prepare(&sq->room);
+		if (fiber_park_sem_value(&sq->jobs_num) < (uint32_t)mark) {
+			fiber_park_event_cancel(&sq->room);
+			return 0;
+		}
+		fiber_park_event_wait(&sq->room, key, NULL);
+	}
+}
+
+static inline struct seg_jq_seg *seg_get(struct seg_jq *sq)
+{
+	pthread_mutex_lock(&sq->spare_lock);
+	struct seg_jq_seg *seg = sq->spare;
+	if (seg != NULL) {
+		sq->spare = seg->next;
+		--sq->spare_num;
+	}
+	pthread_mutex_unlock(&sq->spare_lock);
+	if (seg == NULL) {
+		seg = sq->malloc(sizeof(*seg));
+		if (seg == NULL) {
+			return NULL;
+		}
+	}
+	seg->next = NULL;
+	return seg;
+}
+
+// Keeps seg for reuse unless spare_max are kept already
+static inline void seg_put(struct seg_jq *sq, struct seg_jq_seg *seg)
+{
+	pthread_mutex_lock(&sq->spare_lock);
+	int keep = sq->spare_num < sq->spare_max;
+	if (keep) {
+		seg->next = sq->spare;
+		sq->spare = seg;
+		++sq->spare_num;
+	}
+	pthread_mutex_unlock(&sq->spare_lock);
+	if (!keep) {
+		sq->free(seg);
+	}
+}
+
+/* Caller holds tail_lock. Links new segments as the tail one fills.
+ * @returns: The number of jobs copied, less than n only if malloc failed.
+ */
+static inline qsize seg_copy_in(struct seg_jq *sq, struct fiber_job *jobs,
+				qsize n)
+{
+	qsize copied = 0;
+	while (copied < n) {
+		if (sq->tail == FIBER_SEG_JOBS) {
+			struct seg_jq_seg *seg = seg_get(sq);
+			if (seg == NULL) {
+				break;
+			}
+			// Consumers only follow next once a job in seg is
+			// posted, which happens after this
+			sq->tail_seg->next = seg;
+			sq->tail_seg = seg;
+			sq->tail = 0;
+		}
+		qsize chunk = FIBER_SEG_JOBS - sq->tail;
+		if (chunk > n - copied) {
+			chunk = n - copied;
+		}
+		memcpy(&sq->tail_seg->jobs[sq->tail], jobs + copied,
+		       chunk * sizeof(*jobs));
+		sq->tail += chunk;
+		copied += chunk;
+	}
+	return copied;
+}
+
+// Caller holds head_lock and has taken n from jobs_num
+static inline void seg_copy_out(struct seg_jq *sq, struct fiber_job *buffer,
+				qsize n)
+{
+	qsize copied = 0;
+	while (copied < n) {
+		if (sq->head == FIBER_SEG_JOBS) {
+			struct seg_jq_seg *done = sq->head_seg;
+			sq->head_seg = done->next;
+			sq->head = 0;
+			seg_put(sq, done);
+		}
+		qsize chunk = FIBER_SEG_JOBS - sq->head;
+		if (chunk > n - copied) {
+			chunk = n - copied;
+		}
+		memcpy(buffer + copied, &sq->head_seg->jobs[sq->head],
+		       chunk * sizeof(*buffer));
+		sq->head += chunk;
+		copied += chunk;
+	}
+}
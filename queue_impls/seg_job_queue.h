@@ -0,0 +1,82 @@
+/* See LICENSE file for copyright and license details. */
+
+#ifndef _FIBER_SEG_JOB_QUEUE_H
+#define _FIBER_SEG_JOB_QUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fiber_park.h"
+#include "job_queue.h"
+
+/* Unbounded FIFO built from linked segments of FIBER_SEG_JOBS jobs. A push
+ * never waits for room, it links a new segment when the tail one is full.
+ * Emptied segments go on a spare list for the next burst. Spares past the
+ * capacity passed to init are freed, so memory shrinks back once a burst is
+ * drained.
+ *
+ * For backpressure, fiber_queue_seg_set_high_water sets a soft limit. Pushes
+ * that find that many jobs queued wait, or fail without FIBER_BLOCK. A
+ * push_n that gets in may take the queue past the mark.
+ */
+
+#ifndef FIBER_SEG_JOBS
+#define FIBER_SEG_JOBS 128
+#endif
+
+struct seg_jq_seg {
+	struct seg_jq_seg *next;
+	struct fiber_job jobs[FIBER_SEG_JOBS];
+};
+
+struct seg_jq {
+	struct fiber_park_sem jobs_num;
+	// Notified by pops while high_water is set
+	struct fiber_park_event room;
+	// Producers serialize on tail, consumers on head
+	pthread_mutex_t tail_lock;
+	pthread_mutex_t head_lock;
+	struct seg_jq_seg *tail_seg;
+	qsize tail;
+	struct seg_jq_seg *head_seg;
+	qsize head;
+	// Emptied segments, shared by both sides
+	pthread_mutex_t spare_lock;
+	struct seg_jq_seg *spare;
+	qsize spare_num;
+	qsize spare_max;
+	// 0 when unbounded
+	qsize high_water;
+	void *(*malloc)(size_t);
+	void (*free)(void *);
+};
+
+/* capacity is how many jobs' worth of segments are kept once they are
+ * emptied. The queue itself has no fixed size.
+ */
+int fiber_queue_seg_init(void **queue, qsize capacity, void *(*malloc)(size_t),
+			 void (*free)(void *));
+
+/* @returns: 0 on success, -EAGAIN if FIBER_BLOCK isn't set and the queue is
+ * at its high-water mark, -ENOMEM if a segment could not be allocated.
+ */
+int fiber_queue_seg_push(void *queue, struct fiber_job *job, uint32_t flags);
+
+int fiber_queue_seg_pop(void *queue, struct fiber_job *buffer, uint32_t flags);
+
+qsize fiber_queue_seg_push_n(void *queue, struct fiber_job *jobs, qsize n,
+			     uint32_t flags);
+
+qsize fiber_queue_seg_pop_n(void *queue, struct fiber_job *buffer, qsize n,
+			    uint32_t flags);
+
+void fiber_queue_seg_set_park_spin(void *queue, uint32_t spin);
+
+/* Sets the soft limit on queued jobs. 0, the default, disables it. */
+void fiber_queue_seg_set_high_water(void *queue, qsize mark);
+
+void fiber_queue_seg_free(void *queue);
+
+qsize fiber_queue_seg_length(void *queue);
+
+#endif // _FIBER_SEG_JOB_QUEUE_H
@@ -0,0 +1,110 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define LOAD_JOBS 64
+#define SLEEP_US 5000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 1,
+	.queue_length = 128,
+	.flags = FIBER_OPT_AUTOSCALE,
+	.autoscale = { .threads_min = 1,
+		       .threads_max = 4,
+		       .idle_timeout_ms = 50 },
+};
+
+void *sleep_job(void *arg)
+{
+	usleep(SLEEP_US);
+	return NULL;
+}
+
+// Polls for up to a second, returns the last thread count seen
+static tpsize wait_for_threads(tpsize expected)
+{
+	tpsize threads = fiber_threads_number(&pool);
+	for (int tries = 0; tries < 100 && threads != expected; ++tries) {
+		usleep(10000);
+		threads = fiber_threads_number(&pool);
+	}
+	return threads;
+}
+
+TEST(autoscale_bad_bounds)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 5;
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_init(&pool, &opts));
+	opts.threads_number = 1;
+	opts.autoscale.threads_min = 2;
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_init(&pool, &opts));
+	opts.autoscale.threads_min = 0;
+	opts.autoscale.threads_max = 0;
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_init(&pool, &opts));
+	struct fiber_queue_operations ops = {
+		.init = fiber_queue_fifo_init,
+		.free = fiber_queue_fifo_free,
+		.push = fiber_queue_fifo_push,
+		.pop = fiber_queue_fifo_pop,
+	};
+	opts = default_opts;
+	opts.queue_ops = &ops;
+	ASSERT_EQUAL_INT(FBR_EQUEOPS_NONE, fiber_init(&pool, &opts));
+}
+
+TEST(autoscale_grows_under_load)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = sleep_job };
+	for (int i = 0; i < LOAD_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	tpsize threads = wait_for_threads(4);
+	ASSERT_EQUAL_INT(4, threads);
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+TEST(autoscale_retires_idle)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = sleep_job };
+	for (int i = 0; i < LOAD_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	tpsize threads = wait_for_threads(1);
+	ASSERT_EQUAL_INT(1, threads);
+	// Still runs jobs after shrinking
+	fiber_job_push(&pool, &job, FIBER_BLOCK);
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+TEST(autoscale_keeps_min)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 3;
+	opts.autoscale.threads_min = 2;
+	opts.autoscale.idle_timeout_ms = 10;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	tpsize threads = wait_for_threads(2);
+	ASSERT_EQUAL_INT(2, threads);
+	usleep(200000);
+	threads = fiber_threads_number(&pool);
+	ASSERT_EQUAL_INT(2, threads);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,182 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define CANCEL_JOBS 100
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 1,
+	.queue_length = CANCEL_JOBS * 2,
+	.flags = FIBER_OPT_CANCEL,
+};
+
+static long executed = 0;
+static int held = 0;
+static int release = 0;
+static int stopped = 0;
+
+void *count_job(void *arg)
+{
+	__atomic_add_fetch(&executed, 1, __ATOMIC_RELAXED);
+	return (void *)1;
+}
+
+void *hold_job(void *arg)
+{
+	__atomic_store_n(&held, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&release, __ATOMIC_ACQUIRE)) {
+		usleep(100);
+	}
+	return NULL;
+}
+
+// Runs until it is cancelled
+void *poll_job(void *arg)
+{
+	__atomic_store_n(&held, 1, __ATOMIC_RELEASE);
+	while (!fiber_job_cancelled()) {
+		usleep(100);
+	}
+	__atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Keeps the only worker busy until release is set
+static void hold_worker(void)
+{
+	__atomic_store_n(&held, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&release, 0, __ATOMIC_RELAXED);
+	struct fiber_job hold = { .job_func = hold_job };
+	fiber_job_push(&pool, &hold, FIBER_BLOCK);
+	while (!__atomic_load_n(&held, __ATOMIC_ACQUIRE)) {
+		usleep(100);
+	}
+}
+
+TEST(cancel_queued_jobs_are_skipped)
+{
+	__atomic_store_n(&executed, 0, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	hold_worker();
+	jid ids[CANCEL_JOBS];
+	struct fiber_job job = { .job_func = count_job };
+	for (int i = 0; i < CANCEL_JOBS; ++i) {
+		ids[i] = fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	for (int i = 0; i < CANCEL_JOBS; i += 2) {
+		ASSERT_EQUAL_INT(0, fiber_job_cancel(&pool, ids[i]));
+	}
+	// Cancelling twice is fine
+	ASSERT_EQUAL_INT(0, fiber_job_cancel(&pool, ids[0]));
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	fiber_wait(&pool);
+	long ran = __atomic_load_n(&executed, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_LONG((long)(CANCEL_JOBS / 2), ran);
+	// Finished jobs can't be cancelled
+	ASSERT_EQUAL_INT(FBR_ENO_JOB, fiber_job_cancel(&pool, ids[1]));
+	fiber_free(&pool);
+}
+
+TEST(cancel_counts_down_group_and_future)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	hold_worker();
+	struct fiber_group group;
+	ASSERT_EQUAL_INT(0, fiber_group_init(&group, &pool));
+	struct fiber_job job = { .job_func = count_job };
+	jid grouped = fiber_group_push(&group, &job, FIBER_BLOCK);
+	struct fiber_future future;
+	jid futured = fiber_job_push_future(&pool, &job, FIBER_BLOCK, &future);
+	ASSERT_EQUAL_INT(0, fiber_job_cancel(&pool, grouped));
+	ASSERT_EQUAL_INT(0, fiber_job_cancel(&pool, futured));
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	ASSERT_EQUAL_INT(0, fiber_group_wait(&group));
+	void *result = (void *)-1;
+	ASSERT_EQUAL_INT(0, fiber_future_wait(&pool, &future, &result));
+	ASSERT_EQUAL_PTR(NULL, result);
+	fiber_free(&pool);
+}
+
+TEST(cancel_running_job_sets_token)
+{
+	__atomic_store_n(&held, 0, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = poll_job };
+	jid id = fiber_job_push(&pool, &job, FIBER_BLOCK);
+	while (!__atomic_load_n(&held, __ATOMIC_ACQUIRE)) {
+		usleep(100);
+	}
+	ASSERT_EQUAL_INT(FBR_EJOB_RUNNING, fiber_job_cancel(&pool, id));
+	fiber_wait(&pool);
+	int stop = __atomic_load_n(&stopped, __ATOMIC_ACQUIRE);
+	ASSERT_EQUAL_INT(1, stop);
+	// Not in a job
+	ASSERT_EQUAL_INT(0, fiber_job_cancelled());
+	fiber_free(&pool);
+}
+
+TEST(cancel_pending_timer)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.flags |= FIBER_OPT_TIMERS;
+	__atomic_store_n(&executed, 0, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = count_job };
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 20000000 };
+	jid id = fiber_job_push_after(&pool, &job, &delay);
+	ASSERT_EQUAL_INT(0, fiber_job_cancel(&pool, id));
+	usleep(50000);
+	fiber_wait(&pool);
+	long ran = __atomic_load_n(&executed, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_LONG(0L, ran);
+	fiber_free(&pool);
+}
+
+TEST(cancel_unpushed_jobs_fails)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.queue_length = CANCEL_JOBS / 4;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	hold_worker();
+	struct fiber_job jobs[CANCEL_JOBS];
+	for (int i = 0; i < CANCEL_JOBS; ++i) {
+		jobs[i] = (struct fiber_job){ .job_func = count_job };
+	}
+	qsize pushed = fiber_job_push_n(&pool, jobs, CANCEL_JOBS, 0);
+	int partial = pushed > 0 && pushed < CANCEL_JOBS;
+	ASSERT_TRUE(partial);
+	ASSERT_EQUAL_INT(0, fiber_job_cancel(&pool, jobs[0].job_id));
+	ASSERT_EQUAL_INT(FBR_ENO_JOB,
+			 fiber_job_cancel(&pool, jobs[pushed].job_id));
+	ASSERT_EQUAL_INT(FBR_ENO_JOB,
+			 fiber_job_cancel(&pool, jobs[CANCEL_JOBS - 1].job_id));
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+TEST(cancel_errors)
+{
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_job_cancel(NULL, 0));
+	struct fiber_pool_init_options opts = default_opts;
+	opts.flags = 0;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_job_cancel(&pool, 0));
+	fiber_free(&pool);
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_INT(FBR_ENO_JOB, fiber_job_cancel(&pool, 0));
+	ASSERT_EQUAL_INT(FBR_ENO_JOB, fiber_job_cancel(&pool, -1));
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,116 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define DEFAULT_THREADS_NUMBER 2
+#define FUTURES_NUMBER 4
+#define RECYCLE_ROUNDS 1000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = DEFAULT_THREADS_NUMBER,
+	.queue_length = 64,
+	.futures_number = FUTURES_NUMBER,
+};
+
+void *double_it(void *arg)
+{
+	return (void *)((long)arg * 2);
+}
+
+static int gate = 0;
+void *wait_gate(void *arg)
+{
+	while (!__atomic_load_n(&gate, __ATOMIC_ACQUIRE)) {
+		usleep(1000);
+	}
+	return arg;
+}
+
+TEST(future_wait_result)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = double_it, .job_arg = (void *)21 };
+	struct fiber_future fut;
+	jid id = fiber_job_push_future(&pool, &job, FIBER_BLOCK, &fut);
+	ASSERT_EQUAL_LONG(job.job_id, id);
+	ASSERT_EQUAL_LONG(id, fut.job_id);
+	void *res = NULL;
+	ASSERT_EQUAL_INT(0, fiber_future_wait(&pool, &fut, &res));
+	ASSERT_EQUAL_LONG(42L, (long)res);
+	// Consumed, a second wait must not hang
+	ASSERT_EQUAL_INT(FBR_EINVLD_FUTURE, fiber_future_wait(&pool, &fut, &res));
+	fiber_free(&pool);
+}
+
+TEST(future_try_get_and_timeout)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = wait_gate, .job_arg = (void *)7 };
+	struct fiber_future fut;
+	ASSERT_EQUAL_INT(1, fiber_job_push_future(&pool, &job, FIBER_BLOCK,
+						  &fut) >= 0);
+	void *res = NULL;
+	ASSERT_EQUAL_INT(EAGAIN, fiber_future_try_get(&pool, &fut, &res));
+	struct timespec timeout = { .tv_sec = 0, .tv_nsec = 20000000 };
+	ASSERT_EQUAL_INT(ETIMEDOUT,
+			 fiber_future_wait_timeout(&pool, &fut, &res, &timeout));
+	__atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+	timeout.tv_sec = 5;
+	ASSERT_EQUAL_INT(0,
+			 fiber_future_wait_timeout(&pool, &fut, &res, &timeout));
+	ASSERT_EQUAL_LONG(7L, (long)res);
+	fiber_free(&pool);
+}
+
+TEST(future_exhausted)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = wait_gate, .job_arg = NULL };
+	struct fiber_future futs[FUTURES_NUMBER + 1];
+	for (int i = 0; i < FUTURES_NUMBER; ++i) {
+		ASSERT_EQUAL_INT(1, fiber_job_push_future(&pool, &job,
+							  FIBER_BLOCK,
+							  &futs[i]) >= 0);
+	}
+	ASSERT_EQUAL_LONG((jid)FBR_ENO_FUTURE,
+			  fiber_job_push_future(&pool, &job, FIBER_BLOCK,
+						&futs[FUTURES_NUMBER]));
+	__atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < FUTURES_NUMBER; ++i) {
+		ASSERT_EQUAL_INT(0, fiber_future_wait(&pool, &futs[i], NULL));
+	}
+	fiber_free(&pool);
+}
+
+TEST(future_discard_recycles)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = double_it, .job_arg = (void *)1 };
+	struct fiber_future fut;
+	for (int i = 0; i < RECYCLE_ROUNDS; ++i) {
+		jid res;
+		// Discarded slots come back once their job has run
+		while ((res = fiber_job_push_future(&pool, &job, FIBER_BLOCK,
+						    &fut)) == FBR_ENO_FUTURE) {
+			sched_yield();
+		}
+		ASSERT_EQUAL_INT(1, res >= 0);
+		ASSERT_EQUAL_INT(0, fiber_future_discard(&pool, &fut));
+		ASSERT_EQUAL_INT(FBR_EINVLD_FUTURE,
+				 fiber_future_discard(&pool, &fut));
+	}
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
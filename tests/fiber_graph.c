@@ -0,0 +1,253 @@
+#include <stdlib.h>
+
+#include "fiber.h"
+#include "fiber_graph.h"
+#include "xtal.h"
+
+#define DEFAULT_THREADS_NUMBER 4
+#define CHUNKS 16
+#define STAGES 3
+#define FAN_OUT 32
+#define CHAIN 20000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = DEFAULT_THREADS_NUMBER,
+	.queue_length = 64,
+};
+
+static struct fiber_graph graph;
+
+// Order in which each node ran, starting at 1
+static long ticket = 0;
+static long order[CHUNKS * STAGES + FAN_OUT + 1];
+void *stamp(void *arg)
+{
+	long idx = (long)arg;
+	order[idx] = __atomic_add_fetch(&ticket, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static int add_node(long idx)
+{
+	struct fiber_job job = { .job_func = stamp, .job_arg = (void *)idx };
+	return fiber_graph_add(&graph, &job);
+}
+
+TEST(graph_bad_args)
+{
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_graph_init(NULL, &pool, 1, 1));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, fiber_graph_init(&graph, &pool, 0, 1));
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, 2, 1));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, fiber_graph_submit(&graph, 0));
+	ASSERT_EQUAL_INT(0, add_node(0));
+	ASSERT_EQUAL_INT(1, add_node(1));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, add_node(2));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, fiber_graph_edge(&graph, 0, 0));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, fiber_graph_edge(&graph, 0, 2));
+	ASSERT_EQUAL_INT(0, fiber_graph_edge(&graph, 0, 1));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, fiber_graph_edge(&graph, 1, 0));
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+TEST(graph_cycle_rejected)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, 3, 3));
+	for (long i = 0; i < 3; ++i) {
+		add_node(i);
+	}
+	fiber_graph_edge(&graph, 0, 1);
+	fiber_graph_edge(&graph, 1, 2);
+	fiber_graph_edge(&graph, 2, 1);
+	ASSERT_EQUAL_INT(FBR_EGRAPH_CYCLE,
+			 fiber_graph_submit(&graph, FIBER_BLOCK));
+	fiber_graph_wait(&graph);
+	ASSERT_EQUAL_LONG(0L, ticket);
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+TEST(graph_diamond_order)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, 4, 4));
+	for (long i = 0; i < 4; ++i) {
+		add_node(i);
+	}
+	fiber_graph_edge(&graph, 0, 1);
+	fiber_graph_edge(&graph, 0, 2);
+	fiber_graph_edge(&graph, 1, 3);
+	fiber_graph_edge(&graph, 2, 3);
+	ASSERT_EQUAL_INT(0, fiber_graph_submit(&graph, FIBER_BLOCK));
+	fiber_graph_wait(&graph);
+	ASSERT_EQUAL_LONG(4L, ticket);
+	ASSERT_EQUAL_LONG(1L, order[0]);
+	ASSERT_EQUAL_LONG(4L, order[3]);
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+TEST(graph_pipelines_resubmit)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, CHUNKS * STAGES,
+					     CHUNKS * (STAGES - 1)));
+	for (long i = 0; i < CHUNKS * STAGES; ++i) {
+		add_node(i);
+	}
+	// Node chunk * STAGES + s is stage s of chunk
+	for (int c = 0; c < CHUNKS; ++c) {
+		for (int s = 1; s < STAGES; ++s) {
+			fiber_graph_edge(&graph, c * STAGES + s - 1,
+					 c * STAGES + s);
+		}
+	}
+	for (int run = 1; run <= 2; ++run) {
+		ASSERT_EQUAL_INT(0, fiber_graph_submit(&graph, FIBER_BLOCK));
+		fiber_graph_wait(&graph);
+		ASSERT_EQUAL_LONG((long)run * CHUNKS * STAGES, ticket);
+		for (int c = 0; c < CHUNKS; ++c) {
+			for (int s = 1; s < STAGES; ++s) {
+				ASSERT_EQUAL_INT(1,
+						 order[c * STAGES + s - 1] <
+							 order[c * STAGES + s]);
+			}
+		}
+	}
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+TEST(graph_full_queue_runs_inline)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.queue_length = 1;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, FAN_OUT + 1,
+					     FAN_OUT));
+	add_node(FAN_OUT);
+	for (long i = 0; i < FAN_OUT; ++i) {
+		add_node(i);
+		fiber_graph_edge(&graph, 0, i + 1);
+	}
+	ASSERT_EQUAL_INT(0, fiber_graph_submit(&graph, FIBER_BLOCK));
+	fiber_graph_wait(&graph);
+	ASSERT_EQUAL_LONG((long)FAN_OUT + 1, ticket);
+	ASSERT_EQUAL_LONG(1L, order[FAN_OUT]);
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+void *count(void *arg)
+{
+	__atomic_add_fetch(&ticket, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(graph_long_chain_full_queue)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.queue_length = 1;
+	// Runs nodes on small task stacks
+	opts.flags = FIBER_OPT_STACKFUL;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, CHAIN * 2,
+					     CHAIN * 2));
+	struct fiber_job job = { .job_func = count };
+	for (int i = 0; i < CHAIN; ++i) {
+		fiber_graph_add(&graph, &job);
+		fiber_graph_add(&graph, &job);
+	}
+	// Edges added last are followed first, so each leaf fills the queue
+	// and the next link of the chain has to run inline
+	for (int i = 0; i < CHAIN; ++i) {
+		if (i + 1 < CHAIN) {
+			fiber_graph_edge(&graph, i * 2, (i + 1) * 2);
+		}
+		fiber_graph_edge(&graph, i * 2, i * 2 + 1);
+	}
+	ASSERT_EQUAL_INT(0, fiber_graph_submit(&graph, FIBER_BLOCK));
+	fiber_graph_wait(&graph);
+	ASSERT_EQUAL_LONG((long)CHAIN * 2, ticket);
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+TEST(graph_free_arg_ignored)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, 2, 1));
+	add_node(0);
+	add_node(1);
+	fiber_graph_edge(&graph, 0, 1);
+	// The wrapper jobs' job_arg is the node, it must not be released
+	int res = fiber_graph_submit(&graph, FIBER_BLOCK | FIBER_FREE_ARG);
+	ASSERT_EQUAL_INT(0, res);
+	fiber_graph_wait(&graph);
+	ASSERT_EQUAL_LONG(2L, ticket);
+	ASSERT_EQUAL_LONG(2L, order[1]);
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+TEST(graph_inline_arg_rejected)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, 1, 0));
+	add_node(0);
+	int res = fiber_graph_submit(&graph, FIBER_BLOCK | FIBER_INLINE_ARG);
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, res);
+	fiber_graph_wait(&graph);
+	ASSERT_EQUAL_LONG(0L, ticket);
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+static int held = 1;
+void *hold(void *arg)
+{
+	__atomic_store_n((int *)arg, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&held, __ATOMIC_ACQUIRE)) {
+	}
+	return NULL;
+}
+
+TEST(graph_nodes_not_cancellable)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.flags = FIBER_OPT_CANCEL;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(0, fiber_graph_init(&graph, &pool, 2, 1));
+	add_node(0);
+	add_node(1);
+	fiber_graph_edge(&graph, 0, 1);
+	// Keeps the only worker busy so node 0 stays queued
+	int started = 0;
+	struct fiber_job job = { .job_func = hold, .job_arg = &started };
+	fiber_job_push(&pool, &job, FIBER_BLOCK);
+	while (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+	}
+	ASSERT_EQUAL_INT(0, fiber_graph_submit(&graph, FIBER_BLOCK));
+	int res = fiber_job_cancel(&pool, graph.nodes[0].job.job_id);
+	ASSERT_EQUAL_INT(FBR_ENO_JOB, res);
+	__atomic_store_n(&held, 0, __ATOMIC_RELEASE);
+	fiber_graph_wait(&graph);
+	ASSERT_EQUAL_LONG(2L, ticket);
+	fiber_graph_free(&graph);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,149 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define GROUP_JOBS 1000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 4,
+	.queue_length = GROUP_JOBS * 2,
+	.flags = 0,
+};
+
+static int release = 0;
+static int fast_done = 0;
+
+void *held(void *arg)
+{
+	while (!__atomic_load_n(&release, __ATOMIC_ACQUIRE)) {
+		usleep(100);
+	}
+	return NULL;
+}
+
+void *fast(void *arg)
+{
+	__atomic_add_fetch(&fast_done, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(wait_ignores_other_groups)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_group slow;
+	struct fiber_group quick;
+	ASSERT_EQUAL_INT(0, fiber_group_init(&slow, &pool));
+	ASSERT_EQUAL_INT(0, fiber_group_init(&quick, &pool));
+	struct fiber_job job = { .job_func = held };
+	fiber_group_push(&slow, &job, FIBER_BLOCK);
+	job.job_func = fast;
+	for (int i = 0; i < GROUP_JOBS; ++i) {
+		fiber_group_push(&quick, &job, FIBER_BLOCK);
+	}
+	ASSERT_EQUAL_INT(0, fiber_group_wait(&quick));
+	int done = __atomic_load_n(&fast_done, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_INT(GROUP_JOBS, done);
+	qsize pending = fiber_group_pending(&slow);
+	ASSERT_EQUAL_INT(1, pending);
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	ASSERT_EQUAL_INT(0, fiber_group_wait(&slow));
+	pending = fiber_group_pending(&slow);
+	ASSERT_EQUAL_INT(0, pending);
+	fiber_free(&pool);
+}
+
+TEST(push_n_counts_every_job)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_group group;
+	fiber_group_init(&group, &pool);
+	struct fiber_job jobs[64];
+	for (int i = 0; i < 64; ++i) {
+		jobs[i].job_func = fast;
+		jobs[i].job_arg = NULL;
+	}
+	for (int i = 0; i < GROUP_JOBS / 64; ++i) {
+		qsize pushed = fiber_group_push_n(&group, jobs, 64, FIBER_BLOCK);
+		ASSERT_EQUAL_INT(64, pushed);
+	}
+	fiber_group_wait(&group);
+	int done = __atomic_load_n(&fast_done, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_INT(GROUP_JOBS / 64 * 64, done);
+	fiber_free(&pool);
+}
+
+static struct fiber_group nested;
+
+void *spawn(void *arg)
+{
+	uintptr_t depth = (uintptr_t)arg;
+	__atomic_add_fetch(&fast_done, 1, __ATOMIC_RELAXED);
+	if (depth > 0) {
+		struct fiber_job job = { .job_func = spawn,
+					 .job_arg = (void *)(depth - 1) };
+		fiber_group_push(&nested, &job, FIBER_BLOCK);
+		fiber_group_push(&nested, &job, FIBER_BLOCK);
+	}
+	return NULL;
+}
+
+TEST(jobs_push_into_own_group)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	fiber_group_init(&nested, &pool);
+	struct fiber_job job = { .job_func = spawn, .job_arg = (void *)6 };
+	fiber_group_push(&nested, &job, FIBER_BLOCK);
+	fiber_group_wait(&nested);
+	// Full binary tree of depth 6
+	int done = __atomic_load_n(&fast_done, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_INT(127, done);
+	fiber_free(&pool);
+}
+
+void *slow(void *arg)
+{
+	usleep(100000);
+	return NULL;
+}
+
+TEST(wait_clears_waiters_bit)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_group group;
+	fiber_group_init(&group, &pool);
+	struct fiber_job job = { .job_func = slow };
+	fiber_group_push(&group, &job, FIBER_BLOCK);
+	// Sleeps on the group, so the last job sees the waiters bit
+	ASSERT_EQUAL_INT(0, fiber_group_wait(&group));
+	// A reused group doesn't wake anyone unless someone waits again
+	ASSERT_EQUAL_INT(0, (int)group.pending);
+	fiber_free(&pool);
+}
+
+TEST(group_errors)
+{
+	struct fiber_group group;
+	struct fiber_job job = { .job_func = fast };
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_group_init(NULL, &pool));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_group_init(&group, NULL));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_group_push(NULL, &job, 0));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_group_wait(NULL));
+	ASSERT_EQUAL_INT(0, fiber_group_init(&group, &pool));
+	// A failed push isn't counted
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_group_push(&group, NULL, 0));
+	qsize pending = fiber_group_pending(&group);
+	ASSERT_EQUAL_INT(0, pending);
+	ASSERT_EQUAL_INT(0, fiber_group_wait(&group));
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -1,3 +1,7 @@
+#define _DEFAULT_SOURCE
+#include <sys/resource.h>
+#include <unistd.h>
+
 #include "fiber.c"
 #include "xtal.h"
 
@@ -117,6 +121,32 @@ TEST(init_normal)
 	fiber_free(&pool);
 }
 
+TEST(free_waits_for_workers)
+{
+	// Workers are still parking on the queue when it's freed
+	for (int i = 0; i < 100; ++i) {
+		ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+		fiber_free(&pool);
+		ASSERT_EQUAL_INT(0, (int)pool.threads_live);
+	}
+}
+
+TEST(idle_pool_sleeps)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	// Give the workers time to park
+	usleep(100000);
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	usleep(500000);
+	getrusage(RUSAGE_SELF, &after);
+	// Our own sleep, parked workers must not wake up on their own
+	long switches = after.ru_nvcsw - before.ru_nvcsw;
+	int quiet = switches < 5;
+	ASSERT_TRUE(quiet);
+	fiber_free(&pool);
+}
+
 int main()
 {
 	run_tests();
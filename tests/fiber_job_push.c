@@ -0,0 +1,418 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define DEFAULT_THREADS_NUMBER 2
+#define BATCH_JOBS 1000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = DEFAULT_THREADS_NUMBER,
+	.queue_length = 64,
+};
+
+static long executed = 0;
+void *count_job(void *arg)
+{
+	__atomic_add_fetch(&executed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void wait_executed(long expected)
+{
+	int poll_tries = 50;
+	while (__atomic_load_n(&executed, __ATOMIC_RELAXED) != expected &&
+	       poll_tries-- > 0) {
+		usleep(100000);
+	}
+	ASSERT_EQUAL_LONG(expected, executed);
+}
+
+static struct fiber_job jobs[BATCH_JOBS];
+static void fill_jobs(void)
+{
+	for (int i = 0; i < BATCH_JOBS; ++i) {
+		jobs[i].job_func = count_job;
+		jobs[i].job_arg = NULL;
+	}
+}
+
+TEST(push_n_bad_args)
+{
+	fill_jobs();
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_job_push_n(NULL, jobs, 1, 0));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_job_push_n(&pool, NULL, 1, 0));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, fiber_job_push_n(&pool, jobs, 0, 0));
+	jobs[1].job_func = NULL;
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_job_push_n(&pool, jobs, 2, 0));
+}
+
+TEST(push_n_contiguous_ids)
+{
+	fill_jobs();
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job single = { .job_func = count_job };
+	jid first = fiber_job_push(&pool, &single, FIBER_BLOCK);
+	qsize res = fiber_job_push_n(&pool, jobs, BATCH_JOBS, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(BATCH_JOBS, res);
+	for (int i = 0; i < BATCH_JOBS; ++i) {
+		ASSERT_EQUAL_LONG(first + 1 + i, jobs[i].job_id);
+	}
+	wait_executed(BATCH_JOBS + 1);
+	fiber_free(&pool);
+}
+
+TEST(push_n_batched_pop)
+{
+	fill_jobs();
+	struct fiber_pool_init_options opts = default_opts;
+	opts.pop_batch = 8;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(8, pool.pop_batch);
+	qsize res = fiber_job_push_n(&pool, jobs, BATCH_JOBS, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(BATCH_JOBS, res);
+	wait_executed(BATCH_JOBS);
+	fiber_free(&pool);
+}
+
+TEST(push_n_without_queue_push_n)
+{
+	fill_jobs();
+	struct fiber_pool_init_options opts = default_opts;
+	struct fiber_queue_operations ops = def_queue_ops;
+	ops.push_n = NULL;
+	ops.pop_n = NULL;
+	opts.queue_ops = &ops;
+	opts.pop_batch = 8;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	qsize res = fiber_job_push_n(&pool, jobs, BATCH_JOBS, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(BATCH_JOBS, res);
+	wait_executed(BATCH_JOBS);
+	fiber_free(&pool);
+}
+
+static int held = 0;
+static int release = 0;
+void *hold_job(void *arg)
+{
+	__atomic_store_n(&held, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&release, __ATOMIC_ACQUIRE)) {
+		usleep(100);
+	}
+	return NULL;
+}
+
+void *release_job(void *arg)
+{
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Keeps the only worker busy until release is set
+static void hold_worker(void)
+{
+	struct fiber_job hold = { .job_func = hold_job };
+	fiber_job_push(&pool, &hold, FIBER_BLOCK);
+	while (!__atomic_load_n(&held, __ATOMIC_ACQUIRE)) {
+		usleep(100);
+	}
+}
+
+TEST(caller_runs_on_full_queue)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.queue_length = 4;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	hold_worker();
+	struct fiber_job job = { .job_func = count_job };
+	int queued = 0;
+	while (fiber_job_push(&pool, &job, FIBER_NO_BLOCK) >= 0) {
+		++queued;
+	}
+	// A plain FIBER_BLOCK push would wait on the held worker forever
+	jid res = fiber_job_push(&pool, &job, FIBER_BLOCK | FIBER_CALLER_RUNS);
+	int ok = res >= 0;
+	ASSERT_TRUE(ok);
+	ASSERT_EQUAL_LONG(1, executed);
+	struct fiber_stats stats;
+	fiber_pool_stats(&pool, &stats);
+	ASSERT_EQUAL_LONG((uint64_t)1, stats.jobs_inline);
+	// The push that ended the fill loop and ours
+	ASSERT_EQUAL_LONG((uint64_t)2, stats.pushes_full);
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	wait_executed(queued + 1);
+	fiber_free(&pool);
+}
+
+// The default queue, but reporting a full queue as a positive EAGAIN
+int positive_full_push(void *queue, struct fiber_job *job, uint32_t flags)
+{
+	int res = fiber_queue_fifo_push(queue, job, flags);
+	return res == -EAGAIN ? EAGAIN : res;
+}
+
+TEST(caller_runs_positive_full)
+{
+	struct fiber_queue_operations ops = {
+		.push = positive_full_push,
+		.pop = fiber_queue_fifo_pop,
+		.init = fiber_queue_fifo_init,
+		.free = fiber_queue_fifo_free,
+		.length = fiber_queue_fifo_length,
+	};
+	struct fiber_pool_init_options opts = default_opts;
+	opts.queue_ops = &ops;
+	opts.threads_number = 1;
+	opts.queue_length = 4;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	hold_worker();
+	struct fiber_job job = { .job_func = count_job };
+	int queued = 0;
+	while (fiber_job_push(&pool, &job, FIBER_NO_BLOCK) >= 0) {
+		++queued;
+	}
+	jid res = fiber_job_push(&pool, &job, FIBER_BLOCK | FIBER_CALLER_RUNS);
+	int ok = res >= 0;
+	ASSERT_TRUE(ok);
+	ASSERT_EQUAL_LONG(1, executed);
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	wait_executed(queued + 1);
+	fiber_free(&pool);
+}
+
+TEST(caller_runs_pool_push_n)
+{
+	fill_jobs();
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.flags = FIBER_OPT_CALLER_RUNS;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	hold_worker();
+	qsize res = fiber_job_push_n(&pool, jobs, BATCH_JOBS, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(BATCH_JOBS, res);
+	long ran = __atomic_load_n(&executed, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_LONG((long)(BATCH_JOBS - 64), ran);
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	wait_executed(BATCH_JOBS);
+	fiber_free(&pool);
+}
+
+TEST(caller_runs_wait_drains_queue)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.flags = FIBER_OPT_CALLER_RUNS;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	hold_worker();
+	struct fiber_job job = { .job_func = count_job };
+	for (int i = 0; i < 10; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	// Only runs if fiber_wait takes it, the worker is held until then
+	job.job_func = release_job;
+	fiber_job_push(&pool, &job, FIBER_BLOCK);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_LONG(10, executed);
+	struct fiber_stats stats;
+	fiber_pool_stats(&pool, &stats);
+	ASSERT_EQUAL_LONG((uint64_t)11, stats.jobs_inline);
+	fiber_free(&pool);
+}
+
+struct inline_arg {
+	long a, b, c;
+};
+
+static long inline_sum = 0;
+void *inline_job(void *arg)
+{
+	struct inline_arg *in = (struct inline_arg *)arg;
+	__atomic_add_fetch(&inline_sum, in->a + in->b + in->c,
+			   __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(inline_job_layout)
+{
+	ASSERT_EQUAL_LONG(64L, (long)sizeof(struct fiber_job));
+	ASSERT_EQUAL_LONG((long)offsetof(struct fiber_job, job_arg),
+			  (long)offsetof(struct fiber_job, job_data));
+	int fits = sizeof(struct inline_arg) <= FIBER_JOB_DATA_SIZE;
+	ASSERT_TRUE(fits);
+}
+
+TEST(inline_arg_push)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = inline_job };
+	struct inline_arg *in = (struct inline_arg *)job.job_data;
+	for (long i = 0; i < BATCH_JOBS; ++i) {
+		in->a = i;
+		in->b = 1;
+		in->c = 2;
+		// FIBER_FREE_ARG is ignored, there is no pointer to free
+		uint32_t flags = FIBER_BLOCK | FIBER_INLINE_ARG;
+		if (i % 2 == 0) {
+			flags |= FIBER_FREE_ARG;
+		}
+		fiber_job_push(&pool, &job, flags);
+		// Overwriting the data after the push doesn't reach the job
+		in->a = -1000000;
+	}
+	fiber_wait(&pool);
+	long expect = (long)BATCH_JOBS * (BATCH_JOBS - 1) / 2 + 3 * BATCH_JOBS;
+	ASSERT_EQUAL_LONG(expect, inline_sum);
+	fiber_free(&pool);
+}
+
+TEST(inline_arg_push_n_stackful)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.flags = FIBER_OPT_STACKFUL | FIBER_OPT_WORK_STEALING;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	for (long i = 0; i < BATCH_JOBS; ++i) {
+		jobs[i].job_func = inline_job;
+		struct inline_arg *in = (struct inline_arg *)jobs[i].job_data;
+		in->a = i;
+		in->b = i;
+		in->c = i;
+	}
+	qsize res = fiber_job_push_n(&pool, jobs, BATCH_JOBS,
+				     FIBER_BLOCK | FIBER_INLINE_ARG);
+	ASSERT_EQUAL_INT(BATCH_JOBS, res);
+	fiber_wait(&pool);
+	long expect = 3L * BATCH_JOBS * (BATCH_JOBS - 1) / 2;
+	ASSERT_EQUAL_LONG(expect, inline_sum);
+	fiber_free(&pool);
+}
+
+TEST(inline_arg_future_rejected)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = inline_job };
+	struct fiber_future future;
+	uint32_t flags = FIBER_BLOCK | FIBER_INLINE_ARG;
+	jid res = fiber_job_push_future(&pool, &job, flags, &future);
+	ASSERT_EQUAL_LONG((jid)FBR_EINVLD_OPT, res);
+	fiber_free(&pool);
+}
+
+TEST(push_n_jid_wraps)
+{
+	// Without overflow checks 64 bit ids are assumed to never wrap
+#if JOB_ID_MAX < INT64_MAX || defined(FIBER_CHECK_JID_OVERFLOW)
+	jid prev = JOB_ID_MAX - 1;
+	jid first = get_and_update_jid_n(&prev, 4);
+	ASSERT_EQUAL_LONG((jid)0, first);
+	ASSERT_EQUAL_LONG((jid)3, prev);
+#endif
+}
+
+static jid other_thread_id = -1;
+void *push_from_thread(void *arg)
+{
+	struct fiber_job job = { .job_func = count_job };
+	other_thread_id = fiber_job_push(&pool, &job, FIBER_BLOCK);
+	return NULL;
+}
+
+TEST(jid_blocks_per_thread)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = count_job };
+	ASSERT_EQUAL_LONG((jid)0, fiber_job_push(&pool, &job, FIBER_BLOCK));
+	ASSERT_EQUAL_LONG((jid)1, fiber_job_push(&pool, &job, FIBER_BLOCK));
+	pthread_t tid;
+	pthread_create(&tid, NULL, push_from_thread, NULL);
+	pthread_join(tid, NULL);
+	// The other thread reserved the next block
+	ASSERT_EQUAL_LONG((jid)FIBER_JID_BLOCK, other_thread_id);
+	ASSERT_EQUAL_LONG((jid)2, fiber_job_push(&pool, &job, FIBER_BLOCK));
+	ASSERT_EQUAL_LONG((jid)(2 * FIBER_JID_BLOCK - 1), pool.job_id_prev);
+	// Big batches don't touch the block
+	jid first = jid_take(&pool, FIBER_JID_BLOCK);
+	ASSERT_EQUAL_LONG((jid)(2 * FIBER_JID_BLOCK), first);
+	ASSERT_EQUAL_LONG((jid)3, jid_take(&pool, 1));
+	// Not enough left, so a new block is reserved
+	first = jid_take(&pool, FIBER_JID_BLOCK - 1);
+	ASSERT_EQUAL_LONG((jid)(3 * FIBER_JID_BLOCK), first);
+	fiber_wait(&pool);
+	fiber_free(&pool);
+	// A new pool at the same address doesn't use the old block
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_EQUAL_LONG((jid)0, fiber_job_push(&pool, &job, FIBER_BLOCK));
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+TEST(jid_cancel_pool_skips_blocks)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.flags = FIBER_OPT_CANCEL;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = count_job };
+	ASSERT_EQUAL_LONG((jid)0, fiber_job_push(&pool, &job, FIBER_BLOCK));
+	pthread_t tid;
+	pthread_create(&tid, NULL, push_from_thread, NULL);
+	pthread_join(tid, NULL);
+	ASSERT_EQUAL_LONG((jid)1, other_thread_id);
+	ASSERT_EQUAL_LONG((jid)2, fiber_job_push(&pool, &job, FIBER_BLOCK));
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+#define JID_PRODUCERS 8
+#define JID_PER_PRODUCER 5000
+static jid pushed_ids[JID_PRODUCERS * JID_PER_PRODUCER];
+
+void *push_ids(void *arg)
+{
+	jid *ids = (jid *)arg;
+	struct fiber_job job = { .job_func = count_job };
+	for (int i = 0; i < JID_PER_PRODUCER; ++i) {
+		ids[i] = fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	return NULL;
+}
+
+static int cmp_jid(const void *a, const void *b)
+{
+	jid x = *(const jid *)a;
+	jid y = *(const jid *)b;
+	return (x > y) - (x < y);
+}
+
+TEST(jid_unique_across_producers)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	pthread_t tids[JID_PRODUCERS];
+	for (int i = 0; i < JID_PRODUCERS; ++i) {
+		pthread_create(&tids[i], NULL, push_ids,
+			       &pushed_ids[i * JID_PER_PRODUCER]);
+	}
+	for (int i = 0; i < JID_PRODUCERS; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+	fiber_wait(&pool);
+	long n = JID_PRODUCERS * JID_PER_PRODUCER;
+	qsort(pushed_ids, n, sizeof(*pushed_ids), cmp_jid);
+	int ok = pushed_ids[0] >= 0;
+	for (long i = 1; i < n; ++i) {
+		ok = ok && pushed_ids[i] > pushed_ids[i - 1];
+	}
+	ASSERT_TRUE(ok);
+	ASSERT_EQUAL_LONG(n, executed);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,144 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define LATENCY_JOBS 50
+#define SLEEP_US 2000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 2,
+	.queue_length = 64,
+	.flags = FIBER_OPT_LATENCY,
+};
+
+void *sleep_job(void *arg)
+{
+	usleep(SLEEP_US);
+	return NULL;
+}
+
+TEST(hist_exact_small_values)
+{
+	struct fiber_hist hist = { 0 };
+	for (uint64_t v = 0; v < FIBER_HIST_SUB; ++v) {
+		__fiber_hist_record(&hist, v);
+	}
+	ASSERT_EQUAL_LONG((uint64_t)FIBER_HIST_SUB, hist.count);
+	uint64_t p0 = fiber_hist_percentile(&hist, 0.0);
+	ASSERT_EQUAL_LONG((uint64_t)0, p0);
+	uint64_t p50 = fiber_hist_percentile(&hist, 50.0);
+	ASSERT_EQUAL_LONG((uint64_t)FIBER_HIST_SUB / 2 - 1, p50);
+	uint64_t p100 = fiber_hist_percentile(&hist, 100.0);
+	ASSERT_EQUAL_LONG((uint64_t)FIBER_HIST_SUB - 1, p100);
+}
+
+TEST(hist_relative_error)
+{
+	uint64_t values[] = { 17, 1000, 123456, 5000000, 987654321 };
+	for (size_t i = 0; i < sizeof(values) / sizeof(*values); ++i) {
+		struct fiber_hist hist = { 0 };
+		__fiber_hist_record(&hist, values[i]);
+		// Add a larger value so the max doesn't cap the answer
+		__fiber_hist_record(&hist, values[i] * 4);
+		uint64_t p = fiber_hist_percentile(&hist, 50.0);
+		int close = p >= values[i] &&
+			    p - values[i] <= values[i] / FIBER_HIST_SUB;
+		ASSERT_TRUE(close);
+	}
+	struct fiber_hist hist = { 0 };
+	__fiber_hist_record(&hist, UINT64_MAX);
+	int last = hist.buckets[FIBER_HIST_BUCKETS - 1] == 1;
+	ASSERT_TRUE(last);
+	uint64_t p = fiber_hist_percentile(&hist, 99.0);
+	ASSERT_EQUAL_LONG(UINT64_MAX, p);
+}
+
+TEST(hist_merge)
+{
+	struct fiber_hist a = { 0 };
+	struct fiber_hist b = { 0 };
+	for (uint64_t v = 1; v <= 100; ++v) {
+		__fiber_hist_record(&a, v);
+		__fiber_hist_record(&b, v * 1000);
+	}
+	fiber_hist_merge(&a, &b);
+	ASSERT_EQUAL_LONG((uint64_t)200, a.count);
+	ASSERT_EQUAL_LONG((uint64_t)100000, a.max);
+	uint64_t p25 = fiber_hist_percentile(&a, 25.0);
+	int low = p25 <= 100;
+	ASSERT_TRUE(low);
+	uint64_t p75 = fiber_hist_percentile(&a, 75.0);
+	int high = p75 >= 1000;
+	ASSERT_TRUE(high);
+}
+
+TEST(latency_requires_opt)
+{
+	struct fiber_hist run;
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_pool_latency(NULL, NULL, &run));
+	struct fiber_pool_init_options opts = default_opts;
+	opts.flags = 0;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_pool_latency(&pool, NULL, &run));
+	fiber_free(&pool);
+}
+
+TEST(latency_records_jobs)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = sleep_job };
+	for (int i = 0; i < LATENCY_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	// fiber_wait can return as the last job finishes
+	usleep(10000);
+	struct fiber_hist wait;
+	struct fiber_hist run;
+	ASSERT_EQUAL_INT(0, fiber_pool_latency(&pool, &wait, &run));
+	ASSERT_EQUAL_LONG((uint64_t)LATENCY_JOBS, run.count);
+	ASSERT_EQUAL_LONG((uint64_t)LATENCY_JOBS, wait.count);
+	uint64_t run_p50 = fiber_hist_percentile(&run, 50.0);
+	int ran = run_p50 >= SLEEP_US * 1000ull;
+	ASSERT_TRUE(ran);
+	// Two workers on LATENCY_JOBS sleeps, the last ones queue for a while
+	uint64_t wait_p99 = fiber_hist_percentile(&wait, 99.0);
+	int waited = wait_p99 >= SLEEP_US * 1000ull;
+	ASSERT_TRUE(waited);
+	fiber_free(&pool);
+}
+
+TEST(latency_survives_thread_removal)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job jobs[LATENCY_JOBS];
+	for (int i = 0; i < LATENCY_JOBS; ++i) {
+		jobs[i] = (struct fiber_job){ .job_func = sleep_job };
+	}
+	qsize pushed = fiber_job_push_n(&pool, jobs, LATENCY_JOBS, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(LATENCY_JOBS, pushed);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(0, fiber_threads_remove(&pool, 2));
+	int poll_tries = 50;
+	while (fiber_threads_number(&pool) > 0 && poll_tries-- > 0) {
+		usleep(100000);
+	}
+	ASSERT_EQUAL_INT(0, fiber_threads_number(&pool));
+	struct fiber_hist run;
+	ASSERT_EQUAL_INT(0, fiber_pool_latency(&pool, NULL, &run));
+	// Wake jobs aren't recorded
+	ASSERT_EQUAL_LONG((uint64_t)LATENCY_JOBS, run.count);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,178 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define CROSS_JOBS 32
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 4,
+	.queue_length = 64,
+	.flags = FIBER_OPT_NUMA,
+};
+
+static long executed = 0;
+void *count_job(void *arg)
+{
+	__atomic_add_fetch(&executed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void wait_executed(long expected)
+{
+	int poll_tries = 50;
+	while (__atomic_load_n(&executed, __ATOMIC_RELAXED) != expected &&
+	       poll_tries-- > 0) {
+		usleep(100000);
+	}
+	ASSERT_EQUAL_LONG(expected, executed);
+}
+
+static void write_file(const char *path, const char *content)
+{
+	FILE *f = fopen(path, "w");
+	ASSERT_NOT_NULL(f);
+	fputs(content, f);
+	fclose(f);
+}
+
+// Builds a sysfs like tree with nodes 0 and 1 and a memory only node 2
+static char *fake_tree(const char *node0_cpus, const char *node1_cpus)
+{
+	static char root[] = "/tmp/fiber_numa_XXXXXX";
+	char path[256];
+	ASSERT_NOT_NULL(mkdtemp(root));
+	snprintf(path, sizeof(path), "%s/online", root);
+	write_file(path, "0-2\n");
+	const char *cpus[] = { node0_cpus, node1_cpus, "\n" };
+	for (int i = 0; i < 3; ++i) {
+		snprintf(path, sizeof(path), "%s/node%d", root, i);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", root, i);
+		write_file(path, cpus[i]);
+	}
+	return root;
+}
+
+static void remove_tree(const char *root)
+{
+	char path[256];
+	for (int i = 0; i < 3; ++i) {
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", root, i);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/node%d", root, i);
+		rmdir(path);
+	}
+	snprintf(path, sizeof(path), "%s/online", root);
+	unlink(path);
+	rmdir(root);
+}
+
+TEST(numa_parse_list)
+{
+	int out[16];
+	ASSERT_EQUAL_INT(7, fiber_numa_parse_list("0-3,8,10-11\n", out, 16));
+	int expected[] = { 0, 1, 2, 3, 8, 10, 11 };
+	for (int i = 0; i < 7; ++i) {
+		ASSERT_EQUAL_INT(expected[i], out[i]);
+	}
+	ASSERT_EQUAL_INT(0, fiber_numa_parse_list("\n", out, 16));
+	ASSERT_EQUAL_INT(-1, fiber_numa_parse_list("3-1", out, 16));
+	ASSERT_EQUAL_INT(-1, fiber_numa_parse_list("0,x", out, 16));
+	ASSERT_EQUAL_INT(-1, fiber_numa_parse_list("0-16", out, 16));
+}
+
+TEST(numa_discover_fake_tree)
+{
+	struct fiber_numa_topology topo;
+	char *root = fake_tree("0-1\n", "2,3\n");
+	ASSERT_EQUAL_INT(0, fiber_numa_discover(&topo, root, malloc, free));
+	// The memory only node is left out
+	ASSERT_EQUAL_INT(2, topo.nodes_number);
+	ASSERT_EQUAL_INT(1, topo.nodes[1].id);
+	ASSERT_EQUAL_INT(2, topo.nodes[1].cpus_number);
+	ASSERT_EQUAL_INT(4, topo.cpus_max);
+	ASSERT_EQUAL_INT(0, topo.cpu_node[1]);
+	ASSERT_EQUAL_INT(1, topo.cpu_node[2]);
+	fiber_numa_release(&topo, free);
+	remove_tree(root);
+	ASSERT_NULL(topo.nodes);
+
+	ASSERT_EQUAL_INT(0, fiber_numa_discover(&topo, "/nonexistent", malloc,
+						free));
+	ASSERT_EQUAL_INT(1, topo.nodes_number);
+	ASSERT_EQUAL_INT(0, topo.nodes[0].cpus_number);
+	ASSERT_EQUAL_INT(0, fiber_numa_current_node(&topo));
+	fiber_numa_release(&topo, free);
+}
+
+TEST(numa_pool_runs_jobs)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	ASSERT_NOT_NULL(pool.numa_queues);
+	tpsize threads = 0;
+	for (int i = 0; i < pool.numa.nodes_number; ++i) {
+		threads += pool.numa_queues[i].threads_number;
+	}
+	ASSERT_EQUAL_INT(4, threads);
+	struct fiber_job job = { .job_func = count_job };
+	for (int i = 0; i < 1000; ++i) {
+		int pushed = fiber_job_push(&pool, &job, FIBER_BLOCK) >= 0;
+		ASSERT_TRUE(pushed);
+	}
+	wait_executed(1000);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(0, fiber_jobs_pending(&pool));
+	fiber_free(&pool);
+}
+
+// Pushes to its own node's queue then stays busy. The jobs can only run if
+// the worker on the other node takes them.
+static int saw_all = 0;
+void *push_and_hold(void *arg)
+{
+	struct fiber_job job = { .job_func = count_job };
+	for (int i = 0; i < CROSS_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	int poll_tries = 50;
+	while (__atomic_load_n(&executed, __ATOMIC_RELAXED) != CROSS_JOBS &&
+	       poll_tries-- > 0) {
+		usleep(100000);
+	}
+	saw_all = __atomic_load_n(&executed, __ATOMIC_RELAXED) == CROSS_JOBS;
+	return NULL;
+}
+
+TEST(numa_pool_cross_node)
+{
+	// Both nodes get CPU 0 so pinning works on any box
+	numa_sysfs_root = fake_tree("0\n", "0\n");
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 2;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	remove_tree(numa_sysfs_root);
+	ASSERT_EQUAL_INT(2, pool.numa.nodes_number);
+	ASSERT_EQUAL_INT(1, pool.numa_queues[0].threads_number);
+	ASSERT_EQUAL_INT(1, pool.numa_queues[1].threads_number);
+	struct fiber_job holder = { .job_func = push_and_hold };
+	int pushed = fiber_job_push(&pool, &holder, FIBER_BLOCK) >= 0;
+	ASSERT_TRUE(pushed);
+	wait_executed(CROSS_JOBS);
+	fiber_wait(&pool);
+	ASSERT_TRUE(saw_all);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fiber.h"
+#include "fiber_parallel.h"
+#include "xtal.h"
+
+#define DEFAULT_THREADS_NUMBER 4
+#define RANGE 100000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = DEFAULT_THREADS_NUMBER,
+	.queue_length = 64,
+};
+
+static unsigned char seen[RANGE];
+
+void mark(int64_t begin, int64_t end, void *ctx)
+{
+	for (int64_t i = begin; i < end; ++i) {
+		__atomic_add_fetch(&seen[i], 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int all_once(void)
+{
+	for (int i = 0; i < RANGE; ++i) {
+		if (seen[i] != 1) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+TEST(for_covers_range_once)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	int64_t grains[] = { 0, 1, 7, 1000, RANGE * 2 };
+	for (int g = 0; g < 5; ++g) {
+		memset(seen, 0, sizeof(seen));
+		int res = fiber_parallel_for(&pool, 0, RANGE, grains[g], mark,
+					     NULL);
+		ASSERT_EQUAL_INT(0, res);
+		int ok = all_once();
+		ASSERT_TRUE(ok);
+	}
+	fiber_free(&pool);
+}
+
+void sum(int64_t begin, int64_t end, void *acc, void *ctx)
+{
+	int64_t *total = (int64_t *)acc;
+	for (int64_t i = begin; i < end; ++i) {
+		*total += i;
+	}
+}
+
+void add(void *acc, const void *other, void *ctx)
+{
+	*(int64_t *)acc += *(const int64_t *)other;
+}
+
+TEST(reduce_sums_range)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	int64_t zero = 0;
+	int64_t total = -1;
+	int res = fiber_parallel_reduce(&pool, 10, RANGE, 0, sizeof(int64_t),
+					&zero, sum, add, NULL, &total);
+	ASSERT_EQUAL_INT(0, res);
+	int64_t expect = (int64_t)RANGE * (RANGE - 1) / 2 - 45;
+	ASSERT_EQUAL_LONG(expect, total);
+	// Empty range gives identity
+	int64_t seven = 7;
+	res = fiber_parallel_reduce(&pool, 5, 5, 0, sizeof(int64_t), &seven,
+				    sum, add, NULL, &total);
+	ASSERT_EQUAL_INT(0, res);
+	ASSERT_EQUAL_LONG((int64_t)7, total);
+	fiber_free(&pool);
+}
+
+void nested(int64_t begin, int64_t end, void *ctx)
+{
+	for (int64_t i = begin; i < end; ++i) {
+		fiber_parallel_for(&pool, i * 100, i * 100 + 100, 10, mark,
+				   NULL);
+	}
+}
+
+TEST(for_inside_job)
+{
+	// One worker, the inner loops can only finish because callers help
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	memset(seen, 0, sizeof(seen));
+	ASSERT_EQUAL_INT(0, fiber_parallel_for(&pool, 0, RANGE / 100, 1,
+					       nested, NULL));
+	int ok = all_once();
+	ASSERT_TRUE(ok);
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+TEST(parallel_bad_args)
+{
+	int64_t zero = 0;
+	int64_t total;
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS,
+			 fiber_parallel_for(NULL, 0, 1, 0, mark, NULL));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS,
+			 fiber_parallel_for(&pool, 0, 1, 0, NULL, NULL));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE,
+			 fiber_parallel_for(&pool, 1, 0, 0, mark, NULL));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE,
+			 fiber_parallel_for(&pool, 0, 1, -1, mark, NULL));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS,
+			 fiber_parallel_reduce(&pool, 0, 1, 0, 8, &zero, sum,
+					       NULL, NULL, &total));
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE,
+			 fiber_parallel_reduce(&pool, 0, 1, 0, 0, &zero, sum,
+					       add, NULL, &total));
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
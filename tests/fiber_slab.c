@@ -0,0 +1,174 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define SLAB_JOBS 10000
+
+static long live_allocs = 0;
+
+static void *count_malloc(size_t size)
+{
+	__atomic_add_fetch(&live_allocs, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+static void count_free(void *ptr)
+{
+	__atomic_sub_fetch(&live_allocs, 1, __ATOMIC_RELAXED);
+	free(ptr);
+}
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = count_malloc,
+	.free = count_free,
+	.threads_number = 4,
+	.queue_length = 256,
+	.flags = 0,
+};
+
+static long sum = 0;
+
+void *sum_job(void *arg)
+{
+	long *v = (long *)arg;
+	__atomic_add_fetch(&sum, *v, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(slab_size_classes)
+{
+	struct fiber_slab slab;
+	fiber_slab_init(&slab, count_malloc, count_free);
+	long before = live_allocs;
+	void *a = fiber_slab_alloc(&slab, NULL, 1);
+	void *b = fiber_slab_alloc(&slab, NULL, FIBER_SLAB_MIN + 1);
+	void *c = fiber_slab_alloc(&slab, NULL, FIBER_SLAB_MAX);
+	int aligned = ((uintptr_t)a | (uintptr_t)b | (uintptr_t)c) % 16 == 0;
+	ASSERT_TRUE(aligned);
+	struct fiber_slab_block *hdr = (struct fiber_slab_block *)b - 1;
+	ASSERT_EQUAL_LONG((uint64_t)1, hdr->cls);
+	hdr = (struct fiber_slab_block *)c - 1;
+	ASSERT_EQUAL_LONG((uint64_t)(FIBER_SLAB_CLASSES - 1), hdr->cls);
+	// One chunk per class
+	ASSERT_EQUAL_LONG(before + 3, live_allocs);
+	void *large = fiber_slab_alloc(&slab, NULL, FIBER_SLAB_MAX + 1);
+	ASSERT_EQUAL_LONG(before + 4, live_allocs);
+	fiber_slab_release(&slab, NULL, large);
+	ASSERT_EQUAL_LONG(before + 3, live_allocs);
+	// A freed block is handed out again
+	fiber_slab_release(&slab, NULL, b);
+	void *again = fiber_slab_alloc(&slab, NULL, FIBER_SLAB_MIN * 2);
+	ASSERT_EQUAL_PTR(b, again);
+	fiber_slab_free(&slab);
+	ASSERT_EQUAL_LONG(before, live_allocs);
+}
+
+TEST(slab_cache_trims_and_flushes)
+{
+	struct fiber_slab slab;
+	struct fiber_slab_cache cache = { 0 };
+	fiber_slab_init(&slab, count_malloc, count_free);
+	void *blocks[FIBER_SLAB_BATCH * 2];
+	for (int i = 0; i < FIBER_SLAB_BATCH * 2; ++i) {
+		blocks[i] = fiber_slab_alloc(&slab, &cache, 8);
+	}
+	for (int i = 0; i < FIBER_SLAB_BATCH * 2; ++i) {
+		fiber_slab_release(&slab, &cache, blocks[i]);
+	}
+	// Anything past two batches goes back to the shared list
+	int kept = cache.number[0] < FIBER_SLAB_BATCH * 2;
+	ASSERT_TRUE(kept);
+	fiber_slab_cache_flush(&slab, &cache);
+	ASSERT_EQUAL_INT(0, (int)cache.number[0]);
+	ASSERT_EQUAL_PTR(NULL, cache.free[0]);
+	fiber_slab_free(&slab);
+}
+
+TEST(job_arg_freed_after_job)
+{
+	__atomic_store_n(&sum, 0, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	long baseline = __atomic_load_n(&live_allocs, __ATOMIC_RELAXED);
+	struct fiber_job job = { .job_func = sum_job };
+	for (int i = 0; i < SLAB_JOBS; ++i) {
+		// Past FIBER_SLAB_MAX so every argument is its own malloc
+		long *arg = fiber_job_arg_alloc(&pool, FIBER_SLAB_MAX + 1);
+		*arg = i;
+		job.job_arg = arg;
+		fiber_job_push(&pool, &job, FIBER_BLOCK | FIBER_FREE_ARG);
+	}
+	fiber_wait(&pool);
+	long expect = (long)SLAB_JOBS * (SLAB_JOBS - 1) / 2;
+	ASSERT_EQUAL_LONG(expect, sum);
+	ASSERT_EQUAL_LONG(baseline, live_allocs);
+	fiber_free(&pool);
+	ASSERT_EQUAL_LONG(0L, live_allocs);
+}
+
+void *alloc_job(void *arg)
+{
+	// Allocated on a worker, freed on whichever worker runs the child
+	long *child_arg = fiber_job_arg_alloc(&pool, sizeof(long));
+	*child_arg = 1;
+	struct fiber_job child = { .job_func = sum_job, .job_arg = child_arg };
+	fiber_job_push(&pool, &child, FIBER_BLOCK | FIBER_FREE_ARG);
+	return NULL;
+}
+
+TEST(job_arg_alloc_on_workers)
+{
+	__atomic_store_n(&sum, 0, __ATOMIC_RELAXED);
+	struct fiber_pool_init_options opts = default_opts;
+	opts.queue_length = SLAB_JOBS * 2;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = alloc_job };
+	for (int i = 0; i < SLAB_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	ASSERT_EQUAL_LONG((long)SLAB_JOBS, sum);
+	fiber_free(&pool);
+	ASSERT_EQUAL_LONG(0L, live_allocs);
+}
+
+static int release = 0;
+
+void *hold_job(void *arg)
+{
+	while (!__atomic_load_n(&release, __ATOMIC_ACQUIRE)) {
+		usleep(100);
+	}
+	return NULL;
+}
+
+TEST(job_arg_freed_when_cancelled)
+{
+	__atomic_store_n(&sum, 0, __ATOMIC_RELAXED);
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.flags = FIBER_OPT_CANCEL;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job hold = { .job_func = hold_job };
+	fiber_job_push(&pool, &hold, FIBER_BLOCK);
+	long baseline = __atomic_load_n(&live_allocs, __ATOMIC_RELAXED);
+	long *arg = fiber_job_arg_alloc(&pool, FIBER_SLAB_MAX + 1);
+	*arg = 5;
+	struct fiber_job job = { .job_func = sum_job, .job_arg = arg };
+	jid id = fiber_job_push(&pool, &job, FIBER_BLOCK | FIBER_FREE_ARG);
+	ASSERT_EQUAL_INT(0, fiber_job_cancel(&pool, id));
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_LONG(0L, sum);
+	ASSERT_EQUAL_LONG(baseline, live_allocs);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,141 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define STATS_JOBS 1000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 2,
+	.queue_length = 64,
+};
+
+void *do_nothing(void *arg)
+{
+	return NULL;
+}
+
+static int release = 0;
+void *hold_job(void *arg)
+{
+	while (!__atomic_load_n(&release, __ATOMIC_ACQUIRE)) {
+		usleep(1000);
+	}
+	return NULL;
+}
+
+TEST(stats_bad_args)
+{
+	struct fiber_stats stats;
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_pool_stats(NULL, &stats));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_pool_stats(&pool, NULL));
+}
+
+TEST(stats_jobs_and_pushes)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = do_nothing };
+	for (int i = 0; i < STATS_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	// fiber_wait can return as the last job finishes
+	usleep(10000);
+	struct fiber_stats stats;
+	ASSERT_EQUAL_INT(0, fiber_pool_stats(&pool, &stats));
+	ASSERT_EQUAL_LONG((uint64_t)STATS_JOBS, stats.jobs);
+	ASSERT_EQUAL_LONG((uint64_t)STATS_JOBS, stats.pushes);
+	ASSERT_EQUAL_LONG((uint64_t)0, stats.pushes_full);
+	ASSERT_EQUAL_INT(2, stats.threads_number);
+	ASSERT_EQUAL_INT(0, stats.jobs_pending);
+	int idled = stats.idle_ns > 0;
+	ASSERT_TRUE(idled);
+	fiber_free(&pool);
+}
+
+void *yield_job(void *arg)
+{
+	for (int i = 0; i < 3; ++i) {
+		fiber_yield();
+	}
+	return NULL;
+}
+
+TEST(stats_stackful_counts_finished)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.flags = FIBER_OPT_STACKFUL;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = yield_job };
+	for (int i = 0; i < STATS_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	usleep(10000);
+	struct fiber_stats stats;
+	ASSERT_EQUAL_INT(0, fiber_pool_stats(&pool, &stats));
+	// Resuming a yielded task isn't another job
+	ASSERT_EQUAL_LONG((uint64_t)STATS_JOBS, stats.jobs);
+	fiber_free(&pool);
+}
+
+TEST(stats_queue_full)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 1;
+	opts.queue_length = 1;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job hold = { .job_func = hold_job };
+	fiber_job_push(&pool, &hold, FIBER_BLOCK);
+	while (fiber_threads_working(&pool) == 0) {
+		usleep(1000);
+	}
+	struct fiber_job job = { .job_func = do_nothing };
+	jid id = fiber_job_push(&pool, &job, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_LONG((jid)1, id);
+	int full = fiber_job_push(&pool, &job, FIBER_NO_BLOCK) == -EAGAIN;
+	ASSERT_TRUE(full);
+	struct fiber_stats stats;
+	fiber_pool_stats(&pool, &stats);
+	ASSERT_EQUAL_LONG((uint64_t)2, stats.pushes);
+	ASSERT_EQUAL_LONG((uint64_t)1, stats.pushes_full);
+	ASSERT_EQUAL_INT(1, stats.threads_working);
+	ASSERT_EQUAL_INT(1, stats.jobs_pending);
+	__atomic_store_n(&release, 1, __ATOMIC_RELEASE);
+	fiber_wait(&pool);
+	fiber_free(&pool);
+}
+
+TEST(stats_survive_thread_removal)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = do_nothing };
+	for (int i = 0; i < STATS_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(0, fiber_threads_remove(&pool, 2));
+	int poll_tries = 50;
+	while (fiber_threads_number(&pool) > 0 && poll_tries-- > 0) {
+		usleep(100000);
+	}
+	ASSERT_EQUAL_INT(0, fiber_threads_number(&pool));
+	struct fiber_stats stats;
+	fiber_pool_stats(&pool, &stats);
+	// The wake job sent by fiber_threads_remove runs too
+	int all_jobs = stats.jobs >= STATS_JOBS;
+	ASSERT_TRUE(all_jobs);
+	ASSERT_EQUAL_LONG((uint64_t)STATS_JOBS, stats.pushes);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
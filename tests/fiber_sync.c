@@ -0,0 +1,209 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define SYNC_JOBS 1000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 1,
+	.queue_length = SYNC_JOBS * 2,
+	.flags = FIBER_OPT_STACKFUL,
+};
+
+static struct fiber_mutex mutex = { 0 };
+static int counter = 0;
+
+void *locked_add(void *arg)
+{
+	fiber_mutex_lock(&mutex);
+	int seen = counter;
+	// Let others pile up on the mutex
+	fiber_yield();
+	counter = seen + 1;
+	fiber_mutex_unlock(&mutex);
+	return NULL;
+}
+
+TEST(mutex_parks_jobs)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 4;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = locked_add };
+	for (int i = 0; i < SYNC_JOBS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(SYNC_JOBS, counter);
+	fiber_free(&pool);
+}
+
+TEST(mutex_trylock)
+{
+	ASSERT_EQUAL_INT(0, fiber_mutex_trylock(&mutex));
+	ASSERT_EQUAL_INT(EAGAIN, fiber_mutex_trylock(&mutex));
+	ASSERT_EQUAL_INT(0, fiber_mutex_unlock(&mutex));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_mutex_lock(NULL));
+}
+
+void *thread_add(void *arg)
+{
+	for (int i = 0; i < SYNC_JOBS; ++i) {
+		fiber_mutex_lock(&mutex);
+		++counter;
+		fiber_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+TEST(mutex_between_threads)
+{
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i) {
+		pthread_create(&threads[i], NULL, thread_add, NULL);
+	}
+	for (int i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	ASSERT_EQUAL_INT(4 * SYNC_JOBS, counter);
+}
+
+static struct fiber_semaphore sem = { 0 };
+static int consumed = 0;
+
+void *consume(void *arg)
+{
+	fiber_semaphore_wait(&sem);
+	++consumed;
+	return NULL;
+}
+
+void *produce(void *arg)
+{
+	fiber_semaphore_post(&sem);
+	return NULL;
+}
+
+// Consumers are queued first, so one worker only gets to the producers if
+// waiting consumers give it up
+TEST(semaphore_one_worker)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job c = { .job_func = consume };
+	struct fiber_job p = { .job_func = produce };
+	for (int i = 0; i < 10; ++i) {
+		fiber_job_push(&pool, &c, FIBER_BLOCK);
+	}
+	for (int i = 0; i < 10; ++i) {
+		fiber_job_push(&pool, &p, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(10, consumed);
+	ASSERT_EQUAL_INT(EAGAIN, fiber_semaphore_trywait(&sem));
+	fiber_free(&pool);
+}
+
+static struct fiber_cond cond = { 0 };
+static int ready = 0;
+
+void *wait_ready(void *arg)
+{
+	fiber_mutex_lock(&mutex);
+	while (!ready) {
+		fiber_cond_wait(&cond, &mutex);
+	}
+	++counter;
+	fiber_mutex_unlock(&mutex);
+	return NULL;
+}
+
+void *set_ready(void *arg)
+{
+	fiber_mutex_lock(&mutex);
+	ready = 1;
+	fiber_mutex_unlock(&mutex);
+	fiber_cond_broadcast(&cond);
+	return NULL;
+}
+
+TEST(cond_one_worker)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job w = { .job_func = wait_ready };
+	struct fiber_job s = { .job_func = set_ready };
+	for (int i = 0; i < 5; ++i) {
+		fiber_job_push(&pool, &w, FIBER_BLOCK);
+	}
+	fiber_job_push(&pool, &s, FIBER_BLOCK);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(5, counter);
+	fiber_free(&pool);
+}
+
+TEST(wake_on_full_queue)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	// The only worker is the one waking, nobody else pops the queue
+	opts.queue_length = 2;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job a = { .job_func = locked_add };
+	struct fiber_job w = { .job_func = wait_ready };
+	for (int i = 0; i < SYNC_JOBS; ++i) {
+		fiber_job_push(&pool, i % 2 ? &a : &w, FIBER_BLOCK);
+	}
+	struct fiber_job s = { .job_func = set_ready };
+	fiber_job_push(&pool, &s, FIBER_BLOCK);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(SYNC_JOBS, counter);
+	fiber_free(&pool);
+}
+
+static struct fiber_waitgroup wg = { 0 };
+
+void *wg_done(void *arg)
+{
+	__atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+	fiber_waitgroup_done(&wg);
+	return NULL;
+}
+
+void *wg_wait(void *arg)
+{
+	fiber_waitgroup_wait(&wg);
+	ready = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(waitgroup)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 2;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(0, fiber_waitgroup_add(&wg, SYNC_JOBS));
+	// A job waiting on the group, then the caller's thread
+	struct fiber_job w = { .job_func = wg_wait };
+	fiber_job_push(&pool, &w, FIBER_BLOCK);
+	struct fiber_job d = { .job_func = wg_done };
+	for (int i = 0; i < SYNC_JOBS; ++i) {
+		fiber_job_push(&pool, &d, FIBER_BLOCK);
+	}
+	ASSERT_EQUAL_INT(0, fiber_waitgroup_wait(&wg));
+	int all = __atomic_load_n(&counter, __ATOMIC_RELAXED) == SYNC_JOBS;
+	ASSERT_TRUE(all);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(SYNC_JOBS, ready);
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE, fiber_waitgroup_done(&wg));
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
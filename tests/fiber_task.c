@@ -0,0 +1,172 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define MANY_TASKS 10000
+#define SLEEPERS 1000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 1,
+	.queue_length = MANY_TASKS * 2,
+	.flags = FIBER_OPT_STACKFUL,
+};
+
+static struct fiber_ctx main_ctx;
+static int pings = 0;
+
+static void ping_entry(void *arg)
+{
+	struct fiber_task *task = (struct fiber_task *)arg;
+	for (int i = 0; i < 3; ++i) {
+		++pings;
+		fiber_task_switch(&task->ctx, &main_ctx);
+	}
+	task->state = FIBER_TASK_DONE;
+	fiber_task_switch(&task->ctx, &main_ctx);
+}
+
+TEST(task_switch)
+{
+	struct fiber_task *task = fiber_task_alloc(FIBER_TASK_STACK_DEFAULT);
+	ASSERT_NOT_NULL(task);
+	fiber_task_prepare(task, ping_entry, task);
+	for (int i = 1; i <= 3; ++i) {
+		fiber_task_switch(&main_ctx, &task->ctx);
+		ASSERT_EQUAL_INT(i, pings);
+	}
+	fiber_task_switch(&main_ctx, &task->ctx);
+	ASSERT_EQUAL_INT(FIBER_TASK_DONE, task->state);
+	// Reused for another run
+	pings = 0;
+	fiber_task_prepare(task, ping_entry, task);
+	fiber_task_switch(&main_ctx, &task->ctx);
+	ASSERT_EQUAL_INT(1, pings);
+	fiber_task_free(task);
+}
+
+TEST(sleep_heap_order)
+{
+	struct fiber_task tasks[8];
+	uint64_t wakes[8] = { 50, 10, 70, 30, 20, 80, 60, 40 };
+	struct fiber_sleep_heap heap = { 0 };
+	for (int i = 0; i < 8; ++i) {
+		tasks[i].wake_ns = wakes[i];
+		ASSERT_EQUAL_INT(0, fiber_sleep_heap_push(&heap, &tasks[i],
+							  malloc, free));
+	}
+	uint64_t next = fiber_sleep_heap_next(&heap);
+	ASSERT_EQUAL_LONG((uint64_t)10, next);
+	int not_due = fiber_sleep_heap_pop_due(&heap, 5) == NULL;
+	ASSERT_TRUE(not_due);
+	uint64_t prev = 0;
+	struct fiber_task *task;
+	int popped = 0;
+	while ((task = fiber_sleep_heap_pop_due(&heap, 100)) != NULL) {
+		int ordered = task->wake_ns >= prev;
+		ASSERT_TRUE(ordered);
+		prev = task->wake_ns;
+		++popped;
+	}
+	ASSERT_EQUAL_INT(8, popped);
+	// Nothing left for free to unmap
+	fiber_sleep_heap_free(&heap, free);
+}
+
+static int turn = 0;
+
+void *take_turns(void *arg)
+{
+	int me = (int)(intptr_t)arg;
+	for (int i = 0; i < 100; ++i) {
+		while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) % 2 != me) {
+			fiber_yield();
+		}
+		__atomic_add_fetch(&turn, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+// Would never finish on one worker without a real yield
+TEST(yield_interleaves_one_worker)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job a = { .job_func = take_turns, .job_arg = (void *)0 };
+	struct fiber_job b = { .job_func = take_turns, .job_arg = (void *)1 };
+	fiber_job_push(&pool, &a, FIBER_BLOCK);
+	fiber_job_push(&pool, &b, FIBER_BLOCK);
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(200, turn);
+	fiber_free(&pool);
+}
+
+static int finished = 0;
+
+void *yield_a_lot(void *arg)
+{
+	for (int i = 0; i < 10; ++i) {
+		fiber_yield();
+	}
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(many_tasks)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.threads_number = 4;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = yield_a_lot };
+	for (int i = 0; i < MANY_TASKS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(MANY_TASKS, finished);
+	fiber_free(&pool);
+}
+
+void *nap(void *arg)
+{
+	struct timespec ts = { .tv_nsec = 50 * 1000000 };
+	fiber_sleep(&ts);
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// SLEEPERS 50ms sleeps on one worker only take ~50ms if none block it
+TEST(sleep_does_not_block_worker)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = nap };
+	uint64_t start = __fiber_stats_now_ns();
+	for (int i = 0; i < SLEEPERS; ++i) {
+		fiber_job_push(&pool, &job, FIBER_BLOCK);
+	}
+	fiber_wait(&pool);
+	uint64_t took = __fiber_stats_now_ns() - start;
+	ASSERT_EQUAL_INT(SLEEPERS, finished);
+	int slept = took >= 50 * 1000000ull;
+	ASSERT_TRUE(slept);
+	int concurrent = took < 1000 * 1000000ull;
+	ASSERT_TRUE(concurrent);
+	fiber_free(&pool);
+}
+
+TEST(yield_outside_task)
+{
+	fiber_yield();
+	struct timespec ts = { .tv_nsec = 1000 };
+	ASSERT_EQUAL_INT(0, fiber_sleep(&ts));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_sleep(NULL));
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
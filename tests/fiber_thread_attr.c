@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define STACK_SIZE (256 * 1024)
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 2,
+	.queue_length = 64,
+};
+
+static void write_file(const char *path, const char *content)
+{
+	FILE *f = fopen(path, "w");
+	ASSERT_NOT_NULL(f);
+	fputs(content, f);
+	fclose(f);
+}
+
+TEST(thread_opts_bad)
+{
+	struct fiber_pool_init_options opts = default_opts;
+	opts.thread_opts.affinity = 99;
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_init(&pool, &opts));
+	opts.thread_opts.affinity = FIBER_AFFINITY_EXPLICIT;
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_init(&pool, &opts));
+	int cpus[] = { 0 };
+	opts.thread_opts.cpus = cpus;
+	opts.thread_opts.cpus_number = 0;
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_init(&pool, &opts));
+}
+
+TEST(thread_attr_cpus_order)
+{
+	char root[] = "/tmp/fiber_attr_XXXXXX";
+	char path[256];
+	ASSERT_NOT_NULL(mkdtemp(root));
+	snprintf(path, sizeof(path), "%s/online", root);
+	write_file(path, "0-1\n");
+	const char *lists[] = { "0-2\n", "3-5\n" };
+	for (int i = 0; i < 2; ++i) {
+		snprintf(path, sizeof(path), "%s/node%d", root, i);
+		mkdir(path, 0755);
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", root, i);
+		write_file(path, lists[i]);
+	}
+	// CPU 4 is left out
+	int allowed[] = { 0, 1, 2, 3, 5 };
+	int *out;
+	int n;
+	ASSERT_EQUAL_INT(0, fiber_thread_attr_cpus(FIBER_AFFINITY_COMPACT,
+						   allowed, 5, root, malloc,
+						   free, &out, &n));
+	int compact[] = { 0, 1, 2, 3, 5 };
+	ASSERT_EQUAL_INT(5, n);
+	for (int i = 0; i < n; ++i) {
+		ASSERT_EQUAL_INT(compact[i], out[i]);
+	}
+	free(out);
+	ASSERT_EQUAL_INT(0, fiber_thread_attr_cpus(FIBER_AFFINITY_SCATTER,
+						   allowed, 5, root, malloc,
+						   free, &out, &n));
+	int scatter[] = { 0, 3, 1, 2, 5 };
+	ASSERT_EQUAL_INT(5, n);
+	for (int i = 0; i < n; ++i) {
+		ASSERT_EQUAL_INT(scatter[i], out[i]);
+	}
+	free(out);
+	ASSERT_EQUAL_INT(0, fiber_thread_attr_cpus(FIBER_AFFINITY_NONE, NULL,
+						   0, root, malloc, free, &out,
+						   &n));
+	ASSERT_EQUAL_INT(0, n);
+	ASSERT_NULL(out);
+	for (int i = 0; i < 2; ++i) {
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", root, i);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/node%d", root, i);
+		rmdir(path);
+	}
+	snprintf(path, sizeof(path), "%s/online", root);
+	unlink(path);
+	rmdir(root);
+}
+
+struct worker_info {
+	char name[FIBER_THREAD_NAME_MAX];
+	int cpu;
+	size_t stack_size;
+};
+static struct worker_info infos[2];
+static int infos_number = 0;
+void *record_worker(void *arg)
+{
+	struct worker_info *info =
+		&infos[__atomic_fetch_add(&infos_number, 1, __ATOMIC_RELAXED)];
+	pthread_getname_np(pthread_self(), info->name, sizeof(info->name));
+	info->cpu = sched_getcpu();
+	pthread_attr_t attr;
+	pthread_getattr_np(pthread_self(), &attr);
+	pthread_attr_getstacksize(&attr, &info->stack_size);
+	pthread_attr_destroy(&attr);
+	// Keep this worker busy so the other one runs the second job
+	while (__atomic_load_n(&infos_number, __ATOMIC_RELAXED) < 2) {
+		usleep(1000);
+	}
+	return NULL;
+}
+
+TEST(workers_named_pinned_sized)
+{
+	int cpu = sched_getcpu();
+	struct fiber_pool_init_options opts = default_opts;
+	opts.thread_opts.affinity = FIBER_AFFINITY_EXPLICIT;
+	opts.thread_opts.cpus = &cpu;
+	opts.thread_opts.cpus_number = 1;
+	opts.thread_opts.stack_size = STACK_SIZE;
+	opts.thread_opts.name = "wrk";
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = record_worker };
+	fiber_job_push(&pool, &job, FIBER_BLOCK);
+	fiber_job_push(&pool, &job, FIBER_BLOCK);
+	int poll_tries = 50;
+	while (__atomic_load_n(&infos_number, __ATOMIC_RELAXED) < 2 &&
+	       poll_tries-- > 0) {
+		usleep(100000);
+	}
+	fiber_wait(&pool);
+	ASSERT_EQUAL_INT(2, infos_number);
+	int names = strcmp(infos[0].name, "wrk-0") == 0 ?
+			    strcmp(infos[1].name, "wrk-1") == 0 :
+			    strcmp(infos[0].name, "wrk-1") == 0 &&
+				    strcmp(infos[1].name, "wrk-0") == 0;
+	ASSERT_TRUE(names);
+	for (int i = 0; i < 2; ++i) {
+		ASSERT_EQUAL_INT(cpu, infos[i].cpu);
+		ASSERT_EQUAL_LONG((size_t)STACK_SIZE, infos[i].stack_size);
+	}
+	fiber_free(&pool);
+}
+
+TEST(threads_add_opts)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_thread_options topts = { .name = "extra" };
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS, fiber_threads_add_opts(&pool, 1, NULL));
+	topts.affinity = 99;
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_threads_add_opts(&pool, 1, &topts));
+	topts.affinity = FIBER_AFFINITY_COMPACT;
+	ASSERT_EQUAL_INT(0, fiber_threads_add_opts(&pool, 1, &topts));
+	ASSERT_EQUAL_INT(3, fiber_threads_number(&pool));
+	int found = 0;
+	pthread_mutex_lock(&pool.lock);
+	for (struct fiber_thread *t = pool.thread_head; t != NULL; t = t->next) {
+		char name[FIBER_THREAD_NAME_MAX];
+		pthread_getname_np(t->thread_id, name, sizeof(name));
+		found += strcmp(name, "extra-2") == 0;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	ASSERT_EQUAL_INT(1, found);
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
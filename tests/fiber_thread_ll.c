@@ -8,8 +8,10 @@
 
 TEST(allocate_threads)
 {
+	struct fiber_slab slab;
+	fiber_slab_init(&slab, malloc, free);
 	struct fiber_thread *head = NULL;
-	int err = thread_ll_alloc_n(&head, 5, malloc);
+	int err = thread_ll_alloc_n(&slab, &head, 5);
 	ASSERT_EQUAL_INT(0, err);
 	struct fiber_thread *curr = head;
 	for (int i = 0; i < 5; i++) {
@@ -17,7 +19,8 @@ TEST(allocate_threads)
 		curr = curr->next;
 	}
 	ASSERT_NULL(curr); // Ensure last thread points to NULL
-	thread_ll_free(head, free);
+	thread_ll_free(&slab, head);
+	fiber_slab_free(&slab);
 }
 
 TEST(add_threads_empty_ll)
@@ -0,0 +1,167 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define WHEEL_TIMERS 100000
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = 2,
+	.queue_length = 64,
+	.flags = FIBER_OPT_TIMERS,
+};
+
+static struct fiber_timer *timers[WHEEL_TIMERS];
+// 0 pending, 1 fired, 2 cancelled
+static char state[WHEEL_TIMERS];
+
+TEST(wheel_fires_each_timer_on_time)
+{
+	struct fiber_timer_wheel wheel;
+	uint64_t start = 123456789;
+	ASSERT_EQUAL_INT(0, fiber_timer_wheel_init(&wheel, start, malloc));
+	uint32_t x = 1;
+	for (int i = 0; i < WHEEL_TIMERS; ++i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		timers[i] = calloc(1, sizeof(struct fiber_timer));
+		timers[i]->job.job_id = i;
+		// Every 1000th is past the top level and waits in overflow
+		uint64_t delay = i % 1000 == 0 ? (uint64_t)x << 8 : x % 5000000;
+		timers[i]->expire = start + delay;
+		fiber_timer_wheel_add(&wheel, timers[i], malloc, free);
+	}
+	for (int i = 0; i < WHEEL_TIMERS; i += 7) {
+		struct fiber_timer *removed = fiber_timer_wheel_remove(&wheel, i);
+		ASSERT_EQUAL_PTR(timers[i], removed);
+		state[i] = 2;
+		free(removed);
+	}
+	ASSERT_EQUAL_PTR(NULL, fiber_timer_wheel_remove(&wheel, 7));
+	uint64_t now = start;
+	int bad = 0;
+	while (wheel.count > 0) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		uint64_t next = fiber_timer_wheel_next(&wheel);
+		uint64_t to = now + 1 + x % 20000;
+		if (next - now > 20000) {
+			to = next;
+		}
+		struct fiber_timer *due = fiber_timer_wheel_advance(&wheel, to);
+		while (due != NULL) {
+			struct fiber_timer *timer = due;
+			due = due->next;
+			int id = (int)timer->job.job_id;
+			if (state[id] != 0 || timer->expire > to ||
+			    timer->expire <= now) {
+				++bad;
+			}
+			state[id] = 1;
+			free(timer);
+		}
+		now = to;
+	}
+	for (int i = 0; i < WHEEL_TIMERS; ++i) {
+		bad += state[i] == 0;
+	}
+	ASSERT_EQUAL_INT(0, bad);
+	fiber_timer_wheel_free(&wheel, free);
+}
+
+static uint64_t ran_at = 0;
+static int runs = 0;
+void *stamp(void *arg)
+{
+	__atomic_store_n(&ran_at, __fiber_stats_now_ns(), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&runs, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(push_after_waits_for_delay)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = stamp };
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 20000000 };
+	uint64_t start = __fiber_stats_now_ns();
+	jid id = fiber_job_push_after(&pool, &job, &delay);
+	int ok = id >= 0 && id == job.job_id;
+	ASSERT_TRUE(ok);
+	usleep(100000);
+	ASSERT_EQUAL_INT(1, runs);
+	ok = ran_at - start >= 20000000;
+	ASSERT_TRUE(ok);
+	// Already fired
+	ASSERT_EQUAL_INT(FBR_ENO_JOB, fiber_job_timer_cancel(&pool, id));
+	fiber_free(&pool);
+}
+
+TEST(push_every_until_cancelled)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = stamp };
+	struct timespec period = { .tv_sec = 0, .tv_nsec = 10000000 };
+	jid id = fiber_job_push_every(&pool, &job, &period);
+	usleep(105000);
+	ASSERT_EQUAL_INT(0, fiber_job_timer_cancel(&pool, id));
+	fiber_wait(&pool);
+	int seen = __atomic_load_n(&runs, __ATOMIC_RELAXED);
+	int ok = seen >= 5 && seen <= 10;
+	ASSERT_TRUE(ok);
+	usleep(30000);
+	ASSERT_EQUAL_INT(seen, runs);
+	fiber_free(&pool);
+}
+
+TEST(cancel_many_pending)
+{
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	struct fiber_job job = { .job_func = stamp };
+	static jid ids[WHEEL_TIMERS];
+	for (int i = 0; i < WHEEL_TIMERS; ++i) {
+		struct timespec delay = { .tv_sec = 1 + i % 60, .tv_nsec = i };
+		ids[i] = fiber_job_push_after(&pool, &job, &delay);
+	}
+	for (int i = 0; i < WHEEL_TIMERS; ++i) {
+		int res = fiber_job_timer_cancel(&pool, ids[i]);
+		ASSERT_EQUAL_INT(0, res);
+	}
+	ASSERT_EQUAL_INT(0, runs);
+	fiber_free(&pool);
+}
+
+TEST(timer_errors)
+{
+	struct fiber_job job = { .job_func = stamp };
+	struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000 };
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS,
+			 fiber_job_push_after(NULL, &job, &delay));
+	ASSERT_EQUAL_INT(FBR_ENULL_ARGS,
+			 fiber_job_push_after(&pool, &job, NULL));
+	struct fiber_pool_init_options opts = default_opts;
+	opts.flags = 0;
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT,
+			 fiber_job_push_after(&pool, &job, &delay));
+	ASSERT_EQUAL_INT(FBR_EINVLD_OPT, fiber_job_timer_cancel(&pool, 1));
+	fiber_free(&pool);
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &default_opts));
+	// Shorter than a tick
+	ASSERT_EQUAL_INT(FBR_EINVLD_SIZE,
+			 fiber_job_push_every(&pool, &job, &delay));
+	ASSERT_EQUAL_INT(FBR_ENO_JOB, fiber_job_timer_cancel(&pool, 12345));
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,185 @@
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+
+#include "fiber.c"
+#include "xtal.h"
+
+#define DEFAULT_THREADS_NUMBER 4
+#define THIEVES 3
+#define STEAL_JOBS 50000
+#define FAN_OUT_DEPTH 12
+
+struct fiber_pool pool = { 0 };
+struct fiber_pool_init_options default_opts = {
+	.queue_ops = NULL, // Use default FIFO
+	.malloc = malloc,
+	.free = free,
+	.threads_number = DEFAULT_THREADS_NUMBER,
+	.queue_length = 64,
+	.flags = FIBER_OPT_WORK_STEALING,
+	.deque_length = 0,
+};
+
+static struct fiber_deque dq;
+
+void *do_nothing(void *arg)
+{
+	return NULL;
+}
+
+TEST(deque_push_pop_lifo)
+{
+	ASSERT_EQUAL_INT(0, fiber_deque_init(&dq, 4, malloc));
+	struct fiber_job job = { .job_func = do_nothing };
+	for (jid i = 0; i < 4; ++i) {
+		job.job_id = i;
+		ASSERT_EQUAL_INT(0, fiber_deque_push(&dq, &job));
+	}
+	ASSERT_EQUAL_INT(4, fiber_deque_length(&dq));
+	struct fiber_job buf;
+	for (jid i = 3; i >= 0; --i) {
+		ASSERT_EQUAL_INT(0, fiber_deque_pop(&dq, &buf));
+		ASSERT_EQUAL_LONG(i, buf.job_id);
+	}
+	ASSERT_EQUAL_INT(EAGAIN, fiber_deque_pop(&dq, &buf));
+	fiber_deque_free(&dq, free);
+}
+
+TEST(deque_steal_fifo)
+{
+	ASSERT_EQUAL_INT(0, fiber_deque_init(&dq, 4, malloc));
+	struct fiber_job job = { .job_func = do_nothing };
+	for (jid i = 0; i < 3; ++i) {
+		job.job_id = i;
+		fiber_deque_push(&dq, &job);
+	}
+	struct fiber_job buf;
+	ASSERT_EQUAL_INT(0, fiber_deque_steal(&dq, &buf));
+	ASSERT_EQUAL_LONG((jid)0, buf.job_id);
+	ASSERT_EQUAL_INT(0, fiber_deque_pop(&dq, &buf));
+	ASSERT_EQUAL_LONG((jid)2, buf.job_id);
+	ASSERT_EQUAL_INT(0, fiber_deque_steal(&dq, &buf));
+	ASSERT_EQUAL_LONG((jid)1, buf.job_id);
+	ASSERT_EQUAL_INT(EAGAIN, fiber_deque_steal(&dq, &buf));
+	fiber_deque_free(&dq, free);
+}
+
+TEST(deque_full)
+{
+	ASSERT_EQUAL_INT(0, fiber_deque_init(&dq, 2, malloc));
+	struct fiber_job job = { .job_func = do_nothing };
+	ASSERT_EQUAL_INT(0, fiber_deque_push(&dq, &job));
+	ASSERT_EQUAL_INT(0, fiber_deque_push(&dq, &job));
+	ASSERT_EQUAL_INT(-EAGAIN, fiber_deque_push(&dq, &job));
+	fiber_deque_free(&dq, free);
+}
+
+static long stolen_sum = 0;
+static int owner_done = 0;
+static void *thief(void *arg)
+{
+	struct fiber_job buf;
+	long sum = 0;
+	while (!__atomic_load_n(&owner_done, __ATOMIC_ACQUIRE) ||
+	       fiber_deque_length(&dq) > 0) {
+		if (fiber_deque_steal(&dq, &buf) == 0) {
+			sum += buf.job_id;
+		}
+	}
+	__atomic_add_fetch(&stolen_sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(deque_concurrent_steal_no_loss)
+{
+	ASSERT_EQUAL_INT(0, fiber_deque_init(&dq, 64, malloc));
+	pthread_t thieves[THIEVES];
+	for (int i = 0; i < THIEVES; ++i) {
+		pthread_create(&thieves[i], NULL, thief, NULL);
+	}
+	struct fiber_job job = { .job_func = do_nothing };
+	struct fiber_job buf;
+	long owner_sum = 0;
+	for (jid i = 0; i < STEAL_JOBS; ++i) {
+		job.job_id = i;
+		while (fiber_deque_push(&dq, &job) != 0) {
+			if (fiber_deque_pop(&dq, &buf) == 0) {
+				owner_sum += buf.job_id;
+			}
+		}
+		// Pop every other job so owner and thieves race on the end
+		if ((i & 1) && fiber_deque_pop(&dq, &buf) == 0) {
+			owner_sum += buf.job_id;
+		}
+	}
+	while (fiber_deque_pop(&dq, &buf) == 0) {
+		owner_sum += buf.job_id;
+	}
+	__atomic_store_n(&owner_done, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < THIEVES; ++i) {
+		pthread_join(thieves[i], NULL);
+	}
+	long expected = (long)STEAL_JOBS * (STEAL_JOBS - 1) / 2;
+	ASSERT_EQUAL_LONG(expected, owner_sum + stolen_sum);
+	fiber_deque_free(&dq, free);
+}
+
+TEST(local_push_outside_worker)
+{
+	struct fiber_job job = { .job_func = do_nothing };
+	jid res = worker_local_push(&pool, &job);
+	ASSERT_EQUAL_LONG((jid)FBR_EPUSH_JOB, res);
+}
+
+static long leaves = 0;
+static void *fan_out(void *arg)
+{
+	long depth = (long)arg;
+	if (depth == 0) {
+		__atomic_add_fetch(&leaves, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	struct fiber_job child = { .job_func = fan_out,
+				   .job_arg = (void *)(depth - 1) };
+	fiber_job_push(&pool, &child, FIBER_BLOCK);
+	fiber_job_push(&pool, &child, FIBER_BLOCK);
+	return NULL;
+}
+
+TEST(work_stealing_fan_out)
+{
+	int res = fiber_init(&pool, &default_opts);
+	ASSERT_EQUAL_INT(0, res);
+	ASSERT_EQUAL_INT(FIBER_DEQUE_LENGTH_DEFAULT, pool.deque_length);
+	struct fiber_job root = { .job_func = fan_out,
+				  .job_arg = (void *)FAN_OUT_DEPTH };
+	fiber_job_push(&pool, &root, FIBER_BLOCK);
+	long expected = 1L << FAN_OUT_DEPTH;
+	int poll_tries = 50;
+	while (__atomic_load_n(&leaves, __ATOMIC_RELAXED) != expected &&
+	       poll_tries-- > 0) {
+		usleep(100000);
+	}
+	ASSERT_EQUAL_LONG(expected, leaves);
+	fiber_free(&pool);
+}
+
+TEST(work_stealing_threads_remove)
+{
+	int res = fiber_init(&pool, &default_opts);
+	ASSERT_EQUAL_INT(0, res);
+	res = fiber_threads_remove(&pool, DEFAULT_THREADS_NUMBER);
+	ASSERT_EQUAL_INT(0, res);
+	int poll_tries = 5;
+	do {
+		sleep(1);
+	} while (fiber_threads_number(&pool) != 0 && poll_tries-- > 0);
+	ASSERT_EQUAL_INT(0, fiber_threads_number(&pool));
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
@@ -1,5 +1,6 @@
+#define _DEFAULT_SOURCE
 #include <errno.h>
-#include <semaphore.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -23,7 +24,7 @@ static void push_phony_job(jid id)
 	};
 	jq->tail = 1;
 	*jq->jobs = test;
-	sem_post(&jq->jobs_num);
+	fiber_park_sem_post(&jq->jobs_num, 1);
 }
 
 TEST(fifo_init)
@@ -32,10 +33,9 @@ TEST(fifo_init)
 	ASSERT_EQUAL_INT(0, jq->head)
 	ASSERT_EQUAL_INT(0, jq->tail)
 	ASSERT_EQUAL_INT(5, jq->capacity)
-	int semval = -1;
-	sem_getvalue(&jq->jobs_num, &semval);
+	int semval = fiber_park_sem_value(&jq->jobs_num);
 	ASSERT_EQUAL_INT(0, semval)
-	sem_getvalue(&jq->void_num, &semval);
+	semval = fiber_park_sem_value(&jq->void_num);
 	ASSERT_EQUAL_INT(5, semval)
 	teardown();
 }
@@ -51,10 +51,9 @@ TEST(fifo_push_empty)
 	ASSERT_EQUAL_INT(0, res)
 	ASSERT_EQUAL_INT(0, jq->head)
 	ASSERT_EQUAL_INT(1, jq->tail)
-	int semval = -1;
-	sem_getvalue(&jq->jobs_num, &semval);
+	int semval = fiber_park_sem_value(&jq->jobs_num);
 	ASSERT_EQUAL_INT(1, semval)
-	sem_getvalue(&jq->void_num, &semval);
+	semval = fiber_park_sem_value(&jq->void_num);
 	ASSERT_EQUAL_INT(4, semval)
 	teardown();
 }
@@ -70,10 +69,9 @@ TEST(fifo_push_full)
 	}
 	ASSERT_EQUAL_INT(0, jq->head)
 	ASSERT_EQUAL_INT(0, jq->tail)
-	int semval = -1;
-	sem_getvalue(&jq->jobs_num, &semval);
+	int semval = fiber_park_sem_value(&jq->jobs_num);
 	ASSERT_EQUAL_INT(2, semval)
-	sem_getvalue(&jq->void_num, &semval);
+	semval = fiber_park_sem_value(&jq->void_num);
 	ASSERT_EQUAL_INT(0, semval)
 	int res = fiber_queue_fifo_push(jq, &j, FIBER_NO_BLOCK);
 	ASSERT_EQUAL_INT(-EAGAIN, res)
@@ -147,6 +145,86 @@ TEST(fifo_pop_noblock)
 	teardown();
 }
 
+TEST(fifo_push_n_wraps)
+{
+	setup(4);
+	struct fiber_job jobs[4] = { 0 };
+	for (int i = 0; i < 4; ++i) {
+		jobs[i].job_id = i;
+		jobs[i].job_func = do_nothing;
+	}
+	// Move head and tail so the batch has to wrap around the ring
+	qsize res = fiber_queue_fifo_push_n(jq, jobs, 3, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(3, res)
+	struct fiber_job buf[4];
+	res = fiber_queue_fifo_pop_n(jq, buf, 3, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(3, res)
+	res = fiber_queue_fifo_push_n(jq, jobs, 4, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(4, res)
+	ASSERT_EQUAL_INT(3, jq->head)
+	ASSERT_EQUAL_INT(3, jq->tail)
+	res = fiber_queue_fifo_pop_n(jq, buf, 4, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(4, res)
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_EQUAL_LONG((jid)i, buf[i].job_id)
+	}
+	teardown();
+}
+
+TEST(fifo_push_n_partial)
+{
+	setup(2);
+	struct fiber_job jobs[3] = { 0 };
+	for (int i = 0; i < 3; ++i) {
+		jobs[i].job_func = do_nothing;
+	}
+	qsize res = fiber_queue_fifo_push_n(jq, jobs, 3, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(2, res)
+	res = fiber_queue_fifo_push_n(jq, jobs, 1, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(-EAGAIN, res)
+	int semval = fiber_park_sem_value(&jq->jobs_num);
+	ASSERT_EQUAL_INT(2, semval)
+	teardown();
+}
+
+TEST(fifo_pop_n_empty_noblock)
+{
+	setup(2);
+	struct fiber_job buf[2];
+	qsize res = fiber_queue_fifo_pop_n(jq, buf, 2, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(0, res)
+	teardown();
+}
+
+static void *pop_one(void *arg)
+{
+	struct fiber_job buf = { 0 };
+	fiber_queue_fifo_pop(jq, &buf, FIBER_BLOCK);
+	return (void *)buf.job_id;
+}
+
+TEST(fifo_pop_sleeps_until_push)
+{
+	setup(2);
+	// No spinning so the consumer has to go through the futex
+	fiber_queue_fifo_set_park_spin(jq, 0);
+	pthread_t consumer;
+	pthread_create(&consumer, NULL, pop_one, NULL);
+	int poll_tries = 100;
+	while (__atomic_load_n(&jq->jobs_num.sleepers, __ATOMIC_RELAXED) == 0 &&
+	       poll_tries-- > 0) {
+		usleep(10000);
+	}
+	ASSERT_EQUAL_INT(1, jq->jobs_num.sleepers)
+	struct fiber_job job = { .job_id = 0xB00B, .job_func = do_nothing };
+	fiber_queue_fifo_push(jq, &job, FIBER_BLOCK);
+	void *res;
+	pthread_join(consumer, &res);
+	ASSERT_EQUAL_LONG((jid)0xB00B, (jid)res)
+	ASSERT_EQUAL_INT(0, jq->jobs_num.sleepers)
+	teardown();
+}
+
 int main()
 {
 	run_tests();
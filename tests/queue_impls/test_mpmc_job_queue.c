@@ -0,0 +1,194 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "job_queue.h"
+#include "queue_impls/mpmc_job_queue.h"
+#include "xtal.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define JOBS_PER_PRODUCER 20000
+
+static void setup(qsize cap);
+static void teardown();
+
+static struct mpmc_jq *mq = NULL;
+void *do_nothing(void *arg)
+{
+	return NULL;
+}
+
+TEST(mpmc_init)
+{
+	setup(5);
+	ASSERT_EQUAL_INT(0, (int)mq->head)
+	ASSERT_EQUAL_INT(0, (int)mq->tail)
+	// Capacity is rounded up to the next power of two
+	ASSERT_EQUAL_INT(7, (int)mq->mask)
+	ASSERT_EQUAL_INT(0, fiber_queue_mpmc_length(mq))
+	teardown();
+}
+
+TEST(mpmc_push_pop_order)
+{
+	setup(4);
+	struct fiber_job job = { 0 };
+	job.job_func = do_nothing;
+	for (jid i = 0; i < 4; ++i) {
+		job.job_id = i;
+		int res = fiber_queue_mpmc_push(mq, &job, FIBER_NO_BLOCK);
+		ASSERT_EQUAL_INT(0, res)
+	}
+	ASSERT_EQUAL_INT(4, fiber_queue_mpmc_length(mq))
+	struct fiber_job buf;
+	for (jid i = 0; i < 4; ++i) {
+		int res = fiber_queue_mpmc_pop(mq, &buf, FIBER_NO_BLOCK);
+		ASSERT_EQUAL_INT(0, res)
+		ASSERT_EQUAL_LONG(i, buf.job_id)
+	}
+	ASSERT_EQUAL_INT(0, fiber_queue_mpmc_length(mq))
+	teardown();
+}
+
+TEST(mpmc_push_full)
+{
+	setup(1);
+	struct fiber_job j = { 0 };
+	j.job_func = do_nothing;
+	for (int i = 0; i < 2; i++) {
+		int res = fiber_queue_mpmc_push(mq, &j, FIBER_NO_BLOCK);
+		ASSERT_EQUAL_INT(0, res)
+	}
+	int res = fiber_queue_mpmc_push(mq, &j, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(-EAGAIN, res)
+	teardown();
+}
+
+TEST(mpmc_pop_empty_noblock)
+{
+	setup(1);
+	struct fiber_job buf;
+	int res = fiber_queue_mpmc_pop(mq, &buf, FIBER_NO_BLOCK);
+	ASSERT_EQUAL_INT(EAGAIN, res)
+	teardown();
+}
+
+TEST(mpmc_pop_empty_block)
+{
+	setup(1);
+	struct fiber_job buf;
+	int f = fork();
+	// Same idea as fifo_pop_empty_block. exit(8) should never be reached.
+	if (f < 0) {
+		FAIL("Fork failed.");
+	} else if (f == 0) {
+		alarm(1);
+		fiber_queue_mpmc_pop(mq, &buf, FIBER_BLOCK);
+		exit(8);
+	} else {
+		int child_stat = -1;
+		waitpid(f, &child_stat, 0);
+		int exit_stat = WEXITSTATUS(child_stat);
+		if (exit_stat == 8) {
+			FAIL("Made it past fiber_queue_mpmc_pop");
+		}
+	}
+	teardown();
+}
+
+static void *delayed_pop(void *arg)
+{
+	struct fiber_job buf;
+	usleep(100000);
+	fiber_queue_mpmc_pop(mq, &buf, FIBER_BLOCK);
+	return NULL;
+}
+
+TEST(mpmc_push_full_block_wakes)
+{
+	setup(2);
+	struct fiber_job j = { 0 };
+	j.job_func = do_nothing;
+	for (int i = 0; i < 2; i++) {
+		int res = fiber_queue_mpmc_push(mq, &j, FIBER_NO_BLOCK);
+		ASSERT_EQUAL_INT(0, res)
+	}
+	pthread_t consumer;
+	pthread_create(&consumer, NULL, delayed_pop, NULL);
+	// Blocks until the consumer frees a slot
+	int res = fiber_queue_mpmc_push(mq, &j, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(0, res)
+	pthread_join(consumer, NULL);
+	ASSERT_EQUAL_INT(2, fiber_queue_mpmc_length(mq))
+	teardown();
+}
+
+static long consumed_sum = 0;
+static void *producer(void *arg)
+{
+	long base = (long)arg * JOBS_PER_PRODUCER;
+	struct fiber_job j = { 0 };
+	j.job_func = do_nothing;
+	for (long i = 0; i < JOBS_PER_PRODUCER; ++i) {
+		j.job_id = base + i;
+		fiber_queue_mpmc_push(mq, &j, FIBER_BLOCK);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct fiber_job buf;
+	long sum = 0;
+	for (long i = 0; i < JOBS_PER_PRODUCER; ++i) {
+		fiber_queue_mpmc_pop(mq, &buf, FIBER_BLOCK);
+		sum += buf.job_id;
+	}
+	__atomic_add_fetch(&consumed_sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(mpmc_concurrent_no_loss)
+{
+	setup(64);
+	pthread_t prod[PRODUCERS], cons[CONSUMERS];
+	for (long i = 0; i < CONSUMERS; ++i) {
+		pthread_create(&cons[i], NULL, consumer, NULL);
+	}
+	for (long i = 0; i < PRODUCERS; ++i) {
+		pthread_create(&prod[i], NULL, producer, (void *)i);
+	}
+	for (int i = 0; i < PRODUCERS; ++i) {
+		pthread_join(prod[i], NULL);
+	}
+	for (int i = 0; i < CONSUMERS; ++i) {
+		pthread_join(cons[i], NULL);
+	}
+	long n = (long)PRODUCERS * JOBS_PER_PRODUCER;
+	long expected = n * (n - 1) / 2;
+	ASSERT_EQUAL_LONG(expected, consumed_sum)
+	ASSERT_EQUAL_INT(0, fiber_queue_mpmc_length(mq))
+	teardown();
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
+
+static void setup(qsize cap)
+{
+	int res = fiber_queue_mpmc_init((void **)&mq, cap, malloc, free);
+	ASSERT_EQUAL_INT(0, res);
+}
+
+static void teardown()
+{
+	fiber_queue_mpmc_free(mq);
+	mq = NULL;
+}
@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "job_queue.h"
+#include "queue_impls/prio_job_queue.h"
+#include "xtal.h"
+
+static void setup(qsize cap);
+static void teardown();
+static void push_id(jid id, uint32_t prio);
+
+static struct prio_jq *pq = NULL;
+void *do_nothing(void *arg)
+{
+	return NULL;
+}
+
+TEST(prio_init)
+{
+	setup(4);
+	ASSERT_EQUAL_INT(0, (int)pq->lanes_used)
+	ASSERT_EQUAL_INT(FIBER_PRIO_AGING, (int)pq->aging)
+	ASSERT_EQUAL_INT(0, fiber_queue_prio_length(pq))
+	teardown();
+}
+
+TEST(prio_highest_lane_first)
+{
+	setup(4);
+	fiber_queue_prio_set_aging(pq, 0);
+	push_id(0, FIBER_PRIO_LOWEST);
+	push_id(1, FIBER_PRIO(3));
+	push_id(2, FIBER_PRIO_HIGHEST);
+	push_id(3, FIBER_PRIO(3));
+	int used = (1 << 0) | (1 << 3) | (1 << FIBER_PRIO_HIGHEST);
+	ASSERT_EQUAL_INT(used, (int)pq->lanes_used)
+	jid expected[] = { 2, 1, 3, 0 };
+	struct fiber_job buf;
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_EQUAL_INT(0, fiber_queue_prio_pop(pq, &buf, FIBER_BLOCK))
+		ASSERT_EQUAL_LONG(expected[i], buf.job_id)
+	}
+	ASSERT_EQUAL_INT(0, (int)pq->lanes_used)
+	ASSERT_EQUAL_INT(EAGAIN, fiber_queue_prio_pop(pq, &buf, FIBER_NO_BLOCK))
+	teardown();
+}
+
+TEST(prio_lane_full_noblock)
+{
+	setup(2);
+	struct fiber_job job = { .job_func = do_nothing };
+	ASSERT_EQUAL_INT(0, fiber_queue_prio_push(pq, &job, FIBER_PRIO(1)))
+	ASSERT_EQUAL_INT(0, fiber_queue_prio_push(pq, &job, FIBER_PRIO(1)))
+	ASSERT_EQUAL_INT(-EAGAIN, fiber_queue_prio_push(pq, &job, FIBER_PRIO(1)))
+	// Other lanes have their own room
+	ASSERT_EQUAL_INT(0, fiber_queue_prio_push(pq, &job, FIBER_PRIO(2)))
+	ASSERT_EQUAL_INT(3, fiber_queue_prio_length(pq))
+	teardown();
+}
+
+TEST(prio_aging_serves_starved_lane)
+{
+	setup(16);
+	fiber_queue_prio_set_aging(pq, 3);
+	push_id(100, FIBER_PRIO_LOWEST);
+	for (jid i = 0; i < 8; ++i) {
+		push_id(i, FIBER_PRIO_HIGHEST);
+	}
+	struct fiber_job buf;
+	for (int i = 0; i < 2; ++i) {
+		fiber_queue_prio_pop(pq, &buf, FIBER_BLOCK);
+		ASSERT_EQUAL_LONG((jid)i, buf.job_id)
+	}
+	// Passed over twice, the third pop goes to it
+	fiber_queue_prio_pop(pq, &buf, FIBER_BLOCK);
+	ASSERT_EQUAL_LONG((jid)100, buf.job_id)
+	fiber_queue_prio_pop(pq, &buf, FIBER_BLOCK);
+	ASSERT_EQUAL_LONG((jid)2, buf.job_id)
+	teardown();
+}
+
+TEST(prio_push_n_pop_n)
+{
+	setup(4);
+	fiber_queue_prio_set_aging(pq, 0);
+	struct fiber_job jobs[4] = { 0 };
+	for (int i = 0; i < 4; ++i) {
+		jobs[i].job_func = do_nothing;
+		jobs[i].job_id = i;
+	}
+	ASSERT_EQUAL_INT(4, fiber_queue_prio_push_n(pq, jobs, 4, FIBER_PRIO(1)))
+	ASSERT_EQUAL_INT(-EAGAIN,
+			 fiber_queue_prio_push_n(pq, jobs, 1, FIBER_PRIO(1)))
+	push_id(9, FIBER_PRIO(5));
+	struct fiber_job buf[8];
+	ASSERT_EQUAL_INT(5, fiber_queue_prio_pop_n(pq, buf, 8, FIBER_BLOCK))
+	ASSERT_EQUAL_LONG((jid)9, buf[0].job_id)
+	for (int i = 1; i < 5; ++i) {
+		ASSERT_EQUAL_LONG((jid)(i - 1), buf[i].job_id)
+	}
+	// Lane 1 got its room back
+	ASSERT_EQUAL_INT(4, (int)fiber_park_sem_value(&pq->void_num[1]))
+	teardown();
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
+
+static void setup(qsize cap)
+{
+	int res = fiber_queue_prio_init((void **)&pq, cap, malloc, free);
+	ASSERT_EQUAL_INT(0, res);
+}
+
+static void teardown()
+{
+	fiber_queue_prio_free(pq);
+	pq = NULL;
+}
+
+static void push_id(jid id, uint32_t prio)
+{
+	struct fiber_job job = { .job_id = id, .job_func = do_nothing };
+	ASSERT_EQUAL_INT(0, fiber_queue_prio_push(pq, &job, prio | FIBER_BLOCK))
+}
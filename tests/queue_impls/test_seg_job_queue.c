@@ -0,0 +1,239 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fiber.h"
+#include "job_queue.h"
+#include "queue_impls/seg_job_queue.h"
+#include "xtal.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define JOBS_PER_PRODUCER 20000
+
+static void setup(qsize cap);
+static void teardown();
+
+static struct seg_jq *sq = NULL;
+void *do_nothing(void *arg)
+{
+	return NULL;
+}
+
+TEST(seg_init)
+{
+	setup(FIBER_SEG_JOBS * 2 + 1);
+	ASSERT_EQUAL_INT(3, (int)sq->spare_max)
+	ASSERT_EQUAL_INT(0, (int)sq->spare_num)
+	ASSERT_EQUAL_PTR(sq->head_seg, sq->tail_seg)
+	ASSERT_EQUAL_INT(0, fiber_queue_seg_length(sq))
+	teardown();
+}
+
+TEST(seg_grows_and_keeps_order)
+{
+	setup(1);
+	struct fiber_job job = { .job_func = do_nothing };
+	int n = FIBER_SEG_JOBS * 10 + 3;
+	for (int i = 0; i < n; ++i) {
+		job.job_id = i;
+		ASSERT_EQUAL_INT(0, fiber_queue_seg_push(sq, &job, FIBER_NO_BLOCK))
+	}
+	ASSERT_EQUAL_INT(n, fiber_queue_seg_length(sq))
+	struct fiber_job buf;
+	for (int i = 0; i < n; ++i) {
+		ASSERT_EQUAL_INT(0, fiber_queue_seg_pop(sq, &buf, FIBER_NO_BLOCK))
+		ASSERT_EQUAL_LONG((jid)i, buf.job_id)
+	}
+	ASSERT_EQUAL_INT(EAGAIN, fiber_queue_seg_pop(sq, &buf, FIBER_NO_BLOCK))
+	// Drained segments past capacity were freed
+	ASSERT_EQUAL_INT(1, (int)sq->spare_num)
+	teardown();
+}
+
+TEST(seg_push_n_pop_n_cross_segments)
+{
+	setup(FIBER_SEG_JOBS * 4);
+	int n = FIBER_SEG_JOBS * 3 + 7;
+	struct fiber_job *jobs = malloc(n * sizeof(*jobs));
+	struct fiber_job *buf = malloc(n * sizeof(*buf));
+	for (int i = 0; i < n; ++i) {
+		jobs[i].job_func = do_nothing;
+		jobs[i].job_id = i;
+	}
+	ASSERT_EQUAL_INT(5, fiber_queue_seg_push_n(sq, jobs, 5, FIBER_BLOCK))
+	ASSERT_EQUAL_INT(n, fiber_queue_seg_push_n(sq, jobs, n, FIBER_BLOCK))
+	ASSERT_EQUAL_INT(n + 5, fiber_queue_seg_length(sq))
+	ASSERT_EQUAL_INT(5, fiber_queue_seg_pop_n(sq, buf, 5, FIBER_BLOCK))
+	ASSERT_EQUAL_INT(n, fiber_queue_seg_pop_n(sq, buf, n + 1, FIBER_BLOCK))
+	for (int i = 0; i < n; ++i) {
+		ASSERT_EQUAL_LONG((jid)i, buf[i].job_id)
+	}
+	ASSERT_EQUAL_INT(0, fiber_queue_seg_pop_n(sq, buf, 1, FIBER_NO_BLOCK))
+	free(jobs);
+	free(buf);
+	teardown();
+}
+
+TEST(seg_high_water_noblock)
+{
+	setup(4);
+	fiber_queue_seg_set_high_water(sq, 2);
+	struct fiber_job jobs[4] = { 0 };
+	for (int i = 0; i < 4; ++i) {
+		jobs[i].job_func = do_nothing;
+	}
+	ASSERT_EQUAL_INT(0, fiber_queue_seg_push(sq, jobs, FIBER_NO_BLOCK))
+	// Soft, the batch that gets in may overshoot the mark
+	ASSERT_EQUAL_INT(3, fiber_queue_seg_push_n(sq, jobs, 3, FIBER_NO_BLOCK))
+	ASSERT_EQUAL_INT(-EAGAIN,
+			 fiber_queue_seg_push(sq, jobs, FIBER_NO_BLOCK))
+	ASSERT_EQUAL_INT(-EAGAIN,
+			 fiber_queue_seg_push_n(sq, jobs, 1, FIBER_NO_BLOCK))
+	fiber_queue_seg_set_high_water(sq, 0);
+	ASSERT_EQUAL_INT(0, fiber_queue_seg_push(sq, jobs, FIBER_NO_BLOCK))
+	ASSERT_EQUAL_INT(5, fiber_queue_seg_length(sq))
+	teardown();
+}
+
+static void *delayed_pop(void *arg)
+{
+	struct fiber_job buf;
+	usleep(100000);
+	fiber_queue_seg_pop(sq, &buf, FIBER_BLOCK);
+	return NULL;
+}
+
+TEST(seg_high_water_block_wakes)
+{
+	setup(4);
+	fiber_queue_seg_set_high_water(sq, 2);
+	struct fiber_job j = { 0 };
+	j.job_func = do_nothing;
+	for (int i = 0; i < 2; i++) {
+		int res = fiber_queue_seg_push(sq, &j, FIBER_NO_BLOCK);
+		ASSERT_EQUAL_INT(0, res)
+	}
+	pthread_t consumer;
+	pthread_create(&consumer, NULL, delayed_pop, NULL);
+	// Blocks until the consumer takes a job
+	int res = fiber_queue_seg_push(sq, &j, FIBER_BLOCK);
+	ASSERT_EQUAL_INT(0, res)
+	pthread_join(consumer, NULL);
+	ASSERT_EQUAL_INT(2, fiber_queue_seg_length(sq))
+	teardown();
+}
+
+static long consumed_sum = 0;
+static void *producer(void *arg)
+{
+	long base = (long)arg * JOBS_PER_PRODUCER;
+	struct fiber_job j = { 0 };
+	j.job_func = do_nothing;
+	for (long i = 0; i < JOBS_PER_PRODUCER; ++i) {
+		j.job_id = base + i;
+		fiber_queue_seg_push(sq, &j, FIBER_BLOCK);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	struct fiber_job buf[8];
+	long sum = 0;
+	long left = JOBS_PER_PRODUCER;
+	while (left > 0) {
+		qsize n = fiber_queue_seg_pop_n(sq, buf, left < 8 ? left : 8,
+						FIBER_BLOCK);
+		for (qsize i = 0; i < n; ++i) {
+			sum += buf[i].job_id;
+		}
+		left -= n;
+	}
+	__atomic_add_fetch(&consumed_sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(seg_concurrent_no_loss)
+{
+	setup(64);
+	fiber_queue_seg_set_high_water(sq, 1000);
+	pthread_t prod[PRODUCERS], cons[CONSUMERS];
+	for (long i = 0; i < CONSUMERS; ++i) {
+		pthread_create(&cons[i], NULL, consumer, NULL);
+	}
+	for (long i = 0; i < PRODUCERS; ++i) {
+		pthread_create(&prod[i], NULL, producer, (void *)i);
+	}
+	for (int i = 0; i < PRODUCERS; ++i) {
+		pthread_join(prod[i], NULL);
+	}
+	for (int i = 0; i < CONSUMERS; ++i) {
+		pthread_join(cons[i], NULL);
+	}
+	long n = (long)PRODUCERS * JOBS_PER_PRODUCER;
+	long expected = n * (n - 1) / 2;
+	ASSERT_EQUAL_LONG(expected, consumed_sum)
+	ASSERT_EQUAL_INT(0, fiber_queue_seg_length(sq))
+	teardown();
+}
+
+static long pool_executed = 0;
+static void *count_job(void *arg)
+{
+	__atomic_add_fetch(&pool_executed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+TEST(seg_pool_burst_past_queue_length)
+{
+	struct fiber_queue_operations ops = {
+		.push = fiber_queue_seg_push,
+		.pop = fiber_queue_seg_pop,
+		.init = fiber_queue_seg_init,
+		.free = fiber_queue_seg_free,
+		.length = fiber_queue_seg_length,
+		.push_n = fiber_queue_seg_push_n,
+		.pop_n = fiber_queue_seg_pop_n,
+		.set_park_spin = fiber_queue_seg_set_park_spin,
+	};
+	struct fiber_pool_init_options opts = {
+		.queue_ops = &ops,
+		.threads_number = 2,
+		.queue_length = 4,
+	};
+	struct fiber_pool pool = { 0 };
+	ASSERT_EQUAL_INT(0, fiber_init(&pool, &opts));
+	struct fiber_job job = { .job_func = count_job };
+	// Far past queue_length, none of these can fail for lack of room
+	for (int i = 0; i < JOBS_PER_PRODUCER; ++i) {
+		jid res = fiber_job_push(&pool, &job, FIBER_NO_BLOCK);
+		int ok = res >= 0;
+		ASSERT_TRUE(ok);
+	}
+	fiber_wait(&pool);
+	long ran = __atomic_load_n(&pool_executed, __ATOMIC_RELAXED);
+	ASSERT_EQUAL_LONG((long)JOBS_PER_PRODUCER, ran)
+	fiber_free(&pool);
+}
+
+int main()
+{
+	run_tests();
+	return 0;
+}
+
+static void setup(qsize cap)
+{
+	int res = fiber_queue_seg_init((void **)&sq, cap, malloc, free);
+	ASSERT_EQUAL_INT(0, res);
+}
+
+static void teardown()
+{
+	fiber_queue_seg_free(sq);
+	sq = NULL;
+}